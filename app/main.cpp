@@ -1,36 +1,123 @@
+#include "bytecode.hpp"
+#include "isolate.hpp"
 #include "vm.hpp"
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <exception>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
-void runRepl() {
+void runRepl(lox::InterpretOptions options) {
+  // Every line runs in the same session, so it can use the variables,
+  // functions and classes defined on earlier lines.
+  options.line_buffered = true;
+  lox::Session session(options);
   std::string line;
   while (true) {
     std::cout << "> ";
     if (!std::getline(std::cin, line)) {
       break;
     }
-    lox::InterpretResult result = lox::interpret(line);
-    if (result == lox::InterpretResult::COMPILE_ERROR) {
-      continue;
+    // Errors have already been reported, and the session can carry on.
+    session.eval(line);
+  }
+  if (options.gc_stats) {
+    session.gc_stats().write_json(std::cerr);
+  }
+}
+
+// A read-only view of a whole file, via mmap. This is what we use for source
+// and bytecode files, since they can be used directly from the page cache
+// without copying them first. Things that can't be mapped (like pipes, or
+// empty files) just aren't open.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      size = static_cast<size_t>(st.st_size);
+      void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        data = static_cast<const uint8_t*>(mapped);
+        // Both scanning and loading bytecode read the file from start to end.
+        madvise(mapped, size, MADV_SEQUENTIAL);
+      }
     }
+    // NOTE: The mapping stays valid after the file descriptor is closed.
+    close(fd);
   }
+  ~MappedFile() {
+    if (data != nullptr) {
+      munmap(const_cast<uint8_t*>(data), size);
+    }
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool is_open() const { return data != nullptr; }
+  std::span<const uint8_t> bytes() const { return {data, size}; }
+  std::string_view chars() const {
+    return {reinterpret_cast<const char*>(data), size};
+  }
+
+private:
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+};
+
+// foo.lox -> foo.loxc
+std::string bytecodePath(const std::string& path) {
+  if (path.ends_with(".lox")) {
+    return path + "c";
+  }
+  return path + ".loxc";
 }
 
-void runFile(const char* path) {
-  // NOTE: std::ios::ate moves the file pointer to the end upon opening.
-  // std::ios::binary is a bit more nuanced: it doesn't make a difference on
-  // macOS/Linux, but on Windows if you don't use it, \r\n gets read as one
-  // character instead of two. So I guess it's More Portable to use it.
-  std::ifstream file(path, std::ios::binary | std::ios::ate);
+// Read all of a stream that we can't find the size of in advance.
+std::string readStream(std::istream& in) {
+  std::string contents;
+  char buffer[65536];
+  while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0) {
+    contents.append(buffer, static_cast<size_t>(in.gcount()));
+  }
+  return contents;
+}
+
+std::string readFile(const char* path) {
+  if (std::string_view(path) == "-") {
+    return readStream(std::cin);
+  }
+  // NOTE: std::ios::binary doesn't make a difference on macOS/Linux, but on
+  // Windows if you don't use it, \r\n gets read as one character instead of
+  // two. So I guess it's More Portable to use it.
+  std::ifstream file(path, std::ios::binary);
   if (!file) {
     std::cerr << "Could not open file \"" << path << "\"\n";
     exit(74);
   }
+  // Move to the end to find out the size. That doesn't work for pipes, which
+  // have to be read until they run out instead.
+  file.seekg(0, std::ios::end);
   std::streamsize size = file.tellg();
   if (size < 0) {
-    std::cerr << "Could not get size of file \"" << path << "\"\n";
-    exit(74);
+    file.clear();
+    return readStream(file);
   }
   file.seekg(0, std::ios::beg);
   std::string source(static_cast<size_t>(size), '\0');
@@ -40,7 +127,10 @@ void runFile(const char* path) {
     std::cerr << "Could not read file \"" << path << "\"\n";
     exit(74);
   }
-  lox::InterpretResult result = lox::interpret(source);
+  return source;
+}
+
+[[noreturn]] void exitWith(lox::InterpretResult result) {
   switch (result) {
   case lox::InterpretResult::COMPILE_ERROR:
     exit(65);
@@ -51,13 +141,166 @@ void runFile(const char* path) {
   }
 }
 
+void runFile(const char* path, const lox::InterpretOptions& options) {
+  std::string_view path_view = path;
+  if (path_view.ends_with(".loxc")) {
+    MappedFile bytecode(path);
+    if (!bytecode.is_open()) {
+      std::cerr << "Could not open file \"" << path << "\"\n";
+      exit(74);
+    }
+    exitWith(lox::interpret_bytecode(bytecode.bytes(), options));
+  }
+  // Prefer mapping the source, so that it isn't copied. The scanner only needs
+  // a string_view anyway.
+  MappedFile mapped(path);
+  std::string read_source;
+  std::string_view source;
+  if (mapped.is_open()) {
+    source = mapped.chars();
+  } else {
+    read_source = readFile(path);
+    source = read_source;
+  }
+  // If there's a bytecode file next to the script that was compiled from
+  // exactly this source (by this version of the interpreter), we can skip
+  // compilation altogether. Otherwise just ignore it.
+  MappedFile cached(bytecodePath(path));
+  if (path_view != "-" && cached.is_open() &&
+      lox::bytecode::is_up_to_date(cached.bytes(), source)) {
+    exitWith(lox::interpret_bytecode(cached.bytes(), options));
+  }
+  exitWith(lox::interpret(source, options));
+}
+
+// Run the script `isolates` times in parallel, each in its own isolate (see
+// isolate.hpp). It only gets compiled once.
+void runIsolates(const char* path, size_t isolates,
+                 const lox::InterpretOptions& options) {
+  std::string source = readFile(path);
+  std::optional<lox::Program> program = lox::Program::compile(source);
+  if (!program) {
+    exitWith(lox::InterpretResult::COMPILE_ERROR);
+  }
+  std::vector<lox::InterpretResult> results = lox::run_isolates(
+      *program, isolates, std::thread::hardware_concurrency(), options);
+  for (lox::InterpretResult result : results) {
+    if (result != lox::InterpretResult::OK) {
+      exitWith(result);
+    }
+  }
+  exitWith(lox::InterpretResult::OK);
+}
+
+void emitBytecode(const char* path) {
+  std::string source = readFile(path);
+  std::string out_path = bytecodePath(path);
+  std::ofstream out(out_path, std::ios::binary);
+  if (!out) {
+    std::cerr << "Could not open file \"" << out_path << "\"\n";
+    exit(74);
+  }
+  lox::InterpretResult result = lox::compile_to_bytecode(source, out);
+  out.close();
+  if (result == lox::InterpretResult::OK && !out) {
+    std::cerr << "Could not write file \"" << out_path << "\"\n";
+    exit(74);
+  }
+  exitWith(result);
+}
+
+void usage(const char* argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [--gc=mark-sweep|generational|incremental]"
+               " [--gc-pause=<microseconds>] [--gc-stats]"
+               " [--max-call-depth=<frames>] [--stream]\n"
+               "       [--profile] [--profile-folded=<file>]"
+               " [--tier-up=<calls>] [script|-]\n"
+            << "       " << argv0 << " --isolates=<n> [options] script.lox\n"
+            << "       " << argv0 << " --emit-bytecode script.lox"
+            << std::endl;
+  exit(64);
+}
+
+// The value of a numeric option such as `--tier-up=<calls>`, if it's a
+// non-negative integer no bigger than `max`. (Unlike std::stoul, this doesn't
+// accept "-1", leading whitespace, or anything after the number.)
+std::optional<unsigned long> option_value(std::string_view arg,
+                                          unsigned long max) {
+  std::string_view value = arg.substr(arg.find('=') + 1);
+  unsigned long result;
+  auto [end, ec] =
+      std::from_chars(value.data(), value.data() + value.size(), result);
+  if (ec != std::errc() || end != value.data() + value.size() ||
+      result > max) {
+    return std::nullopt;
+  }
+  return result;
+}
+
 int main(int argc, char* argv[]) {
-  if (argc == 1)
-    runRepl();
-  else if (argc == 2)
-    runFile(argv[1]);
-  else {
-    std::cerr << "Usage: " << argv[0] << " [script]" << std::endl;
-    return 64;
+  lox::InterpretOptions options;
+  const char* path = nullptr;
+  bool emit_bytecode = false;
+  size_t isolates = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg == "--gc=mark-sweep") {
+      options.gc_mode = lox::GCMode::MARK_SWEEP;
+    } else if (arg == "--gc=generational") {
+      options.gc_mode = lox::GCMode::GENERATIONAL;
+    } else if (arg == "--gc=incremental") {
+      options.gc_mode = lox::GCMode::INCREMENTAL;
+    } else if (arg == "--emit-bytecode") {
+      emit_bytecode = true;
+    } else if (arg == "--gc-stats") {
+      options.gc_stats = true;
+    } else if (arg == "--stream") {
+      options.streaming = true;
+    } else if (arg == "--profile") {
+      options.profile = true;
+    } else if (arg.starts_with("--profile-folded=")) {
+      options.profile_folded_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--gc-pause=")) {
+      auto pause = option_value(arg, ULONG_MAX);
+      if (!pause) {
+        usage(argv[0]);
+      }
+      options.gc_pause_budget = std::chrono::microseconds(*pause);
+    } else if (arg.starts_with("--max-call-depth=")) {
+      auto depth = option_value(arg, lox::MAX_CALL_DEPTH_LIMIT);
+      if (!depth || *depth == 0) {
+        usage(argv[0]);
+      }
+      options.max_call_depth = *depth;
+    } else if (arg.starts_with("--tier-up=")) {
+      auto threshold = option_value(arg, UINT32_MAX);
+      if (!threshold) {
+        usage(argv[0]);
+      }
+      options.tier_up_threshold = static_cast<uint32_t>(*threshold);
+    } else if (arg.starts_with("--isolates=")) {
+      auto n = option_value(arg, ULONG_MAX);
+      if (!n || *n == 0) {
+        usage(argv[0]);
+      }
+      isolates = *n;
+    } else if ((arg.starts_with("-") && arg != "-") || path != nullptr) {
+      usage(argv[0]);
+    } else {
+      path = argv[i];
+    }
   }
+  // If someone's watching, they should see each line as soon as it's printed.
+  options.line_buffered = isatty(STDOUT_FILENO);
+  if ((emit_bytecode || isolates > 0) && path == nullptr)
+    usage(argv[0]);
+  if (emit_bytecode)
+    emitBytecode(path);
+  else if (isolates > 0)
+    runIsolates(path, isolates, options);
+  else if (path == nullptr)
+    runRepl(options);
+  else
+    runFile(path, options);
 }
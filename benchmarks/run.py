@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""Run the benchmarks in this directory and report the results as JSON.
+
+Each benchmark is run several times with `loxc --gc-stats`, and for each one we
+record the median of:
+
+- compile_us and execute_us, which loxc prints when it's built with
+  `make BUILD=time` (without that they're null);
+- wall_s, the wall-clock time for the whole process;
+- peak_rss_kb, the peak resident set size of the process;
+- gc_total_pause_us, gc_max_pause_us and gc_collections, from --gc-stats.
+
+With --compare, the results are also compared against a baseline written
+earlier by --save-baseline, and the script exits with status 1 if any
+benchmark's execute time (or wall time, if there's no execute time) got worse
+by more than --threshold.
+
+Only uses the standard library, so that it runs anywhere loxc does.
+"""
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+BENCHMARK_DIR = Path(__file__).resolve().parent
+REPO_DIR = BENCHMARK_DIR.parent
+# Printed by the LOX_TIME build (see run_toplevel in src/vm.cpp).
+TIMING_RE = re.compile(r"^(Compilation|Execution): (\d+) us$", re.MULTILINE)
+
+
+def run_once(loxc, script, extra_args):
+    """Run one benchmark once, and return its measurements."""
+    with tempfile.TemporaryFile() as out, tempfile.TemporaryFile() as err:
+        start = time.perf_counter()
+        proc = subprocess.Popen(
+            [loxc, "--gc-stats", *extra_args, str(script)], stdout=out, stderr=err
+        )
+        # NOTE: wait4 gives us the resource usage of just this process, unlike
+        # getrusage(RUSAGE_CHILDREN), whose maxrss is the maximum over every
+        # child that has finished so far.
+        _, status, rusage = os.wait4(proc.pid, 0)
+        wall = time.perf_counter() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        out.seek(0)
+        err.seek(0)
+        stdout = out.read().decode()
+        stderr = err.read().decode()
+    if proc.returncode != 0:
+        raise RuntimeError(
+            f"{script.name} exited with status {proc.returncode}:\n{stderr}"
+        )
+
+    timings = dict(TIMING_RE.findall(stderr))
+    # The GC stats are the last thing printed, and are the only JSON object.
+    gc_stats = json.loads(stderr[stderr.index("{") :])
+    # ru_maxrss is in kilobytes on Linux, but bytes on macOS.
+    rss_kb = rusage.ru_maxrss // 1024 if sys.platform == "darwin" else rusage.ru_maxrss
+    return {
+        "compile_us": int(timings["Compilation"]) if "Compilation" in timings else None,
+        "execute_us": int(timings["Execution"]) if "Execution" in timings else None,
+        "wall_s": wall,
+        "peak_rss_kb": rss_kb,
+        "gc_total_pause_us": gc_stats["total_pause_us"],
+        "gc_max_pause_us": gc_stats["max_pause_us"],
+        "gc_collections": gc_stats["collections"],
+        "output": stdout,
+    }
+
+
+def run_benchmark(loxc, script, runs, extra_args):
+    samples = [run_once(loxc, script, extra_args) for _ in range(runs)]
+    outputs = {s["output"] for s in samples}
+    if len(outputs) != 1:
+        raise RuntimeError(f"{script.name} printed different things on different runs")
+    result = {}
+    for key in samples[0]:
+        if key == "output":
+            continue
+        values = [s[key] for s in samples]
+        result[key] = None if None in values else statistics.median(values)
+    return result
+
+
+def compare(results, baseline, threshold):
+    """Print a comparison table (to stderr, so that stdout is just the JSON
+    results), and return the names of the regressions."""
+    regressions = []
+    out = sys.stderr
+    print(f"{'benchmark':<12} {'metric':<12} {'baseline':>12} {'now':>12} {'change':>8}", file=out)
+    for name, result in results.items():
+        if name not in baseline:
+            print(f"{name:<12} (not in baseline)", file=out)
+            continue
+        base = baseline[name]
+        metric = "execute_us" if result["execute_us"] and base.get("execute_us") else "wall_s"
+        change = result[metric] / base[metric] - 1
+        flag = ""
+        if change > threshold:
+            regressions.append(name)
+            flag = "  REGRESSION"
+        print(
+            f"{name:<12} {metric:<12} {base[metric]:>12.6g} {result[metric]:>12.6g}"
+            f" {change:>+7.1%}{flag}",
+            file=out,
+        )
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--loxc", default=str(REPO_DIR / "loxc"), help="interpreter to run")
+    parser.add_argument("--runs", type=int, default=5, help="runs per benchmark")
+    parser.add_argument("--output", help="also write the results to this file")
+    parser.add_argument("--compare", metavar="BASELINE", help="baseline to compare against")
+    parser.add_argument("--save-baseline", metavar="BASELINE", help="write the results as a new baseline")
+    parser.add_argument(
+        "--threshold", type=float, default=0.10,
+        help="slowdown (as a fraction) that counts as a regression (default 0.10)",
+    )
+    parser.add_argument("benchmarks", nargs="*", help="names of benchmarks to run (default: all)")
+    args, extra_args = parser.parse_known_args()
+
+    scripts = sorted(BENCHMARK_DIR.glob("*.lox"))
+    if args.benchmarks:
+        scripts = [s for s in scripts if s.stem in args.benchmarks]
+    results = {}
+    for script in scripts:
+        print(f"Running {script.stem}...", file=sys.stderr)
+        results[script.stem] = run_benchmark(args.loxc, script, args.runs, extra_args)
+
+    report = json.dumps(results, indent=2)
+    print(report)
+    for path in (args.output, args.save_baseline):
+        if path:
+            Path(path).write_text(report + "\n")
+    if args.compare:
+        baseline = json.loads(Path(args.compare).read_text())
+        regressions = compare(results, baseline, args.threshold)
+        if regressions:
+            print(f"Regressions: {', '.join(regressions)}", file=sys.stderr)
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
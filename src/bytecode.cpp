@@ -0,0 +1,679 @@
+#include "bytecode.hpp"
+#include "chunk.hpp"
+#include "opcode_def.hpp"
+#include "optimise.hpp"
+#include "superinstruction_def.hpp"
+#include "value_def.hpp"
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef LOX_BUILD_ID
+// Builds that don't go through the Makefile only have the time when this file
+// was compiled to go on.
+#define LOX_BUILD_ID __DATE__ " " __TIME__
+#endif
+
+namespace {
+
+// Tags for the different kinds of constant.
+enum class ConstantTag : uint8_t {
+  NIL,
+  FALSE,
+  TRUE,
+  NUMBER,
+  STRING,
+  FUNCTION,
+};
+
+constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325;
+constexpr uint64_t FNV_PRIME = 0x100000001b3;
+
+uint64_t fnv1a(std::string_view data, uint64_t hash = FNV_OFFSET_BASIS) {
+  for (char c : data) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+// The number of values that the single (non-super) instruction `op` takes off
+// the top of the stack (or reads there), where `count` is its argument or
+// element count if it has one.
+size_t stack_inputs(lox::OpCode op, size_t count) {
+  using lox::OpCode;
+  switch (op) {
+  case OpCode::CONSTANT:
+  case OpCode::GET_GLOBAL_SLOT:
+  case OpCode::GET_LOCAL:
+  case OpCode::JUMP:
+  case OpCode::JUMP_LONG:
+  case OpCode::CLOSURE:
+  case OpCode::GET_UPVALUE:
+  case OpCode::CLASS:
+    return 0;
+  case OpCode::BUILD_LIST:
+    return count;
+  // The callee (or receiver) is below the arguments.
+  case OpCode::CALL:
+  case OpCode::INVOKE:
+  case OpCode::CALL_PROPERTY:
+    return count + 1;
+  // ...and the superclass is above them.
+  case OpCode::SUPER_INVOKE:
+    return count + 2;
+  case OpCode::ADD:
+  case OpCode::SUBTRACT:
+  case OpCode::MULTIPLY:
+  case OpCode::DIVIDE:
+  case OpCode::EQUAL:
+  case OpCode::GREATER:
+  case OpCode::LESS:
+  case OpCode::SET_PROPERTY:
+  case OpCode::DEFINE_METHOD:
+  case OpCode::INHERIT:
+  case OpCode::GET_SUPER:
+  case OpCode::GET_INDEX:
+    return 2;
+  case OpCode::SET_INDEX:
+    return 3;
+  case OpCode::RETURN:
+  case OpCode::NEGATE:
+  case OpCode::NOT:
+  case OpCode::PRINT:
+  case OpCode::POP:
+  case OpCode::SET_GLOBAL_SLOT:
+  case OpCode::DEFINE_GLOBAL_SLOT:
+  case OpCode::SET_LOCAL:
+  case OpCode::JUMP_IF_FALSE:
+  case OpCode::JUMP_IF_FALSE_LONG:
+  case OpCode::SET_UPVALUE:
+  case OpCode::CLOSE_UPVALUE:
+  case OpCode::GET_PROPERTY:
+    return 1;
+  default:
+    break;
+  }
+  throw std::runtime_error("bytecode: invalid opcode");
+}
+
+void write_u8(std::ostream& out, uint8_t value) {
+  out.put(static_cast<char>(value));
+}
+void write_u32(std::ostream& out, size_t value) {
+  if (value > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("bytecode: value too large to serialise");
+  }
+  for (size_t i = 0; i < 4; i++) {
+    write_u8(out, static_cast<uint8_t>((value >> (8 * i)) & 0xff));
+  }
+}
+void write_u64(std::ostream& out, uint64_t value) {
+  for (size_t i = 0; i < 8; i++) {
+    write_u8(out, static_cast<uint8_t>((value >> (8 * i)) & 0xff));
+  }
+}
+void write_string(std::ostream& out, std::string_view str) {
+  write_u32(out, str.size());
+  out.write(str.data(), static_cast<std::streamsize>(str.size()));
+}
+
+void write_function(std::ostream& out, const lox::ObjFunction* fn);
+
+bool is_obj_of_type(lox::Value value, lox::ObjType type) {
+  return lox::is_obj(value) && lox::as_obj(value)->type == type;
+}
+
+void write_constant(std::ostream& out, lox::Value value) {
+  if (lox::is_nil(value)) {
+    write_u8(out, static_cast<uint8_t>(ConstantTag::NIL));
+  } else if (lox::is_bool(value)) {
+    write_u8(out, static_cast<uint8_t>(lox::as_bool(value) ? ConstantTag::TRUE
+                                                           : ConstantTag::FALSE));
+  } else if (lox::is_double(value)) {
+    write_u8(out, static_cast<uint8_t>(ConstantTag::NUMBER));
+    write_u64(out, std::bit_cast<uint64_t>(lox::as_double(value)));
+  } else if (is_obj_of_type(value, lox::ObjType::STRING)) {
+    write_u8(out, static_cast<uint8_t>(ConstantTag::STRING));
+    write_string(out, lox::as_objptr_unsafe<lox::ObjString>(value)->value);
+  } else if (is_obj_of_type(value, lox::ObjType::FUNCTION)) {
+    write_u8(out, static_cast<uint8_t>(ConstantTag::FUNCTION));
+    write_function(out, lox::as_objptr_unsafe<lox::ObjFunction>(value));
+  } else {
+    // The compiler never emits any other kind of constant.
+    throw std::runtime_error("bytecode: cannot serialise constant");
+  }
+}
+
+void write_function(std::ostream& out, const lox::ObjFunction* fn) {
+  const lox::Chunk& chunk = fn->chunk;
+  if (chunk.has_far_jumps()) {
+    throw std::runtime_error(
+        "bytecode: cannot serialise a chunk with unresolved far jumps");
+  }
+  write_string(out, fn->name->value);
+  write_u32(out, fn->arity);
+  write_u32(out, fn->max_stack_depth);
+  write_u8(out, fn->has_captured_locals ? 1 : 0);
+  write_u32(out, fn->upvalues.size());
+  for (const lox::Upvalue& upvalue : fn->upvalues) {
+    write_u8(out, upvalue.is_local ? 1 : 0);
+    write_u32(out, upvalue.index);
+  }
+  write_u32(out, chunk.size());
+  for (size_t i = 0; i < chunk.size(); i++) {
+    write_u8(out, chunk.at(i));
+  }
+  write_u32(out, chunk.constants_size());
+  for (const lox::Value& constant : chunk.get_constants()) {
+    write_constant(out, constant);
+  }
+  std::vector<lox::DebugInfo> debuginfo = chunk.get_debuginfo();
+  write_u32(out, debuginfo.size());
+  for (const lox::DebugInfo& info : debuginfo) {
+    write_u32(out, info.bytecode_offset);
+    write_u32(out, info.line);
+  }
+  write_u32(out, chunk.inline_caches_size());
+}
+
+} // namespace
+
+namespace lox::bytecode {
+
+uint64_t interpreter_version() {
+  uint64_t hash = fnv1a(std::to_string(FORMAT_VERSION));
+  hash = fnv1a(LOX_BUILD_ID ";", hash);
+#define OPCODE_HASH(name) hash = fnv1a(#name ";", hash);
+  OPCODE_LIST(OPCODE_HASH)
+#define SUPERINSTRUCTION_HASH(name, prefix, last)                              \
+  hash = fnv1a(#name "=" #prefix #last ";", hash);
+  SUPERINSTRUCTION_LIST(SUPERINSTRUCTION_HASH)
+#define QUICKENED_HASH(name, generic) hash = fnv1a(#name "=" #generic ";", hash);
+  QUICKENED_LIST(QUICKENED_HASH)
+#undef QUICKENED_HASH
+#undef SUPERINSTRUCTION_HASH
+#undef OPCODE_HASH
+  return hash;
+}
+
+uint64_t hash_source(std::string_view source) { return fnv1a(source); }
+
+bool is_up_to_date(std::span<const uint8_t> bytes, std::string_view source) {
+  // magic (4) + format version (4) + interpreter version (8) + source hash (8)
+  constexpr size_t HEADER_SIZE = 24;
+  if (bytes.size() < HEADER_SIZE ||
+      std::memcmp(bytes.data(), MAGIC.data(), MAGIC.size()) != 0) {
+    return false;
+  }
+  auto read_u64_at = [&bytes](size_t pos) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < 8; i++) {
+      value |= static_cast<uint64_t>(bytes[pos + i]) << (8 * i);
+    }
+    return value;
+  };
+  // The format version is covered by the interpreter version.
+  return read_u64_at(8) == interpreter_version() &&
+         read_u64_at(16) == hash_source(source);
+}
+
+void write(std::ostream& out, const ObjFunction* top_level_fn,
+           const Globals& globals, uint64_t source_hash) {
+  out.write(MAGIC.data(), static_cast<std::streamsize>(MAGIC.size()));
+  write_u32(out, FORMAT_VERSION);
+  write_u64(out, interpreter_version());
+  write_u64(out, source_hash);
+  write_u32(out, globals.size());
+  for (size_t slot = 0; slot < globals.size(); slot++) {
+    write_string(out, globals.name_at(slot)->value);
+  }
+  write_function(out, top_level_fn);
+  if (!out) {
+    throw std::runtime_error("bytecode: error while writing");
+  }
+}
+
+const uint8_t* Reader::take(size_t n) {
+  if (n > bytes.size() - pos) {
+    throw std::runtime_error("bytecode: unexpected end of file");
+  }
+  const uint8_t* start = bytes.data() + pos;
+  pos += n;
+  return start;
+}
+
+uint8_t Reader::read_u8() { return *take(1); }
+
+uint32_t Reader::read_u32() {
+  const uint8_t* data = take(4);
+  uint32_t value = 0;
+  for (size_t i = 0; i < 4; i++) {
+    value |= static_cast<uint32_t>(data[i]) << (8 * i);
+  }
+  return value;
+}
+
+uint64_t Reader::read_u64() {
+  const uint8_t* data = take(8);
+  uint64_t value = 0;
+  for (size_t i = 0; i < 8; i++) {
+    value |= static_cast<uint64_t>(data[i]) << (8 * i);
+  }
+  return value;
+}
+
+uint32_t Reader::read_count(size_t min_size) {
+  uint32_t count = read_u32();
+  if (count > (bytes.size() - pos) / min_size) {
+    throw std::runtime_error("bytecode: unexpected end of file");
+  }
+  return count;
+}
+
+std::string_view Reader::read_string() {
+  uint32_t length = read_u32();
+  // NOTE: The string_view points straight into the file, so it only lives as
+  // long as `bytes` does. That's fine because the only thing we do with it is
+  // to intern it.
+  return std::string_view(reinterpret_cast<const char*>(take(length)), length);
+}
+
+lox::Value Reader::read_constant() {
+  switch (static_cast<ConstantTag>(read_u8())) {
+  case ConstantTag::NIL:
+    return nil_val();
+  case ConstantTag::FALSE:
+    return from_bool(false);
+  case ConstantTag::TRUE:
+    return from_bool(true);
+  case ConstantTag::NUMBER:
+    return from_double(std::bit_cast<double>(read_u64()));
+  case ConstantTag::STRING:
+    return from_obj(gc.get_string_ptr(read_string()));
+  case ConstantTag::FUNCTION:
+    return from_obj(read_function());
+  }
+  throw std::runtime_error("bytecode: invalid constant tag");
+}
+
+ObjFunction* Reader::read_function() {
+  ObjString* name = gc.get_string_ptr(read_string());
+  uint32_t arity = read_u32();
+  // The name has to stay alive while we allocate the function.
+  in_progress.push_back(name);
+  ObjFunction* fn = gc.alloc<ObjFunction>(name, size_t(arity));
+  in_progress.back() = fn;
+
+  read_u32(); // max_stack_depth, recomputed once the code has been checked
+  fn->has_captured_locals = read_u8() != 0;
+  uint32_t n_upvalues = read_count(5);
+  fn->upvalues.reserve(n_upvalues);
+  for (uint32_t i = 0; i < n_upvalues; i++) {
+    bool is_local = read_u8() != 0;
+    uint32_t index = read_u32();
+    fn->upvalues.push_back(Upvalue{index, is_local});
+  }
+  uint32_t code_size = read_u32();
+  std::span<const uint8_t> code(take(code_size), code_size);
+  uint32_t n_constants = read_count(1);
+  for (uint32_t i = 0; i < n_constants; i++) {
+    lox::Value constant = read_constant();
+    fn->chunk.push_constant(constant);
+    // `fn` may have been promoted to the old generation while we were reading
+    // its constants.
+    gc.write_barrier(fn);
+  }
+
+  uint32_t n_debuginfo = read_count(8);
+  std::vector<DebugInfo> debuginfo;
+  debuginfo.reserve(n_debuginfo);
+  for (uint32_t i = 0; i < n_debuginfo; i++) {
+    uint32_t offset = read_u32();
+    uint32_t line = read_u32();
+    debuginfo.push_back(DebugInfo(offset, line));
+  }
+  // Rebuild the code using the line table. Chunk::write merges consecutive
+  // bytes on the same line, so this gives back exactly the same line table.
+  for (size_t i = 0; i < debuginfo.size(); i++) {
+    size_t start = debuginfo[i].bytecode_offset;
+    size_t end =
+        i + 1 < debuginfo.size() ? debuginfo[i + 1].bytecode_offset : code_size;
+    if (start != fn->chunk.size() || end <= start || end > code_size) {
+      throw std::runtime_error("bytecode: invalid line table");
+    }
+    for (size_t j = start; j < end; j++) {
+      fn->chunk.write(code[j], debuginfo[i].line);
+    }
+  }
+  if (fn->chunk.size() != code_size) {
+    throw std::runtime_error("bytecode: invalid line table");
+  }
+
+  // Every inline cache belongs to an instruction.
+  uint32_t n_inline_caches = read_u32();
+  if (n_inline_caches > code_size) {
+    throw std::runtime_error("bytecode: too many inline caches");
+  }
+  for (uint32_t i = 0; i < n_inline_caches; i++) {
+    fn->chunk.add_inline_cache();
+  }
+  check_code(fn);
+  fn->max_stack_depth = optimise::max_stack_depth(fn->chunk, fn->arity + 1);
+  in_progress.pop_back();
+  return fn;
+}
+
+void Reader::check_code(const ObjFunction* fn) const {
+  const Chunk& chunk = fn->chunk;
+  size_t size = chunk.size();
+  auto invalid = [](const std::string& what) {
+    throw std::runtime_error("bytecode: " + what);
+  };
+  auto opcode_at = [&](size_t offset) {
+    if (offset >= size || chunk.at(offset) >= N_OPCODES) {
+      invalid("invalid opcode");
+    }
+    return static_cast<OpCode>(chunk.at(offset));
+  };
+  auto closure_function = [&](size_t constant) {
+    if (constant >= chunk.constants_size()) {
+      invalid("constant index out of range");
+    }
+    lox::Value value = chunk.constant_at(constant);
+    if (!is_obj(value) || as_obj(value)->type != ObjType::FUNCTION) {
+      invalid("CLOSURE of something that isn't a function");
+    }
+    return static_cast<const ObjFunction*>(as_obj(value));
+  };
+
+  // The `i`th operand of an instruction whose operands start at `operands`
+  // and are `width` bytes each.
+  auto operand_at = [&](size_t operands, size_t width, size_t i) -> size_t {
+    return width == 3 ? chunk.wide_operand_at(operands + 3 * i)
+                      : chunk.at(operands + i);
+  };
+
+  std::vector<bool> is_instruction(size, false);
+  std::vector<bool> cache_used(chunk.inline_caches_size(), false);
+  std::vector<ptrdiff_t> jump_targets;
+  // Check the operands of a single (non-super) instruction `op`, whose
+  // operands start at `operands` and are `width` bytes each, and which ends
+  // (i.e. its jumps are relative to) `end`.
+  auto check = [&](OpCode op, size_t operands, size_t width, size_t end) {
+    auto operand = [&](size_t i) { return operand_at(operands, width, i); };
+    if (std::optional<size_t> i = constant_operand_index(op)) {
+      if (operand(*i) >= chunk.constants_size()) {
+        invalid("constant index out of range");
+      }
+      // Apart from CONSTANT and CLOSURE (see closure_function), the constant
+      // is the name of a class, property or method.
+      if (op != OpCode::CONSTANT && op != OpCode::CLOSURE &&
+          !is_obj_of_type(chunk.constant_at(operand(*i)), ObjType::STRING)) {
+        invalid("name that isn't a string");
+      }
+    }
+    switch (op) {
+    case OpCode::GET_GLOBAL_SLOT:
+    case OpCode::SET_GLOBAL_SLOT:
+    case OpCode::DEFINE_GLOBAL_SLOT:
+      if (operand(0) >= globals.size()) {
+        invalid("global slot out of range");
+      }
+      break;
+    case OpCode::GET_PROPERTY:
+    case OpCode::SET_PROPERTY:
+    case OpCode::INVOKE:
+    case OpCode::CALL_PROPERTY: {
+      // The inline cache is always the last operand. The entries in a cache
+      // are only valid for the property name of the instruction that owns it,
+      // so no two instructions may share one.
+      size_t cache = operand(wide_operand_count(op) - 1);
+      if (cache == NO_INLINE_CACHE) {
+        break;
+      }
+      if (cache >= chunk.inline_caches_size()) {
+        invalid("inline cache index out of range");
+      }
+      if (cache_used[cache]) {
+        invalid("inline cache shared between instructions");
+      }
+      cache_used[cache] = true;
+      break;
+    }
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_FALSE:
+      jump_targets.push_back(
+          static_cast<ptrdiff_t>(end) +
+          get_jump_offset(chunk.at(operands), chunk.at(operands + 1)));
+      break;
+    case OpCode::JUMP_LONG:
+    case OpCode::JUMP_IF_FALSE_LONG: {
+      uint8_t bytes[4] = {chunk.at(operands), chunk.at(operands + 1),
+                          chunk.at(operands + 2), chunk.at(operands + 3)};
+      jump_targets.push_back(static_cast<ptrdiff_t>(end) +
+                             get_long_jump_offset(bytes));
+      break;
+    }
+    default:
+      break;
+    }
+  };
+
+  size_t offset = 0;
+  while (offset < size) {
+    is_instruction[offset] = true;
+    OpCode op = opcode_at(offset);
+    size_t end;
+    if (op == OpCode::WIDE) {
+      OpCode wide_op = opcode_at(offset + 1);
+      size_t n_operands = wide_operand_count(wide_op);
+      if (n_operands == 0) {
+        invalid("invalid WIDE instruction");
+      }
+      end = offset + 2 + 3 * n_operands;
+      if (end > size) {
+        invalid("truncated instruction");
+      }
+      if (wide_op == OpCode::CLOSURE) {
+        end += 6 * closure_function(chunk.wide_operand_at(offset + 2))
+                       ->upvalues.size();
+      }
+      check(wide_op, offset + 2, 3, end);
+    } else if (op == OpCode::CLOSURE) {
+      if (offset + 2 > size) {
+        invalid("truncated instruction");
+      }
+      end = offset + 2 +
+            2 * closure_function(chunk.at(offset + 1))->upvalues.size();
+    } else {
+      end = offset + instruction_length(op);
+      if (end > size) {
+        invalid("truncated instruction");
+      }
+      if (const Superinstruction* super = find_superinstruction(op)) {
+        size_t operands = offset + 1;
+        for (size_t i = 0; i < super->n_components; i++) {
+          check(super->components[i], operands, 1, end);
+          operands += instruction_length(super->components[i]) - 1;
+        }
+      } else {
+        check(generic_opcode(op), offset + 1, 1, end);
+      }
+    }
+    if (end > size) {
+      invalid("truncated instruction");
+    }
+    offset = end;
+  }
+  for (ptrdiff_t target : jump_targets) {
+    if (target < 0 || static_cast<size_t>(target) >= size ||
+        !is_instruction[static_cast<size_t>(target)]) {
+      invalid("jump target out of range");
+    }
+  }
+
+  // Now that every instruction is known to be well-formed, follow the paths
+  // that the VM can take through the code, keeping track of the stack depth.
+  // Slot 0 of the frame holds the function itself, so no instruction may use
+  // more than `depth - 1` values, and every instruction has to be reached with
+  // the same depth no matter which path led there (which is also what
+  // optimise::max_stack_depth relies on).
+  //
+  // Apply the single (non-super) instruction `op` at depth `depth`, and return
+  // the depth afterwards. `start` is the start of the whole instruction.
+  auto step = [&](OpCode op, size_t start, size_t operands, size_t width,
+                  ptrdiff_t depth) {
+    auto operand = [&](size_t i) { return operand_at(operands, width, i); };
+    size_t count = 0;
+    switch (op) {
+    case OpCode::BUILD_LIST:
+    case OpCode::CALL:
+    case OpCode::INVOKE:
+    case OpCode::CALL_PROPERTY:
+    case OpCode::SUPER_INVOKE:
+      count = operand(0);
+      break;
+    default:
+      break;
+    }
+    if (static_cast<size_t>(depth) <= stack_inputs(op, count)) {
+      invalid("instruction uses more values than are on the stack");
+    }
+    switch (op) {
+    case OpCode::GET_LOCAL:
+    case OpCode::SET_LOCAL:
+      if (operand(0) >= static_cast<size_t>(depth)) {
+        invalid("local slot out of range");
+      }
+      break;
+    case OpCode::GET_UPVALUE:
+    case OpCode::SET_UPVALUE:
+      if (operand(0) >= fn->upvalues.size()) {
+        invalid("upvalue index out of range");
+      }
+      break;
+    case OpCode::CLOSURE: {
+      // Each upvalue is either a local of this frame or one of our upvalues.
+      size_t n_upvalues = closure_function(operand(0))->upvalues.size();
+      for (size_t i = 0; i < n_upvalues; i++) {
+        bool is_local = operand(1 + 2 * i) != 0;
+        size_t index = operand(2 + 2 * i);
+        if (is_local ? index >= static_cast<size_t>(depth)
+                     : index >= fn->upvalues.size()) {
+          invalid("captured variable out of range");
+        }
+        // Otherwise RETURN wouldn't close the upvalue.
+        if (is_local && !fn->has_captured_locals) {
+          invalid("captured local in a function without captured locals");
+        }
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    return depth + (width == 3 ? optimise::stack_effect(chunk, start)
+                               : optimise::simple_stack_effect(op, chunk,
+                                                               operands));
+  };
+
+  std::vector<ptrdiff_t> depth_at(size, -1);
+  std::vector<std::pair<size_t, ptrdiff_t>> worklist;
+  worklist.emplace_back(0, static_cast<ptrdiff_t>(fn->arity + 1));
+  while (!worklist.empty()) {
+    size_t offset = worklist.back().first;
+    ptrdiff_t depth = worklist.back().second;
+    worklist.pop_back();
+    while (true) {
+      if (offset >= size) {
+        invalid("code runs past the end of the function");
+      }
+      if (depth_at[offset] >= 0) {
+        if (depth_at[offset] != depth) {
+          invalid("inconsistent stack depth");
+        }
+        break;
+      }
+      depth_at[offset] = depth;
+      OpCode op = static_cast<OpCode>(chunk.at(offset));
+      // Any jump is the only jump in its instruction, so `depth` is the depth
+      // at the target once the jump component has been applied.
+      std::optional<ptrdiff_t> target_depth;
+      auto apply = [&](OpCode component, size_t operands, size_t width) {
+        depth = step(component, offset, operands, width, depth);
+        if (optimise::is_jump(component)) {
+          target_depth = depth;
+        }
+      };
+      if (op == OpCode::WIDE) {
+        apply(static_cast<OpCode>(chunk.at(offset + 1)), offset + 2, 3);
+      } else if (const Superinstruction* super = find_superinstruction(op)) {
+        size_t operands = offset + 1;
+        for (size_t i = 0; i < super->n_components; i++) {
+          apply(super->components[i], operands, 1);
+          operands += instruction_length(super->components[i]) - 1;
+        }
+      } else {
+        apply(generic_opcode(op), offset + 1, 1);
+      }
+      if (target_depth) {
+        worklist.emplace_back(
+            static_cast<size_t>(optimise::jump_target(chunk, offset)),
+            *target_depth);
+      }
+      if (!optimise::falls_through(op)) {
+        break;
+      }
+      offset = optimise::next_instruction(chunk, offset);
+    }
+  }
+}
+
+ObjFunction* Reader::read() {
+  if (bytes.size() < MAGIC.size() ||
+      std::memcmp(take(MAGIC.size()), MAGIC.data(), MAGIC.size()) != 0) {
+    throw std::runtime_error("bytecode: not a bytecode file");
+  }
+  uint32_t format_version = read_u32();
+  if (format_version != FORMAT_VERSION ||
+      read_u64() != interpreter_version()) {
+    throw std::runtime_error(
+        "bytecode: file was written by a different version of the interpreter");
+  }
+  read_u64(); // source hash, only used by is_up_to_date
+
+  // The global slots have to come out exactly the same as when the file was
+  // written, so that the slot operands in the bytecode still line up.
+  uint32_t n_globals = read_count(4);
+  if (globals.size() != 0) {
+    throw std::runtime_error("bytecode: global table is not empty");
+  }
+  for (uint32_t slot = 0; slot < n_globals; slot++) {
+    if (globals.slot_for(gc.get_string_ptr(read_string())) != slot) {
+      throw std::runtime_error("bytecode: duplicate global name");
+    }
+  }
+
+  ObjFunction* top_level_fn = read_function();
+  // The VM calls the top-level function without any arguments.
+  if (top_level_fn->arity != 0) {
+    throw std::runtime_error("bytecode: top-level function takes arguments");
+  }
+  if (pos != bytes.size()) {
+    throw std::runtime_error("bytecode: trailing data at end of file");
+  }
+  return top_level_fn;
+}
+
+void Reader::mark_as_grey(GC& gc) const {
+  for (Obj* obj : in_progress) {
+    gc.mark_as_grey(obj);
+  }
+}
+
+} // namespace lox::bytecode
@@ -0,0 +1,89 @@
+#pragma once
+#include "gc.hpp"
+#include "globals.hpp"
+#include "value.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lox {
+
+// Serialised bytecode (`.loxc` files), which lets us skip scanning, compiling
+// and optimising a script that hasn't changed since the last time it was run.
+//
+// A file contains a header, the names of the global variable slots (in slot
+// order, since the bytecode refers to globals by slot index), and then the
+// top-level function. Each function is stored as its name, arity,
+// max_stack_depth, has_captured_locals, its upvalues, and its chunk (code,
+// constants, line table, and the number of inline caches it needs; the
+// caches themselves start off empty). Nested functions are stored inline, as
+// constants of the function that encloses them. All integers are fixed-width
+// and little-endian.
+namespace bytecode {
+
+constexpr std::string_view MAGIC = "LOXC";
+// Bump this whenever the layout of the file changes. Changes to the
+// instruction set don't need a bump, because they change interpreter_version().
+constexpr uint32_t FORMAT_VERSION = 1;
+
+// Identifies the interpreter that wrote a file: a hash of FORMAT_VERSION, the
+// names of all the opcodes, in order, the superinstruction table, and the
+// build ID (LOX_BUILD_ID, which the Makefile sets to a hash of the sources and
+// compiler flags). Rebuilding the interpreter from different sources
+// therefore invalidates existing files, even if the instruction set is the
+// same (e.g. after a fix to the compiler or the optimiser).
+uint64_t interpreter_version();
+// FNV-1a hash of the source code that a file was compiled from.
+uint64_t hash_source(std::string_view source);
+
+// Whether `bytes` is a bytecode file written by this interpreter for exactly
+// this source code.
+bool is_up_to_date(std::span<const uint8_t> bytes, std::string_view source);
+
+void write(std::ostream& out, const ObjFunction* top_level_fn,
+           const Globals& globals, uint64_t source_hash);
+
+class Reader {
+public:
+  Reader(std::span<const uint8_t> bytes, GC& gc, Globals& globals)
+      : bytes(bytes), gc(gc), globals(globals) {}
+  // Returns the top-level function. Throws a std::runtime_error if the file
+  // is malformed or was written by a different interpreter version.
+  ObjFunction* read();
+  // Functions that have been allocated but aren't yet reachable from
+  // anything else (the VM calls this from mark_roots).
+  void mark_as_grey(GC& gc) const;
+
+private:
+  std::span<const uint8_t> bytes;
+  size_t pos = 0;
+  GC& gc;
+  Globals& globals;
+  // Functions currently being read, outermost first (plus the name of the
+  // function that is about to be allocated).
+  std::vector<Obj*> in_progress;
+
+  const uint8_t* take(size_t n);
+  uint8_t read_u8();
+  uint32_t read_u32();
+  uint64_t read_u64();
+  // Reads the number of items in a list where each item takes up at least
+  // `min_size` bytes, and throws if there aren't enough bytes left for them.
+  uint32_t read_count(size_t min_size);
+  std::string_view read_string();
+  lox::Value read_constant();
+  ObjFunction* read_function();
+  // Throws if any instruction in `fn` is malformed, or has an operand that
+  // the VM would use without checking it (a constant, global slot, local
+  // slot, upvalue or inline cache index, an argument count, or a jump target)
+  // that is out of range, or if the stack depth could go below the frame or
+  // differs between two paths to the same instruction.
+  void check_code(const ObjFunction* fn) const;
+};
+
+} // namespace bytecode
+} // namespace lox
@@ -5,6 +5,8 @@
 #include <cstdint>
 #include <cstdlib>
 #include <format>
+#include <array>
+#include <initializer_list>
 #include <new>
 #include <ostream>
 #include <stdexcept>
@@ -34,7 +36,125 @@ std::ostream& print_byte(std::ostream& os, uint8_t byte) {
 
 } // namespace
 
-lox::Chunk::Chunk() : code(), constants(), debuginfo() {}
+size_t lox::wide_operand_count(OpCode opcode) {
+  switch (opcode) {
+  case OpCode::CONSTANT:
+  case OpCode::CLOSURE:
+  case OpCode::GET_UPVALUE:
+  case OpCode::SET_UPVALUE:
+  case OpCode::CLASS:
+  case OpCode::GET_GLOBAL_SLOT:
+  case OpCode::SET_GLOBAL_SLOT:
+  case OpCode::DEFINE_GLOBAL_SLOT:
+  case OpCode::SET_LOCAL:
+  case OpCode::GET_LOCAL:
+  case OpCode::GET_SUPER:
+    return 1;
+  case OpCode::GET_PROPERTY:
+  case OpCode::SET_PROPERTY:
+  case OpCode::SUPER_INVOKE:
+    return 2;
+  case OpCode::INVOKE:
+  case OpCode::CALL_PROPERTY:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+std::optional<size_t> lox::constant_operand_index(OpCode opcode) {
+  switch (opcode) {
+  case OpCode::CONSTANT:
+  case OpCode::CLOSURE:
+  case OpCode::CLASS:
+  case OpCode::GET_SUPER:
+  case OpCode::GET_PROPERTY:
+  case OpCode::SET_PROPERTY:
+    return 0;
+  // The first operand is the number of arguments.
+  case OpCode::INVOKE:
+  case OpCode::CALL_PROPERTY:
+  case OpCode::SUPER_INVOKE:
+    return 1;
+  default:
+    return std::nullopt;
+  }
+}
+
+std::string_view lox::opcode_name(OpCode opcode) {
+  switch (opcode) {
+#define OPCODE_NAME(name)                                                      \
+  case OpCode::name:                                                           \
+    return #name;
+    OPCODE_LIST(OPCODE_NAME)
+#define SUPERINSTRUCTION_NAME(name, prefix, last) OPCODE_NAME(name)
+    SUPERINSTRUCTION_LIST(SUPERINSTRUCTION_NAME)
+#undef SUPERINSTRUCTION_NAME
+#define QUICKENED_NAME(name, generic) OPCODE_NAME(name)
+    QUICKENED_LIST(QUICKENED_NAME)
+#undef QUICKENED_NAME
+#undef OPCODE_NAME
+  }
+  return "<unknown>";
+}
+
+#define LOX_COMPONENT(op) lox::OpCode::op,
+#define CHECK_SUPERINSTRUCTION(name, prefix, last)                             \
+  static_assert(lox::is_valid_superinstruction(std::array{                     \
+                    LOX_FOR_EACH_PREFIX(LOX_COMPONENT, prefix)                 \
+                        lox::OpCode::last}),                                   \
+                "invalid superinstruction " #name);
+SUPERINSTRUCTION_LIST(CHECK_SUPERINSTRUCTION)
+#undef CHECK_SUPERINSTRUCTION
+
+const std::vector<std::pair<lox::OpCode, lox::Superinstruction>>&
+lox::all_superinstructions() {
+#define SUPERINSTRUCTION_ENTRY(name, prefix, last)                             \
+  {OpCode::name,                                                               \
+   Superinstruction{                                                           \
+       {LOX_FOR_EACH_PREFIX(LOX_COMPONENT, prefix) OpCode::last},              \
+       std::initializer_list<OpCode>{                                          \
+           LOX_FOR_EACH_PREFIX(LOX_COMPONENT, prefix) OpCode::last}            \
+           .size()}},
+  static const std::vector<std::pair<OpCode, Superinstruction>> table = {
+      SUPERINSTRUCTION_LIST(SUPERINSTRUCTION_ENTRY)};
+#undef SUPERINSTRUCTION_ENTRY
+  return table;
+}
+#undef LOX_COMPONENT
+
+const lox::Superinstruction* lox::find_superinstruction(OpCode opcode) {
+  // NOTE: The superinstructions come after all the ordinary opcodes in the
+  // enum, so we can index straight into the table.
+  const auto& table = all_superinstructions();
+  auto index = static_cast<size_t>(opcode) - N_ORDINARY_OPCODES;
+  if (!is_superinstruction(opcode) || index >= table.size()) {
+    return nullptr;
+  }
+  return &table[index].second;
+}
+
+lox::Chunk::Chunk() : code(), constants(), inline_caches(), cold() {}
+
+lox::Chunk::Chunk(const Chunk& other)
+    : code(other.code), constants(other.constants),
+      inline_caches(other.inline_caches),
+      cold(other.cold ? std::make_unique<Cold>(*other.cold) : nullptr) {}
+
+lox::Chunk& lox::Chunk::operator=(const Chunk& other) {
+  if (this != &other) {
+    *this = Chunk(other);
+  }
+  return *this;
+}
+
+lox::Chunk lox::Chunk::empty_like(const Chunk& other) {
+  Chunk chunk;
+  chunk.code.reserve(other.code.size());
+  chunk.constants = other.constants;
+  chunk.inline_caches.resize(other.inline_caches.size());
+  return chunk;
+}
 
 // NOTE: Sometimes, tiny functions like these are defined inside the header.
 // There are a few reasons why one might do that:
@@ -56,6 +176,15 @@ lox::Chunk::Chunk() : code(), constants(), debuginfo() {}
 size_t lox::Chunk::size() const { return code.size(); }
 
 size_t lox::Chunk::capacity() const { return code.capacity(); }
+size_t lox::Chunk::heap_size() const {
+  return code.capacity() * sizeof(uint8_t) +
+         constants.capacity() * sizeof(lox::Value) +
+         inline_caches.capacity() * sizeof(InlineCache) +
+         (cold ? sizeof(Cold) + cold->lines.heap_size() +
+                     cold->far_jumps.capacity() *
+                         sizeof(std::pair<size_t, size_t>)
+               : 0);
+}
 
 uint8_t lox::Chunk::at(size_t index) const { return code[index]; }
 
@@ -64,11 +193,8 @@ lox::Chunk& lox::Chunk::write(uint8_t byte, size_t line) {
   try {
     size_t nbytes = code.size();
     code.push_back(byte);
-    // Check if the line number has changed since the last recorded DebugInfo;
-    // if so, we need to add a new entry.
-    if (debuginfo.empty() || debuginfo.back().line != line) {
-      debuginfo.push_back(DebugInfo(nbytes, line));
-    }
+    // This only adds an entry if the line number has changed.
+    cold_info().lines.add(nbytes, line);
   } catch (const std::bad_alloc&) {
     // Gracefully handle OOM.
     // NOTE: std::vector will clean up its own memory if an exception is
@@ -111,6 +237,34 @@ bool lox::Chunk::patch_jump_operand(size_t jump_operand_byte,
   return true;
 }
 
+bool lox::Chunk::patch_long_jump_operand(size_t jump_operand_byte,
+                                         size_t target_byte) {
+  // As above, but there are four bytes of offset.
+  int64_t jump_offset = static_cast<int64_t>(target_byte) -
+                        static_cast<int64_t>(jump_operand_byte) - 4;
+  if (jump_offset > INT32_MAX || jump_offset < INT32_MIN) {
+    return false;
+  }
+  uint32_t bits = static_cast<uint32_t>(static_cast<int32_t>(jump_offset));
+  for (size_t i = 0; i < 4; i++) {
+    patch_at_offset(jump_operand_byte + i,
+                    static_cast<uint8_t>((bits >> (24 - 8 * i)) & 0xff));
+  }
+  return true;
+}
+
+std::optional<size_t> lox::Chunk::far_jump_target(size_t jump_offset) const {
+  if (!cold) {
+    return std::nullopt;
+  }
+  for (const auto& [offset, target] : cold->far_jumps) {
+    if (offset == jump_offset) {
+      return target;
+    }
+  }
+  return std::nullopt;
+}
+
 lox::Chunk& lox::Chunk::reset() {
   // NOTE: clear() removes elements and so size() will return 0, but does not
   // change capacity
@@ -118,6 +272,30 @@ lox::Chunk& lox::Chunk::reset() {
   return *this;
 }
 
+lox::Chunk& lox::Chunk::truncate(size_t new_size) {
+  if (new_size > code.size()) {
+    throw std::out_of_range("loxc: Chunk::truncate: size " +
+                            std::to_string(new_size) + " out of range (size " +
+                            std::to_string(code.size()) + ")");
+  }
+  code.resize(new_size);
+  if (cold) {
+    cold->lines.truncate(new_size);
+    std::erase_if(cold->far_jumps, [new_size](const auto& jump) {
+      return jump.first >= new_size;
+    });
+  }
+  return *this;
+}
+
+uint32_t lox::Chunk::add_inline_cache() {
+  if (inline_caches.size() >= NO_INLINE_CACHE) {
+    return NO_INLINE_CACHE;
+  }
+  inline_caches.emplace_back();
+  return static_cast<uint32_t>(inline_caches.size() - 1);
+}
+
 size_t lox::Chunk::push_constant(lox::Value value) {
   try {
     constants.push_back(value);
@@ -134,30 +312,19 @@ lox::Value lox::Chunk::constant_at(size_t index) const {
 
 size_t lox::Chunk::constants_size() const { return constants.size(); }
 
-size_t lox::Chunk::debuginfo_size() const { return debuginfo.size(); }
-
-bool compare_by_offset(size_t target, const lox::DebugInfo& info) {
-  return target < info.bytecode_offset;
+size_t lox::Chunk::debuginfo_size() const {
+  return cold ? cold->lines.size() : 0;
 }
 
 size_t lox::Chunk::debuginfo_at(size_t bytecode_offset) const {
-  if (debuginfo.empty()) {
+  if (!cold) {
     throw std::runtime_error("loxc: debuginfo_at: no debug info found");
   }
-  // NOTE: upper_bound returns an iterator to the first element that is STRICTLY
-  // greater than the target. What that means is that the entry we want is
-  // really the one just before the returned iterator.
-  auto it = std::upper_bound(debuginfo.begin(), debuginfo.end(),
-                             bytecode_offset, compare_by_offset);
-  // Unless it's the very first entry, which means that the debuginfo contains
-  // no line info for bytecode_offset. That is an error by construction.
-  if (it == debuginfo.begin()) {
-    throw std::runtime_error(
-        "loxc: debuginfo_at: no debug info for given bytecode offset");
-  } else {
-    --it;
-    return it->line;
-  }
+  return cold->lines.line_at(bytecode_offset);
+}
+
+std::vector<lox::DebugInfo> lox::Chunk::get_debuginfo() const {
+  return cold ? cold->lines.entries() : std::vector<DebugInfo>{};
 }
 
 size_t lox::Chunk::disassemble(std::ostream& os, size_t offset,
@@ -219,20 +386,6 @@ size_t lox::Chunk::disassemble(std::ostream& os, size_t offset,
     os << "DEFINE_METHOD\n";
     return offset + 1;
   }
-  case OpCode::ADD_LOCAL_CONST: {
-    uint8_t local_index = code[offset + 1];
-    uint8_t constant_index = code[offset + 1];
-    os << "ADD_LOCAL_CONST local_index=" << +local_index
-       << " constant_index=" << +constant_index << "\n";
-    return offset + 3;
-  }
-  case OpCode::LOCAL_CONST_LESS: {
-    uint8_t local_index = code[offset + 1];
-    uint8_t constant_index = code[offset + 1];
-    os << "LOCAL_CONST_LESS local_index=" << +local_index
-       << " constant_index=" << +constant_index << "\n";
-    return offset + 3;
-  }
   case OpCode::NEGATE: {
     os << "NEGATE\n";
     return offset + 1;
@@ -286,21 +439,32 @@ size_t lox::Chunk::disassemble(std::ostream& os, size_t offset,
   case OpCode::GET_PROPERTY: {
     uint8_t constant_index = code[offset + 1];
     Value constant = constants[constant_index];
-    os << "GET_PROPERTY " << constant << "\n";
-    return offset + 2;
+    os << "GET_PROPERTY " << constant << " cache=" << +code[offset + 2]
+       << "\n";
+    return offset + 3;
   }
   case OpCode::SET_PROPERTY: {
     uint8_t constant_index = code[offset + 1];
     Value constant = constants[constant_index];
-    os << "SET_PROPERTY " << constant << "\n";
-    return offset + 2;
+    os << "SET_PROPERTY " << constant << " cache=" << +code[offset + 2]
+       << "\n";
+    return offset + 3;
   }
   case OpCode::INVOKE: {
     uint8_t nargs = code[offset + 1];
     uint8_t constant_index = code[offset + 2]; // name of the method
     Value constant = constants[constant_index];
-    os << "INVOKE " << constant << " nargs=" << +nargs << "\n";
-    return offset + 3;
+    os << "INVOKE " << constant << " nargs=" << +nargs
+       << " cache=" << +code[offset + 3] << "\n";
+    return offset + 4;
+  }
+  case OpCode::CALL_PROPERTY: {
+    uint8_t nargs = code[offset + 1];
+    uint8_t constant_index = code[offset + 2]; // name of the property
+    Value constant = constants[constant_index];
+    os << "CALL_PROPERTY " << constant << " nargs=" << +nargs
+       << " cache=" << +code[offset + 3] << "\n";
+    return offset + 4;
   }
   case OpCode::SUPER_INVOKE: {
     uint8_t nargs = code[offset + 1];
@@ -309,22 +473,19 @@ size_t lox::Chunk::disassemble(std::ostream& os, size_t offset,
     os << "SUPER_INVOKE " << constant << " nargs=" << +nargs << "\n";
     return offset + 3;
   }
-  case OpCode::GET_GLOBAL: {
-    uint8_t constant_index = code[offset + 1];
-    Value constant = constants[constant_index];
-    os << "GET_GLOBAL " << constant << "\n";
+  case OpCode::GET_GLOBAL_SLOT: {
+    uint8_t slot = code[offset + 1];
+    os << "GET_GLOBAL_SLOT slot=" << +slot << "\n";
     return offset + 2;
   }
-  case OpCode::SET_GLOBAL: {
-    uint8_t constant_index = code[offset + 1];
-    Value constant = constants[constant_index];
-    os << "SET_GLOBAL " << constant << "\n";
+  case OpCode::SET_GLOBAL_SLOT: {
+    uint8_t slot = code[offset + 1];
+    os << "SET_GLOBAL_SLOT slot=" << +slot << "\n";
     return offset + 2;
   }
-  case OpCode::DEFINE_GLOBAL: {
-    uint8_t constant_index = code[offset + 1];
-    Value constant = constants[constant_index];
-    os << "DEFINE_GLOBAL " << constant << "\n";
+  case OpCode::DEFINE_GLOBAL_SLOT: {
+    uint8_t slot = code[offset + 1];
+    os << "DEFINE_GLOBAL_SLOT slot=" << +slot << "\n";
     return offset + 2;
   }
   case OpCode::SET_LOCAL: {
@@ -356,6 +517,32 @@ size_t lox::Chunk::disassemble(std::ostream& os, size_t offset,
     os << "JUMP offset=" << jump_offset << "\n";
     return offset + 3;
   }
+  case OpCode::JUMP_IF_FALSE_LONG: {
+    ptrdiff_t jump_offset = get_long_jump_offset(code.data() + offset + 1);
+    os << "JUMP_IF_FALSE_LONG offset=" << jump_offset << "\n";
+    return offset + 5;
+  }
+  case OpCode::JUMP_LONG: {
+    ptrdiff_t jump_offset = get_long_jump_offset(code.data() + offset + 1);
+    os << "JUMP_LONG offset=" << jump_offset << "\n";
+    return offset + 5;
+  }
+  case OpCode::WIDE: {
+    // Just print the raw operands of the instruction that follows.
+    auto wide_opcode = static_cast<OpCode>(code[offset + 1]);
+    size_t n_operands = wide_operand_count(wide_opcode);
+    if (wide_opcode == OpCode::CLOSURE) {
+      auto function = static_cast<ObjFunction*>(
+          as_obj(constants[wide_operand_at(offset + 2)]));
+      n_operands += 2 * function->upvalues.size();
+    }
+    os << "WIDE " << opcode_name(wide_opcode);
+    for (size_t i = 0; i < n_operands; i++) {
+      os << " " << wide_operand_at(offset + 2 + 3 * i);
+    }
+    os << "\n";
+    return offset + 2 + 3 * n_operands;
+  }
   case OpCode::CALL: {
     uint8_t nargs = code[offset + 1];
     os << "CALL nargs=" << +nargs << "\n";
@@ -371,6 +558,46 @@ size_t lox::Chunk::disassemble(std::ostream& os, size_t offset,
     os << "GET_SUPER " << constant << "\n";
     return offset + 2;
   }
+  case OpCode::BUILD_LIST: {
+    uint8_t n_elements = code[offset + 1];
+    os << "BUILD_LIST n=" << +n_elements << "\n";
+    return offset + 2;
+  }
+  case OpCode::GET_INDEX: {
+    os << "GET_INDEX\n";
+    return offset + 1;
+  }
+  case OpCode::SET_INDEX: {
+    os << "SET_INDEX\n";
+    return offset + 1;
+  }
+  default:
+    break;
+  }
+  if (const Superinstruction* super =
+          find_superinstruction(static_cast<OpCode>(instruction))) {
+    // e.g. LOCAL_CONST_LESS (GET_LOCAL 1; CONSTANT 0; LESS)
+    os << opcode_name(static_cast<OpCode>(instruction)) << " (";
+    size_t operand = offset + 1;
+    for (size_t i = 0; i < super->n_components; i++) {
+      OpCode component = super->components[i];
+      os << (i == 0 ? "" : "; ") << opcode_name(component);
+      for (size_t j = 1; j < instruction_length(component); j++) {
+        os << " " << +code[operand++];
+      }
+    }
+    os << ")\n";
+    return operand;
+  }
+  if (is_quickened(static_cast<OpCode>(instruction))) {
+    // e.g. ADD_NUM (after ADD has been quickened at runtime)
+    OpCode opcode = static_cast<OpCode>(instruction);
+    os << opcode_name(opcode);
+    for (size_t j = 1; j < instruction_length(opcode); j++) {
+      os << " " << +code[offset + j];
+    }
+    os << "\n";
+    return offset + instruction_length(opcode);
   }
   throw std::runtime_error("loxc: Chunk::disassemble: unknown opcode " +
                            std::to_string(instruction));
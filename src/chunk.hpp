@@ -1,11 +1,19 @@
 #pragma once
 
+#include "line_table.hpp"
 #include "opcode_def.hpp"
+#include "quickening_def.hpp"
+#include "superinstruction_def.hpp"
 #include "value_def.hpp"
+#include <array>
 #include <cstdint>
 #include <cstdlib>
+#include <memory>
+#include <optional>
 #include <ostream>
+#include <span>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 namespace lox {
@@ -17,13 +25,49 @@ enum class OpCode {
 #define OPCODE_ENUM(name) name,
   OPCODE_LIST(OPCODE_ENUM)
 #undef OPCODE_ENUM
+#define SUPERINSTRUCTION_ENUM(name, prefix, last) name,
+  SUPERINSTRUCTION_LIST(SUPERINSTRUCTION_ENUM)
+#undef SUPERINSTRUCTION_ENUM
+#define QUICKENED_ENUM(name, generic) name,
+  QUICKENED_LIST(QUICKENED_ENUM)
+#undef QUICKENED_ENUM
 };
 
-struct DebugInfo {
-  size_t bytecode_offset;
-  size_t line;
-  // size_t column;
-};
+// The superinstructions come after all of the ordinary opcodes, and the
+// quickened instructions come after those.
+#define OPCODE_COUNT(name) +1
+constexpr size_t N_ORDINARY_OPCODES = 0 OPCODE_LIST(OPCODE_COUNT);
+#undef OPCODE_COUNT
+#define SUPERINSTRUCTION_COUNT(name, prefix, last) +1
+constexpr size_t N_SUPERINSTRUCTIONS =
+    0 SUPERINSTRUCTION_LIST(SUPERINSTRUCTION_COUNT);
+#undef SUPERINSTRUCTION_COUNT
+constexpr bool is_superinstruction(OpCode opcode) {
+  auto index = static_cast<size_t>(opcode);
+  return index >= N_ORDINARY_OPCODES &&
+         index < N_ORDINARY_OPCODES + N_SUPERINSTRUCTIONS;
+}
+constexpr bool is_quickened(OpCode opcode) {
+  return static_cast<size_t>(opcode) >=
+         N_ORDINARY_OPCODES + N_SUPERINSTRUCTIONS;
+}
+#define QUICKENED_COUNT(name, generic) +1
+constexpr size_t N_OPCODES =
+    N_ORDINARY_OPCODES + N_SUPERINSTRUCTIONS + (0 QUICKENED_LIST(QUICKENED_COUNT));
+#undef QUICKENED_COUNT
+// The instruction that `opcode` is a quickened form of (see
+// quickening_def.hpp), or `opcode` itself if it isn't quickened.
+constexpr OpCode generic_opcode(OpCode opcode) {
+  switch (opcode) {
+#define QUICKENED_GENERIC(name, generic)                                       \
+  case OpCode::name:                                                           \
+    return OpCode::generic;
+    QUICKENED_LIST(QUICKENED_GENERIC)
+#undef QUICKENED_GENERIC
+  default:
+    return opcode;
+  }
+}
 
 inline ptrdiff_t get_jump_offset(uint8_t high_byte, uint8_t low_byte) {
   // NOTE: we have to be really careful here about how we do the static_cast!
@@ -46,20 +90,263 @@ inline std::pair<uint8_t, uint8_t> split_jump_offset(int16_t offset) {
   uint8_t low_byte = static_cast<uint8_t>(offset & 0xff);
   return {high_byte, low_byte};
 }
+// JUMP_LONG and JUMP_IF_FALSE_LONG have four-byte offsets instead. The
+// compiler only uses them for jumps that don't fit in two bytes.
+inline ptrdiff_t get_long_jump_offset(const uint8_t* bytes) {
+  uint32_t offset = (static_cast<uint32_t>(bytes[0]) << 24) |
+                    (static_cast<uint32_t>(bytes[1]) << 16) |
+                    (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+  // Same as above: reinterpret as signed first, then widen.
+  return static_cast<ptrdiff_t>(static_cast<int32_t>(offset));
+}
+
+// If an instruction has an operand that doesn't fit in one byte (e.g. the
+// 300th constant in a chunk), the compiler emits a WIDE prefix before it. In
+// that case *all* of its one-byte operands are three bytes long instead (most
+// significant byte first). This is the largest value that such an operand can
+// hold.
+constexpr size_t MAX_WIDE_OPERAND = (1 << 24) - 1;
+inline uint32_t read_wide_operand(const uint8_t* bytes) {
+  return (static_cast<uint32_t>(bytes[0]) << 16) |
+         (static_cast<uint32_t>(bytes[1]) << 8) | bytes[2];
+}
+// The number of one-byte operands that `opcode` has, i.e. the number of
+// three-byte operands that it has after WIDE. This is zero for instructions
+// that can't be prefixed with WIDE. (For CLOSURE, this is just the function
+// constant: the upvalue operands after it are wide too, but how many there are
+// depends on the function.)
+size_t wide_operand_count(OpCode opcode);
+// Which of the operands of `opcode` (counting from 0) is an index into the
+// constant table, if any.
+std::optional<size_t> constant_operand_index(OpCode opcode);
+std::string_view opcode_name(OpCode opcode);
+
+// The component instructions of a superinstruction (see
+// superinstruction_def.hpp), in order.
+struct Superinstruction {
+  static constexpr size_t MAX_COMPONENTS = 5;
+  std::array<OpCode, MAX_COMPONENTS> components;
+  size_t n_components;
+  OpCode last() const { return components[n_components - 1]; }
+};
+// Returns nullptr if `opcode` isn't a superinstruction.
+const Superinstruction* find_superinstruction(OpCode opcode);
+// All of them, in the order of SUPERINSTRUCTION_LIST.
+const std::vector<std::pair<OpCode, Superinstruction>>& all_superinstructions();
+
+// Whether `opcode` can be in the PREFIX of a superinstruction, i.e. whether
+// the VM has an implementation of it that doesn't dispatch.
+constexpr bool can_be_superinstruction_prefix(OpCode opcode) {
+  switch (opcode) {
+  case OpCode::CONSTANT:
+  case OpCode::GET_LOCAL:
+  case OpCode::SET_LOCAL:
+  case OpCode::GET_UPVALUE:
+  case OpCode::GET_GLOBAL_SLOT:
+  case OpCode::POP:
+  case OpCode::ADD:
+  case OpCode::SUBTRACT:
+  case OpCode::MULTIPLY:
+  case OpCode::DIVIDE:
+  case OpCode::NEGATE:
+  case OpCode::NOT:
+  case OpCode::EQUAL:
+  case OpCode::GREATER:
+  case OpCode::LESS:
+  case OpCode::JUMP_IF_FALSE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// The length in bytes of an instruction (including its one-byte operands), or
+// 0 if that depends on more than just the opcode (CLOSURE and WIDE).
+constexpr size_t instruction_length(OpCode opcode);
+
+constexpr size_t instruction_length(OpCode opcode) {
+  switch (opcode) {
+  case OpCode::CLOSURE:
+  case OpCode::WIDE:
+    return 0;
+
+  case OpCode::CLOSE_UPVALUE:
+  case OpCode::RETURN:
+  case OpCode::DEFINE_METHOD:
+  case OpCode::NEGATE:
+  case OpCode::ADD:
+  case OpCode::SUBTRACT:
+  case OpCode::MULTIPLY:
+  case OpCode::DIVIDE:
+  case OpCode::NOT:
+  case OpCode::EQUAL:
+  case OpCode::GREATER:
+  case OpCode::LESS:
+  case OpCode::PRINT:
+  case OpCode::POP:
+  case OpCode::INHERIT:
+  case OpCode::GET_INDEX:
+  case OpCode::SET_INDEX:
+    return 1;
+
+  case OpCode::CONSTANT:
+  case OpCode::GET_UPVALUE:
+  case OpCode::SET_UPVALUE:
+  case OpCode::CLASS:
+  case OpCode::GET_GLOBAL_SLOT:
+  case OpCode::SET_GLOBAL_SLOT:
+  case OpCode::DEFINE_GLOBAL_SLOT:
+  case OpCode::SET_LOCAL:
+  case OpCode::GET_LOCAL:
+  case OpCode::CALL:
+  case OpCode::GET_SUPER:
+  case OpCode::BUILD_LIST:
+    return 2;
+
+  case OpCode::GET_PROPERTY:
+  case OpCode::SET_PROPERTY:
+  case OpCode::SUPER_INVOKE:
+  case OpCode::JUMP_IF_FALSE:
+  case OpCode::JUMP:
+    return 3;
+
+  case OpCode::INVOKE:
+  case OpCode::CALL_PROPERTY:
+    return 4;
+
+  case OpCode::JUMP_IF_FALSE_LONG:
+  case OpCode::JUMP_LONG:
+    return 5;
+
+    // A superinstruction is one byte for itself, plus the operands of all of
+    // its components.
+#define LOX_COMPONENT_OPERANDS(op) +(instruction_length(OpCode::op) - 1)
+#define SUPERINSTRUCTION_LENGTH(name, prefix, last)                            \
+  case OpCode::name:                                                           \
+    return 1 LOX_FOR_EACH_PREFIX(LOX_COMPONENT_OPERANDS, prefix)               \
+        LOX_COMPONENT_OPERANDS(last);
+    SUPERINSTRUCTION_LIST(SUPERINSTRUCTION_LENGTH)
+#undef SUPERINSTRUCTION_LENGTH
+#undef LOX_COMPONENT_OPERANDS
+
+#define QUICKENED_LENGTH(name, generic)                                        \
+  case OpCode::name:                                                           \
+    return instruction_length(OpCode::generic);
+    QUICKENED_LIST(QUICKENED_LENGTH)
+#undef QUICKENED_LENGTH
+  }
+  return 0;
+}
+
+// Whether a sequence of instructions satisfies the restrictions described in
+// superinstruction_def.hpp (the last element is LAST, the rest are PREFIX).
+constexpr bool is_valid_superinstruction(std::span<const OpCode> components) {
+  if (components.size() < 2 ||
+      components.size() > Superinstruction::MAX_COMPONENTS) {
+    return false;
+  }
+  OpCode last = components.back();
+  if (instruction_length(last) == 0 || last == OpCode::JUMP_LONG ||
+      last == OpCode::JUMP_IF_FALSE_LONG || is_superinstruction(last) ||
+      is_quickened(last)) {
+    return false;
+  }
+  bool operands_after = instruction_length(last) > 1;
+  for (size_t i = components.size() - 1; i-- > 0;) {
+    if (!can_be_superinstruction_prefix(components[i]) ||
+        (components[i] == OpCode::JUMP_IF_FALSE && operands_after)) {
+      return false;
+    }
+    operands_after = operands_after || instruction_length(components[i]) > 1;
+  }
+  return true;
+}
+
+class ObjShape;
+class ObjClosure;
+
+// Each GET_PROPERTY, SET_PROPERTY, and INVOKE instruction has its own inline
+// cache, which remembers what the property lookup found for the last few
+// shapes of instance that the instruction saw. If the next instance has one of
+// those shapes, the VM can skip the lookup entirely.
+struct InlineCache {
+  struct Entry {
+    ObjShape* shape = nullptr;
+    // If `method` is nullptr, the property is a field stored at `slot`.
+    // Otherwise, it's a method and this is the closure.
+    size_t slot = 0;
+    ObjClosure* method = nullptr;
+    // Only for SET_PROPERTY when the field didn't exist yet: the shape of the
+    // instance after adding the field (which is then stored at `slot`).
+    ObjShape* new_shape = nullptr;
+  };
+  // Four entries is enough for the vast majority of call sites. If more
+  // shapes than that come through, the oldest entry is evicted.
+  static constexpr size_t N_ENTRIES = 4;
+  std::array<Entry, N_ENTRIES> entries;
+
+  const Entry* find(const ObjShape* shape) const {
+    for (const Entry& entry : entries) {
+      if (entry.shape == shape) {
+        return &entry;
+      }
+    }
+    return nullptr;
+  }
+  void insert(const Entry& entry) {
+    for (size_t i = N_ENTRIES - 1; i > 0; i--) {
+      entries[i] = entries[i - 1];
+    }
+    entries[0] = entry;
+  }
+};
+
+// Cache operand for instructions that don't have an inline cache, because
+// their chunk already has as many as an operand can refer to.
+constexpr uint32_t NO_INLINE_CACHE = MAX_WIDE_OPERAND;
 
 class Chunk {
 public:
   Chunk();
+  // Copies have their own copy of the cold section.
+  Chunk(const Chunk& other);
+  Chunk& operator=(const Chunk& other);
+  Chunk(Chunk&&) noexcept = default;
+  Chunk& operator=(Chunk&&) noexcept = default;
+  // A chunk with no code, but the same constants and the same number of inline
+  // caches as `other` (which is what the peephole optimiser starts from when
+  // it rebuilds a chunk).
+  static Chunk empty_like(const Chunk& other);
   size_t size() const;
   size_t capacity() const;
+  // Number of bytes of heap memory owned by this chunk's vectors (i.e. not
+  // including sizeof(Chunk) itself).
+  size_t heap_size() const;
   uint8_t at(size_t index) const;
+  // The three-byte operand starting at `index` (see WIDE).
+  uint32_t wide_operand_at(size_t index) const {
+    return read_wide_operand(code.data() + index);
+  }
   Chunk& write(OpCode opcode, size_t line);
   Chunk& write(uint8_t byte, size_t line);
   Chunk& patch_at_offset(size_t offset, uint8_t byte);
   // Returns whether the patch was successful (i.e. whether the jump offset fits in two
   // uint8_t's).
   bool patch_jump_operand(size_t jump_operand_byte, size_t target_byte);
+  // Same, but for the four-byte operand of JUMP_LONG / JUMP_IF_FALSE_LONG.
+  bool patch_long_jump_operand(size_t jump_operand_byte, size_t target_byte);
+  // Jumps whose offset didn't fit in their two-byte operand. The compiler
+  // records their targets here, and optimise::peephole_optimise turns them into
+  // long jumps when it rebuilds the chunk.
+  void add_far_jump(size_t jump_offset, size_t target_byte) {
+    cold_info().far_jumps.emplace_back(jump_offset, target_byte);
+  }
+  bool has_far_jumps() const { return cold && !cold->far_jumps.empty(); }
+  // The target of the jump instruction at `jump_offset`, if it is a far jump.
+  std::optional<size_t> far_jump_target(size_t jump_offset) const;
   Chunk& reset();
+  // Throw away everything from `new_size` onwards.
+  Chunk& truncate(size_t new_size);
   // Returns the index of the constant just added
   size_t push_constant(lox::Value value);
   lox::Value constant_at(size_t index) const;
@@ -68,6 +355,22 @@ public:
   size_t debuginfo_at(size_t bytecode_offset) const;
 
   const std::vector<lox::Value>& get_constants() const { return constants; }
+  // Replace the whole constant table (the caller is responsible for updating
+  // any instructions that refer to it).
+  void set_constants(std::vector<lox::Value> new_constants) {
+    constants = std::move(new_constants);
+  }
+  // The line table, decoded (see LineTable).
+  std::vector<DebugInfo> get_debuginfo() const;
+
+  // Returns the index of a new, empty inline cache (or NO_INLINE_CACHE if
+  // there are too many already).
+  uint32_t add_inline_cache();
+  size_t inline_caches_size() const { return inline_caches.size(); }
+  InlineCache& inline_cache_at(size_t index) { return inline_caches[index]; }
+  const std::vector<InlineCache>& get_inline_caches() const {
+    return inline_caches;
+  }
 
   std::ostream& hex_dump(std::ostream& os, std::string_view fn_name) const;
   // Disassemble a single instruction at the given offset, and return the new
@@ -86,7 +389,23 @@ private:
   // capacity() is the number of elements it can store without resizing.
   std::vector<uint8_t> code;
   std::vector<lox::Value> constants;
-  std::vector<DebugInfo> debuginfo;
+  std::vector<InlineCache> inline_caches;
+
+  // Things that only the compiler, the optimiser, and error reporting need.
+  // These live in a separate allocation, so that the VM's view of a Chunk is
+  // just the vectors above.
+  struct Cold {
+    LineTable lines;
+    // (jump instruction offset, target offset) pairs
+    std::vector<std::pair<size_t, size_t>> far_jumps;
+  };
+  std::unique_ptr<Cold> cold;
+  Cold& cold_info() {
+    if (!cold) {
+      cold = std::make_unique<Cold>();
+    }
+    return *cold;
+  }
 };
 
 } // namespace lox
@@ -4,6 +4,7 @@
 #include "scanner.hpp"
 #include "value.hpp"
 
+#include <algorithm>
 #include <cstdint>
 #include <functional>
 #include <iostream>
@@ -18,6 +19,9 @@ lox::scanner::Token SENTINEL_EOF =
     lox::scanner::Token(lox::scanner::TokenType::_EOF, "", 0);
 
 constexpr int16_t MAX_ARITY = 255;
+// The elements of a list literal all go on the stack before BUILD_LIST, the
+// same as arguments do.
+constexpr int16_t MAX_LIST_LITERAL = 255;
 } // namespace
 
 namespace lox {
@@ -41,7 +45,9 @@ std::vector<bool> Compiler::end_scope() {
 }
 
 bool Compiler::declare_local(std::string_view name) {
-  if (locals.size() >= 256) {
+  // Local variable slots are instruction operands, so this is the limit (but in
+  // practice, the VM will run out of stack space well before reaching it).
+  if (locals.size() > MAX_WIDE_OPERAND) {
     throw std::runtime_error("too many local variables in function");
   }
   // Check for duplicates. We go backwards from the end of the locals vector
@@ -83,6 +89,7 @@ std::optional<size_t> Compiler::resolve_upvalue(std::string_view name) {
   if (opt_local_index.has_value()) {
     size_t parent_local_index = opt_local_index.value();
     parent->locals[parent_local_index].is_captured = true;
+    parent->current_function->has_captured_locals = true;
     size_t upvalue_index = declare_upvalue(Upvalue{parent_local_index, true});
     return upvalue_index;
   }
@@ -121,9 +128,10 @@ size_t Compiler::declare_upvalue(Upvalue upvalue) {
 using lox::scanner::Scanner;
 using lox::scanner::TokenType;
 
-Parser::Parser(std::unique_ptr<Scanner> scanner, ObjFunction* fnptr, GC& gc)
+Parser::Parser(std::unique_ptr<Scanner> scanner, ObjFunction* fnptr, GC& gc,
+               Globals& globals)
     : scanner(std::move(scanner)), current(SENTINEL_EOF),
-      previous(SENTINEL_EOF), errmsg(std::nullopt), gc(gc),
+      previous(SENTINEL_EOF), errmsg(std::nullopt), gc(gc), globals(globals),
       compiler(
           std::make_unique<Compiler>(fnptr, nullptr, FunctionType::TOPLEVEL)),
       current_class(nullptr) {}
@@ -194,12 +202,12 @@ void Parser::function(bool is_class_method) {
     return;
   } else {
     size_t constant_index = make_constant(from_obj(final_fnptr));
-    emit(lox::OpCode::CLOSURE);
-    emit(static_cast<uint8_t>(constant_index));
+    std::vector<size_t> operands{constant_index};
     for (const Upvalue& upvalue : final_fnptr->upvalues) {
-      emit(upvalue.is_local ? 1 : 0);
-      emit(static_cast<uint8_t>(upvalue.index));
+      operands.push_back(upvalue.is_local ? 1 : 0);
+      operands.push_back(upvalue.index);
     }
+    emit_instruction(lox::OpCode::CLOSURE, operands);
     if (!is_class_method) {
       // This makes `fn_name` available either as a local variable (if it's in
       // an inner scope) or a global variable. However, we don't always want to
@@ -244,6 +252,29 @@ size_t Parser::argument_list() {
 }
 
 void Parser::call(bool) {
+  std::optional<PropertyAccess> access =
+      std::exchange(last_property_access, std::nullopt);
+  // Check that the property access is the entire callee (which is the case if
+  // nothing else has been emitted since, and nothing jumps to the end of it,
+  // which would happen with e.g. `(a or b.c)(...)`).
+  if (access.has_value() &&
+      access->function == compiler->get_current_function() &&
+      access->end == get_chunk_size()) {
+    compiler->truncate_chunk(access->start);
+    size_t arg_count = argument_list();
+    if (access->opcode == lox::OpCode::GET_PROPERTY) {
+      // The instance is still on the stack, and the arguments go above it.
+      emit_instruction(
+          lox::OpCode::CALL_PROPERTY,
+          {arg_count, access->name_constant_index, access->cache_index});
+    } else {
+      // Same as in super_()
+      named_variable("super", false);
+      emit_instruction(lox::OpCode::SUPER_INVOKE,
+                       {arg_count, access->name_constant_index});
+    }
+    return;
+  }
   size_t arg_count = argument_list();
   emit_call(arg_count);
 }
@@ -274,7 +305,13 @@ ObjFunction* Parser::finalise_function() {
     // Get the function object from the current compiler, and pop it off the
     // compiler stack.
     auto fnptr = compiler->get_current_function();
-    fnptr->optimise_chunk();
+    fnptr->optimise_chunk(gc);
+    // Constant folding may have added new objects to the constant table.
+    gc.write_barrier(fnptr);
+    // Slot 0 (the callee) and the arguments are already on the stack when the
+    // function starts executing.
+    fnptr->max_stack_depth =
+        lox::optimise::max_stack_depth(fnptr->chunk, fnptr->arity + 1);
     compiler = compiler->get_parent();
     return fnptr;
   }
@@ -306,7 +343,10 @@ void Parser::error(std::string_view message, size_t line) {
 
 size_t Parser::make_constant(lox::Value value) {
   size_t constant_index = compiler->push_constant(value);
-  if (constant_index > UINT8_MAX) {
+  // The function being compiled may have been promoted to the old generation
+  // by now.
+  gc.write_barrier(compiler->get_current_function());
+  if (constant_index > MAX_WIDE_OPERAND) {
     error("Too many constants in one chunk.", previous.line);
   }
   return constant_index;
@@ -314,11 +354,32 @@ size_t Parser::make_constant(lox::Value value) {
 
 size_t Parser::emit_constant(lox::Value value) {
   size_t constant_index = make_constant(value);
-  emit(lox::OpCode::CONSTANT);
-  emit(static_cast<uint8_t>(constant_index));
+  emit_instruction(lox::OpCode::CONSTANT, {constant_index});
   return constant_index;
 }
 
+void Parser::emit_instruction(lox::OpCode opcode,
+                              const std::vector<size_t>& operands) {
+  bool wide = std::any_of(operands.begin(), operands.end(),
+                          [](size_t operand) { return operand > UINT8_MAX; });
+  if (!wide) {
+    // The usual case
+    emit(opcode);
+    for (size_t operand : operands) {
+      emit(static_cast<uint8_t>(operand));
+    }
+  } else {
+    emit(lox::OpCode::WIDE);
+    emit(opcode);
+    for (size_t operand : operands) {
+      // The callers already checked that it fits in three bytes.
+      emit(static_cast<uint8_t>((operand >> 16) & 0xff));
+      emit(static_cast<uint8_t>((operand >> 8) & 0xff));
+      emit(static_cast<uint8_t>(operand & 0xff));
+    }
+  }
+}
+
 void Parser::emit_call(size_t arg_count) {
   emit(lox::OpCode::CALL);
   emit(static_cast<uint8_t>(arg_count));
@@ -334,18 +395,52 @@ size_t Parser::emit_jump(lox::OpCode jump_opcode) {
 }
 
 void Parser::patch_jump_operand(size_t jump_byte, size_t target_byte) {
+  // If something jumps here, then whatever was emitted last isn't the whole
+  // of the current expression.
+  if (target_byte == get_chunk_size()) {
+    last_property_access.reset();
+  }
   bool success = compiler->patch_jump_operand(jump_byte, target_byte);
   if (!success) {
-    error("Too much code to jump over.", previous.line);
-    return;
+    // It'll be turned into a long jump when the function is finalised. We
+    // can't do it here because that would move all the code after it.
+    compiler->add_far_jump(jump_byte - 1, target_byte);
   }
 }
 
 void Parser::parse() {
-  advance(); // Load the first token into `current`.
-  while (current.type != TokenType::_EOF && !has_error()) {
+  while (!at_end() && !has_error()) {
+    declaration();
+  }
+}
+
+bool Parser::at_end() {
+  if (!started) {
+    advance(); // Load the first token into `current`.
+    started = true;
+  }
+  return current.type == TokenType::_EOF;
+}
+
+ObjFunction* Parser::next_declaration(ObjFunction* fnptr) {
+  // The previous top-level function's compiler was popped by
+  // finalise_function, so there isn't one now.
+  compiler = std::make_unique<Compiler>(fnptr, nullptr, FunctionType::TOPLEVEL);
+  if (!at_end()) {
     declaration();
   }
+  return finalise_function();
+}
+
+void Parser::reset(std::unique_ptr<Scanner> new_scanner, ObjFunction* fnptr) {
+  scanner = std::move(new_scanner);
+  started = false;
+  current = SENTINEL_EOF;
+  previous = SENTINEL_EOF;
+  errmsg = std::nullopt;
+  compiler = std::make_unique<Compiler>(fnptr, nullptr, FunctionType::TOPLEVEL);
+  current_class = nullptr;
+  last_property_access = std::nullopt;
 }
 
 void Parser::parse_precedence(Precedence precedence) {
@@ -411,10 +506,9 @@ void Parser::class_declaration() {
 
   // Store the class name in the constant table. The CLASS instruction will
   // construct the ObjClass at runtime and put it on the stack.
-  uint8_t name_constant_index =
+  size_t name_constant_index =
       make_constant(from_obj(gc.get_string_ptr(class_name)));
-  emit(lox::OpCode::CLASS);
-  emit(name_constant_index);
+  emit_instruction(lox::OpCode::CLASS, {name_constant_index});
 
   // This call will emit code to read from the top of the stack and create
   // either a local or global variable with the class.
@@ -524,13 +618,19 @@ void Parser::define_variable(std::string_view var_name) {
 }
 
 void Parser::define_global_variable(std::string_view name) {
+  size_t slot = global_slot(name);
+  emit_instruction(lox::OpCode::DEFINE_GLOBAL_SLOT, {slot});
+}
+
+size_t Parser::global_slot(std::string_view name) {
+  // The name doesn't need to go into the constant table: the global table
+  // keeps hold of it (and the VM marks it during GC).
   ObjString* var_name_str = gc.get_string_ptr(name);
-  // NOTE: we use make_constant here (not emit_constant) because we don't want
-  // to emit a CONSTANT instruction right now. If we did so then the VM would
-  // interpret it as a string literal.
-  size_t constant_index = make_constant(from_obj(var_name_str));
-  emit(lox::OpCode::DEFINE_GLOBAL);
-  emit(static_cast<uint8_t>(constant_index));
+  size_t slot = globals.slot_for(var_name_str);
+  if (slot > MAX_WIDE_OPERAND) {
+    error("Too many global variables.", previous.line);
+  }
+  return slot;
 }
 
 void Parser::variable(bool can_assign) {
@@ -538,9 +638,9 @@ void Parser::variable(bool can_assign) {
   named_variable(previous.lexeme, can_assign);
 }
 
-void Parser::emit_variable_access(lox::OpCode set_opcode,
+bool Parser::emit_variable_access(lox::OpCode set_opcode,
                                   lox::OpCode get_opcode, bool can_assign,
-                                  size_t index) {
+                                  const std::vector<size_t>& operands) {
   // check whether it's a get or a set.
   if (consume_if(TokenType::EQUAL)) {
     if (!can_assign) {
@@ -552,16 +652,17 @@ void Parser::emit_variable_access(lox::OpCode set_opcode,
     // The set opcode will then read it from the stack and assign it to the
     // variable in position `index`. (Exactly what `index` refers to depends on
     // whether it's a local, upvalue, or global. For locals, `index` refers to
-    // the position on the stack. For globals and properties, `index` refers to
-    // the index of the variable NAME in the constant table. The VM then looks
-    // up the name in its globals map to get the value.)
-    emit(set_opcode);
-    emit(static_cast<uint8_t>(index));
+    // the position on the stack. For globals, `index` is the slot in the VM's
+    // global table. For properties, `index` refers to the index of the
+    // property NAME in the constant table, and it's followed by the index of
+    // the inline cache.)
+    emit_instruction(set_opcode, operands);
+    return true;
   } else {
     // Just a get; the get opcode will read it from position `index` and push to
     // the stack.
-    emit(get_opcode);
-    emit(static_cast<uint8_t>(index));
+    emit_instruction(get_opcode, operands);
+    return false;
   }
 }
 
@@ -570,23 +671,22 @@ void Parser::named_variable(std::string_view lexeme, bool can_assign) {
   if (opt_local_index.has_value()) {
     size_t local_index = opt_local_index.value();
     emit_variable_access(lox::OpCode::SET_LOCAL, lox::OpCode::GET_LOCAL,
-                         can_assign, local_index);
+                         can_assign, {local_index});
   } else {
     // Check if it's an upvalue.
     std::optional<size_t> opt_upvalue_index = compiler->resolve_upvalue(lexeme);
     if (opt_upvalue_index.has_value()) {
       size_t upvalue_index = opt_upvalue_index.value();
       emit_variable_access(lox::OpCode::SET_UPVALUE, lox::OpCode::GET_UPVALUE,
-                           can_assign, upvalue_index);
+                           can_assign, {upvalue_index});
     } else {
       // Not found, so it's a global variable (it might be undefined, but
       // that's a runtime error). We can't error in the compiler because it
       // might be defined later after we're done compiling the current
       // function.
-      ObjString* var_name_str = gc.get_string_ptr(lexeme);
-      size_t constant_index = make_constant(from_obj(var_name_str));
-      emit_variable_access(lox::OpCode::SET_GLOBAL, lox::OpCode::GET_GLOBAL,
-                           can_assign, constant_index);
+      size_t slot = global_slot(lexeme);
+      emit_variable_access(lox::OpCode::SET_GLOBAL_SLOT,
+                           lox::OpCode::GET_GLOBAL_SLOT, can_assign, {slot});
     }
   }
   return;
@@ -800,7 +900,7 @@ void Parser::super_(bool _) {
   consume_or_error(TokenType::DOT, "expected '.' after 'super'");
   consume_or_error(TokenType::IDENTIFIER, "expected superclass method name");
   std::string_view method_name = previous.lexeme;
-  uint8_t name_constant_index =
+  size_t name_constant_index =
       make_constant(from_obj(gc.get_string_ptr(method_name)));
 
   // Check for method invocation.
@@ -819,17 +919,18 @@ void Parser::super_(bool _) {
     // stack, so that SUPER_INVOKE can use it at runtime to find the right
     // ObjClosure to call (and also get rid of it from the stack).
     named_variable("super", false);
-    emit(lox::OpCode::SUPER_INVOKE);
-    emit(static_cast<uint8_t>(arg_count));
-    emit(name_constant_index);
+    emit_instruction(lox::OpCode::SUPER_INVOKE, {arg_count, name_constant_index});
   } else {
     // boring, just a method access
     // push instance to stack
     named_variable("this", false);
     // push superclass to stack
+    size_t start = get_chunk_size();
     named_variable("super", false);
-    emit(lox::OpCode::GET_SUPER);
-    emit(name_constant_index);
+    emit_instruction(lox::OpCode::GET_SUPER, {name_constant_index});
+    last_property_access =
+        PropertyAccess{compiler->get_current_function(), lox::OpCode::GET_SUPER,
+                       start, get_chunk_size(), name_constant_index, 0};
   }
 }
 
@@ -860,6 +961,41 @@ void Parser::grouping(bool _) {
   consume_or_error(TokenType::RIGHT_PAREN, "expected ')'");
 }
 
+void Parser::list(bool _) {
+  // We've already consumed the '[' token. Each element is pushed to the stack,
+  // and BUILD_LIST then replaces them all with the list.
+  size_t n_elements = 0;
+  if (!consume_if(TokenType::RIGHT_BRACKET)) {
+    while (true) {
+      n_elements++;
+      if (n_elements > MAX_LIST_LITERAL) {
+        error("cannot have more than 255 elements in a list literal",
+              previous.line);
+      }
+      expression();
+      if (consume_if(TokenType::COMMA)) {
+        continue;
+      } else if (consume_if(TokenType::RIGHT_BRACKET)) {
+        break;
+      } else {
+        error("expected ',' or ']' after list element", previous.line);
+        break;
+      }
+    }
+  }
+  emit(lox::OpCode::BUILD_LIST);
+  emit(static_cast<uint8_t>(n_elements));
+}
+
+void Parser::index(bool can_assign) {
+  // '[' has already been consumed; the list is already on the stack.
+  expression();
+  consume_or_error(TokenType::RIGHT_BRACKET, "expected ']' after index");
+  // For a set, the value goes on the stack above the list and the index.
+  emit_variable_access(lox::OpCode::SET_INDEX, lox::OpCode::GET_INDEX,
+                       can_assign, {});
+}
+
 void Parser::unary(bool _) {
   // We've already consumed the operator.
   TokenType prev_type = previous.type;
@@ -916,8 +1052,10 @@ void Parser::dot(bool can_assign) {
   consume_or_error(TokenType::IDENTIFIER, "expected property name after '.'");
   std::string_view field_name = previous.lexeme;
   // push it to the constant table
-  uint8_t name_constant_index =
+  size_t name_constant_index =
       make_constant(from_obj(gc.get_string_ptr(field_name)));
+  // Each property access gets its own inline cache.
+  size_t cache_index = compiler->add_inline_cache();
 
   // first check if it's an invocation, i.e. `a.b(...`
   // by the time we've reached here, we've consumed `a.b` already, so we can
@@ -925,12 +1063,18 @@ void Parser::dot(bool can_assign) {
   if (consume_if(TokenType::LEFT_PAREN)) {
     // this emits code to put the arguments on the stack
     size_t nargs = argument_list();
-    emit(lox::OpCode::INVOKE);
-    emit(static_cast<uint8_t>(nargs));
-    emit(name_constant_index);
+    emit_instruction(lox::OpCode::INVOKE,
+                     {nargs, name_constant_index, cache_index});
   } else {
-    emit_variable_access(lox::OpCode::SET_PROPERTY, lox::OpCode::GET_PROPERTY,
-                         can_assign, name_constant_index);
+    size_t start = get_chunk_size();
+    bool is_set = emit_variable_access(
+        lox::OpCode::SET_PROPERTY, lox::OpCode::GET_PROPERTY, can_assign,
+        {name_constant_index, cache_index});
+    if (!is_set) {
+      last_property_access = PropertyAccess{
+          compiler->get_current_function(), lox::OpCode::GET_PROPERTY, start,
+          get_chunk_size(), name_constant_index, cache_index};
+    }
   }
 }
 
@@ -1,10 +1,12 @@
 #include "chunk.hpp"
 #include "gc.hpp"
+#include "globals.hpp"
 #include "scanner.hpp"
 #include <memory>
 #include <optional>
 #include <stdexcept>
 #include <string_view>
+#include <vector>
 
 namespace lox {
 
@@ -79,6 +81,9 @@ public:
   FunctionType get_function_type() const { return fn_type; }
 
   size_t get_chunk_size() const { return current_function->chunk.size(); }
+  void truncate_chunk(size_t new_size) {
+    current_function->chunk.truncate(new_size);
+  }
   ObjFunction* get_current_function() { return current_function; }
   void emit(uint8_t byte, size_t line) {
     current_function->chunk.write(byte, line);
@@ -87,10 +92,16 @@ public:
   size_t push_constant(lox::Value value) {
     return current_function->chunk.push_constant(value);
   }
+  uint32_t add_inline_cache() {
+    return current_function->chunk.add_inline_cache();
+  }
   bool patch_jump_operand(size_t jump_operand_byte, size_t target_byte) {
     return current_function->chunk.patch_jump_operand(jump_operand_byte,
                                                       target_byte);
   }
+  void add_far_jump(size_t jump_offset, size_t target_byte) {
+    current_function->chunk.add_far_jump(jump_offset, target_byte);
+  }
 
   std::unique_ptr<Compiler> get_parent() { return std::move(parent); }
 
@@ -108,17 +119,38 @@ private:
 
 class Parser {
 public:
-  Parser(std::unique_ptr<scanner::Scanner> scanner, ObjFunction* fnptr, GC& gc);
+  Parser(std::unique_ptr<scanner::Scanner> scanner, ObjFunction* fnptr, GC& gc,
+         Globals& globals);
   void parse();
   ObjFunction* finalise_function();
+  // Streaming compilation: instead of parse() followed by finalise_function(),
+  // compile the top-level code one declaration at a time, so that each one
+  // can be run (and then thrown away) before the next is compiled.
+  // `at_end()` says whether there are any declarations left. If there are,
+  // `next_declaration(fnptr)` compiles the next one into `fnptr`, which must
+  // be a fresh top-level function, and returns it (or nullptr if there was a
+  // compile error).
+  bool at_end();
+  ObjFunction* next_declaration(ObjFunction* fnptr);
+  // Start compiling a new piece of source code (e.g. the next line typed into
+  // the REPL) into the fresh top-level function `fnptr`. Anything left over
+  // from the previous source, including a compile error, is thrown away.
+  // Global variables are resolved against the same table as before, so the
+  // new code can refer to globals that earlier code defined.
+  void reset(std::unique_ptr<scanner::Scanner> new_scanner, ObjFunction* fnptr);
   void mark_function_as_grey();
 
 private:
   std::unique_ptr<scanner::Scanner> scanner;
+  // Whether the first token has been loaded into `current` yet.
+  bool started = false;
   scanner::Token current;
   scanner::Token previous;
   std::optional<std::pair<std::string, size_t>> errmsg;
   GC& gc;
+  // The VM's global variable table, which we use to resolve global variable
+  // names to slot indices at compile time.
+  Globals& globals;
   std::unique_ptr<Compiler> compiler;
 
   bool is_in_class() const { return current_class != nullptr; }
@@ -153,6 +185,25 @@ private:
   }
   std::unique_ptr<CurrentClass> current_class;
 
+  // The last GET_PROPERTY or GET_SUPER that was emitted. If it's immediately
+  // followed by a call, i.e. `(a.b)(...)` or `(super.b)(...)`, then `call()`
+  // rewinds the chunk to `start` and emits a CALL_PROPERTY or SUPER_INVOKE
+  // instead, so that the VM never has to create an ObjBoundMethod.
+  struct PropertyAccess {
+    // The function whose chunk the access was emitted into.
+    ObjFunction* function;
+    lox::OpCode opcode;
+    // For GET_PROPERTY, the offset of the instruction itself. For GET_SUPER,
+    // the offset of the code that loads the superclass (the code that loads
+    // `this` before it is kept).
+    size_t start;
+    // The offset just after the instruction.
+    size_t end;
+    size_t name_constant_index;
+    size_t cache_index;
+  };
+  std::optional<PropertyAccess> last_property_access;
+
   // Interact with scanner
   void advance();
   bool consume_or_error(scanner::TokenType type,
@@ -188,6 +239,8 @@ private:
   void call(bool can_assign);
   void number(bool can_assign);
   void grouping(bool can_assign);
+  void list(bool can_assign);
+  void index(bool can_assign);
   void unary(bool can_assign);
   void binary(bool can_assign);
   void dot(bool can_assign);
@@ -200,6 +253,9 @@ private:
   void super_(bool can_assign);
   void define_variable(std::string_view var_name);
   void define_global_variable(std::string_view name);
+  // Returns the slot index of the global variable `name` (creating it if
+  // necessary).
+  size_t global_slot(std::string_view name);
   void named_variable(std::string_view lexeme, bool can_assign);
   void emit_auto_return_value();
 
@@ -213,8 +269,13 @@ private:
   // Pushes to the constant table and *additionally* emits the CONSTANT
   // instruction. Returns the index of the constant just added.
   size_t emit_constant(lox::Value value);
-  void emit_variable_access(lox::OpCode get_opcode, lox::OpCode set_opcode,
-                            bool can_assign, size_t index);
+  // Emits either `set_opcode` (if this is an assignment, in which case it
+  // returns true) or `get_opcode`, with the given operands.
+  bool emit_variable_access(lox::OpCode set_opcode, lox::OpCode get_opcode,
+                            bool can_assign, const std::vector<size_t>& operands);
+  // Emits `opcode` followed by `operands`, which are one byte each if they all
+  // fit, or otherwise prefixed with WIDE and three bytes each.
+  void emit_instruction(lox::OpCode opcode, const std::vector<size_t>& operands);
   size_t emit_jump(lox::OpCode jump_opcode);
   void patch_jump_operand(size_t jump_byte, size_t jump_offset);
   void emit_call(size_t arg_count);
@@ -237,6 +298,10 @@ private:
       return Rule{NULL, NULL, Precedence::NONE};
     case TokenType::RIGHT_BRACE:
       return Rule{NULL, NULL, Precedence::NONE};
+    case TokenType::LEFT_BRACKET:
+      return Rule{&Parser::list, &Parser::index, Precedence::CALL};
+    case TokenType::RIGHT_BRACKET:
+      return Rule{NULL, NULL, Precedence::NONE};
     case TokenType::COMMA:
       return Rule{NULL, NULL, Precedence::NONE};
     case TokenType::DOT:
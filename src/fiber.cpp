@@ -0,0 +1,135 @@
+#include "fiber.hpp"
+#include "gc.hpp"
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+namespace lox {
+
+ObjFiber::ObjFiber(ObjClosure* entry, size_t max_call_depth,
+                   size_t max_stack_size)
+    : Obj(static_type),
+      call_frames(std::make_unique<CallFrame[]>(max_call_depth)),
+      max_call_depth(max_call_depth),
+      // Most fibers only ever use the bottom of their stack, so this doesn't
+      // initialise it: the pages that aren't used are never touched.
+      stack(std::make_unique_for_overwrite<Value[]>(max_stack_size)),
+      max_stack_size(max_stack_size) {
+  // This is the same as what VM::invoke_toplevel and VM::call do for the
+  // top-level function.
+  stack[0] = from_obj(entry);
+  stack_top = stack.get() + 1;
+  CallFrame& frame = call_frames[0];
+  frame.closure = entry;
+  frame.chunk = &entry->function->chunk;
+  frame.constants = entry->function->chunk.get_constants().data();
+  frame.ip = entry->function->entry_point();
+  frame.slots = stack.get();
+  frame_count = 1;
+}
+
+void ObjFiber::release() {
+  call_frames.reset();
+  frame_count = 0;
+  stack.reset();
+  stack_top = nullptr;
+  open_upvalues = {};
+}
+
+void Scheduler::spawn(ObjFiber* fiber) {
+  live.insert(fiber);
+  make_ready(fiber);
+}
+
+void Scheduler::finish(ObjFiber* fiber) {
+  fiber->state = ObjFiber::State::DONE;
+  live.erase(fiber);
+}
+
+void Scheduler::make_ready(ObjFiber* fiber) {
+  if (fiber->state == ObjFiber::State::SUSPENDED) {
+    n_suspended--;
+  }
+  fiber->state = ObjFiber::State::READY;
+  ready.push_back(fiber);
+}
+
+void Scheduler::suspend(ObjFiber* fiber) {
+  fiber->state = ObjFiber::State::SUSPENDED;
+  fiber->suspensions++;
+  n_suspended++;
+}
+
+void Scheduler::suspend_until(ObjFiber* fiber, Clock::time_point deadline) {
+  suspend(fiber);
+  timers.push_back(
+      Timer{deadline, timer_sequence++, fiber, fiber->suspensions});
+  std::push_heap(timers.begin(), timers.end(), std::greater<Timer>());
+}
+
+void Scheduler::fire_timers() {
+  Clock::time_point now = Clock::now();
+  while (!timers.empty() && timers.front().deadline <= now) {
+    std::pop_heap(timers.begin(), timers.end(), std::greater<Timer>());
+    Timer timer = timers.back();
+    timers.pop_back();
+    // If the fiber was resumed by something else in the meantime, this timer
+    // doesn't apply any more.
+    if (timer.fiber->state == ObjFiber::State::SUSPENDED &&
+        timer.fiber->suspensions == timer.suspension) {
+      make_ready(timer.fiber);
+    }
+  }
+}
+
+ObjFiber* Scheduler::next() {
+  while (true) {
+    fire_timers();
+    if (!ready.empty()) {
+      ObjFiber* fiber = ready.front();
+      ready.pop_front();
+      return fiber;
+    }
+    if (n_suspended == 0) {
+      return nullptr;
+    }
+    std::optional<Clock::time_point> deadline;
+    if (!timers.empty()) {
+      deadline = timers.front().deadline;
+    }
+    if (event_loop != nullptr) {
+      event_loop->wait(deadline);
+    } else if (deadline.has_value()) {
+      std::this_thread::sleep_until(*deadline);
+    } else {
+      throw std::runtime_error(
+          "deadlock: every fiber is waiting, and nothing can resume them");
+    }
+  }
+}
+
+void Scheduler::clear() {
+  for (ObjFiber* fiber : live) {
+    fiber->state = ObjFiber::State::DONE;
+    fiber->joiners.clear();
+    fiber->release();
+  }
+  live.clear();
+  ready.clear();
+  timers.clear();
+  n_suspended = 0;
+}
+
+void Scheduler::mark_as_grey(GC& gc) const {
+  for (ObjFiber* fiber : live) {
+    gc.mark_as_grey(fiber);
+  }
+  // Fibers that have finished can still have timers left over (and those can
+  // only be thrown away once they go off).
+  for (const Timer& timer : timers) {
+    gc.mark_as_grey(timer.fiber);
+  }
+}
+
+} // namespace lox
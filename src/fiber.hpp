@@ -0,0 +1,209 @@
+#pragma once
+
+#include "chunk.hpp"
+#include "value.hpp"
+#include "value_def.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace lox {
+
+// The state of one function call. The VM keeps these in a preallocated array
+// (see VM::call_frames), so entering and leaving a function never allocates.
+class CallFrame {
+public:
+  ObjClosure* closure = nullptr;
+  // These are cached from closure->function->chunk when the frame is entered,
+  // so that switching frames doesn't have to chase pointers.
+  Chunk* chunk = nullptr;
+  const lox::Value* constants = nullptr;
+  // Where to resume execution in this frame. For the innermost frame, VM::run
+  // keeps this in a local variable instead, and only writes it back when it
+  // calls another function.
+  uint8_t* ip = nullptr;
+  // The first stack slot belonging to this frame (which holds the callee;
+  // the arguments and local variables come after it).
+  lox::Value* slots = nullptr;
+
+  // Whether the frame is running the function's register code (see
+  // register_code.hpp) rather than its bytecode.
+  bool in_register_code() const {
+    const RegisterCode* code = closure->function->register_code.get();
+    return code != nullptr && code->contains(ip);
+  }
+  // The offset in the bytecode that `ip` corresponds to.
+  size_t ip_offset() const {
+    if (in_register_code()) {
+      return closure->function->register_code->bytecode_offset(ip);
+    }
+    return static_cast<size_t>(ip - chunk->begin_location());
+  }
+  size_t get_current_debuginfo_line() const {
+    return chunk->debuginfo_at(ip_offset() - 1);
+  }
+  void disassemble(std::ostream& out) const {
+    ObjFunction* function = closure->function;
+    if (in_register_code()) {
+      function->register_code->disassemble(
+          out, static_cast<size_t>(ip - function->register_code->entry()),
+          *chunk, function->name->value);
+    } else {
+      chunk->disassemble(out, ip_offset(), function->name->value);
+    }
+  }
+};
+
+// A fiber is a thread of Lox execution with its own value stack, call frames,
+// and open upvalues, which the VM can switch to and from without leaving
+// VM::run. Fibers are cooperative: the running one carries on until it
+// finishes, or until it calls a native function that suspends it (e.g.
+// `yield`, `sleep`, `join`, or a host function that waits for I/O).
+//
+// The VM only ever works on the running fiber's state, which it keeps in its
+// own members (VM::stack, VM::call_frames, and so on) so that nothing in
+// VM::run has to go through an extra pointer. Switching fibers moves that
+// state into the ObjFiber being left, and moves the next fiber's state out of
+// its ObjFiber; the buffers themselves never move, so pointers into the stack
+// (e.g. from open upvalues) stay valid.
+//
+// The programme's top-level code runs on the VM's main fiber, which only gets
+// an ObjFiber (to save its state into) once a fiber native is first used.
+class ObjFiber : public Obj {
+public:
+  enum class State {
+    // Waiting in the scheduler's queue for its turn.
+    READY,
+    RUNNING,
+    // Waiting for something else (a timer, another fiber, or the host) to
+    // resume it.
+    SUSPENDED,
+    DONE,
+  };
+  State state = State::READY;
+
+  // Saved execution state (see above). Only the main fiber can be resumed
+  // after having finished, so the others drop their buffers when they're DONE.
+  std::unique_ptr<CallFrame[]> call_frames;
+  size_t frame_count = 0;
+  size_t max_call_depth = 0;
+  std::unique_ptr<Value[]> stack;
+  Value* stack_top = nullptr;
+  size_t max_stack_size = 0;
+  std::vector<ObjUpvalue*> open_upvalues;
+
+  // Once it's DONE, what its function returned.
+  Value result = nil_val();
+  // If set, this replaces the return value of the native function that
+  // suspended the fiber, when it next runs (see VM::resume).
+  std::optional<Value> resume_value;
+  // Fibers that are waiting in `join` for this one to finish.
+  std::vector<ObjFiber*> joiners;
+  // Incremented every time the fiber is suspended, so that a timer that was
+  // set for an earlier suspension can tell that it's out of date.
+  uint64_t suspensions = 0;
+
+  // For the main fiber, which starts off with nothing to save.
+  ObjFiber() : Obj(static_type) {}
+  // A new fiber that will call `entry` (with no arguments) when it first
+  // runs. The caller has to check that `entry` takes no arguments, and that
+  // its stack fits.
+  ObjFiber(ObjClosure* entry, size_t max_call_depth, size_t max_stack_size);
+
+  // Throw away the buffers once the fiber is done with them.
+  void release();
+
+  std::string to_repr() const override { return "<fiber>"; }
+  size_t heap_size() const override {
+    return (call_frames ? max_call_depth * sizeof(CallFrame) : 0) +
+           (stack ? max_stack_size * sizeof(Value) : 0) +
+           open_upvalues.capacity() * sizeof(ObjUpvalue*) +
+           joiners.capacity() * sizeof(ObjFiber*);
+  }
+
+  static constexpr ObjType static_type = ObjType::FIBER;
+  static constexpr std::string_view static_type_name = "ObjFiber";
+};
+
+// What the VM does when no fiber can run, because they're all waiting for
+// something. A host that does its own I/O (e.g. with epoll or io_uring)
+// implements this so that the VM waits inside the host's event loop: wait()
+// should block until `deadline` (if there is one), or until some of the
+// host's I/O has finished, and call VM::resume for every fiber that can now
+// carry on. It's fine for wait() to return early without resuming anything.
+//
+// Without an event loop, the VM just sleeps until the next timer.
+class EventLoop {
+public:
+  using Clock = std::chrono::steady_clock;
+  virtual ~EventLoop() = default;
+  virtual void wait(std::optional<Clock::time_point> deadline) = 0;
+};
+
+// Decides which fiber runs next. This only keeps track of fibers; actually
+// switching between them is up to the VM.
+class Scheduler {
+public:
+  using Clock = EventLoop::Clock;
+
+  // Start keeping `fiber` alive (a fiber that hasn't finished can't be
+  // collected, even if nothing in Lox refers to it any more, since it may
+  // still do something) and queue it up to run.
+  void spawn(ObjFiber* fiber);
+  // `fiber` has finished, so it doesn't need to be kept alive any more.
+  void finish(ObjFiber* fiber);
+  // Queue `fiber` up to run.
+  void make_ready(ObjFiber* fiber);
+  // Mark `fiber` as waiting for something to resume it.
+  void suspend(ObjFiber* fiber);
+  // Suspend `fiber`, and make it ready again at `deadline`.
+  void suspend_until(ObjFiber* fiber, Clock::time_point deadline);
+
+  // Whether anything other than the running fiber is ready or waiting.
+  bool has_work() const { return !ready.empty() || n_suspended > 0; }
+  // Take the next fiber to run from the queue, waiting for a timer or the
+  // event loop if nothing is ready yet. Returns nullptr if no fiber is ready
+  // or waiting. Throws if they're all waiting and nothing can wake them up.
+  ObjFiber* next();
+
+  void set_event_loop(EventLoop* loop) { event_loop = loop; }
+  // Forget about every fiber (after a runtime error). They're all marked as
+  // DONE, and their buffers are released; the caller has to make sure that
+  // none of their upvalues are still open.
+  void clear();
+  // All of the unfinished fibers that the scheduler knows about.
+  const std::unordered_set<ObjFiber*>& get_live() const { return live; }
+  void mark_as_grey(GC& gc) const;
+
+private:
+  std::deque<ObjFiber*> ready;
+  struct Timer {
+    Clock::time_point deadline;
+    // Timers with the same deadline go off in the order they were set.
+    uint64_t sequence;
+    ObjFiber* fiber;
+    uint64_t suspension;
+    bool operator>(const Timer& other) const {
+      return deadline != other.deadline ? deadline > other.deadline
+                                        : sequence > other.sequence;
+    }
+  };
+  // A min-heap (with std::push_heap and std::pop_heap), rather than a
+  // std::priority_queue, so that the GC can see the fibers in it.
+  std::vector<Timer> timers;
+  uint64_t timer_sequence = 0;
+  size_t n_suspended = 0;
+  std::unordered_set<ObjFiber*> live;
+  EventLoop* event_loop = nullptr;
+
+  // Make every fiber whose timer has gone off ready.
+  void fire_timers();
+};
+
+} // namespace lox
@@ -1,31 +1,341 @@
 #include "gc.hpp"
+#include "fiber.hpp"
 #include "value.hpp"
 #include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <ostream>
 #include <string_view>
-#include <unordered_map>
+#include <utility>
 
-namespace {} // namespace
+namespace {
+
+// The size of each type of object, which determines the block size of its
+// pool.
+constexpr size_t obj_size(lox::ObjType type) {
+  using lox::ObjType;
+  switch (type) {
+  case ObjType::STRING:
+    return sizeof(lox::ObjString);
+  case ObjType::FUNCTION:
+    return sizeof(lox::ObjFunction);
+  case ObjType::UPVALUE:
+    return sizeof(lox::ObjUpvalue);
+  case ObjType::CLOSURE:
+    return sizeof(lox::ObjClosure);
+  case ObjType::NATIVE_FUNCTION:
+    return sizeof(lox::ObjNativeFunction);
+  case ObjType::CLASS:
+    return sizeof(lox::ObjClass);
+  case ObjType::INSTANCE:
+    return sizeof(lox::ObjInstance);
+  case ObjType::BOUND_METHOD:
+    return sizeof(lox::ObjBoundMethod);
+  case ObjType::SHAPE:
+    return sizeof(lox::ObjShape);
+  case ObjType::ROPE:
+    return sizeof(lox::ObjRope);
+  case ObjType::LIST:
+    return sizeof(lox::ObjList);
+  case ObjType::FIBER:
+    return sizeof(lox::ObjFiber);
+  }
+  return 0;
+}
+
+std::string_view gc_mode_name(lox::GCMode mode) {
+  switch (mode) {
+  case lox::GCMode::MARK_SWEEP:
+    return "mark-sweep";
+  case lox::GCMode::GENERATIONAL:
+    return "generational";
+  case lox::GCMode::INCREMENTAL:
+    return "incremental";
+  }
+  return "unknown";
+}
+
+} // namespace
 
 namespace lox {
 
-ObjString* GC::get_string_ptr(std::string_view key) {
-  auto it = interned_strings.map.find(key);
-  if (it == interned_strings.map.end()) {
-    // Not found; create a new one.
-    ObjString* s = alloc<ObjString>(key);
-    auto new_pair = interned_strings.map.emplace(std::string(key), s);
-    it = new_pair.first;
+std::string_view obj_type_name(ObjType type) {
+  switch (type) {
+  case ObjType::STRING:
+    return ObjString::static_type_name;
+  case ObjType::FUNCTION:
+    return ObjFunction::static_type_name;
+  case ObjType::UPVALUE:
+    return ObjUpvalue::static_type_name;
+  case ObjType::CLOSURE:
+    return ObjClosure::static_type_name;
+  case ObjType::NATIVE_FUNCTION:
+    return ObjNativeFunction::static_type_name;
+  case ObjType::CLASS:
+    return ObjClass::static_type_name;
+  case ObjType::INSTANCE:
+    return ObjInstance::static_type_name;
+  case ObjType::BOUND_METHOD:
+    return ObjBoundMethod::static_type_name;
+  case ObjType::SHAPE:
+    return ObjShape::static_type_name;
+  case ObjType::ROPE:
+    return ObjRope::static_type_name;
+  case ObjType::LIST:
+    return ObjList::static_type_name;
+  case ObjType::FIBER:
+    return ObjFiber::static_type_name;
+  }
+  return "unknown";
+}
+
+GCStats::TypeStats GCStats::total() const {
+  TypeStats result;
+  for (const TypeStats& t : per_type) {
+    result.objects_allocated += t.objects_allocated;
+    result.bytes_allocated += t.bytes_allocated;
+    result.objects_freed += t.objects_freed;
+    result.bytes_freed += t.bytes_freed;
+  }
+  return result;
+}
+
+void GCStats::record_pause(std::chrono::nanoseconds pause) {
+  total_pause += pause;
+  max_pause = std::max(max_pause, pause);
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(pause);
+  size_t bucket = 0;
+  while (bucket < PAUSE_HISTOGRAM_BUCKETS - 1 && (1 << bucket) <= us.count()) {
+    bucket++;
+  }
+  pause_histogram[bucket]++;
+}
+
+void GCStats::write_json(std::ostream& out) const {
+  auto us = [](std::chrono::nanoseconds ns) {
+    return std::chrono::duration<double, std::micro>(ns).count();
+  };
+  out << "{\n";
+  out << "  \"mode\": \"" << gc_mode_name(mode) << "\",\n";
+  out << "  \"collections\": " << collections << ",\n";
+  out << "  \"minor_collections\": " << minor_collections << ",\n";
+  out << "  \"major_collections\": " << major_collections << ",\n";
+  out << "  \"incremental_steps\": " << incremental_steps << ",\n";
+  out << "  \"bytes_allocated\": " << bytes_allocated << ",\n";
+  out << "  \"peak_bytes\": " << peak_bytes << ",\n";
+  out << "  \"bytes_reserved\": " << bytes_reserved << ",\n";
+  out << "  \"interned_strings\": " << interned_strings << ",\n";
+  out << "  \"total_pause_us\": " << us(total_pause) << ",\n";
+  out << "  \"max_pause_us\": " << us(max_pause) << ",\n";
+  // Each bucket is labelled with its (exclusive) upper bound, or null for the
+  // last one.
+  out << "  \"pause_histogram\": [";
+  for (size_t i = 0; i < PAUSE_HISTOGRAM_BUCKETS; i++) {
+    out << (i == 0 ? "\n" : ",\n") << "    {\"below_us\": ";
+    if (i == PAUSE_HISTOGRAM_BUCKETS - 1) {
+      out << "null";
+    } else {
+      out << (1 << i);
+    }
+    out << ", \"count\": " << pause_histogram[i] << "}";
+  }
+  out << "\n  ],\n";
+  out << "  \"types\": {";
+  for (size_t i = 0; i < NUM_OBJ_TYPES; i++) {
+    const TypeStats& t = per_type[i];
+    out << (i == 0 ? "\n" : ",\n") << "    \""
+        << obj_type_name(static_cast<ObjType>(i)) << "\": {"
+        << "\"objects_allocated\": " << t.objects_allocated
+        << ", \"bytes_allocated\": " << t.bytes_allocated
+        << ", \"objects_freed\": " << t.objects_freed
+        << ", \"bytes_freed\": " << t.bytes_freed << "}";
+  }
+  out << "\n  }\n";
+  out << "}\n";
+}
+
+GC::GC(GCMode mode) : mode(mode) {
+  stats.mode = mode;
+  for (size_t i = 0; i < NUM_OBJ_TYPES; i++) {
+    pools[i] = Pool(obj_size(static_cast<ObjType>(i)));
+  }
+}
+
+GC::GC(GC&& other) noexcept : GC(other.mode) { *this = std::move(other); }
+
+GC& GC::operator=(GC&& other) noexcept {
+  if (this != &other) {
+    free_all_objects();
+    mode = other.mode;
+    head = std::exchange(other.head, nullptr);
+    old_head = std::exchange(other.old_head, nullptr);
+    remembered_set = std::move(other.remembered_set);
+    minor_collection = other.minor_collection;
+    interned_strings = std::move(other.interned_strings);
+    grey_stack = std::move(other.grey_stack);
+    alloc_callback = std::move(other.alloc_callback);
+    defer_depth = std::exchange(other.defer_depth, 0);
+    bytes_allocated = std::exchange(other.bytes_allocated, 0);
+    young_bytes = std::exchange(other.young_bytes, 0);
+    phase = std::exchange(other.phase, Phase::IDLE);
+    unswept = std::exchange(other.unswept, nullptr);
+    swept = std::exchange(other.swept, nullptr);
+    swept_tail = std::exchange(other.swept_tail, nullptr);
+    pause_budget = other.pause_budget;
+    bytes_at_cycle_start = other.bytes_at_cycle_start;
+    next_gc_threshold = other.next_gc_threshold;
+    heap_growth_factor = other.heap_growth_factor;
+    stats = other.stats;
+    pause_start = other.pause_start;
+    pools = std::move(other.pools);
+    release_empty_pages = other.release_empty_pages;
+  }
+  return *this;
+}
+
+GC::~GC() { free_all_objects(); }
+
+void GC::free_object(Obj* objptr) {
+  Pool& pool = pools[static_cast<size_t>(objptr->type)];
+  GCStats::TypeStats& type_stats =
+      stats.per_type[static_cast<size_t>(objptr->type)];
+  type_stats.objects_freed++;
+  type_stats.bytes_freed += objptr->size;
+  // NOTE: Because the object was created with placement new, we can't use
+  // `delete` on it: instead we call the destructor explicitly (it's virtual,
+  // so this runs the derived class's destructor) and then hand the memory
+  // back to the pool ourselves.
+  objptr->~Obj();
+  pool.deallocate(objptr);
+}
+
+void GC::free_list(Obj*& list) {
+  Obj* objptr = list;
+  while (objptr != nullptr) {
+    Obj* next = objptr->next;
+    free_object(objptr);
+    objptr = next;
+  }
+  list = nullptr;
+}
+
+void GC::free_all_objects() {
+  free_list(head);
+  free_list(old_head);
+  free_list(unswept);
+  free_list(swept);
+  swept_tail = nullptr;
+  phase = Phase::IDLE;
+  remembered_set.clear();
+  grey_stack.clear();
+  bytes_allocated = 0;
+  young_bytes = 0;
+}
+
+size_t GC::get_bytes_reserved() const {
+  size_t total = 0;
+  for (const Pool& pool : pools) {
+    total += pool.reserved_bytes();
+  }
+  return total;
+}
+
+GCStats GC::get_stats() const {
+  GCStats result = stats;
+  result.bytes_allocated = bytes_allocated;
+  result.bytes_reserved = get_bytes_reserved();
+  result.interned_strings = interned_strings.size();
+  return result;
+}
+
+ObjString* GC::get_string_ptr(std::string_view str) {
+  size_t hash = hash_string(str);
+  ObjString* s = interned_strings.find_key(str, hash);
+  if (s == nullptr) {
+    // Not found; create a new one. The table only holds pointers to the
+    // ObjStrings themselves, so there's no need to copy the key again.
+    s = alloc<ObjString>(str, hash);
+    interned_strings.set(s, s);
   }
-  return it->second;
+  return s;
+}
+
+ObjString* GC::get_string_ptr(std::string&& str) {
+  size_t hash = hash_string(str);
+  ObjString* s = interned_strings.find_key(str, hash);
+  if (s == nullptr) {
+    s = alloc<ObjString>(std::move(str), hash);
+    interned_strings.set(s, s);
+  }
+  return s;
 }
 
 bool GC::should_gc() {
+  if (defer_depth > 0) {
+    return false;
+  }
 #ifdef LOX_GC_DEBUG
   return true;
 #else
-  return bytes_allocated > next_gc_threshold;
+  switch (mode) {
+  case GCMode::MARK_SWEEP:
+    return bytes_allocated > next_gc_threshold;
+  case GCMode::GENERATIONAL:
+    return young_bytes > NURSERY_SIZE;
+  case GCMode::INCREMENTAL:
+    if (phase == Phase::IDLE) {
+      return bytes_allocated > next_gc_threshold;
+    }
+    return young_bytes > INCREMENTAL_STEP_SIZE;
+  }
+  return false;
+#endif
+}
+
+bool GC::begin_collection() {
+  pause_start = std::chrono::steady_clock::now();
+  switch (mode) {
+  case GCMode::MARK_SWEEP:
+    minor_collection = false;
+    return true;
+  case GCMode::GENERATIONAL: {
+    size_t old_bytes = bytes_allocated - young_bytes;
+#ifdef LOX_GC_DEBUG
+    // Collections happen on every allocation, so the old generation would
+    // never get big enough for a major collection; alternate between them
+    // instead so that both are exercised.
+    minor_collection = !minor_collection;
+    (void)old_bytes;
+#else
+    minor_collection = old_bytes <= next_gc_threshold;
 #endif
+    return true;
+  }
+  case GCMode::INCREMENTAL:
+    if (phase == Phase::IDLE) {
+      phase = Phase::MARKING;
+      bytes_at_cycle_start = bytes_allocated;
+    }
+    // The roots aren't covered by the write barrier, so they have to be
+    // marked again at the start of every marking step.
+    return phase == Phase::MARKING;
+  }
+  return true;
+}
+
+void GC::write_barrier_slow(Obj* owner) {
+  if (phase == Phase::MARKING) {
+    // Only black objects need to be traced again. White ones will get traced
+    // anyway if they turn out to be reachable, and grey ones haven't been
+    // traced yet.
+    if (owner->is_marked) {
+      owner->is_remembered = true;
+      grey_stack.push_back(owner);
+    }
+  } else {
+    owner->is_remembered = true;
+    remembered_set.push_back(owner);
+  }
 }
 
 void GC::mark_as_grey(const lox::Value& value) {
@@ -35,7 +345,11 @@ void GC::mark_as_grey(const lox::Value& value) {
   }
 }
 void GC::mark_as_grey(Obj* objptr) {
-  if (objptr != nullptr && !objptr->is_marked) {
+  // During a minor collection, old objects are assumed to be alive, so we
+  // don't trace through them. (Any young objects that they point to will have
+  // been put in the remembered set by the write barrier.)
+  if (objptr != nullptr && !objptr->is_marked &&
+      !(minor_collection && objptr->is_old)) {
     objptr->is_marked = true;
     // For strings and native functions, there are no sub-objects to mark, so
     // we can just stop here. For other objects, we need to add them to the
@@ -49,159 +363,407 @@ void GC::mark_as_grey(Obj* objptr) {
 
 void GC::list_objects() const {
   std::cerr << "        === GC Objects ===\n";
-  for (Obj* obj = head; obj != nullptr; obj = obj->next) {
-    // some nice unicode symbols for white/grey/black
-    if (obj->is_marked) {
-      if (std::find(grey_stack.begin(), grey_stack.end(), obj) !=
-          grey_stack.end()) {
-        std::cerr << "        🟡 "; // grey (well... close enough)
+  for (Obj* list : {head, old_head, unswept, swept}) {
+    for (Obj* obj = list; obj != nullptr; obj = obj->next) {
+      // some nice unicode symbols for white/grey/black
+      if (obj->is_marked) {
+        if (std::find(grey_stack.begin(), grey_stack.end(), obj) !=
+            grey_stack.end()) {
+          std::cerr << "        🟡 "; // grey (well... close enough)
+        } else {
+          std::cerr << "        ⚫ "; // black
+        }
       } else {
-        std::cerr << "        ⚫ "; // black
+        std::cerr << "        ⚪ "; // white
       }
-    } else {
-      std::cerr << "        ⚪ "; // white
+      // Unmarked objects that haven't been swept yet are garbage, and the
+      // objects they refer to might already have been freed, so we can't
+      // print them.
+      if (list == unswept && !obj->is_marked) {
+        std::cerr << "<garbage " << obj_type_name(obj->type) << ">\n";
+        continue;
+      }
+      std::cerr << obj->to_repr() << (obj->is_old ? " (old)" : "") << "\n";
     }
-    std::cerr << obj->to_repr() << "\n";
   }
   std::cerr << "        === End GC Objects ===\n";
 }
 
+void GC::blacken(Obj* objptr) {
+  // Once an object has been traced it's black, so the write barrier needs to
+  // take notice of it again.
+  objptr->is_remembered = false;
+  switch (objptr->type) {
+  // ObjString has no references to other objects, so we don't need to
+  // mark anything else as grey. Likewise for native functions.
+  case ObjType::STRING:
+    break;
+  case ObjType::NATIVE_FUNCTION:
+    break;
+  case ObjType::CLASS: {
+    auto p = static_cast<ObjClass*>(objptr);
+    mark_as_grey(p->name);
+    mark_as_grey(p->root_shape);
+    for (const auto& [methodname, method] : p->methods) {
+      mark_as_grey(methodname);
+      mark_as_grey(method);
+    }
+    break;
+  }
+  case ObjType::FUNCTION: {
+    ObjFunction* p = static_cast<ObjFunction*>(objptr);
+    mark_as_grey(p->name);
+    for (const auto& constant : p->chunk.get_constants()) {
+      mark_as_grey(constant);
+    }
+    // The inline caches have to keep their shapes alive: otherwise a new
+    // shape could be allocated at the same address as a dead one, and we'd
+    // get a false cache hit.
+    for (const InlineCache& cache : p->chunk.get_inline_caches()) {
+      for (const InlineCache::Entry& entry : cache.entries) {
+        mark_as_grey(entry.shape);
+        mark_as_grey(entry.method);
+        mark_as_grey(entry.new_shape);
+      }
+    }
+    break;
+  }
+  case ObjType::UPVALUE: {
+    // For ObjUpvalue, we only need to care about the value if it's closed. If
+    // it's not closed, then the value exists somewhere on the VM's stack, so
+    // the GC will already have marked it as grey.
+    ObjUpvalue* p = static_cast<ObjUpvalue*>(objptr);
+    mark_as_grey(p->closed);
+    break;
+  }
+  case ObjType::CLOSURE: {
+    ObjClosure* p = static_cast<ObjClosure*>(objptr);
+    mark_as_grey(p->function);
+    for (ObjUpvalue* upvalue : p->upvalues) {
+      mark_as_grey(upvalue);
+    }
+    break;
+  }
+  case ObjType::INSTANCE: {
+    auto p = static_cast<ObjInstance*>(objptr);
+    mark_as_grey(p->klass);
+    mark_as_grey(p->shape);
+    for (const Value& value : p->fields) {
+      mark_as_grey(value);
+    }
+    break;
+  }
+  case ObjType::SHAPE: {
+    // Marking the parent and the key is enough to keep all the keys in
+    // `slots` alive, since they were all added by one of our ancestors.
+    auto p = static_cast<ObjShape*>(objptr);
+    mark_as_grey(p->parent);
+    mark_as_grey(p->key);
+    for (const auto& [fieldname, child] : p->transitions) {
+      mark_as_grey(fieldname);
+      mark_as_grey(child);
+    }
+    break;
+  }
+  case ObjType::BOUND_METHOD: {
+    auto p = static_cast<ObjBoundMethod*>(objptr);
+    mark_as_grey(p->receiver);
+    mark_as_grey(p->method);
+    break;
+  }
+  case ObjType::ROPE: {
+    // Once a rope has been flattened these are null, and it doesn't refer to
+    // anything.
+    auto p = static_cast<ObjRope*>(objptr);
+    mark_as_grey(p->get_left());
+    mark_as_grey(p->get_right());
+    break;
+  }
+  case ObjType::LIST: {
+    auto p = static_cast<ObjList*>(objptr);
+    for (const Value& value : p->elements) {
+      mark_as_grey(value);
+    }
+    break;
+  }
+  case ObjType::FIBER: {
+    // While a fiber is running, its stack and call frames belong to the VM
+    // (which marks them as roots), so these are empty.
+    auto p = static_cast<ObjFiber*>(objptr);
+    for (const Value* v = p->stack.get(); v != p->stack_top; ++v) {
+      mark_as_grey(*v);
+    }
+    for (size_t i = 0; i < p->frame_count; i++) {
+      mark_as_grey(p->call_frames[i].closure);
+    }
+    for (ObjUpvalue* upvalue : p->open_upvalues) {
+      mark_as_grey(upvalue);
+    }
+    mark_as_grey(p->result);
+    if (p->resume_value.has_value()) {
+      mark_as_grey(*p->resume_value);
+    }
+    for (ObjFiber* joiner : p->joiners) {
+      mark_as_grey(joiner);
+    }
+    break;
+  }
+  }
+}
+
+void GC::update_size(Obj* objptr) {
+  size_t new_size = pools[static_cast<size_t>(objptr->type)].block_size() +
+                    objptr->heap_size();
+  bytes_allocated = bytes_allocated - objptr->size + new_size;
+  objptr->size = new_size;
+}
+
+void GC::update_threshold(size_t bytes_before) {
+  // If a collection didn't manage to free much, most of the heap is live, and
+  // collecting again soon would mostly be wasted effort; so we let the heap
+  // grow more before the next one. Conversely, if most of the heap was
+  // garbage, we can afford to collect more often.
+  size_t freed =
+      bytes_before > bytes_allocated ? bytes_before - bytes_allocated : 0;
+  if (freed * 4 < bytes_before) {
+    heap_growth_factor = std::min(heap_growth_factor * 1.5, 8.0);
+  } else if (freed * 4 > bytes_before * 3) {
+    heap_growth_factor = std::max(heap_growth_factor / 1.5, 1.5);
+  }
+  auto grown = static_cast<size_t>(static_cast<double>(bytes_allocated) *
+                                   heap_growth_factor);
+  next_gc_threshold = std::max(grown, MIN_GC_THRESHOLD);
+}
+
+void GC::sweep_interned_strings() {
+  // In a minor collection old strings aren't marked, but are still alive.
+  interned_strings.erase_if([minor = minor_collection](ObjString* key,
+                                                       ObjString*) {
+    return !key->is_marked && !(minor && key->is_old);
+  });
+}
+
+Obj* GC::sweep(Obj*& list, bool promote) {
+  Obj* prev = nullptr;
+  Obj* objptr = list;
+  while (objptr != nullptr) {
+    Obj* next = objptr->next;
+    if (!objptr->is_marked) {
+      // Unreachable object.
+#ifdef LOX_GC_DEBUG
+      // NOTE: Don't use to_repr() here. For most types it looks at other
+      // objects (e.g. a bound method's receiver), which may already have been
+      // freed earlier in this sweep.
+      std::cerr << "        GC: deleting " << obj_type_name(objptr->type)
+                << " at " << static_cast<const void*>(objptr) << "\n";
+#endif
+
+      // Remove from linked list
+      if (prev != nullptr) {
+        prev->next = next;
+      } else {
+        list = next;
+      }
+
+      // Delete
+      bytes_allocated -= objptr->size;
+      free_object(objptr);
+      objptr = next;
+    } else {
+      // Reachable object. Unmark it, and update its size, since any
+      // containers inside it might have grown since it was allocated.
+      objptr->is_marked = false;
+      if (promote) {
+        objptr->is_old = true;
+      }
+      update_size(objptr);
+      prev = objptr;
+      objptr = next;
+    }
+  }
+  return prev;
+}
+
 void GC::gc() {
   // When we enter this function, all objects should have been unmarked, and
   // the roots should have been marked as grey already. This is handled inside
   // VM::gc() (we don't want to deal with the root finding here since that
   // requires knowledge of the VM's state).
+  if (mode == GCMode::INCREMENTAL) {
+    incremental_step();
+    stats.incremental_steps++;
+    stats.record_pause(std::chrono::steady_clock::now() - pause_start);
+    return;
+  }
+  size_t bytes_before = bytes_allocated;
 
 #ifdef LOX_GC_DEBUG
-  std::cerr << "        GC: starting mark-and-sweep\n";
+  std::cerr << "        GC: starting "
+            << (mode == GCMode::MARK_SWEEP ? "mark-and-sweep"
+                : minor_collection     ? "minor collection"
+                                       : "major collection")
+            << "\n";
   // list_objects();
-  size_t nobjs_deleted = 0;
-  size_t nbytes_deleted = 0;
 #endif
 
+  // In a minor collection, the remembered set is an extra set of roots. We
+  // can't just mark the objects in it as grey, because they're old (and so
+  // mark_as_grey would ignore them), so we trace through their children
+  // directly.
+  if (minor_collection) {
+    for (Obj* objptr : remembered_set) {
+      blacken(objptr);
+    }
+  }
+
   // Propagate grey markings forward.
   while (!grey_stack.empty()) {
     Obj* objptr = grey_stack.back();
     grey_stack.pop_back();
-
-    if (objptr == nullptr) {
-      continue;
-    }
-    switch (objptr->type) {
-    // ObjString has no references to other objects, so we don't need to
-    // mark anything else as grey. Likewise for native functions.
-    case ObjType::STRING:
-      break;
-    case ObjType::NATIVE_FUNCTION:
-      break;
-    case ObjType::CLASS: {
-      auto p = static_cast<ObjClass*>(objptr);
-      mark_as_grey(p->name);
-      for (const auto& [methodname, method] : p->methods) {
-        mark_as_grey(methodname);
-        mark_as_grey(method);
-      }
-      break;
-    }
-    case ObjType::FUNCTION: {
-      ObjFunction* p = static_cast<ObjFunction*>(objptr);
-      mark_as_grey(p->name);
-      for (const auto& constant : p->chunk.get_constants()) {
-        mark_as_grey(constant);
-      }
-      break;
-    }
-    case ObjType::UPVALUE: {
-      // For ObjUpvalue, we only need to care about the value if it's closed. If
-      // it's not closed, then the value exists somewhere on the VM's stack, so
-      // the GC will already have marked it as grey.
-      ObjUpvalue* p = static_cast<ObjUpvalue*>(objptr);
-      mark_as_grey(p->closed);
-      break;
-    }
-    case ObjType::CLOSURE: {
-      ObjClosure* p = static_cast<ObjClosure*>(objptr);
-      mark_as_grey(p->function);
-      for (ObjUpvalue* upvalue : p->upvalues) {
-        mark_as_grey(upvalue);
-      }
-      break;
-    }
-    case ObjType::INSTANCE: {
-      auto p = static_cast<ObjInstance*>(objptr);
-      mark_as_grey(p->klass);
-      for (const auto& [fieldname, value] : p->fields) {
-        mark_as_grey(fieldname);
-        mark_as_grey(value);
-      }
-      break;
+    if (objptr != nullptr) {
+      blacken(objptr);
     }
-    case ObjType::BOUND_METHOD: {
-      auto p = static_cast<ObjBoundMethod*>(objptr);
-      mark_as_grey(p->receiver);
-      mark_as_grey(p->method);
-      break;
+  }
+
+  // After this collection, all surviving objects will be old, so there can't
+  // be any old-to-young references left.
+  for (Obj* objptr : remembered_set) {
+    objptr->is_remembered = false;
+  }
+  remembered_set.clear();
+
+  sweep_interned_strings();
+
+  // Sweep
+  if (mode == GCMode::MARK_SWEEP) {
+    sweep(head, false);
+  } else {
+    if (!minor_collection) {
+      sweep(old_head, false);
     }
+    // Promote the surviving young objects by moving them to the front of the
+    // old list.
+    Obj* last_survivor = sweep(head, true);
+    if (last_survivor != nullptr) {
+      last_survivor->next = old_head;
+      old_head = head;
+      head = nullptr;
     }
+  }
+  young_bytes = 0;
 
 #ifdef LOX_GC_DEBUG
-    // list_objects();
+  std::cerr << "        GC: finished, freed " << bytes_before - bytes_allocated
+            << " bytes\n";
 #endif
+
+  if (release_empty_pages) {
+    for (Pool& pool : pools) {
+      pool.release_empty_pages();
+    }
+  }
+
+  // Update the GC threshold. In generational mode this only applies to the
+  // old generation, so it's only updated after a major collection.
+  if (!minor_collection) {
+    update_threshold(bytes_before);
   }
 
-  // Clear interned strings
-  for (auto it = interned_strings.map.begin();
-       it != interned_strings.map.end();) {
-    if (!it->second->is_marked) {
-      it = interned_strings.map.erase(it);
+  stats.collections++;
+  if (mode == GCMode::GENERATIONAL) {
+    if (minor_collection) {
+      stats.minor_collections++;
     } else {
-      ++it;
+      stats.major_collections++;
     }
   }
+  stats.record_pause(std::chrono::steady_clock::now() - pause_start);
+}
 
-  // Sweep
-  Obj* prev = nullptr;
-  Obj* objptr = head;
-  while (objptr != nullptr) {
-    Obj* next = objptr->next;
-    if (!objptr->is_marked) {
-      // Unreachable object.
+void GC::incremental_step() {
+  young_bytes = 0;
+  auto deadline = std::chrono::steady_clock::now() + pause_budget;
+  size_t work_done = 0;
+  // Returns true once this step has used up its time. Reading the clock
+  // isn't free, so we only do it every so often.
+  auto out_of_time = [&work_done, deadline]() {
+    work_done++;
 #ifdef LOX_GC_DEBUG
-      std::cerr << "        GC: deleting " << objptr->to_repr() << "\n";
+    // Do as little work as possible per step, so that collections are spread
+    // over lots of allocations: this is a good way of finding missing write
+    // barriers.
+    (void)deadline;
+    return work_done >= 4;
+#else
+    return work_done % 64 == 0 && std::chrono::steady_clock::now() >= deadline;
 #endif
+  };
 
-      // Remove from linked list
-      if (prev != nullptr) {
-        prev->next = next;
-      } else {
-        head = next;
+  if (phase == Phase::MARKING) {
+    while (!grey_stack.empty()) {
+      Obj* objptr = grey_stack.back();
+      grey_stack.pop_back();
+      blacken(objptr);
+      if (out_of_time()) {
+        return;
       }
-
-      // Delete
-      size_t bytes = objptr->size;
-      bytes_allocated -= bytes;
-      delete objptr;
-      objptr = next;
+    }
+    // The roots were marked at the start of this step and the program hasn't
+    // run since, so once the grey stack is empty, everything reachable has
+    // been marked.
+    sweep_interned_strings();
+    unswept = std::exchange(head, nullptr);
+    phase = Phase::SWEEPING;
 #ifdef LOX_GC_DEBUG
-      nbytes_deleted += bytes;
-      nobjs_deleted++;
+    std::cerr << "        GC: incremental marking finished\n";
 #endif
-
-    } else {
-      // Reachable object. Unmark it.
-      objptr->is_marked = false;
-      prev = objptr;
-      objptr = next;
-    }
   }
 
+  if (phase == Phase::SWEEPING) {
+    while (unswept != nullptr) {
+      Obj* objptr = unswept;
+      unswept = objptr->next;
+      if (!objptr->is_marked) {
 #ifdef LOX_GC_DEBUG
-  std::cerr << "        GC: finished mark-and-sweep, deleted " << nobjs_deleted
-            << " objects, " << nbytes_deleted << " bytes\n";
+        std::cerr << "        GC: deleting " << obj_type_name(objptr->type)
+                  << " at " << static_cast<const void*>(objptr) << "\n";
+#endif
+        bytes_allocated -= objptr->size;
+        free_object(objptr);
+      } else {
+        objptr->is_marked = false;
+        update_size(objptr);
+        objptr->next = swept;
+        if (swept == nullptr) {
+          swept_tail = objptr;
+        }
+        swept = objptr;
+      }
+      if (out_of_time()) {
+        return;
+      }
+    }
+    // Put the survivors back with the objects that were allocated while we
+    // were sweeping.
+    if (swept_tail != nullptr) {
+      swept_tail->next = head;
+      head = swept;
+    }
+    swept = nullptr;
+    swept_tail = nullptr;
+    phase = Phase::IDLE;
+#ifdef LOX_GC_DEBUG
+    std::cerr << "        GC: incremental sweeping finished\n";
 #endif
 
-  // Update the GC threshold.
-  next_gc_threshold = bytes_allocated * 2;
+    if (release_empty_pages) {
+      for (Pool& pool : pools) {
+        pool.release_empty_pages();
+      }
+    }
+    update_threshold(bytes_at_cycle_start);
+    stats.collections++;
+  }
 }
 
 } // namespace lox
@@ -1,12 +1,75 @@
 #pragma once
+#include "pool.hpp"
 #include "stringmap.hpp"
 #include "value.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <new>
+#include <ostream>
 #include <string_view>
 #include <utility>
 
 namespace lox {
 
+enum class GCMode {
+  // Every collection marks everything reachable and sweeps the whole heap.
+  MARK_SWEEP,
+  // New objects are allocated into a nursery, which is collected on its own
+  // (a 'minor' collection) whenever it fills up. Objects that survive a minor
+  // collection are promoted to the old generation, which is only collected
+  // (together with the nursery, in a 'major' collection) when it has grown
+  // past next_gc_threshold.
+  GENERATIONAL,
+  // Collections are split up into small steps which are interleaved with the
+  // program, so that no single pause takes longer than the pause budget (see
+  // GC::set_pause_budget).
+  INCREMENTAL,
+};
+
+// Counters that the GC keeps track of. These are always on (they're cheap to
+// update), and can be retrieved with GC::get_stats.
+struct GCStats {
+  struct TypeStats {
+    uint64_t objects_allocated = 0;
+    uint64_t bytes_allocated = 0;
+    uint64_t objects_freed = 0;
+    uint64_t bytes_freed = 0;
+  };
+  // Bucket i counts the pauses that took less than 2^i microseconds. The last
+  // bucket counts everything else.
+  static constexpr size_t PAUSE_HISTOGRAM_BUCKETS = 16;
+
+  GCMode mode = GCMode::MARK_SWEEP;
+  // Number of completed collections. In generational mode this is the sum of
+  // the minor and major collections, and in incremental mode it's the number
+  // of complete cycles.
+  uint64_t collections = 0;
+  uint64_t minor_collections = 0;
+  uint64_t major_collections = 0;
+  uint64_t incremental_steps = 0;
+  // Indexed by static_cast<size_t>(ObjType).
+  std::array<TypeStats, NUM_OBJ_TYPES> per_type{};
+  // Number of times the program was paused to do GC work, and how long for.
+  std::array<uint64_t, PAUSE_HISTOGRAM_BUCKETS> pause_histogram{};
+  std::chrono::nanoseconds total_pause{0};
+  std::chrono::nanoseconds max_pause{0};
+  size_t peak_bytes = 0;
+  // These are filled in by GC::get_stats.
+  size_t bytes_allocated = 0;
+  size_t bytes_reserved = 0;
+  size_t interned_strings = 0;
+
+  // Total over all object types.
+  TypeStats total() const;
+  void record_pause(std::chrono::nanoseconds pause);
+  void write_json(std::ostream& out) const;
+};
+
+// The name of each ObjType, e.g. "ObjString".
+std::string_view obj_type_name(ObjType type);
+
 class GC {
 public:
   // Central allocation function
@@ -22,17 +85,44 @@ public:
 
     static_assert(std::is_base_of_v<Obj, T>,
                   "GC::alloc can only be used to allocate subclasses of Obj");
-    // Create new object
-    T* obj = new T(std::forward<Args>(args)...);
+    // Create new object. The memory comes from the pool for this type of
+    // object; we then construct the object in-place inside it using
+    // 'placement new'.
+    Pool& pool = pools[static_cast<size_t>(T::static_type)];
+    void* memory = pool.allocate();
+    T* obj;
+    try {
+      obj = new (memory) T(std::forward<Args>(args)...);
+    } catch (...) {
+      pool.deallocate(memory);
+      throw;
+    }
     obj->is_marked = false;
     // and make it point to the old head
     obj->next = head;
-    // and make it be the new head
+    // and make it be the new head. (In generational mode, this list is the
+    // nursery: new objects are always young.)
     head = obj;
-    // Update memory usage
-    size_t obj_size = sizeof(T);
+    // Objects created while an incremental collection is marking start out
+    // grey: they're reachable (someone is about to use them), and their
+    // children still need to be traced.
+    if (phase == Phase::MARKING) {
+      mark_as_grey(obj);
+    }
+    // Update memory usage. Note that this is only the size at the time of
+    // allocation; containers inside the object may grow later on, which is
+    // picked up when the object survives a GC (see GC::gc).
+    size_t obj_size = pool.block_size() + obj->heap_size();
     bytes_allocated += obj_size;
+    young_bytes += obj_size;
     obj->size = obj_size;
+    GCStats::TypeStats& type_stats =
+        stats.per_type[static_cast<size_t>(T::static_type)];
+    type_stats.objects_allocated++;
+    type_stats.bytes_allocated += obj_size;
+    if (bytes_allocated > stats.peak_bytes) {
+      stats.peak_bytes = bytes_allocated;
+    }
 #ifdef LOX_GC_DEBUG
     std::cerr << "        GC: allocated object " << obj->to_repr() << " of size "
               << obj_size << "\n";
@@ -43,18 +133,59 @@ public:
   // We want GCs to be movable but non-copyable. This is because GC contains a
   // pointer Obj* head which is not safe to copy (if we copy a GC to another
   // one, then delete the first, the second GC will have a dangling pointer).
-  // But moving a GC is fine. The methods with `const GC&` are copy constructors
-  // and copy assignment operators
+  // But moving a GC is fine, as long as the moved-from GC forgets about the
+  // objects it used to own (otherwise its destructor would free them). The
+  // methods with `const GC&` are copy constructors and copy assignment
+  // operators.
   GC(const GC&) = delete;
   GC& operator=(const GC&) = delete;
-  GC(GC&&) = default;
-  GC& operator=(GC&&) = default;
-  // Once we define any constructor (including the copy/move ones), the default
-  // constructor is not generated, so we need to explicitly define it.
-  GC() = default;
+  GC(GC&& other) noexcept;
+  GC& operator=(GC&& other) noexcept;
+  explicit GC(GCMode mode = GCMode::MARK_SWEEP);
+  // Frees all objects that are still alive.
+  ~GC();
 
   bool should_gc();
 
+  // While one of these exists, should_gc() always returns false. This is for
+  // when new objects are only reachable from somewhere that mark_roots can't
+  // see yet (e.g. the constant table of a chunk that the optimiser is still
+  // building).
+  class DeferCollections {
+  public:
+    explicit DeferCollections(GC& gc) : gc(gc) { gc.defer_depth++; }
+    ~DeferCollections() { gc.defer_depth--; }
+    DeferCollections(const DeferCollections&) = delete;
+    DeferCollections& operator=(const DeferCollections&) = delete;
+
+  private:
+    GC& gc;
+  };
+  // Must be called before gc(). Decides what kind of collection (or, in
+  // incremental mode, what kind of step) this will be, and returns whether
+  // the roots should be marked before calling gc().
+  [[nodiscard]] bool begin_collection();
+
+  // Write barrier. This must be called whenever a reference to another object
+  // is stored inside `owner` (e.g. setting a field on an instance).
+  //
+  // In generational mode, a minor collection doesn't trace through old
+  // objects, so it would miss young objects that are only reachable via an
+  // old one. Old objects are therefore added to the remembered set, which is
+  // treated as an extra set of roots in the next minor collection.
+  //
+  // In incremental mode, if `owner` has already been traced (i.e. it's
+  // black), the object now stored in it might never be marked. So we turn
+  // `owner` grey again, and it'll be traced again later on.
+  //
+  // Storing into the stack or the globals table doesn't need a barrier, since
+  // those are always roots.
+  void write_barrier(Obj* owner) {
+    if ((owner->is_old || phase == Phase::MARKING) && !owner->is_remembered) {
+      write_barrier_slow(owner);
+    }
+  }
+
   // Mark a value as grey (i.e., reachable but not yet fully processed)
   void mark_as_grey(const Value& value);
   void mark_as_grey(Obj* objptr);
@@ -65,21 +196,116 @@ public:
   // Run the garbage collector.
   void gc();
 
+  GCMode get_mode() const { return mode; }
+  // Whether an incremental collection has been started but not finished.
+  bool collection_in_progress() const { return phase != Phase::IDLE; }
+
   // Get a pointer to an interned ObjString object, creating it if necessary.
-  ObjString* get_string_ptr(std::string_view);
+  ObjString* get_string_ptr(std::string_view str);
+  // Same, but if the string has to be created, its contents are moved from
+  // `str` rather than copied.
+  ObjString* get_string_ptr(std::string&& str);
+  ObjString* get_string_ptr(const char* str) {
+    return get_string_ptr(std::string_view(str));
+  }
 
   void set_alloc_callback(std::function<void()> callback) {
     alloc_callback = callback;
   }
 
+  // The maximum amount of time that a single step of an incremental
+  // collection should take. (This is a target rather than a guarantee: the
+  // clock is only checked every so often.)
+  void set_pause_budget(std::chrono::microseconds budget) {
+    pause_budget = budget;
+  }
+
+  // Whether to give completely empty pages back to the system allocator after
+  // each GC (on by default). Turning this off means that the heap never
+  // shrinks, but avoids repeatedly freeing and reallocating pages in programs
+  // whose memory usage oscillates.
+  void set_release_empty_pages(bool release) { release_empty_pages = release; }
+
+  // Number of bytes used by live objects (including memory owned by their
+  // strings / vectors / maps, as of the last GC).
+  size_t get_bytes_allocated() const { return bytes_allocated; }
+  // Number of bytes held by the allocation pools, including free blocks.
+  size_t get_bytes_reserved() const;
+  // A snapshot of the GC's counters.
+  GCStats get_stats() const;
+
 private:
-  // First object in the linked list of all objects tracked by the GC.
+  GCMode mode;
+  // First object in the linked list of all objects tracked by the GC. In
+  // generational mode, this only contains the young objects, and the old
+  // ones are in `old_head`.
   Obj* head = nullptr;
+  Obj* old_head = nullptr;
+  // Old objects that have had references stored into them since the last
+  // collection.
+  std::vector<Obj*> remembered_set;
+  // Whether the collection currently in progress is a minor one.
+  bool minor_collection = false;
+  // State of an incremental collection. In the other modes, this stays IDLE.
+  enum class Phase { IDLE, MARKING, SWEEPING };
+  Phase phase = Phase::IDLE;
+  // While an incremental collection is sweeping, the objects that haven't
+  // been looked at yet are in `unswept`, and the survivors are moved to
+  // `swept` (newly allocated objects go onto `head` as usual).
+  Obj* unswept = nullptr;
+  Obj* swept = nullptr;
+  Obj* swept_tail = nullptr;
+  std::chrono::microseconds pause_budget{500};
+  size_t bytes_at_cycle_start = 0;
+  GCStats stats;
+  // When the current pause started (set in begin_collection).
+  std::chrono::steady_clock::time_point pause_start;
+  // Interned strings. The keys and values are the same; this table doesn't
+  // keep strings alive, and unmarked strings are removed from it on every GC.
   StringMap<ObjString*> interned_strings;
   std::vector<Obj*> grey_stack;
   std::function<void()> alloc_callback = nullptr;
+  // Number of DeferCollections guards that currently exist.
+  size_t defer_depth = 0;
   size_t bytes_allocated = 0;
-  size_t next_gc_threshold = 1024 * 1024; // 1MB
+  // Bytes allocated since the last collection (i.e. the size of the nursery),
+  // or in incremental mode, since the last step.
+  size_t young_bytes = 0;
+  // Collections (or in generational mode, major collections) start once
+  // bytes_allocated exceeds this. See update_threshold.
+  size_t next_gc_threshold = MIN_GC_THRESHOLD;
+  // How much the heap is allowed to grow by before the next collection.
+  double heap_growth_factor = 2.0;
+  static constexpr size_t MIN_GC_THRESHOLD = 1024 * 1024; // 1MB
+  static constexpr size_t NURSERY_SIZE = 256 * 1024;
+  // In incremental mode, how many bytes the program gets to allocate between
+  // steps.
+  static constexpr size_t INCREMENTAL_STEP_SIZE = 32 * 1024;
+  // One pool per ObjType, indexed by static_cast<size_t>(type).
+  std::array<Pool, NUM_OBJ_TYPES> pools;
+  bool release_empty_pages = true;
+
+  void write_barrier_slow(Obj* owner);
+  // Mark everything that `objptr` refers to as grey.
+  void blacken(Obj* objptr);
+  // Recompute an object's size when it survives a collection.
+  void update_size(Obj* objptr);
+  // Remember how much each collection freed, and use it to choose the next
+  // threshold.
+  void update_threshold(size_t bytes_before);
+  // Do one step of an incremental collection.
+  void incremental_step();
+  // Free all unmarked objects in the list starting at `list`, and unmark the
+  // rest. If `promote` is true, survivors become old. Returns the last
+  // surviving object (so that the list can be spliced onto another one).
+  Obj* sweep(Obj*& list, bool promote);
+
+  // Destroy an object and return its memory to the appropriate pool.
+  void free_object(Obj* objptr);
+  void free_list(Obj*& list);
+  // Remove unreachable strings from the interned string table.
+  void sweep_interned_strings();
+  void free_all_objects();
 };
 
 } // namespace lox
@@ -0,0 +1,27 @@
+#include "globals.hpp"
+#include "gc.hpp"
+#include "value.hpp"
+
+namespace lox {
+
+size_t Globals::slot_for(ObjString* name) {
+  if (size_t* existing = slots.find(name)) {
+    return *existing;
+  }
+  size_t slot = values.size();
+  slots.set(name, slot);
+  values.push_back(undefined_val());
+  names.push_back(name);
+  return slot;
+}
+
+void Globals::mark_as_grey(GC& gc) const {
+  for (ObjString* name : names) {
+    gc.mark_as_grey(name);
+  }
+  for (const Value& value : values) {
+    gc.mark_as_grey(value);
+  }
+}
+
+} // namespace lox
@@ -0,0 +1,46 @@
+#pragma once
+#include "stringmap.hpp"
+#include "value_def.hpp"
+#include <cstddef>
+#include <vector>
+
+namespace lox {
+
+class GC;
+class ObjString;
+
+// Table of global variables. The Parser assigns each global name a dense slot
+// index at compile time, so that at runtime, accessing a global is just an
+// index into a vector rather than a hash table lookup.
+//
+// Slots are created as soon as the Parser sees a name (which may well be
+// before the variable is defined, e.g. if a function refers to a global that
+// is only declared further down). Until the variable is actually defined, its
+// slot holds `undefined_val()`, which the VM turns into the usual 'undefined
+// variable' runtime error.
+class Globals {
+public:
+  Globals() = default;
+
+  // Returns the slot index for `name`, creating a new undefined slot if the
+  // name hasn't been seen before.
+  size_t slot_for(ObjString* name);
+  // Define (or redefine) the global variable `name`.
+  void define(ObjString* name, Value value) { values[slot_for(name)] = value; }
+
+  // These are used by the VM, which already knows that the slot is valid.
+  Value& operator[](size_t slot) { return values[slot]; }
+  ObjString* name_at(size_t slot) const { return names[slot]; }
+  size_t size() const { return values.size(); }
+
+  // Mark all global names and values as reachable.
+  void mark_as_grey(GC& gc) const;
+
+private:
+  // maps from the name of a global variable to its slot index
+  StringMap<size_t> slots;
+  std::vector<Value> values;
+  std::vector<ObjString*> names;
+};
+
+} // namespace lox
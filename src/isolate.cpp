@@ -0,0 +1,49 @@
+#include "isolate.hpp"
+#include "bytecode.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <thread>
+
+namespace lox {
+
+std::optional<Program> Program::compile(std::string_view source) {
+  std::ostringstream out;
+  if (compile_to_bytecode(source, out) != InterpretResult::OK) {
+    return std::nullopt;
+  }
+  return Program(std::move(out).str());
+}
+
+InterpretResult Program::run(const InterpretOptions& options) const {
+  return interpret_bytecode(
+      {reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size()}, options);
+}
+
+std::vector<InterpretResult> run_isolates(const Program& program, size_t runs,
+                                          size_t threads,
+                                          const InterpretOptions& options) {
+  std::vector<InterpretResult> results(runs, InterpretResult::OK);
+  // Each thread keeps taking the next run that nobody has started yet, so a
+  // thread that gets short runs doesn't sit idle while the others finish.
+  std::atomic<size_t> next_run = 0;
+  auto worker = [&]() {
+    for (size_t i = next_run++; i < runs; i = next_run++) {
+      results[i] = program.run(options);
+    }
+  };
+  threads = std::clamp<size_t>(threads, 1, std::max<size_t>(runs, 1));
+  std::vector<std::thread> pool;
+  // The calling thread is one of the workers too.
+  for (size_t i = 1; i < threads; i++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& thread : pool) {
+    thread.join();
+  }
+  return results;
+}
+
+} // namespace lox
@@ -0,0 +1,40 @@
+#pragma once
+#include "vm.hpp"
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lox {
+
+// A compiled script that can be run any number of times, from any number of
+// threads at once. Every run gets its own VM, with a private heap, intern
+// table and globals (an "isolate"), so runs can't see each other, and the only
+// thing the threads share is this object, which never changes after it has
+// been compiled.
+//
+// NOTE: The script is kept as serialised bytecode (see bytecode.hpp), not as
+// compiled ObjFunctions. Those belong to the GC that allocated them, and they
+// aren't read-only either: running a chunk fills in its inline caches. Loading
+// bytecode into a new isolate still skips scanning, compiling and optimising.
+class Program {
+public:
+  // Returns std::nullopt if `source` doesn't compile (the error will already
+  // have been reported).
+  static std::optional<Program> compile(std::string_view source);
+  // Run the script once, in a new isolate.
+  InterpretResult run(const InterpretOptions& options = {}) const;
+
+private:
+  explicit Program(std::string bytes) : bytes(std::move(bytes)) {}
+  std::string bytes;
+};
+
+// Run `program` `runs` times, using up to `threads` threads (each of which
+// runs one isolate at a time). Returns the result of each run, in order.
+std::vector<InterpretResult> run_isolates(const Program& program, size_t runs,
+                                          size_t threads,
+                                          const InterpretOptions& options = {});
+
+} // namespace lox
@@ -0,0 +1,127 @@
+#include "line_table.hpp"
+#include <stdexcept>
+
+namespace {
+
+void write_varint(std::vector<uint8_t>& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+uint64_t read_varint(const std::vector<uint8_t>& in, size_t& pos) {
+  uint64_t value = 0;
+  for (unsigned shift = 0;; shift += 7) {
+    uint8_t byte = in[pos++];
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+}
+
+// The position of the first byte of the varint whose last byte is
+// in[end - 1]. (Every byte of a varint except the last has its top bit set,
+// so we can find the start by walking backwards.)
+size_t varint_start(const std::vector<uint8_t>& in, size_t end) {
+  size_t pos = end - 1;
+  while (pos > 0 && (in[pos - 1] & 0x80) != 0) {
+    pos--;
+  }
+  return pos;
+}
+
+// Zigzag encoding maps small negative numbers to small unsigned ones (0, -1,
+// 1, -2, ... => 0, 1, 2, 3, ...), so that they make short varints.
+uint64_t zigzag(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+int64_t unzigzag(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+} // namespace
+
+namespace lox {
+
+void LineTable::add(size_t offset, size_t line) {
+  if (n_entries > 0 && line == last_line) {
+    return;
+  }
+  // NOTE: For the first entry, last_offset and last_line are both 0.
+  write_varint(bytes, offset - last_offset);
+  write_varint(bytes, zigzag(static_cast<int64_t>(line) -
+                             static_cast<int64_t>(last_line)));
+  last_offset = offset;
+  last_line = line;
+  n_entries++;
+}
+
+void LineTable::advance(Cursor& at) const {
+  at.offset += read_varint(bytes, at.pos);
+  at.line = static_cast<size_t>(static_cast<int64_t>(at.line) +
+                                unzigzag(read_varint(bytes, at.pos)));
+}
+
+size_t LineTable::line_at(size_t offset) const {
+  if (n_entries == 0) {
+    throw std::runtime_error("loxc: debuginfo_at: no debug info found");
+  }
+  Cursor at = cursor;
+  if (at.pos == 0 || at.offset > offset) {
+    at = Cursor{};
+    advance(at);
+    // If the very first entry starts after `offset`, there's no line info for
+    // it. That is an error by construction.
+    if (at.offset > offset) {
+      throw std::runtime_error(
+          "loxc: debuginfo_at: no debug info for given bytecode offset");
+    }
+  }
+  // The entry we want is the last one that starts at or before `offset`.
+  while (at.pos < bytes.size()) {
+    Cursor next = at;
+    advance(next);
+    if (next.offset > offset) {
+      break;
+    }
+    at = next;
+  }
+  cursor = at;
+  return at.line;
+}
+
+void LineTable::truncate(size_t new_size) {
+  while (n_entries > 0 && last_offset >= new_size) {
+    // Each entry is two varints, so the last one can be popped off the end
+    // without decoding anything before it.
+    size_t line_start = varint_start(bytes, bytes.size());
+    size_t offset_start = varint_start(bytes, line_start);
+    size_t pos = line_start;
+    int64_t line_delta = unzigzag(read_varint(bytes, pos));
+    pos = offset_start;
+    uint64_t offset_delta = read_varint(bytes, pos);
+    bytes.resize(offset_start);
+    last_offset -= offset_delta;
+    last_line = static_cast<size_t>(static_cast<int64_t>(last_line) - line_delta);
+    n_entries--;
+  }
+  if (cursor.pos > bytes.size()) {
+    cursor = Cursor{};
+  }
+}
+
+std::vector<DebugInfo> LineTable::entries() const {
+  std::vector<DebugInfo> result;
+  result.reserve(n_entries);
+  Cursor at;
+  while (at.pos < bytes.size()) {
+    advance(at);
+    result.push_back(DebugInfo(at.offset, at.line));
+  }
+  return result;
+}
+
+} // namespace lox
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lox {
+
+struct DebugInfo {
+  size_t bytecode_offset;
+  size_t line;
+  // size_t column;
+};
+
+// Maps bytecode offsets to source lines. Each run of bytes that come from the
+// same line is one entry, and entries are stored as the difference from the
+// previous entry (the offset as an unsigned varint, and the line as a zigzag
+// varint, since it can go backwards), which is usually just two bytes per
+// entry instead of sizeof(DebugInfo).
+//
+// The table is only read when something goes wrong (or when disassembling,
+// profiling, or optimising), so it's fine that finding a line means decoding
+// it from the start. To make walking forwards through a chunk (which is what
+// the optimiser does) cheap, lookups carry on from where the previous lookup
+// got to if they can.
+class LineTable {
+public:
+  // Record that the bytes from `offset` onwards come from `line`. `offset`
+  // must not be less than the offset of any entry added before. If `line` is
+  // the same as the last entry's line, this does nothing.
+  void add(size_t offset, size_t line);
+  // The line that the byte at `offset` comes from. Throws if there isn't an
+  // entry for it.
+  size_t line_at(size_t offset) const;
+  // Remove every entry that starts at `new_size` or later.
+  void truncate(size_t new_size);
+  // Number of entries.
+  size_t size() const { return n_entries; }
+  bool empty() const { return n_entries == 0; }
+  // All of the entries, decoded.
+  std::vector<DebugInfo> entries() const;
+  size_t heap_size() const { return bytes.capacity(); }
+
+private:
+  std::vector<uint8_t> bytes;
+  size_t n_entries = 0;
+  // The last entry, so that add() and truncate() don't have to decode
+  // anything.
+  size_t last_offset = 0;
+  size_t last_line = 0;
+
+  // Where the previous line_at() got to: the entry that ends at bytes[pos],
+  // or (if pos is 0) the start of the table.
+  struct Cursor {
+    size_t pos = 0;
+    size_t offset = 0;
+    size_t line = 0;
+  };
+  mutable Cursor cursor;
+
+  // Read the entry starting at bytes[pos] and apply it to `at`.
+  void advance(Cursor& at) const;
+};
+
+} // namespace lox
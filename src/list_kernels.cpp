@@ -0,0 +1,72 @@
+#include "list_kernels.hpp"
+
+namespace {
+
+// How many partial sums sum() and dot() keep. Floating-point addition isn't
+// associative, so the compiler won't vectorise a single running total;
+// independent partial sums give it (and the CPU) lanes to work with.
+constexpr size_t LANES = 8;
+
+} // namespace
+
+namespace lox::list_kernels {
+
+bool all_numbers(std::span<const Value> values) {
+  // Counting instead of returning at the first non-number keeps the loop
+  // branch-free.
+  size_t non_numbers = 0;
+  for (const Value& value : values) {
+    non_numbers += !is_double(value);
+  }
+  return non_numbers == 0;
+}
+
+double sum(std::span<const Value> values) {
+  double partial[LANES] = {};
+  size_t i = 0;
+  for (; i + LANES <= values.size(); i += LANES) {
+    for (size_t lane = 0; lane < LANES; lane++) {
+      partial[lane] += as_double(values[i + lane]);
+    }
+  }
+  double total = 0;
+  for (double p : partial) {
+    total += p;
+  }
+  for (; i < values.size(); i++) {
+    total += as_double(values[i]);
+  }
+  return total;
+}
+
+void scale(std::span<Value> values, double factor) {
+  for (Value& value : values) {
+    value = from_double(as_double(value) * factor);
+  }
+}
+
+void fill(std::span<Value> values, Value value) {
+  for (Value& v : values) {
+    v = value;
+  }
+}
+
+double dot(std::span<const Value> a, std::span<const Value> b) {
+  double partial[LANES] = {};
+  size_t i = 0;
+  for (; i + LANES <= a.size(); i += LANES) {
+    for (size_t lane = 0; lane < LANES; lane++) {
+      partial[lane] += as_double(a[i + lane]) * as_double(b[i + lane]);
+    }
+  }
+  double total = 0;
+  for (double p : partial) {
+    total += p;
+  }
+  for (; i < a.size(); i++) {
+    total += as_double(a[i]) * as_double(b[i]);
+  }
+  return total;
+}
+
+} // namespace lox::list_kernels
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "value_def.hpp"
+#include <span>
+
+// The loops behind the bulk list natives (sum, scale, fill, dot). Each one
+// runs over the elements of a list in place, without going through the
+// interpreter or boxing intermediate results, and is written so that the
+// compiler can vectorise it: with NaN boxing, a list of numbers is just an
+// array of doubles.
+namespace lox::list_kernels {
+
+// Whether every value is a number. The other kernels (apart from fill)
+// require this.
+bool all_numbers(std::span<const Value> values);
+
+// NOTE: sum and dot add the elements up in a different order from a
+// left-to-right loop in Lox (they keep several partial sums), so the last few
+// bits of the result can differ.
+double sum(std::span<const Value> values);
+// Multiply every value by `factor`, in place.
+void scale(std::span<Value> values, double factor);
+// Set every value to `value`.
+void fill(std::span<Value> values, Value value);
+// `a` and `b` must be the same length.
+double dot(std::span<const Value> a, std::span<const Value> b);
+
+} // namespace lox::list_kernels
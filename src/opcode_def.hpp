@@ -12,13 +12,16 @@
   X(LESS) \
   X(PRINT) \
   X(POP) \
-  X(GET_GLOBAL) \
-  X(SET_GLOBAL) \
-  X(DEFINE_GLOBAL) \
+  X(GET_GLOBAL_SLOT) \
+  X(SET_GLOBAL_SLOT) \
+  X(DEFINE_GLOBAL_SLOT) \
   X(SET_LOCAL) \
   X(GET_LOCAL) \
   X(JUMP_IF_FALSE) \
   X(JUMP) \
+  X(JUMP_IF_FALSE_LONG) \
+  X(JUMP_LONG) \
+  X(WIDE) \
   X(CALL) \
   X(CLOSURE) \
   X(GET_UPVALUE) \
@@ -29,8 +32,10 @@
   X(SET_PROPERTY) \
   X(DEFINE_METHOD) \
   X(INVOKE) \
+  X(CALL_PROPERTY) \
   X(INHERIT) \
   X(GET_SUPER) \
   X(SUPER_INVOKE) \
-  X(ADD_LOCAL_CONST) \
-  X(LOCAL_CONST_LESS)
+  X(BUILD_LIST) \
+  X(GET_INDEX) \
+  X(SET_INDEX)
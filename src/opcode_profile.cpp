@@ -0,0 +1,84 @@
+#include "opcode_profile.hpp"
+#include <algorithm>
+#include <format>
+#include <string>
+
+namespace {
+
+struct Sequence {
+  std::vector<lox::OpCode> opcodes;
+  uint64_t count;
+};
+
+// e.g. S(GET_LOCAL_CONSTANT_LESS, (GET_LOCAL, CONSTANT), LESS)
+std::string format_sequence(const std::vector<lox::OpCode>& opcodes) {
+  std::string name;
+  std::string prefix;
+  for (size_t i = 0; i < opcodes.size(); i++) {
+    std::string_view op = lox::opcode_name(opcodes[i]);
+    if (i > 0) {
+      name += "_";
+    }
+    name += op;
+    if (i + 1 < opcodes.size()) {
+      if (i > 0) {
+        prefix += ", ";
+      }
+      prefix += op;
+    }
+  }
+  return std::format("S({}, ({}), {})", name, prefix,
+                     lox::opcode_name(opcodes.back()));
+}
+
+} // namespace
+
+namespace lox {
+
+void OpcodeProfile::report(std::ostream& out, size_t n) const {
+  std::vector<Sequence> sequences;
+  for (size_t i = 0; i < pair_counts.size(); i++) {
+    if (pair_counts[i] > 0) {
+      sequences.push_back({{static_cast<OpCode>(i / N_OPCODES),
+                            static_cast<OpCode>(i % N_OPCODES)},
+                           pair_counts[i]});
+    }
+  }
+  for (const auto& [i, count] : triple_counts) {
+    sequences.push_back({{static_cast<OpCode>(i / N_OPCODES / N_OPCODES),
+                          static_cast<OpCode>(i / N_OPCODES % N_OPCODES),
+                          static_cast<OpCode>(i % N_OPCODES)},
+                         count});
+  }
+  // NOTE: Break ties by putting shorter sequences first, and then by opcode,
+  // just so that the output doesn't depend on the order of the hash map.
+  std::sort(sequences.begin(), sequences.end(),
+            [](const Sequence& a, const Sequence& b) {
+              if (a.count != b.count) {
+                return a.count > b.count;
+              }
+              if (a.opcodes.size() != b.opcodes.size()) {
+                return a.opcodes.size() < b.opcodes.size();
+              }
+              return a.opcodes < b.opcodes;
+            });
+
+  out << "Instructions executed: " << total << "\n";
+  out << "Most common sequences (count, % of instructions executed):\n";
+  for (size_t i = 0; i < std::min(n, sequences.size()); i++) {
+    const Sequence& seq = sequences[i];
+    double percent =
+        total == 0 ? 0.0
+                   : 100.0 * static_cast<double>(seq.count) /
+                         static_cast<double>(total);
+    out << std::format("{:>12} {:>6.2f}%  ", seq.count, percent);
+    if (is_valid_superinstruction(seq.opcodes)) {
+      out << format_sequence(seq.opcodes) << "\n";
+    } else {
+      // Still worth knowing about, but it can't be added to the table as is.
+      out << "// " << format_sequence(seq.opcodes) << " (can't be fused)\n";
+    }
+  }
+}
+
+} // namespace lox
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "chunk.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace lox {
+
+// Counts how often each pair and triple of instructions is executed one
+// straight after the other, to find out which sequences are worth turning
+// into superinstructions (see superinstruction_def.hpp). This is only used in
+// the profile build (`make BUILD=profile`, which defines
+// LOX_PROFILE_OPCODES): the VM records every instruction it dispatches, and
+// the report is printed to stderr when the program finishes.
+//
+// Only sequences that ran without a jump, call or return in between are
+// counted, because those are the only ones that can be fused.
+class OpcodeProfile {
+public:
+  OpcodeProfile() : pair_counts(N_OPCODES * N_OPCODES, 0) {}
+
+  // Called with the address of every instruction just before it runs.
+  void record(const uint8_t* ip) {
+    // Quickened instructions are counted as their generic forms, since those
+    // are what the compiler emits (and what superinstructions are made of).
+    OpCode opcode = generic_opcode(static_cast<OpCode>(*ip));
+    total++;
+    if (ip != expected_ip) {
+      history_size = 0;
+    }
+    if (history_size >= 1) {
+      pair_counts[index(history[1], opcode)]++;
+    }
+    if (history_size >= 2) {
+      triple_counts[index(history[0], history[1], opcode)]++;
+    }
+    history[0] = history[1];
+    history[1] = opcode;
+    history_size = history_size < 2 ? history_size + 1 : 2;
+    // NOTE: instruction_length is 0 for CLOSURE and WIDE, so we never count a
+    // sequence that continues after one of those (they can't be fused
+    // anyway).
+    size_t length = instruction_length(opcode);
+    expected_ip = length == 0 ? nullptr : ip + length;
+  }
+
+  // Print the `n` most common pairs and triples, most common first.
+  // Sequences that could be added to SUPERINSTRUCTION_LIST are printed in
+  // the format that it uses.
+  void report(std::ostream& out, size_t n) const;
+
+private:
+  static constexpr size_t N_OPCODES = 256;
+  static size_t index(OpCode a, OpCode b) {
+    return static_cast<size_t>(a) * N_OPCODES + static_cast<size_t>(b);
+  }
+  static size_t index(OpCode a, OpCode b, OpCode c) {
+    return index(a, b) * N_OPCODES + static_cast<size_t>(c);
+  }
+
+  uint64_t total = 0;
+  const uint8_t* expected_ip = nullptr;
+  // The last two instructions in the current straight-line sequence (oldest
+  // first), of which the first `history_size` are valid.
+  std::array<OpCode, 2> history{};
+  size_t history_size = 0;
+  std::vector<uint64_t> pair_counts;
+  // There are too many possible triples to store them all densely.
+  std::unordered_map<size_t, uint64_t> triple_counts;
+};
+
+} // namespace lox
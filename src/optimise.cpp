@@ -1,8 +1,13 @@
 #include "optimise.hpp"
 #include "chunk.hpp"
+#include "gc.hpp"
 #include "value.hpp"
 #include <algorithm>
+#include <bit>
+#include <initializer_list>
 #include <memory>
+#include <numeric>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #ifdef LOX_DEBUG
@@ -12,166 +17,402 @@
 namespace lox {
 namespace optimise {
 
-bool AddLocalConstOptimisation::matches(const Chunk& chunk, const ChunkInfo& ci,
-                                        size_t instruction_index) const {
-  if (instruction_index + match_length() - 1 >= ci.instruction_offsets.size()) {
+#ifdef LOX_TIME
+namespace {
+// Adds the time between its construction and destruction to `total`.
+class PassTimer {
+public:
+  PassTimer(std::chrono::nanoseconds& total)
+      : total(total), start(std::chrono::steady_clock::now()) {}
+  ~PassTimer() { total += std::chrono::steady_clock::now() - start; }
+
+private:
+  std::chrono::nanoseconds& total;
+  std::chrono::steady_clock::time_point start;
+};
+} // namespace
+#endif
+
+bool SuperinstructionOptimisation::matches(const Chunk& chunk,
+                                           const ChunkInfo& ci,
+                                           size_t instruction_index) const {
+  if (instruction_index + match_length() > ci.instruction_offsets.size()) {
     return false;
   }
-  size_t i = instruction_index;
-  if (static_cast<OpCode>(chunk.at(ci.instruction_offsets[i])) ==
-          OpCode::GET_LOCAL &&
-      static_cast<OpCode>(chunk.at(ci.instruction_offsets[i + 1])) ==
-          OpCode::CONSTANT &&
-      static_cast<OpCode>(chunk.at(ci.instruction_offsets[i + 2])) ==
-          OpCode::ADD &&
-      static_cast<OpCode>(chunk.at(ci.instruction_offsets[i + 3])) ==
-          OpCode::SET_LOCAL &&
-      static_cast<OpCode>(chunk.at(ci.instruction_offsets[i + 4])) ==
-          OpCode::POP) {
-    uint8_t get_local_index = chunk.at(ci.instruction_offsets[i] + 1);
-    uint8_t set_local_index = chunk.at(ci.instruction_offsets[i + 3] + 1);
-    if (get_local_index == set_local_index &&
-        /* make sure that nothing tries to jump to the middle of this sequence
-         */
-        !(ci.jump_targets.contains(ci.instruction_offsets[i + 1]) ||
-          ci.jump_targets.contains(ci.instruction_offsets[i + 2]) ||
-          ci.jump_targets.contains(ci.instruction_offsets[i + 3]) ||
-          ci.jump_targets.contains(ci.instruction_offsets[i + 4]))) {
-      return true;
+  for (size_t i = 0; i < super.n_components; i++) {
+    size_t offset = ci.instruction_offsets[instruction_index + i];
+    if (static_cast<OpCode>(chunk.at(offset)) != super.components[i]) {
+      return false;
+    }
+    // make sure that nothing tries to jump to the middle of this sequence
+    if (i > 0 && ci.is_jump_target(offset)) {
+      return false;
     }
   }
-  return false;
+  return true;
 }
 
-size_t AddLocalConstOptimisation::match_length() const { return 5; }
-
 std::pair<size_t, size_t>
-AddLocalConstOptimisation::emit(const Chunk& old_chunk, size_t old_byte_offset,
-                                Chunk& new_chunk) const {
+SuperinstructionOptimisation::emit(const Chunk& old_chunk,
+                                   size_t old_byte_offset,
+                                   Chunk& new_chunk) const {
+  // The operands are just the operands of each of the components, so all we
+  // need to do is to drop the components' opcodes. (If one of them is a jump,
+  // apply_optimisations will patch its offset afterwards.)
   size_t line_number = old_chunk.debuginfo_at(old_byte_offset);
-  uint8_t local_index = old_chunk.at(old_byte_offset + 1);
-  uint8_t constant_index = old_chunk.at(old_byte_offset + 3);
-  new_chunk.write(static_cast<uint8_t>(OpCode::ADD_LOCAL_CONST), line_number);
-  new_chunk.write(local_index, line_number);
-  new_chunk.write(constant_index, line_number);
-  return {8, 3}; // 8 bytes read from old chunk, 3 bytes written to new chunk
-}
-
-bool LocalConstLessOptimisation::matches(const Chunk& chunk,
-                                         const ChunkInfo& ci,
-                                         size_t instruction_index) const {
-  if (instruction_index + match_length() - 1 >= ci.instruction_offsets.size()) {
-    return false;
+  new_chunk.write(opcode, line_number);
+  size_t old_offset = old_byte_offset;
+  for (size_t i = 0; i < super.n_components; i++) {
+    size_t length = instruction_length(super.components[i]);
+    for (size_t j = 1; j < length; j++) {
+      new_chunk.write(old_chunk.at(old_offset + j), line_number);
+    }
+    old_offset += length;
+  }
+  return {old_offset - old_byte_offset, instruction_length(opcode)};
+}
+
+namespace {
+
+// The opcode of the instruction with index `instruction_index`, or nullopt if
+// there isn't one.
+std::optional<OpCode> opcode_at(const Chunk& chunk, const ChunkInfo& ci,
+                                size_t instruction_index) {
+  if (instruction_index >= ci.instruction_offsets.size()) {
+    return std::nullopt;
   }
+  return static_cast<OpCode>(
+      chunk.at(ci.instruction_offsets[instruction_index]));
+}
+
+// Whether the `n` instructions starting at `instruction_index` are `opcodes`,
+// and nothing jumps into the middle of them.
+bool matches_sequence(const Chunk& chunk, const ChunkInfo& ci,
+                      size_t instruction_index,
+                      std::initializer_list<OpCode> opcodes) {
   size_t i = instruction_index;
-  if (static_cast<OpCode>(chunk.at(ci.instruction_offsets[i])) ==
-          OpCode::GET_LOCAL &&
-      static_cast<OpCode>(chunk.at(ci.instruction_offsets[i + 1])) ==
-          OpCode::CONSTANT &&
-      static_cast<OpCode>(chunk.at(ci.instruction_offsets[i + 2])) ==
-          OpCode::LESS) {
-    if (!(ci.jump_targets.contains(ci.instruction_offsets[i + 1]) ||
-          ci.jump_targets.contains(ci.instruction_offsets[i + 2]))) {
-      return true;
+  for (OpCode opcode : opcodes) {
+    if (opcode_at(chunk, ci, i) != opcode ||
+        (i > instruction_index &&
+         ci.is_jump_target(ci.instruction_offsets[i]))) {
+      return false;
     }
+    i++;
   }
-  return false;
+  return true;
+}
+
+// The value loaded by the (one-byte) CONSTANT instruction at `offset`.
+lox::Value constant_value(const Chunk& chunk, size_t offset) {
+  return chunk.constant_at(chunk.at(offset + 1));
+}
+
+// The result of `a op b`, or nullopt if the VM would throw an error.
+std::optional<lox::Value> fold_binary(OpCode op, lox::Value a, lox::Value b,
+                                      GC& gc) {
+  if (op == OpCode::EQUAL) {
+    return from_bool(lox::is_equal(a, b));
+  }
+  bool strings = is_obj(a) && is_obj(b) &&
+                 as_obj(a)->type == ObjType::STRING &&
+                 as_obj(b)->type == ObjType::STRING;
+  if (op == OpCode::ADD && strings) {
+    // Not lox::add, which might make a rope: constants must be ObjStrings.
+    return from_obj(lox::concatenate(as_objptr_unsafe<ObjString>(a),
+                                     as_objptr_unsafe<ObjString>(b), gc));
+  }
+  if (!is_double(a) || !is_double(b)) {
+    return std::nullopt;
+  }
+  double x = as_double(a);
+  double y = as_double(b);
+  switch (op) {
+  case OpCode::ADD:
+    return from_double(x + y);
+  case OpCode::SUBTRACT:
+    return from_double(x - y);
+  case OpCode::MULTIPLY:
+    return from_double(x * y);
+  case OpCode::DIVIDE:
+    return from_double(x / y);
+  case OpCode::LESS:
+    return from_bool(x < y);
+  case OpCode::GREATER:
+    return from_bool(x > y);
+  default:
+    return std::nullopt;
+  }
+}
+
+// Same, for `op a`.
+std::optional<lox::Value> fold_unary(OpCode op, lox::Value a) {
+  if (op == OpCode::NOT) {
+    return from_bool(!lox::is_truthy(a));
+  } else if (op == OpCode::NEGATE && is_double(a)) {
+    return from_double(-as_double(a));
+  }
+  return std::nullopt;
+}
+
+// Appends a CONSTANT instruction that loads `value`, and returns the number of
+// bytes written. If the constant table is full, nothing is written and this
+// returns 0.
+size_t emit_constant(Chunk& chunk, lox::Value value, size_t line) {
+  if (chunk.constants_size() > MAX_WIDE_OPERAND) {
+    return 0;
+  }
+  size_t index = chunk.push_constant(value);
+  if (index <= UINT8_MAX) {
+    chunk.write(OpCode::CONSTANT, line);
+    chunk.write(static_cast<uint8_t>(index), line);
+    return 2;
+  }
+  // Needs a WIDE CONSTANT.
+  chunk.write(OpCode::WIDE, line);
+  chunk.write(OpCode::CONSTANT, line);
+  for (int shift = 16; shift >= 0; shift -= 8) {
+    chunk.write(static_cast<uint8_t>((index >> shift) & 0xff), line);
+  }
+  return 5;
+}
+
+// Copies the bytes from `old_offset` up to `end` unchanged, for when an
+// optimisation turns out not to be possible after all.
+std::pair<size_t, size_t> copy_unchanged(const Chunk& old_chunk,
+                                         size_t old_offset, size_t end,
+                                         Chunk& new_chunk) {
+  for (size_t i = old_offset; i < end; i++) {
+    new_chunk.write(old_chunk.at(i), old_chunk.debuginfo_at(i));
+  }
+  return {end - old_offset, end - old_offset};
+}
+
+} // namespace
+
+bool FoldBinaryOptimisation::matches(const Chunk& chunk, const ChunkInfo& ci,
+                                     size_t instruction_index) const {
+  std::optional<OpCode> op = opcode_at(chunk, ci, instruction_index + 2);
+  if (!op || !matches_sequence(chunk, ci, instruction_index,
+                               {OpCode::CONSTANT, OpCode::CONSTANT, *op})) {
+    return false;
+  }
+  lox::Value a =
+      constant_value(chunk, ci.instruction_offsets[instruction_index]);
+  lox::Value b =
+      constant_value(chunk, ci.instruction_offsets[instruction_index + 1]);
+  switch (*op) {
+  case OpCode::EQUAL:
+    return true;
+  case OpCode::ADD:
+    // Numbers or strings; fold_binary checks which.
+    return (is_double(a) && is_double(b)) ||
+           (is_obj(a) && is_obj(b) && as_obj(a)->type == ObjType::STRING &&
+            as_obj(b)->type == ObjType::STRING);
+  case OpCode::SUBTRACT:
+  case OpCode::MULTIPLY:
+  case OpCode::DIVIDE:
+  case OpCode::LESS:
+  case OpCode::GREATER:
+    return is_double(a) && is_double(b);
+  default:
+    return false;
+  }
+}
+
+std::pair<size_t, size_t>
+FoldBinaryOptimisation::emit(const Chunk& old_chunk, size_t old_byte_offset,
+                             Chunk& new_chunk) const {
+  // CONSTANT a CONSTANT b op
+  auto op = static_cast<OpCode>(old_chunk.at(old_byte_offset + 4));
+  // get the line number for debuginfo from the operator
+  size_t line_number = old_chunk.debuginfo_at(old_byte_offset + 4);
+  lox::Value a = constant_value(old_chunk, old_byte_offset);
+  lox::Value b = constant_value(old_chunk, old_byte_offset + 2);
+  // matches() has already checked that this works.
+  lox::Value result = *fold_binary(op, a, b, gc);
+  if (size_t written = emit_constant(new_chunk, result, line_number)) {
+    return {5, written};
+  }
+  return copy_unchanged(old_chunk, old_byte_offset, old_byte_offset + 5,
+                        new_chunk);
+}
+
+bool FoldUnaryOptimisation::matches(const Chunk& chunk, const ChunkInfo& ci,
+                                    size_t instruction_index) const {
+  std::optional<OpCode> op = opcode_at(chunk, ci, instruction_index + 1);
+  if (!op || !matches_sequence(chunk, ci, instruction_index,
+                               {OpCode::CONSTANT, *op})) {
+    return false;
+  }
+  lox::Value a =
+      constant_value(chunk, ci.instruction_offsets[instruction_index]);
+  return fold_unary(*op, a).has_value();
 }
 
-size_t LocalConstLessOptimisation::match_length() const { return 3; }
+std::pair<size_t, size_t>
+FoldUnaryOptimisation::emit(const Chunk& old_chunk, size_t old_byte_offset,
+                            Chunk& new_chunk) const {
+  auto op = static_cast<OpCode>(old_chunk.at(old_byte_offset + 2));
+  size_t line_number = old_chunk.debuginfo_at(old_byte_offset + 2);
+  lox::Value result =
+      *fold_unary(op, constant_value(old_chunk, old_byte_offset));
+  if (size_t written = emit_constant(new_chunk, result, line_number)) {
+    return {3, written};
+  }
+  return copy_unchanged(old_chunk, old_byte_offset, old_byte_offset + 3,
+                        new_chunk);
+}
+
+bool FoldConstantJumpOptimisation::matches(const Chunk& chunk,
+                                           const ChunkInfo& ci,
+                                           size_t instruction_index) const {
+  return matches_sequence(chunk, ci, instruction_index,
+                          {OpCode::CONSTANT, OpCode::JUMP_IF_FALSE});
+}
 
 std::pair<size_t, size_t>
-LocalConstLessOptimisation::emit(const Chunk& old_chunk, size_t old_byte_offset,
-                                 Chunk& new_chunk) const {
+FoldConstantJumpOptimisation::emit(const Chunk& old_chunk,
+                                   size_t old_byte_offset,
+                                   Chunk& new_chunk) const {
   size_t line_number = old_chunk.debuginfo_at(old_byte_offset);
-  uint8_t local_index = old_chunk.at(old_byte_offset + 1);
-  uint8_t constant_index = old_chunk.at(old_byte_offset + 3);
-  new_chunk.write(static_cast<uint8_t>(OpCode::LOCAL_CONST_LESS), line_number);
-  new_chunk.write(local_index, line_number);
-  new_chunk.write(constant_index, line_number);
-  return {5, 3};
-}
-
-bool FoldConstantNumAddOptimisation::matches(const Chunk& chunk,
-                                             const ChunkInfo& ci,
-                                             size_t instruction_index) const {
-  if (instruction_index + match_length() - 1 >= ci.instruction_offsets.size()) {
+  new_chunk.write(OpCode::CONSTANT, line_number);
+  new_chunk.write(old_chunk.at(old_byte_offset + 1), line_number);
+  if (lox::is_truthy(constant_value(old_chunk, old_byte_offset))) {
+    // Never jumps.
+    return {5, 2};
+  }
+  // Always jumps. The offset is patched by apply_optimisations.
+  size_t jump_line = old_chunk.debuginfo_at(old_byte_offset + 2);
+  new_chunk.write(OpCode::JUMP, jump_line);
+  new_chunk.write(static_cast<uint8_t>(0xff), jump_line);
+  new_chunk.write(static_cast<uint8_t>(0xff), jump_line);
+  return {5, 5};
+}
+
+bool RemoveConstantPopOptimisation::matches(const Chunk& chunk,
+                                            const ChunkInfo& ci,
+                                            size_t instruction_index) const {
+  return matches_sequence(chunk, ci, instruction_index,
+                          {OpCode::CONSTANT, OpCode::POP});
+}
+
+std::pair<size_t, size_t>
+RemoveConstantPopOptimisation::emit(const Chunk&, size_t, Chunk&) const {
+  return {3, 0};
+}
+
+bool RemoveJumpToNextOptimisation::matches(const Chunk& chunk,
+                                           const ChunkInfo& ci,
+                                           size_t instruction_index) const {
+  if (opcode_at(chunk, ci, instruction_index) != OpCode::JUMP) {
     return false;
   }
-  size_t i = instruction_index;
-  size_t const1_byte_offset = ci.instruction_offsets[i];
-  size_t const2_byte_offset = ci.instruction_offsets[i + 1];
-  size_t add_byte_offset = ci.instruction_offsets[i + 2];
-  // First check if the instructions themselves match
-  if (static_cast<OpCode>(chunk.at(const1_byte_offset)) == OpCode::CONSTANT &&
-      static_cast<OpCode>(chunk.at(const2_byte_offset)) == OpCode::CONSTANT &&
-      static_cast<OpCode>(chunk.at(add_byte_offset)) == OpCode::ADD &&
-      (!(ci.jump_targets.contains(const2_byte_offset) ||
-         ci.jump_targets.contains(add_byte_offset)))) {
-    // then check whether both the constants are numbers
-    uint8_t const1_index = chunk.at(const1_byte_offset + 1);
-    uint8_t const2_index = chunk.at(const2_byte_offset + 1);
-    lox::Value const1 = chunk.constant_at(const1_index);
-    lox::Value const2 = chunk.constant_at(const2_index);
-    return lox::is_double(const1) && lox::is_double(const2);
-    // TODO: could also handle the string-string case but is trickier as we have
-    // to wire in the interning table
+  size_t offset = ci.instruction_offsets[instruction_index];
+  return jump_target(chunk, offset) ==
+         static_cast<ptrdiff_t>(next_instruction(chunk, offset));
+}
+
+std::pair<size_t, size_t>
+RemoveJumpToNextOptimisation::emit(const Chunk&, size_t, Chunk&) const {
+  return {3, 0};
+}
+
+namespace {
+bool is_simple_jump(OpCode instruction) {
+  return instruction == OpCode::JUMP || instruction == OpCode::JUMP_IF_FALSE ||
+         instruction == OpCode::JUMP_LONG ||
+         instruction == OpCode::JUMP_IF_FALSE_LONG;
+}
+
+// For a superinstruction containing a jump, the index of the jump component.
+size_t jump_component(const Superinstruction& super) {
+  for (size_t i = 0; i < super.n_components; i++) {
+    if (is_simple_jump(super.components[i])) {
+      return i;
+    }
+  }
+  throw std::runtime_error("loxc: jump_component: no jump in superinstruction");
+}
+} // namespace
+
+bool is_jump(OpCode instruction) {
+  if (is_simple_jump(instruction)) {
+    return true;
+  }
+  if (const Superinstruction* super = find_superinstruction(instruction)) {
+    return std::any_of(super->components.begin(),
+                       super->components.begin() +
+                           static_cast<ptrdiff_t>(super->n_components),
+                       is_simple_jump);
   }
   return false;
 }
 
-size_t FoldConstantNumAddOptimisation::match_length() const { return 3; }
+bool falls_through(OpCode instruction) {
+  // For superinstructions, what matters is the last component (e.g.
+  // CONSTANT_RETURN returns).
+  OpCode last = instruction;
+  if (const Superinstruction* super = find_superinstruction(instruction)) {
+    last = super->last();
+  }
+  return last != OpCode::JUMP && last != OpCode::JUMP_LONG &&
+         last != OpCode::RETURN;
+}
 
-std::pair<size_t, size_t> FoldConstantNumAddOptimisation::emit(
-    const Chunk& old_chunk, size_t old_byte_offset, Chunk& new_chunk) const {
-  // First of all we need to check that there is enough space for the new
-  // constant to be added to the constant table.
-  if (new_chunk.constants_size() > UINT8_MAX) {
-    // If not, then we can't apply this optimisation. Just emit the old bytes.
-    for (size_t i = old_byte_offset; i < old_byte_offset + 5; i++) {
-      new_chunk.write(old_chunk.at(i), old_chunk.debuginfo_at(i));
+size_t jump_operand_offset(const Chunk& chunk, size_t offset) {
+  auto instruction = static_cast<OpCode>(chunk.at(offset));
+  size_t operand_offset = offset + 1;
+  if (const Superinstruction* super = find_superinstruction(instruction)) {
+    // Skip the operands of the components before the jump.
+    for (size_t i = 0; i < jump_component(*super); i++) {
+      operand_offset += instruction_length(super->components[i]) - 1;
     }
-    return {5, 5};
+  }
+  return operand_offset;
+}
+
+ptrdiff_t jump_target(const Chunk& chunk, size_t offset) {
+  if (std::optional<size_t> target = chunk.far_jump_target(offset)) {
+    return static_cast<ptrdiff_t>(*target);
+  }
+  // Jumps are relative to the end of the instruction, because the VM has
+  // already read the offset by the time it jumps. (For superinstructions, that
+  // means the end of the whole superinstruction.)
+  ptrdiff_t end = static_cast<ptrdiff_t>(next_instruction(chunk, offset));
+  auto instruction = static_cast<OpCode>(chunk.at(offset));
+  size_t operand = jump_operand_offset(chunk, offset);
+  if (instruction == OpCode::JUMP_LONG ||
+      instruction == OpCode::JUMP_IF_FALSE_LONG) {
+    uint8_t bytes[4] = {chunk.at(operand), chunk.at(operand + 1),
+                        chunk.at(operand + 2), chunk.at(operand + 3)};
+    return end + get_long_jump_offset(bytes);
   } else {
-    // get the line number for debuginfo from the add
-    size_t line_number = old_chunk.debuginfo_at(old_byte_offset + 4);
-    // get the numbers and add them. At this point we have already confirmed
-    // that they are doubles so we can safely use as_double
-    uint8_t const1_index = old_chunk.at(old_byte_offset + 1);
-    uint8_t const2_index = old_chunk.at(old_byte_offset + 3);
-    lox::Value const1 = old_chunk.constant_at(const1_index);
-    lox::Value const2 = old_chunk.constant_at(const2_index);
-    lox::Value result =
-        from_double(lox::as_double(const1) + lox::as_double(const2));
-    // add the result to the constant table and emit a single CONSTANT
-    // instruction
-    size_t new_constant_idx = new_chunk.push_constant(result);
-    new_chunk.write(static_cast<uint8_t>(OpCode::CONSTANT), line_number);
-    new_chunk.write(static_cast<uint8_t>(new_constant_idx), line_number);
-    return {5, 2};
+    return end + get_jump_offset(chunk.at(operand), chunk.at(operand + 1));
   }
 }
 
-ChunkInfo::ChunkInfo(const Chunk& chunk) : jumps(), instruction_offsets() {
+ChunkInfo::ChunkInfo(const Chunk& chunk)
+    : jumps(), jump_targets(chunk.size(), false), instruction_offsets() {
+#ifdef LOX_TIME
+  PassTimer timer(pass_timings().analyse);
+#endif
   size_t offset = 0;
   while (offset < chunk.size()) {
     // Check if the opcode is a jump
     OpCode instruction = static_cast<OpCode>(chunk.at(offset));
-    if (instruction == OpCode::JUMP || instruction == OpCode::JUMP_IF_FALSE) {
-      uint8_t high_byte = chunk.at(offset + 1);
-      uint8_t low_byte = chunk.at(offset + 2);
-      ptrdiff_t jump_offset = lox::get_jump_offset(high_byte, low_byte);
-      // check for negative targets (just in case). note that we have to add
-      // 3 to the offset here, because we jump after reading the offset
-      ptrdiff_t tmp = static_cast<ptrdiff_t>(offset) + 3 + jump_offset;
+    if (is_jump(instruction)) {
+      // check for negative targets (just in case)
+      ptrdiff_t tmp = jump_target(chunk, offset);
       if (tmp < 0) {
-        std::cerr << offset << " " << jump_offset << "\n";
         throw std::runtime_error("invalid jump to before start of chunk!");
       }
       // if it's fine we can safely cast back to size_t
       size_t target_offset = static_cast<size_t>(tmp);
-      jumps[offset] = target_offset;
-      jump_targets.insert(target_offset);
+      if (target_offset >= chunk.size()) {
+        throw std::runtime_error("invalid jump to beyond end of chunk!");
+      }
+      jumps.emplace_back(offset, target_offset);
+      jump_targets[target_offset] = true;
     }
     instruction_offsets.push_back(offset);
     offset = next_instruction(chunk, offset);
@@ -221,163 +462,760 @@ size_t next_instruction(const Chunk& chunk, size_t offset) {
     return offset + 2 + 2 * n_upvalues;
   }
 
-  case OpCode::CLOSE_UPVALUE:
+  case OpCode::WIDE: {
+    auto wide_opcode = static_cast<OpCode>(chunk.at(offset + 1));
+    size_t n_operands = wide_operand_count(wide_opcode);
+    if (n_operands == 0) {
+      throw std::runtime_error("loxc: next_instruction: WIDE " +
+                               std::string(opcode_name(wide_opcode)) +
+                               " is not a valid instruction");
+    }
+    if (wide_opcode == OpCode::CLOSURE) {
+      auto function = static_cast<ObjFunction*>(
+          as_obj(chunk.constant_at(chunk.wide_operand_at(offset + 2))));
+      n_operands += 2 * function->upvalues.size();
+    }
+    return offset + 2 + 3 * n_operands;
+  }
+
+  default:
+    if (size_t length = instruction_length(static_cast<OpCode>(instruction))) {
+      return offset + length;
+    }
+  }
+  throw std::runtime_error("loxc: Chunk::disassemble: unknown opcode " +
+                           std::to_string(instruction));
+}
+
+ptrdiff_t simple_stack_effect(OpCode instruction, const Chunk& chunk,
+                              size_t operands) {
+  switch (generic_opcode(instruction)) {
   case OpCode::RETURN:
-  case OpCode::DEFINE_METHOD:
   case OpCode::NEGATE:
+  case OpCode::NOT:
+  case OpCode::SET_GLOBAL_SLOT:
+  case OpCode::SET_LOCAL:
+  case OpCode::JUMP_IF_FALSE:
+  case OpCode::JUMP:
+  case OpCode::JUMP_IF_FALSE_LONG:
+  case OpCode::JUMP_LONG:
+  case OpCode::SET_UPVALUE:
+  case OpCode::GET_PROPERTY:
+    return 0;
+
+  case OpCode::CONSTANT:
+  case OpCode::GET_GLOBAL_SLOT:
+  case OpCode::GET_LOCAL:
+  case OpCode::CLOSURE:
+  case OpCode::GET_UPVALUE:
+  case OpCode::CLASS:
+    return 1;
+
   case OpCode::ADD:
   case OpCode::SUBTRACT:
   case OpCode::MULTIPLY:
   case OpCode::DIVIDE:
-  case OpCode::NOT:
   case OpCode::EQUAL:
   case OpCode::GREATER:
   case OpCode::LESS:
   case OpCode::PRINT:
   case OpCode::POP:
-  case OpCode::INHERIT: {
-    return offset + 1;
-  }
-
-  case OpCode::CONSTANT:
-  case OpCode::GET_UPVALUE:
-  case OpCode::SET_UPVALUE:
-  case OpCode::CLASS:
-  case OpCode::GET_PROPERTY:
+  case OpCode::DEFINE_GLOBAL_SLOT:
+  case OpCode::CLOSE_UPVALUE:
   case OpCode::SET_PROPERTY:
-  case OpCode::GET_GLOBAL:
-  case OpCode::SET_GLOBAL:
-  case OpCode::DEFINE_GLOBAL:
-  case OpCode::SET_LOCAL:
-  case OpCode::GET_LOCAL:
-  case OpCode::CALL:
-  case OpCode::GET_SUPER: {
-    return offset + 2;
-  }
+  case OpCode::DEFINE_METHOD:
+  case OpCode::GET_SUPER:
+  case OpCode::GET_INDEX:
+    return -1;
+
+  case OpCode::INHERIT:
+  case OpCode::SET_INDEX:
+    return -2;
 
-  case OpCode::ADD_LOCAL_CONST:
-  case OpCode::LOCAL_CONST_LESS:
+  // The elements are replaced by the list.
+  case OpCode::BUILD_LIST:
+    return 1 - static_cast<ptrdiff_t>(chunk.at(operands));
+
+  // The callee (or receiver) and the arguments are replaced by the return
+  // value.
+  case OpCode::CALL:
   case OpCode::INVOKE:
+  case OpCode::CALL_PROPERTY:
+    return -static_cast<ptrdiff_t>(chunk.at(operands));
+  // Same, but the superclass is also popped.
   case OpCode::SUPER_INVOKE:
-  case OpCode::JUMP_IF_FALSE:
-  case OpCode::JUMP: {
-    return offset + 3;
+    return -static_cast<ptrdiff_t>(chunk.at(operands)) - 1;
+
+  default:
+    break;
   }
+  throw std::runtime_error("loxc: stack_effect: unknown opcode " +
+                           std::to_string(static_cast<int>(instruction)));
+}
+
+namespace {
+// The stack effect of the first `n` components of a superinstruction.
+ptrdiff_t superinstruction_stack_effect(const Superinstruction& super,
+                                        const Chunk& chunk, size_t offset,
+                                        size_t n) {
+  ptrdiff_t effect = 0;
+  size_t operands = offset + 1;
+  for (size_t i = 0; i < n; i++) {
+    effect += simple_stack_effect(super.components[i], chunk, operands);
+    operands += instruction_length(super.components[i]) - 1;
   }
-  throw std::runtime_error("loxc: Chunk::disassemble: unknown opcode " +
-                           std::to_string(instruction));
+  return effect;
 }
+} // namespace
 
-std::unordered_map<size_t, size_t> find_optimisation_offsets(
-    const Chunk& chunk, const ChunkInfo& ci,
-    const std::vector<std::unique_ptr<PeepholeOptimisation>>& registry) {
+ptrdiff_t stack_effect(const Chunk& chunk, size_t offset) {
+  auto instruction = static_cast<OpCode>(chunk.at(offset));
+  switch (instruction) {
+  case OpCode::WIDE: {
+    // Same as the instruction itself, except that the argument count is wide.
+    auto wide_opcode = static_cast<OpCode>(chunk.at(offset + 1));
+    ptrdiff_t nargs = static_cast<ptrdiff_t>(chunk.wide_operand_at(offset + 2));
+    switch (wide_opcode) {
+    case OpCode::INVOKE:
+    case OpCode::CALL_PROPERTY:
+      return -nargs;
+    case OpCode::SUPER_INVOKE:
+      return -nargs - 1;
+    default:
+      return stack_effect(chunk, offset + 1);
+    }
+  }
+  default:
+    break;
+  }
+  if (const Superinstruction* super = find_superinstruction(instruction)) {
+    return superinstruction_stack_effect(*super, chunk, offset,
+                                         super->n_components);
+  }
+  return simple_stack_effect(instruction, chunk, offset + 1);
+}
 
-  std::unordered_map<size_t, size_t> optimisation_offsets;
-  size_t i = 0;
-  while (i < ci.instruction_offsets.size()) {
-    bool found_opt = false;
-    for (size_t opt_num = 0; opt_num < registry.size(); opt_num++) {
-      if (registry[opt_num]->matches(chunk, ci, i)) {
-        optimisation_offsets[ci.instruction_offsets[i]] = opt_num;
-        i += registry[opt_num]->match_length();
-        found_opt = true;
+ptrdiff_t jump_stack_effect(const Chunk& chunk, size_t offset) {
+  auto instruction = static_cast<OpCode>(chunk.at(offset));
+  if (const Superinstruction* super = find_superinstruction(instruction)) {
+    return superinstruction_stack_effect(*super, chunk, offset,
+                                         jump_component(*super) + 1);
+  }
+  return stack_effect(chunk, offset);
+}
+
+size_t max_stack_depth(const Chunk& chunk, size_t initial_depth) {
+#ifdef LOX_TIME
+  PassTimer timer(pass_timings().stack_depth);
+#endif
+  // The compiler always emits code where the stack depth at any given
+  // instruction is the same no matter which path we took to get there, so we
+  // only need to visit each instruction once. `depth_at` records the depth
+  // just before each instruction, or -1 if it hasn't been visited yet.
+  std::vector<ptrdiff_t> depth_at(chunk.size(), -1);
+  std::vector<std::pair<size_t, ptrdiff_t>> worklist;
+  worklist.emplace_back(0, static_cast<ptrdiff_t>(initial_depth));
+  ptrdiff_t max_depth = static_cast<ptrdiff_t>(initial_depth);
+
+  while (!worklist.empty()) {
+    auto [offset, depth] = worklist.back();
+    worklist.pop_back();
+    while (offset < chunk.size() && depth_at[offset] < 0) {
+      depth_at[offset] = depth;
+      OpCode instruction = static_cast<OpCode>(chunk.at(offset));
+      if (const Superinstruction* super = find_superinstruction(instruction)) {
+        // The intermediate depths inside a superinstruction can be higher
+        // than the depth at either end.
+        ptrdiff_t inner_depth = depth;
+        size_t operands = offset + 1;
+        for (size_t i = 0; i < super->n_components; i++) {
+          inner_depth += simple_stack_effect(super->components[i], chunk, operands);
+          max_depth = std::max(max_depth, inner_depth);
+          operands += instruction_length(super->components[i]) - 1;
+        }
+      }
+      if (is_jump(instruction)) {
+        size_t target_offset = static_cast<size_t>(jump_target(chunk, offset));
+        worklist.emplace_back(target_offset,
+                              depth + jump_stack_effect(chunk, offset));
+      }
+      depth += stack_effect(chunk, offset);
+      max_depth = std::max(max_depth, depth);
+
+      if (!falls_through(instruction)) {
         break;
       }
+      offset = next_instruction(chunk, offset);
     }
-    if (!found_opt) {
+  }
+  return static_cast<size_t>(max_depth);
+}
+
+namespace {
+
+// Marks an instruction where no optimisation starts.
+constexpr size_t NO_OPTIMISATION = SIZE_MAX;
+// Marks an instruction that can never run, and so is removed.
+constexpr size_t UNREACHABLE = SIZE_MAX - 1;
+
+// Marks the instructions that can't be reached from the start of the chunk as
+// UNREACHABLE in `optimisations`, and returns whether there were any. Unlike
+// the peephole optimisations, this has to look at the whole chunk, since
+// removing one jump can make code anywhere unreachable.
+bool mark_unreachable(const Chunk& chunk, const ChunkInfo& ci,
+                      std::vector<size_t>& optimisations) {
+  const std::vector<size_t>& offsets = ci.instruction_offsets;
+  std::vector<bool> reachable(offsets.size(), false);
+  std::vector<size_t> worklist{0};
+  while (!worklist.empty()) {
+    size_t i = worklist.back();
+    worklist.pop_back();
+    while (i < offsets.size() && !reachable[i]) {
+      reachable[i] = true;
+      auto instruction = static_cast<OpCode>(chunk.at(offsets[i]));
+      if (is_jump(instruction)) {
+        auto target = static_cast<size_t>(jump_target(chunk, offsets[i]));
+        auto it = std::lower_bound(offsets.begin(), offsets.end(), target);
+        worklist.push_back(static_cast<size_t>(it - offsets.begin()));
+      }
+      if (!falls_through(instruction)) {
+        break;
+      }
       i++;
     }
   }
-  return optimisation_offsets;
+  bool found_any = false;
+  for (size_t i = 0; i < offsets.size(); i++) {
+    if (!reachable[i]) {
+      optimisations[i] = UNREACHABLE;
+      found_any = true;
+    }
+  }
+  return found_any;
 }
 
-Chunk apply_optimisations(
+// For each instruction in `candidates` (indices into ci.instruction_offsets,
+// in increasing order), find the first optimisation in `registry` that matches
+// there, and record its index in `optimisations` (which has one entry per
+// instruction in the chunk). Matches can't overlap, so candidates inside an
+// earlier match are skipped. If `remove_unreachable` is set, unreachable
+// instructions are marked too. Returns whether there is anything to change.
+bool find_optimisations(
+    const Chunk& chunk, const ChunkInfo& ci,
+    const std::vector<std::unique_ptr<PeepholeOptimisation>>& registry,
+    bool remove_unreachable, const std::vector<size_t>& candidates,
+    std::vector<size_t>& optimisations) {
+#ifdef LOX_TIME
+  PassTimer timer(pass_timings().match);
+#endif
+  optimisations.assign(ci.instruction_offsets.size(), NO_OPTIMISATION);
+  bool found_any =
+      remove_unreachable && mark_unreachable(chunk, ci, optimisations);
+  size_t next_free = 0;
+  for (size_t i : candidates) {
+    if (i < next_free || optimisations[i] == UNREACHABLE) {
+      continue;
+    }
+    for (size_t opt_num = 0; opt_num < registry.size(); opt_num++) {
+      if (registry[opt_num]->matches(chunk, ci, i)) {
+        optimisations[i] = opt_num;
+        next_free = i + registry[opt_num]->match_length();
+        found_any = true;
+        break;
+      }
+    }
+  }
+  return found_any;
+}
+
+struct RewriteResult {
+  Chunk chunk;
+  // Built while rewriting, so that we don't have to decode the new chunk
+  // again.
+  ChunkInfo info;
+  // Indices of the instructions in the new chunk that optimisations emitted,
+  // or that now follow removed code, in increasing order. Only these can
+  // create new matches.
+  std::vector<size_t> rewritten;
+};
+
+RewriteResult apply_optimisations(
     const Chunk& old_chunk, const ChunkInfo& ci,
-    const std::unordered_map<size_t, size_t>& optimisation_offsets,
+    const std::vector<size_t>& optimisations,
     const std::vector<std::unique_ptr<PeepholeOptimisation>>& registry) {
-  Chunk new_chunk;
-
-  // Rebuild constant table before adding in any optimisations. Note that
-  // optimisations may add to the constant table (e.g. if we perform constant
-  // folding) so we need to do this _before_ applying any optimisations.
-  for (size_t i = 0; i < old_chunk.constants_size(); i++) {
-    new_chunk.push_constant(old_chunk.constant_at(i));
-  }
-
-  // Build a old offset => new offset map so that we can patch jump offsets
-  // later.
-  std::unordered_map<size_t, size_t> old_to_new_offset;
-
-  // Rebuild bytecode itself + debuginfo
-  size_t old_offset = 0;
-  size_t new_offset = 0; // Every time we write to chunk we increment this
-  while (old_offset < old_chunk.size()) {
-    old_to_new_offset[old_offset] = new_offset;
-    size_t line_number = old_chunk.debuginfo_at(old_offset);
-
-    size_t next_old_offset = next_instruction(old_chunk, old_offset);
-    auto it = optimisation_offsets.find(old_offset);
-    if (it != optimisation_offsets.end()) {
-      auto [old_bytes_read, new_bytes_written] =
-          registry[it->second]->emit(old_chunk, old_offset, new_chunk);
-      old_offset += old_bytes_read;
-      new_offset += new_bytes_written;
-    } else {
-      // just copy the instruction to the new chunk
-      for (size_t i = old_offset; i < next_old_offset; i++) {
-        new_chunk.write(old_chunk.at(i), line_number);
-        new_offset++;
+#ifdef LOX_TIME
+  PassTimer timer(pass_timings().rewrite);
+  pass_timings().rewrites++;
+#endif
+  // The jumps that need to be emitted as long jumps, indexed like ci.jumps. To
+  // begin with, that's the ones that already are, plus the ones that the
+  // compiler couldn't fit into two bytes. Rebuilding the chunk can move things
+  // around such that more jumps need to be long, in which case we just try
+  // again: this can only happen finitely many times, since jumps only ever go
+  // from short to long.
+  std::vector<bool> long_jumps(ci.jumps.size(), false);
+  for (size_t j = 0; j < ci.jumps.size(); j++) {
+    size_t old_jump_offset = ci.jumps[j].first;
+    auto instruction = static_cast<OpCode>(old_chunk.at(old_jump_offset));
+    if (instruction == OpCode::JUMP_LONG ||
+        instruction == OpCode::JUMP_IF_FALSE_LONG ||
+        old_chunk.far_jump_target(old_jump_offset).has_value()) {
+      long_jumps[j] = true;
+    }
+  }
+
+  while (true) {
+    // Optimisations may add to the constant table (e.g. if we perform
+    // constant folding), so the new chunk starts off with the old constants
+    // and gets more added to the end. Likewise, instructions refer to inline
+    // caches by index, so the new chunk needs to have the same number of them.
+    RewriteResult result{Chunk::empty_like(old_chunk), ChunkInfo(), {}};
+    Chunk& new_chunk = result.chunk;
+    std::vector<size_t>& new_instruction_offsets =
+        result.info.instruction_offsets;
+    new_instruction_offsets.reserve(ci.instruction_offsets.size());
+
+    // Old offset => new offset, so that we can patch jump targets later. Only
+    // the entries for instructions are filled in.
+    std::vector<size_t> old_to_new_offset(old_chunk.size() + 1, 0);
+    // For each jump (indexed like ci.jumps), where the instruction and its
+    // operand ended up. The operand isn't always just after the opcode (e.g.
+    // in a superinstruction).
+    std::vector<size_t> new_jump_offset(ci.jumps.size());
+    std::vector<size_t> new_jump_operand_offset(ci.jumps.size());
+    // Jumps that were removed altogether.
+    std::vector<bool> removed_jumps(ci.jumps.size(), false);
+    // ci.jumps is in order of offset, so we can just walk through it.
+    size_t next_jump = 0;
+    // Whether the last thing we did was to remove some instructions, in which
+    // case the next instruction we emit counts as rewritten.
+    bool removed_code = false;
+    auto mark_rewritten = [&result](size_t index) {
+      if (result.rewritten.empty() || result.rewritten.back() < index) {
+        result.rewritten.push_back(index);
+      }
+    };
+
+    // Rebuild bytecode itself + debuginfo
+    size_t new_offset = 0; // Every time we write to chunk we increment this
+    size_t n_instructions = ci.instruction_offsets.size();
+    size_t i = 0;
+    while (i < n_instructions) {
+      size_t old_offset = ci.instruction_offsets[i];
+      old_to_new_offset[old_offset] = new_offset;
+      size_t line_number = old_chunk.debuginfo_at(old_offset);
+      if (removed_code) {
+        mark_rewritten(new_instruction_offsets.size());
+        removed_code = false;
+      }
+
+      size_t next_old_offset = next_instruction(old_chunk, old_offset);
+      auto instruction = static_cast<OpCode>(old_chunk.at(old_offset));
+      size_t opt_num = optimisations[i];
+      bool is_jump_here = next_jump < ci.jumps.size() &&
+                          ci.jumps[next_jump].first == old_offset;
+      if (opt_num == UNREACHABLE) {
+        if (is_jump_here) {
+          removed_jumps[next_jump++] = true;
+        }
+        removed_code = true;
+        i++;
+        continue;
+      }
+      // An optimisation that would swallow a jump can only be applied if the
+      // jump doesn't need to be long.
+      std::optional<size_t> swallowed_jump;
+      size_t match_length = 1;
+      if (opt_num != NO_OPTIMISATION) {
+        match_length = registry[opt_num]->match_length();
+        size_t match_end = i + match_length < n_instructions
+                               ? ci.instruction_offsets[i + match_length]
+                               : old_chunk.size();
+        if (next_jump < ci.jumps.size() &&
+            ci.jumps[next_jump].first < match_end) {
+          swallowed_jump = next_jump;
+        }
+      }
+
+      if (opt_num != NO_OPTIMISATION &&
+          !(swallowed_jump && long_jumps[*swallowed_jump])) {
+        size_t new_bytes_written =
+            registry[opt_num]->emit(old_chunk, old_offset, new_chunk).second;
+        // Usually this is one instruction, but not always (e.g. if constant
+        // folding had to give up), and it can be none at all.
+        std::optional<size_t> new_jump;
+        size_t new_end = new_offset + new_bytes_written;
+        while (new_offset < new_end) {
+          mark_rewritten(new_instruction_offsets.size());
+          new_instruction_offsets.push_back(new_offset);
+          if (is_jump(static_cast<OpCode>(new_chunk.at(new_offset)))) {
+            new_jump = new_offset;
+          }
+          new_offset = next_instruction(new_chunk, new_offset);
+        }
+        if (swallowed_jump && new_jump) {
+          new_jump_offset[*swallowed_jump] = *new_jump;
+          new_jump_operand_offset[*swallowed_jump] =
+              jump_operand_offset(new_chunk, *new_jump);
+        } else if (swallowed_jump) {
+          removed_jumps[*swallowed_jump] = true;
+        }
+        if (swallowed_jump) {
+          next_jump++;
+        }
+        removed_code = new_bytes_written == 0;
+        i += match_length;
+      } else if (is_jump_here) {
+        size_t j = next_jump++;
+        const Superinstruction* super = find_superinstruction(instruction);
+        if (super != nullptr && !long_jumps[j]) {
+          // Copy it as it is, and patch the offset below.
+          for (size_t b = old_offset; b < next_old_offset; b++) {
+            new_chunk.write(old_chunk.at(b), line_number);
+          }
+          new_instruction_offsets.push_back(new_offset);
+          new_jump_offset[j] = new_offset;
+          new_jump_operand_offset[j] =
+              jump_operand_offset(new_chunk, new_offset);
+          new_offset += next_old_offset - old_offset;
+          i++;
+          continue;
+        }
+        // A superinstruction whose jump needs to be long has to be split
+        // back up into its components.
+        std::vector<OpCode> components{instruction};
+        if (super != nullptr) {
+          components.assign(super->components.begin(),
+                            super->components.begin() +
+                                static_cast<ptrdiff_t>(super->n_components));
+        }
+        size_t operand = old_offset + 1;
+        for (OpCode component : components) {
+          new_instruction_offsets.push_back(new_offset);
+          if (!is_simple_jump(component)) {
+            new_chunk.write(component, line_number);
+            size_t length = instruction_length(component);
+            for (size_t b = 1; b < length; b++) {
+              new_chunk.write(old_chunk.at(operand++), line_number);
+            }
+            new_offset += length;
+            continue;
+          }
+          // Emit the jump with a placeholder offset, which is patched below.
+          bool conditional = component == OpCode::JUMP_IF_FALSE ||
+                             component == OpCode::JUMP_IF_FALSE_LONG;
+          OpCode new_instruction =
+              long_jumps[j]
+                  ? (conditional ? OpCode::JUMP_IF_FALSE_LONG
+                                 : OpCode::JUMP_LONG)
+                  : (conditional ? OpCode::JUMP_IF_FALSE : OpCode::JUMP);
+          new_chunk.write(new_instruction, line_number);
+          size_t operand_size = long_jumps[j] ? 4 : 2;
+          for (size_t b = 0; b < operand_size; b++) {
+            new_chunk.write(static_cast<uint8_t>(0xff), line_number);
+          }
+          new_jump_offset[j] = new_offset;
+          new_jump_operand_offset[j] = new_offset + 1;
+          new_offset += 1 + operand_size;
+          operand += instruction_length(component) - 1;
+        }
+        i++;
+      } else {
+        // just copy the instruction to the new chunk
+        new_instruction_offsets.push_back(new_offset);
+        for (size_t b = old_offset; b < next_old_offset; b++) {
+          new_chunk.write(old_chunk.at(b), line_number);
+          new_offset++;
+        }
+        i++;
+      }
+    }
+
+    // Patch jump offsets in new chunk, and record the jumps for the new
+    // ChunkInfo (which stay in the same order).
+    bool needs_more_long_jumps = false;
+    result.info.jumps.reserve(ci.jumps.size());
+    result.info.jump_targets.assign(new_chunk.size(), false);
+    for (size_t j = 0; j < ci.jumps.size(); j++) {
+      if (removed_jumps[j]) {
+        continue;
       }
-      old_offset = next_old_offset;
+      size_t new_operand_offset = new_jump_operand_offset[j];
+      size_t new_target_offset = old_to_new_offset[ci.jumps[j].second];
+      if (long_jumps[j]) {
+        if (!new_chunk.patch_long_jump_operand(new_operand_offset,
+                                               new_target_offset)) {
+          throw std::runtime_error(
+              "loxc: apply_optimisations: jump offset from " +
+              std::to_string(new_operand_offset) + " to " +
+              std::to_string(new_target_offset) +
+              " is too large to fit in four bytes");
+        }
+      } else if (!new_chunk.patch_jump_operand(new_operand_offset,
+                                               new_target_offset)) {
+        long_jumps[j] = true;
+        needs_more_long_jumps = true;
+      }
+      result.info.jumps.emplace_back(new_jump_offset[j], new_target_offset);
+      result.info.jump_targets[new_target_offset] = true;
+    }
+
+    if (!needs_more_long_jumps) {
+      return result;
     }
   }
+}
 
-  // Patch jump offsets in new chunk
-  for (const auto& [old_jump_offset, old_target_offset] : ci.jumps) {
-    size_t new_jump_offset = old_to_new_offset.at(old_jump_offset);
-    size_t new_target_offset = old_to_new_offset.at(old_target_offset);
-    // To patch the jump operand, we need to move one past the opcode itself
-    size_t new_jump_operand_offset = new_jump_offset + 1;
-    bool success = new_chunk.patch_jump_operand(new_jump_operand_offset,
-                                                new_target_offset);
-    // Should not fail but we can check anyway
-    if (!success) {
-      throw std::runtime_error("loxc: apply_optimisations: jump offset from " +
-                               std::to_string(new_jump_offset) + " to " +
-                               std::to_string(new_target_offset) +
-                               " is too large to fit in two bytes");
+} // namespace
+
+namespace {
+
+// Applies the optimisations in `registry` to `chunk` until none of them match
+// any more. Returns nullopt if nothing matched in the first place (and `force`
+// isn't set).
+std::optional<RewriteResult> rewrite_to_fixpoint(
+    const Chunk& chunk, const ChunkInfo& chunk_info,
+    const std::vector<std::unique_ptr<PeepholeOptimisation>>& registry,
+    bool remove_unreachable, bool force) {
+  std::vector<size_t> candidates(chunk_info.instruction_offsets.size());
+  std::iota(candidates.begin(), candidates.end(), 0);
+  std::vector<size_t> optimisations;
+  if (!find_optimisations(chunk, chunk_info, registry, remove_unreachable,
+                          candidates, optimisations) &&
+      !force) {
+    return std::nullopt;
+  }
+  RewriteResult result =
+      apply_optimisations(chunk, chunk_info, optimisations, registry);
+
+  // Rewriting can create new matches (e.g. folding `1 + 2 + 3` produces
+  // `3 + 3`), but only ones that include an instruction that was just
+  // emitted by an optimisation. So rather than scanning the whole chunk
+  // again, we only need to look at the few instructions before each of those.
+  size_t max_match_length = 1;
+  for (const auto& opt : registry) {
+    max_match_length = std::max(max_match_length, opt->match_length());
+  }
+  while (!result.rewritten.empty()) {
+    candidates.clear();
+    for (size_t index : result.rewritten) {
+      size_t first = index >= max_match_length - 1
+                         ? index - (max_match_length - 1)
+                         : 0;
+      if (!candidates.empty()) {
+        first = std::max(first, candidates.back() + 1);
+      }
+      for (size_t k = first; k <= index; k++) {
+        candidates.push_back(k);
+      }
+    }
+    if (!find_optimisations(result.chunk, result.info, registry,
+                            remove_unreachable, candidates, optimisations)) {
+      break;
     }
+    result = apply_optimisations(result.chunk, result.info, optimisations,
+                                 registry);
   }
+  return result;
+}
 
-  return new_chunk;
+// Two constants are the same if they are the same type and have the same bits
+// (so, unlike is_equal, 0 and -0 are different). Strings are interned, so
+// it's fine to compare them by pointer.
+std::pair<int, uint64_t> constant_identity(lox::Value value) {
+  if (is_nil(value)) {
+    return {0, 0};
+  } else if (is_bool(value)) {
+    return {1, as_bool(value)};
+  } else if (is_double(value)) {
+    return {2, std::bit_cast<uint64_t>(as_double(value))};
+  } else {
+    return {3, reinterpret_cast<uintptr_t>(as_obj(value))};
+  }
 }
 
-Chunk peephole_optimise(const Chunk& chunk) {
-#ifdef LOX_NO_OPTIMISE
-  return chunk;
-#else
-  Chunk current = chunk;
+// Removes the constants that no instruction uses any more (e.g. the operands
+// of folded expressions), and merges duplicates (the compiler adds a new
+// constant for every literal). The remaining constants stay in the same
+// order, so indices only ever go down and every operand still fits.
+void compact_constants(Chunk& chunk) {
+  // Where each operand that refers to a constant is, and whether it's wide.
+  std::vector<std::pair<size_t, bool>> operands;
+  size_t offset = 0;
+  while (offset < chunk.size()) {
+    auto instruction = static_cast<OpCode>(chunk.at(offset));
+    if (instruction == OpCode::WIDE) {
+      auto wide_opcode = static_cast<OpCode>(chunk.at(offset + 1));
+      if (std::optional<size_t> k = constant_operand_index(wide_opcode)) {
+        operands.emplace_back(offset + 2 + 3 * *k, true);
+      }
+    } else if (const Superinstruction* super =
+                   find_superinstruction(instruction)) {
+      size_t operand = offset + 1;
+      for (size_t i = 0; i < super->n_components; i++) {
+        OpCode component = super->components[i];
+        if (std::optional<size_t> k = constant_operand_index(component)) {
+          operands.emplace_back(operand + *k, false);
+        }
+        operand += instruction_length(component) - 1;
+      }
+    } else if (std::optional<size_t> k = constant_operand_index(instruction)) {
+      operands.emplace_back(offset + 1 + *k, false);
+    }
+    offset = next_instruction(chunk, offset);
+  }
+  auto read_operand = [&chunk](size_t operand, bool wide) -> size_t {
+    return wide ? chunk.wide_operand_at(operand) : chunk.at(operand);
+  };
 
-  ChunkInfo chunk_info(current);
-  // NOTE: Can't use initialiser list because it copies whatever is passed to it
-  // and unique_ptr can't be copied
-  std::vector<std::unique_ptr<PeepholeOptimisation>> registry;
-  registry.push_back(std::make_unique<AddLocalConstOptimisation>());
-  registry.push_back(std::make_unique<LocalConstLessOptimisation>());
-  registry.push_back(std::make_unique<FoldConstantNumAddOptimisation>());
+  const std::vector<lox::Value>& constants = chunk.get_constants();
+  std::vector<bool> used(constants.size(), false);
+  for (const auto& [operand, wide] : operands) {
+    used[read_operand(operand, wide)] = true;
+  }
+  // Sort the used constants by identity, so that duplicates are next to each
+  // other, with the lowest index first.
+  std::vector<size_t> by_identity;
+  for (size_t i = 0; i < constants.size(); i++) {
+    if (used[i]) {
+      by_identity.push_back(i);
+    }
+  }
+  std::sort(by_identity.begin(), by_identity.end(),
+            [&constants](size_t a, size_t b) {
+              return std::pair(constant_identity(constants[a]), a) <
+                     std::pair(constant_identity(constants[b]), b);
+            });
+  // The first (lowest) index of each constant's duplicates.
+  std::vector<size_t> representative(constants.size());
+  for (size_t i = 0; i < by_identity.size(); i++) {
+    size_t index = by_identity[i];
+    bool duplicate = i > 0 && constant_identity(constants[index]) ==
+                                  constant_identity(constants[by_identity[i - 1]]);
+    representative[index] =
+        duplicate ? representative[by_identity[i - 1]] : index;
+  }
+  std::vector<size_t> new_index(constants.size());
+  std::vector<lox::Value> new_constants;
+  for (size_t i = 0; i < constants.size(); i++) {
+    if (used[i] && representative[i] == i) {
+      new_index[i] = new_constants.size();
+      new_constants.push_back(constants[i]);
+    }
+  }
+  if (new_constants.size() == constants.size()) {
+    return;
+  }
 
-  auto optimisation_offsets =
-      find_optimisation_offsets(current, chunk_info, registry);
+  for (const auto& [operand, wide] : operands) {
+    size_t index = new_index[representative[read_operand(operand, wide)]];
+    if (wide) {
+      chunk.patch_at_offset(operand, static_cast<uint8_t>(index >> 16));
+      chunk.patch_at_offset(operand + 1,
+                            static_cast<uint8_t>((index >> 8) & 0xff));
+      chunk.patch_at_offset(operand + 2, static_cast<uint8_t>(index & 0xff));
+    } else {
+      chunk.patch_at_offset(operand, static_cast<uint8_t>(index));
+    }
+  }
+  chunk.set_constants(std::move(new_constants));
+}
+
+// The superinstruction fusions don't have any state, so they are only set up
+// once. (This matters when lots of small chunks are optimised, e.g. when
+// compiling a script one declaration at a time.)
+const std::vector<std::unique_ptr<PeepholeOptimisation>>&
+fusion_optimisations() {
+  static const std::vector<std::unique_ptr<PeepholeOptimisation>> fusions =
+      [] {
+        std::vector<std::unique_ptr<PeepholeOptimisation>> result;
+#ifndef LOX_NO_OPTIMISE
+        // Longer sequences first, so that e.g. LOCAL_CONST_LESS_JUMP_IF_FALSE
+        // wins over LOCAL_CONST_LESS.
+        std::vector<std::pair<OpCode, Superinstruction>> superinstructions =
+            all_superinstructions();
+        std::stable_sort(superinstructions.begin(), superinstructions.end(),
+                         [](const auto& a, const auto& b) {
+                           return a.second.n_components >
+                                  b.second.n_components;
+                         });
+        for (const auto& [opcode, super] : superinstructions) {
+          result.push_back(
+              std::make_unique<SuperinstructionOptimisation>(opcode, super));
+        }
+#endif
+        return result;
+      }();
+  return fusions;
+}
 
-  while (!optimisation_offsets.empty()) {
-    current =
-        apply_optimisations(current, chunk_info, optimisation_offsets, registry);
-    chunk_info = ChunkInfo(current);
-    optimisation_offsets = find_optimisation_offsets(current, chunk_info, registry);
+} // namespace
+
+Chunk peephole_optimise(const Chunk& chunk, GC& gc) {
+  // NOTE: Can't use initialiser list because it copies whatever is passed to it
+  // and unique_ptr can't be copied
+  std::vector<std::unique_ptr<PeepholeOptimisation>> folds;
+  const auto& fusions = fusion_optimisations();
+#ifndef LOX_NO_OPTIMISE
+  folds.push_back(std::make_unique<FoldBinaryOptimisation>(gc));
+  folds.push_back(std::make_unique<FoldUnaryOptimisation>());
+  folds.push_back(std::make_unique<FoldConstantJumpOptimisation>());
+  folds.push_back(std::make_unique<RemoveConstantPopOptimisation>());
+  folds.push_back(std::make_unique<RemoveJumpToNextOptimisation>());
+  bool remove_unreachable = true;
+#else
+  bool remove_unreachable = false;
+#endif
+  // Even with no optimisations, any jumps that were too far for the compiler
+  // to encode still need to be turned into long jumps. (If there aren't any,
+  // we can skip all the work.)
+  if (folds.empty() && fusions.empty() && !chunk.has_far_jumps()) {
+    return chunk;
   }
-  return current;
+  // Folded strings are only in the new chunk's constant table until it
+  // replaces the old one, so the GC can't see them.
+  GC::DeferCollections defer(gc);
+
+  // Fold constants and remove dead code first, and only then fuse
+  // superinstructions. Otherwise, e.g. in `if (1 < 2)`, the JUMP_IF_FALSE
+  // would be fused with the POP after it before we found out that its
+  // condition is constant.
+  ChunkInfo chunk_info(chunk);
+  std::optional<RewriteResult> folded =
+      rewrite_to_fixpoint(chunk, chunk_info, folds, remove_unreachable,
+                          chunk.has_far_jumps());
+  std::optional<RewriteResult> fused =
+      folded ? rewrite_to_fixpoint(folded->chunk, folded->info, fusions,
+                                   false, false)
+             : rewrite_to_fixpoint(chunk, chunk_info, fusions, false, false);
+  Chunk result = fused    ? std::move(fused->chunk)
+                 : folded ? std::move(folded->chunk)
+                          : chunk;
+#ifndef LOX_NO_OPTIMISE
+  compact_constants(result);
 #endif
+  return result;
+}
+
+#ifdef LOX_TIME
+PassTimings& pass_timings() {
+  // Per thread, so that VMs on different threads don't race on it.
+  thread_local PassTimings timings;
+  return timings;
 }
 
+void report_pass_timings(std::ostream& os) {
+  const PassTimings& timings = pass_timings();
+  auto us = [](std::chrono::nanoseconds ns) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(ns).count();
+  };
+  os << "  Optimiser analysis: " << us(timings.analyse) << " us\n";
+  os << "  Optimiser matching: " << us(timings.match) << " us\n";
+  os << "  Optimiser rewriting: " << us(timings.rewrite) << " us ("
+     << timings.rewrites << " chunks rebuilt)\n";
+  os << "  Stack depth analysis: " << us(timings.stack_depth) << " us\n";
+}
+#endif
+
 } // namespace optimise
 } // namespace lox
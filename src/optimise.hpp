@@ -1,22 +1,31 @@
 #pragma once
 #include "chunk.hpp"
-#include <unordered_map>
-#include <unordered_set>
+#include <utility>
 #include <vector>
+#ifdef LOX_TIME
+#include <chrono>
+#include <ostream>
+#endif
 
 namespace lox {
 
+class GC;
+
 namespace optimise {
 
 class ChunkInfo {
 public:
-  /* Map from jump instruction offset to the target instruction offset */
-  std::unordered_map<size_t, size_t> jumps;
-  /* the targets themselves, for quick lookup */
-  std::unordered_set<size_t> jump_targets;
+  /* (jump instruction offset, target instruction offset) pairs, in order of
+   * the jump instruction offset */
+  std::vector<std::pair<size_t, size_t>> jumps;
+  /* One bit per byte of the chunk, set if some jump targets that offset */
+  std::vector<bool> jump_targets;
   /* Collection of all offsets */
   std::vector<size_t> instruction_offsets;
   ChunkInfo(const Chunk& chunk);
+  ChunkInfo() = default;
+
+  bool is_jump_target(size_t offset) const { return jump_targets[offset]; }
 };
 
 class PeepholeOptimisation {
@@ -34,42 +43,145 @@ public:
 
   // Returns a pair of (number of bytes in old chunk replaced, number of bytes
   // written to new chunk), and also appends the new bytecode to `new_chunk` in
-  // the process.
+  // the process. This may write nothing at all, to remove the instructions.
+  //
+  // If the matched instructions contain a jump, and the new bytecode contains
+  // a jump too, the new one goes to the same place (its offset operand is
+  // patched afterwards). If the new bytecode doesn't contain a jump, the jump
+  // is removed.
   virtual std::pair<size_t, size_t>
   emit(const Chunk& old_chunk, size_t old_offset, Chunk& new_chunk) const = 0;
 
   virtual ~PeepholeOptimisation() = default;
 };
 
-// TODO All this repetition is pretty bad. I think we could do a macro or something.
-class AddLocalConstOptimisation : public PeepholeOptimisation {
+// Fuses the component instructions of a superinstruction (see
+// superinstruction_def.hpp) into one. There is one of these for each entry in
+// SUPERINSTRUCTION_LIST.
+class SuperinstructionOptimisation : public PeepholeOptimisation {
+public:
+  SuperinstructionOptimisation(OpCode opcode, const Superinstruction& super)
+      : opcode(opcode), super(super) {}
+  bool matches(const Chunk& chunk, const ChunkInfo& ci,
+               size_t offset) const override;
+  size_t match_length() const override { return super.n_components; }
+  std::pair<size_t, size_t> emit(const Chunk& old_chunk, size_t old_offset,
+                                 Chunk& new_chunk) const override;
+
+private:
+  OpCode opcode;
+  Superinstruction super;
+};
+// Evaluates an arithmetic or comparison instruction whose operands are both
+// constants (CONSTANT CONSTANT op), e.g. `1 + 2` or `"a" + "b"`. Anything that
+// would be a runtime error is left for the VM to report.
+class FoldBinaryOptimisation : public PeepholeOptimisation {
+public:
+  // Concatenating strings needs to intern the result.
+  FoldBinaryOptimisation(GC& gc) : gc(gc) {}
+  bool matches(const Chunk& chunk, const ChunkInfo& ci,
+               size_t offset) const override;
+  size_t match_length() const override { return 3; }
+  std::pair<size_t, size_t> emit(const Chunk& old_chunk, size_t old_offset,
+                                 Chunk& new_chunk) const override;
+
+private:
+  GC& gc;
+};
+// Same, for NEGATE and NOT (CONSTANT op).
+class FoldUnaryOptimisation : public PeepholeOptimisation {
+public:
+  bool matches(const Chunk& chunk, const ChunkInfo& ci,
+               size_t offset) const override;
+  size_t match_length() const override { return 2; }
+  std::pair<size_t, size_t> emit(const Chunk& old_chunk, size_t old_offset,
+                                 Chunk& new_chunk) const override;
+};
+// A conditional jump on a constant (CONSTANT JUMP_IF_FALSE) either always or
+// never jumps, so it becomes an unconditional JUMP or disappears. Either way,
+// the constant stays on the stack for the POP that follows the jump or is at
+// its target.
+class FoldConstantJumpOptimisation : public PeepholeOptimisation {
 public:
-  bool matches(const Chunk& chunk, const ChunkInfo&,
+  bool matches(const Chunk& chunk, const ChunkInfo& ci,
                size_t offset) const override;
-  size_t match_length() const override;
+  size_t match_length() const override { return 2; }
   std::pair<size_t, size_t> emit(const Chunk& old_chunk, size_t old_offset,
                                  Chunk& new_chunk) const override;
 };
-class LocalConstLessOptimisation : public PeepholeOptimisation {
+// Removes a constant that is popped straight away (CONSTANT POP).
+class RemoveConstantPopOptimisation : public PeepholeOptimisation {
 public:
-  bool matches(const Chunk& chunk, const ChunkInfo&,
+  bool matches(const Chunk& chunk, const ChunkInfo& ci,
                size_t offset) const override;
-  size_t match_length() const override;
+  size_t match_length() const override { return 2; }
   std::pair<size_t, size_t> emit(const Chunk& old_chunk, size_t old_offset,
                                  Chunk& new_chunk) const override;
 };
-class FoldConstantNumAddOptimisation : public PeepholeOptimisation {
+// Removes a JUMP to the instruction straight after it (which is what
+// `if (false)` turns into once its body has been removed).
+class RemoveJumpToNextOptimisation : public PeepholeOptimisation {
 public:
-  bool matches(const Chunk& chunk, const ChunkInfo&,
+  bool matches(const Chunk& chunk, const ChunkInfo& ci,
                size_t offset) const override;
-  size_t match_length() const override;
+  size_t match_length() const override { return 1; }
   std::pair<size_t, size_t> emit(const Chunk& old_chunk, size_t old_offset,
                                  Chunk& new_chunk) const override;
 };
 
 size_t next_instruction(const Chunk& chunk, size_t offset);
 
-Chunk peephole_optimise(const Chunk& chunk);
+// Whether `instruction` is one of the (conditional or unconditional, short or
+// long) jumps, or a superinstruction that contains one.
+bool is_jump(OpCode instruction);
+// Whether execution can carry on to the next instruction after `instruction`
+// (i.e. it isn't an unconditional jump or a return).
+bool falls_through(OpCode instruction);
+// The offset of the operand of the jump instruction at `offset`.
+size_t jump_operand_offset(const Chunk& chunk, size_t offset);
+// The offset that the jump instruction at `offset` jumps to.
+ptrdiff_t jump_target(const Chunk& chunk, size_t offset);
+
+// The stack effect of an ordinary (or quickened) instruction, i.e. not WIDE
+// or a superinstruction, whose operands start at `operands`.
+ptrdiff_t simple_stack_effect(OpCode instruction, const Chunk& chunk,
+                              size_t operands);
+// The net change in stack size caused by executing the instruction at
+// `offset`.
+ptrdiff_t stack_effect(const Chunk& chunk, size_t offset);
+// For a jump instruction, the change in stack size if the jump is taken. This
+// is only different from stack_effect for superinstructions that do more work
+// after a conditional jump (e.g. JUMP_IF_FALSE_POP).
+ptrdiff_t jump_stack_effect(const Chunk& chunk, size_t offset);
+
+// The maximum stack depth reached by any path through `chunk`, given that the
+// stack starts off with `initial_depth` values in the current frame.
+size_t max_stack_depth(const Chunk& chunk, size_t initial_depth);
+
+// Applies the peephole optimisations until none of them match any more. This
+// also removes unreachable code, and then removes unused and duplicate entries
+// from the constant table. Folding string constants allocates, so this needs
+// the GC.
+Chunk peephole_optimise(const Chunk& chunk, GC& gc);
+
+#ifdef LOX_TIME
+// Total time spent in each part of the optimiser, over every function compiled
+// so far.
+struct PassTimings {
+  // Building ChunkInfo for the compiler's output.
+  std::chrono::nanoseconds analyse{0};
+  // Finding where the peephole optimisations match.
+  std::chrono::nanoseconds match{0};
+  // Rebuilding chunks with the optimisations applied.
+  std::chrono::nanoseconds rewrite{0};
+  // max_stack_depth.
+  std::chrono::nanoseconds stack_depth{0};
+  // Number of times a chunk was rebuilt.
+  size_t rewrites = 0;
+};
+PassTimings& pass_timings();
+void report_pass_timings(std::ostream& os);
+#endif
 
 } // namespace optimise
 } // namespace lox
@@ -0,0 +1,68 @@
+#include "output.hpp"
+#include "value_def.hpp"
+#include <charconv>
+#include <iterator>
+
+namespace lox {
+
+void OutputBuffer::flush() {
+  if (buffer.empty()) {
+    return;
+  }
+  out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+  out.flush();
+  buffer.clear();
+}
+
+void OutputBuffer::write_value(Value value) {
+  if (is_nil(value)) {
+    buffer += "nil";
+  } else if (is_bool(value)) {
+    buffer += as_bool(value) ? "true" : "false";
+  } else if (is_double(value)) {
+    write_number(as_double(value));
+  } else {
+    write_obj(as_obj(value));
+  }
+}
+
+void OutputBuffer::write_number(double number) {
+  // Six significant digits, the same as the default formatting of a double
+  // on an ostream (i.e. printf's %g).
+  char digits[32];
+  auto [end, ec] = std::to_chars(std::begin(digits), std::end(digits), number,
+                                 std::chars_format::general, 6);
+  buffer.append(digits, end);
+}
+
+void OutputBuffer::write_obj(const Obj* obj) {
+  // These must match the objects' to_repr(). Only the types that scripts
+  // actually print a lot of are handled here.
+  switch (obj->type) {
+  case ObjType::STRING:
+    buffer += '"';
+    buffer += static_cast<const ObjString*>(obj)->value;
+    buffer += '"';
+    break;
+  case ObjType::ROPE:
+    buffer += '"';
+    buffer += static_cast<const ObjRope*>(obj)->flatten();
+    buffer += '"';
+    break;
+  case ObjType::INSTANCE:
+    buffer += "<instance of <class ";
+    buffer += static_cast<const ObjInstance*>(obj)->klass->name->value;
+    buffer += ">>";
+    break;
+  case ObjType::CLOSURE:
+    buffer += "<clos ";
+    buffer += static_cast<const ObjClosure*>(obj)->function->name->value;
+    buffer += '>';
+    break;
+  default:
+    buffer += obj->to_repr();
+    break;
+  }
+}
+
+} // namespace lox
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "value.hpp"
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace lox {
+
+// Where PRINT writes to. Values are formatted straight into a buffer (numbers
+// with std::to_chars, and objects without building a temporary std::string
+// with to_repr() first), which is written to the underlying stream in large
+// chunks. For scripts that print a lot, that's much cheaper than doing
+// `std::cout << value << "\n"` for every print.
+//
+// The buffer is only ever flushed at the end of a line, so output from VMs
+// running on different threads (see isolate.hpp) can't be interleaved in the
+// middle of a line.
+class OutputBuffer {
+public:
+  enum class Mode {
+    // Flush when the buffer fills up (and when flush() is called).
+    BLOCK,
+    // Flush after every line, for interactive use.
+    LINE,
+  };
+  // How much output to collect before flushing it in BLOCK mode.
+  static constexpr size_t FLUSH_THRESHOLD = 64 * 1024;
+
+  explicit OutputBuffer(std::ostream& out, Mode mode = Mode::BLOCK)
+      : out(out), mode(mode) {
+    buffer.reserve(FLUSH_THRESHOLD + 256);
+  }
+  ~OutputBuffer() { flush(); }
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+  void set_mode(Mode new_mode) {
+    mode = new_mode;
+    if (mode == Mode::LINE) {
+      flush();
+    }
+  }
+
+  // Print `value` followed by a newline (this is what PRINT does).
+  void print_line(Value value) {
+    write_value(value);
+    buffer += '\n';
+    if (mode == Mode::LINE || buffer.size() >= FLUSH_THRESHOLD) {
+      flush();
+    }
+  }
+
+  // Write everything that's been buffered to the underlying stream.
+  void flush();
+
+private:
+  std::ostream& out;
+  Mode mode;
+  std::string buffer;
+
+  // Same format as operator<< on Value.
+  void write_value(Value value);
+  void write_number(double number);
+  void write_obj(const Obj* obj);
+};
+
+} // namespace lox
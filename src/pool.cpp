@@ -0,0 +1,131 @@
+#include "pool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+namespace lox {
+
+Pool::Pool(size_t block_size) {
+  // Every block has to be able to hold a FreeBlock, and has to be suitably
+  // aligned for whatever we put in it.
+  constexpr size_t align = alignof(std::max_align_t);
+  block_size = std::max(block_size, sizeof(FreeBlock));
+  block_size_ = (block_size + align - 1) / align * align;
+  blocks_per_page = (PAGE_SIZE - sizeof(PageHeader)) / block_size_;
+  if (blocks_per_page == 0) {
+    throw std::runtime_error("loxc: Pool: block size too large");
+  }
+}
+
+Pool::~Pool() { free_pages(); }
+
+Pool::Pool(Pool&& other) noexcept
+    : block_size_(other.block_size_), blocks_per_page(other.blocks_per_page),
+      free_list(std::exchange(other.free_list, nullptr)),
+      pages(std::move(other.pages)) {
+  other.pages.clear();
+}
+
+Pool& Pool::operator=(Pool&& other) noexcept {
+  if (this != &other) {
+    free_pages();
+    block_size_ = other.block_size_;
+    blocks_per_page = other.blocks_per_page;
+    free_list = std::exchange(other.free_list, nullptr);
+    pages = std::move(other.pages);
+    other.pages.clear();
+  }
+  return *this;
+}
+
+void Pool::free_pages() {
+  for (PageHeader* page : pages) {
+    ::operator delete(page, std::align_val_t{PAGE_SIZE});
+  }
+  pages.clear();
+  free_list = nullptr;
+}
+
+Pool::PageHeader* Pool::page_of(void* block) {
+  auto address = reinterpret_cast<std::uintptr_t>(block);
+  return reinterpret_cast<PageHeader*>(address & ~(PAGE_SIZE - 1));
+}
+
+void Pool::add_page() {
+  void* memory = ::operator new(PAGE_SIZE, std::align_val_t{PAGE_SIZE});
+  PageHeader* page = new (memory) PageHeader{0};
+  pages.push_back(page);
+  // Thread all the blocks in the new page onto the free list. We go
+  // backwards so that the blocks get handed out in address order.
+  char* first_block = static_cast<char*>(memory) + sizeof(PageHeader);
+  for (size_t i = blocks_per_page; i-- > 0;) {
+    auto block = reinterpret_cast<FreeBlock*>(first_block + i * block_size_);
+    block->next = free_list;
+    free_list = block;
+  }
+}
+
+void* Pool::allocate() {
+  if (free_list == nullptr) {
+    add_page();
+  }
+  FreeBlock* block = free_list;
+  free_list = block->next;
+  page_of(block)->live_blocks++;
+  return block;
+}
+
+void Pool::deallocate(void* block) {
+#ifdef LOX_GC_DEBUG
+  // Make use-after-free bugs more obvious.
+  std::memset(block, 0xdd, block_size_);
+#endif
+  page_of(block)->live_blocks--;
+  auto free_block = static_cast<FreeBlock*>(block);
+  free_block->next = free_list;
+  free_list = free_block;
+}
+
+size_t Pool::release_empty_pages(size_t keep) {
+  size_t n_empty = static_cast<size_t>(
+      std::count_if(pages.begin(), pages.end(),
+                    [](PageHeader* page) { return page->live_blocks == 0; }));
+  if (n_empty <= keep) {
+    return 0;
+  }
+  // Decide which empty pages to release. We mark them by setting their live
+  // count to a value that can't otherwise occur.
+  constexpr size_t RELEASING = SIZE_MAX;
+  size_t to_release = n_empty - keep;
+  for (PageHeader* page : pages) {
+    if (to_release > 0 && page->live_blocks == 0) {
+      page->live_blocks = RELEASING;
+      to_release--;
+    }
+  }
+  // Unlink their blocks from the free list...
+  FreeBlock** link = &free_list;
+  while (*link != nullptr) {
+    if (page_of(*link)->live_blocks == RELEASING) {
+      *link = (*link)->next;
+    } else {
+      link = &(*link)->next;
+    }
+  }
+  // ...and then free them.
+  size_t released = 0;
+  std::erase_if(pages, [&released](PageHeader* page) {
+    if (page->live_blocks == RELEASING) {
+      ::operator delete(page, std::align_val_t{PAGE_SIZE});
+      released += PAGE_SIZE;
+      return true;
+    }
+    return false;
+  });
+  return released;
+}
+
+} // namespace lox
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+namespace lox {
+
+// Fixed-size block allocator. Memory is requested from the system in
+// PAGE_SIZE pages, each of which is carved up into equally-sized blocks. Freed
+// blocks go onto an intrusive free list, so that allocation and deallocation
+// are just a couple of pointer operations in the common case, and objects of
+// the same type end up packed next to each other in memory.
+//
+// The GC keeps one Pool per ObjType (see GC::alloc).
+class Pool {
+public:
+  static constexpr size_t PAGE_SIZE = 64 * 1024;
+
+  Pool() = default;
+  explicit Pool(size_t block_size);
+  ~Pool();
+
+  // Pools own their pages, so they can't be copied, but they can be moved.
+  Pool(const Pool&) = delete;
+  Pool& operator=(const Pool&) = delete;
+  Pool(Pool&& other) noexcept;
+  Pool& operator=(Pool&& other) noexcept;
+
+  // Returns uninitialised memory for one block.
+  void* allocate();
+  // Returns a block to the pool. The object in it must already have been
+  // destroyed.
+  void deallocate(void* block);
+
+  // Give pages that have no live blocks back to the system allocator, keeping
+  // at most `keep` of them around for future allocations. Returns the number
+  // of bytes released.
+  size_t release_empty_pages(size_t keep = 1);
+
+  size_t block_size() const { return block_size_; }
+  // Total number of bytes held by this pool (including free blocks).
+  size_t reserved_bytes() const { return pages.size() * PAGE_SIZE; }
+
+private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+  // Lives at the start of every page. Because pages are aligned to
+  // PAGE_SIZE, we can find the header for any block by masking its address.
+  struct alignas(std::max_align_t) PageHeader {
+    size_t live_blocks;
+  };
+
+  size_t block_size_ = 0;
+  size_t blocks_per_page = 0;
+  FreeBlock* free_list = nullptr;
+  std::vector<PageHeader*> pages;
+
+  void add_page();
+  static PageHeader* page_of(void* block);
+  void free_pages();
+};
+
+} // namespace lox
@@ -0,0 +1,109 @@
+#include "profiler.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <format>
+#include <vector>
+
+namespace {
+
+double percent(uint64_t part, uint64_t total) {
+  return total == 0 ? 0.0
+                    : 100.0 * static_cast<double>(part) /
+                          static_cast<double>(total);
+}
+
+// Entries of `counts`, most common first (ties broken by key, so that the
+// output doesn't depend on the order of a hash map).
+template <typename Map>
+std::vector<std::pair<typename Map::key_type, uint64_t>>
+sorted_by_count(const Map& counts) {
+  std::vector<std::pair<typename Map::key_type, uint64_t>> entries(
+      counts.begin(), counts.end());
+  std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+    if (a.second != b.second) {
+      return a.second > b.second;
+    }
+    return a.first < b.first;
+  });
+  return entries;
+}
+
+// How many functions and lines to show in the report.
+constexpr size_t REPORT_LIMIT = 20;
+
+} // namespace
+
+namespace lox {
+
+void Profiler::take_sample(const CallFrame* frames, size_t frame_count) {
+  samples++;
+  std::string stack;
+  for (size_t i = 0; i < frame_count; i++) {
+    if (i > 0) {
+      stack += ';';
+    }
+    stack += frames[i].closure->function->name->value;
+  }
+  folded_stacks[stack]++;
+  const CallFrame& innermost = frames[frame_count - 1];
+  const std::string& name = innermost.closure->function->name->value;
+  function_samples[name]++;
+  line_samples[{name, innermost.get_current_debuginfo_line()}]++;
+}
+
+void Profiler::report(std::ostream& out) const {
+  uint64_t total_count = 0;
+  uint64_t total_ticks = 0;
+  std::vector<std::pair<size_t, uint64_t>> opcodes;
+  for (size_t i = 0; i < N_OPCODES; i++) {
+    total_count += opcode_counts[i];
+    total_ticks += opcode_ticks[i];
+    if (opcode_counts[i] > 0) {
+      opcodes.emplace_back(i, opcode_ticks[i]);
+    }
+  }
+  std::sort(opcodes.begin(), opcodes.end(), [](const auto& a, const auto& b) {
+    if (a.second != b.second) {
+      return a.second > b.second;
+    }
+    return a.first < b.first;
+  });
+
+  out << "Instructions executed: " << total_count << "\n";
+  out << std::format("{:<32} {:>12} {:>7} {:>14} {:>7} {:>9}\n", "Instruction",
+                     "count", "%", "ticks", "%", "ticks/op");
+  for (const auto& [i, ticks] : opcodes) {
+    uint64_t count = opcode_counts[i];
+    out << std::format(
+        "{:<32} {:>12} {:>6.2f}% {:>14} {:>6.2f}% {:>9.1f}\n",
+        opcode_name(static_cast<OpCode>(i)), count,
+        percent(count, total_count), ticks, percent(ticks, total_ticks),
+        static_cast<double>(ticks) / static_cast<double>(count));
+  }
+
+  out << "\nSamples: " << samples << " (one every " << sample_interval
+      << " instructions)\n";
+  out << std::format("{:<40} {:>10} {:>7}\n", "Function", "samples", "%");
+  auto functions = sorted_by_count(function_samples);
+  for (size_t i = 0; i < std::min(REPORT_LIMIT, functions.size()); i++) {
+    const auto& [name, count] = functions[i];
+    out << std::format("{:<40} {:>10} {:>6.2f}%\n", name, count,
+                       percent(count, samples));
+  }
+  out << std::format("\n{:<40} {:>10} {:>7}\n", "Line", "samples", "%");
+  auto lines = sorted_by_count(line_samples);
+  for (size_t i = 0; i < std::min(REPORT_LIMIT, lines.size()); i++) {
+    const auto& [key, count] = lines[i];
+    out << std::format("{:<40} {:>10} {:>6.2f}%\n",
+                       std::format("{}:{}", key.first, key.second), count,
+                       percent(count, samples));
+  }
+}
+
+void Profiler::write_folded_stacks(std::ostream& out) const {
+  for (const auto& [stack, count] : sorted_by_count(folded_stacks)) {
+    out << stack << " " << count << "\n";
+  }
+}
+
+} // namespace lox
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "chunk.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace lox {
+
+class CallFrame;
+
+// A cheap, monotonic cycle counter (or the nearest thing to one).
+inline uint64_t read_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return static_cast<uint64_t>(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+// The profiler behind `--profile`. Unlike OpcodeProfile, this doesn't need a
+// special build: if the VM has a Profiler, VM::run dispatches every
+// instruction through a table that sends it here first, and if it doesn't,
+// the normal dispatch path is untouched.
+//
+// It collects:
+// - how many times each instruction (or superinstruction) was executed, and
+//   how many cycle counter ticks passed between it being dispatched and the
+//   next instruction being dispatched. That includes whatever the instruction
+//   caused to happen, like calling a native function or running the GC.
+// - a sample of the call stack every `sample_interval` instructions, which
+//   gives the number of samples in each function and on each line, and the
+//   stacks in the "folded" format that flame graph tools read (one line per
+//   distinct stack, e.g. `#toplevel#;fib;fib 42`).
+class Profiler {
+public:
+  static constexpr uint64_t DEFAULT_SAMPLE_INTERVAL = 1000;
+
+  explicit Profiler(uint64_t sample_interval = DEFAULT_SAMPLE_INTERVAL)
+      : sample_interval(sample_interval), until_sample(sample_interval),
+        last_ticks(read_ticks()) {}
+
+  // Called just before each instruction runs. `frames` are the active call
+  // frames, outermost first; the ip of the innermost one must be up to date.
+  void record(OpCode opcode, const CallFrame* frames, size_t frame_count) {
+    uint64_t now = read_ticks();
+    size_t index = static_cast<size_t>(opcode);
+    opcode_ticks[last_opcode] += now - last_ticks;
+    opcode_counts[index]++;
+    last_opcode = index;
+    if (--until_sample == 0) {
+      until_sample = sample_interval;
+      take_sample(frames, frame_count);
+      // Don't charge the sampling to the instruction.
+      now = read_ticks();
+    }
+    last_ticks = now;
+  }
+
+  // Per-instruction, per-function and per-line tables.
+  void report(std::ostream& out) const;
+  // The sampled stacks, in folded format.
+  void write_folded_stacks(std::ostream& out) const;
+
+private:
+  static constexpr size_t N_OPCODES = 256;
+  // Ticks are charged to the previous instruction, and before the first one
+  // there isn't one, so they go here instead (and are never reported).
+  static constexpr size_t NO_OPCODE = N_OPCODES;
+
+  void take_sample(const CallFrame* frames, size_t frame_count);
+
+  uint64_t sample_interval;
+  uint64_t until_sample;
+  uint64_t last_ticks;
+  size_t last_opcode = NO_OPCODE;
+  std::array<uint64_t, N_OPCODES> opcode_counts{};
+  std::array<uint64_t, N_OPCODES + 1> opcode_ticks{};
+  uint64_t samples = 0;
+  // Keyed by function name, so functions with the same name (e.g. two classes'
+  // `init` methods) are counted together.
+  std::unordered_map<std::string, uint64_t> function_samples;
+  std::map<std::pair<std::string, size_t>, uint64_t> line_samples;
+  std::unordered_map<std::string, uint64_t> folded_stacks;
+};
+
+} // namespace lox
@@ -0,0 +1,24 @@
+#pragma once
+
+// Quickened instructions are versions of ordinary instructions that are
+// specialised to the types of their operands. The compiler never emits them:
+// instead, the first time the VM runs a generic instruction that has
+// quickened forms, it looks at the operands and rewrites the opcode in the
+// chunk to the matching quickened one. The quickened handler only has to
+// check that its guess still holds (one type check per operand), and if it
+// doesn't, it rewrites the opcode back to the generic one and runs that
+// instead, which may then quicken it again differently.
+//
+// Each entry is Q(NAME, GENERIC). A quickened instruction has exactly the
+// same operands as GENERIC, so the two can be swapped in place.
+//
+// Only instructions whose operands can have more than one type are worth
+// quickening: e.g. LESS can only ever compare two numbers, so the generic
+// handler is already as specialised as it gets.
+//
+// NOTE: Superinstructions (see superinstruction_def.hpp) are never quickened,
+// and when one of them ends with a generic instruction it runs the generic
+// handler without rewriting anything.
+#define QUICKENED_LIST(Q)                                                      \
+  Q(ADD_NUM, ADD)                                                              \
+  Q(EQUAL_NUM, EQUAL)
@@ -0,0 +1,719 @@
+#include "register_code.hpp"
+#include "optimise.hpp"
+#include "value.hpp"
+#include <algorithm>
+#include <format>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+namespace lox {
+
+std::string_view register_op_name(RegisterOp op) {
+  switch (op) {
+#define REGISTER_OP_NAME(name, operands)                                       \
+  case RegisterOp::name:                                                       \
+    return #name;
+    REGISTER_OP_LIST(REGISTER_OP_NAME)
+#undef REGISTER_OP_NAME
+  }
+  return "UNKNOWN";
+}
+
+namespace {
+std::string_view register_op_operands(RegisterOp op) {
+  switch (op) {
+#define REGISTER_OP_OPERANDS(name, operands)                                   \
+  case RegisterOp::name:                                                       \
+    return operands;
+    REGISTER_OP_LIST(REGISTER_OP_OPERANDS)
+#undef REGISTER_OP_OPERANDS
+  }
+  return "";
+}
+} // namespace
+
+size_t RegisterCode::bytecode_offset(const uint8_t* ip) const {
+  auto offset = static_cast<size_t>(ip - code.data());
+  if (offset == 0) {
+    return 0;
+  }
+  // The last register instruction that starts at or before offset - 1.
+  auto it = std::upper_bound(
+      source_offsets.begin(), source_offsets.end(), offset - 1,
+      [](size_t value, const auto& entry) { return value < entry.first; });
+  return it == source_offsets.begin() ? 0 : std::prev(it)->second;
+}
+
+uint8_t* RegisterCode::loop_entry(size_t bytecode_offset) {
+  auto it = std::lower_bound(
+      entries.begin(), entries.end(), bytecode_offset,
+      [](const auto& entry, size_t value) { return entry.first < value; });
+  if (it == entries.end() || it->first != bytecode_offset) {
+    return nullptr;
+  }
+  return code.data() + it->second;
+}
+
+size_t RegisterCode::disassemble(std::ostream& os, size_t offset,
+                                 const Chunk& chunk,
+                                 std::string_view fn_name) const {
+  os << std::format("{} r{:04} ", fn_name, offset);
+  uint8_t byte = code.at(offset);
+  if (byte < N_OPCODES) {
+    // Part of the bytecode instruction after a STACK.
+    os << "(bytecode) " << opcode_name(static_cast<OpCode>(byte)) << "\n";
+    return offset + 1;
+  }
+  auto op = static_cast<RegisterOp>(byte - N_OPCODES);
+  os << register_op_name(op);
+  size_t pos = offset + 1;
+  for (char operand : register_op_operands(op)) {
+    uint8_t value = code.at(pos++);
+    switch (operand) {
+    case 'r':
+      os << " r" << +value;
+      break;
+    case 'k':
+      os << " #" << +value << " val=" << chunk.constant_at(value);
+      break;
+    case 'g':
+      os << " global=" << +value;
+      break;
+    case 'u':
+      os << " upvalue=" << +value;
+      break;
+    case 'd':
+      os << " depth=" << +value;
+      break;
+    case 'n':
+      os << " nargs=" << +value;
+      break;
+    case 'c':
+      os << " cache=" << +value;
+      break;
+    case 'l':
+      // The bytecode instruction itself is disassembled when it runs.
+      os << " " << opcode_name(static_cast<OpCode>(code.at(pos)));
+      pos += value;
+      break;
+    case 'j': {
+      ptrdiff_t jump = get_jump_offset(value, code.at(pos++));
+      os << std::format(" -> r{:04}", static_cast<ptrdiff_t>(pos) + jump);
+      break;
+    }
+    }
+  }
+  os << "\n";
+  return pos;
+}
+
+// Does the actual work of compile_register_code.
+class RegisterTranslator {
+public:
+  explicit RegisterTranslator(ObjFunction& function)
+      : function(function), chunk(function.chunk),
+        result(std::make_unique<RegisterCode>()) {}
+  std::unique_ptr<RegisterCode> translate();
+
+private:
+  static constexpr size_t NONE = std::numeric_limits<size_t>::max();
+
+  // The bytecode, with superinstructions split up into their components (so
+  // that each of these only does one thing), and quickened instructions
+  // turned back into the generic ones.
+  struct Instruction {
+    OpCode op;
+    // The whole bytecode instruction that this is (part of).
+    size_t start;
+    size_t end;
+    // Where this instruction's own operands start.
+    size_t operands;
+    // Whether this is the start of the bytecode instruction, i.e. the
+    // instruction itself or the first component of a superinstruction.
+    bool first;
+    // Whether this is a component of a superinstruction.
+    bool component;
+    bool wide;
+    // For jumps, the index of the instruction that it jumps to.
+    size_t target = NONE;
+  };
+  // What a stack slot holds, as far as the bytecode is concerned. Only
+  // MATERIALIZED slots actually hold that value in the frame: the others are
+  // written when something needs them to be (see flush_slot).
+  struct Slot {
+    enum class Kind { MATERIALIZED, COPY, CONSTANT };
+    Kind kind = Kind::MATERIALIZED;
+    // The slot that it's a copy of (which is always MATERIALIZED), or the
+    // constant index.
+    uint8_t index = 0;
+  };
+
+  ObjFunction& function;
+  Chunk& chunk;
+  std::unique_ptr<RegisterCode> result;
+  std::vector<Instruction> instructions;
+  // The stack depth before each instruction, or -1 if it's unreachable.
+  std::vector<ptrdiff_t> depth_at;
+  // Which instructions are jumped to, and where their register code starts.
+  std::vector<bool> is_label;
+  std::vector<size_t> label_offset;
+  // Comparisons that are fused with the JUMP_IF_FALSE and POP after them.
+  std::vector<bool> fused;
+  // (offset of the jump operand, end of the jump instruction, target
+  // instruction) for every jump, to be filled in at the end.
+  struct Patch {
+    size_t operand;
+    size_t end;
+    size_t target;
+  };
+  std::vector<Patch> patches;
+  std::vector<Slot> slots;
+  // The instruction being translated.
+  size_t current = 0;
+  // If the last register instruction only wrote to a slot that was on top of
+  // the stack, where its destination operand is, and which slot that was (see
+  // set_local).
+  size_t last_dst = NONE;
+  size_t last_dst_slot = NONE;
+
+  void decode();
+  void compute_depths();
+  void find_labels();
+  // Returns false if the instruction can't be translated.
+  bool translate_instruction(size_t index);
+
+  void emit(RegisterOp op) {
+    result->source_offsets.emplace_back(result->code.size(),
+                                        instructions[current].end);
+    result->code.push_back(register_opcode(op));
+    last_dst = NONE;
+  }
+  void emit_byte(size_t byte) {
+    result->code.push_back(static_cast<uint8_t>(byte));
+  }
+  void emit_jump(size_t target) {
+    patches.push_back(
+        Patch{result->code.size(), result->code.size() + 2, target});
+    emit_byte(0);
+    emit_byte(0);
+  }
+  // Write the destination slot of an instruction whose only effect is to
+  // write to it.
+  void emit_dst(size_t slot) {
+    last_dst = slot == top() ? result->code.size() : NONE;
+    last_dst_slot = slot;
+    emit_byte(slot);
+  }
+
+  uint8_t operand(const Instruction& ins, size_t n) const {
+    return chunk.at(ins.operands + n);
+  }
+  size_t depth() const { return slots.size(); }
+  size_t top() const { return slots.size() - 1; }
+  // The register that holds the value of `slot` (which mustn't be a
+  // constant).
+  uint8_t reg(size_t slot) const {
+    return slots[slot].kind == Slot::Kind::COPY ? slots[slot].index
+                                                : static_cast<uint8_t>(slot);
+  }
+  bool is_constant(size_t slot) const {
+    return slots[slot].kind == Slot::Kind::CONSTANT;
+  }
+
+  void flush_slot(size_t slot);
+  // Flush everything apart from the top `keep` slots.
+  void flush_below(size_t keep) {
+    for (size_t slot = 0; slot + keep < depth(); slot++) {
+      flush_slot(slot);
+    }
+  }
+  void flush_all() { flush_below(0); }
+  void set_local(size_t local);
+  void binary(size_t index);
+  // Hand the instruction over to the bytecode interpreter.
+  bool embed(size_t index);
+  void apply_stack_effect(const Instruction& ins);
+};
+
+std::unique_ptr<RegisterCode> RegisterTranslator::translate() {
+  // Registers and depths are one-byte operands.
+  if (function.max_stack_depth > UINT8_MAX) {
+    return nullptr;
+  }
+  decode();
+  compute_depths();
+  find_labels();
+
+  slots.assign(function.arity + 1, Slot{});
+  bool reachable = true;
+  for (size_t i = 0; i < instructions.size(); i++) {
+    current = i;
+    if (depth_at[i] < 0) {
+      reachable = false;
+      continue;
+    }
+    if (is_label[i]) {
+      // Wherever we came from, everything has to be where the bytecode would
+      // have put it.
+      if (reachable) {
+        flush_all();
+      }
+      slots.assign(static_cast<size_t>(depth_at[i]), Slot{});
+      last_dst = NONE;
+      label_offset[i] = result->code.size();
+      if (instructions[i].first) {
+        result->entries.emplace_back(instructions[i].start,
+                                     result->code.size());
+      }
+    }
+    if (depth() != static_cast<size_t>(depth_at[i])) {
+      throw std::runtime_error("loxc: compile_register_code: stack depth "
+                               "mismatch at offset " +
+                               std::to_string(instructions[i].start));
+    }
+    if (!translate_instruction(i)) {
+      return nullptr;
+    }
+    reachable = optimise::falls_through(instructions[i].op);
+    if (fused[i]) {
+      // The JUMP_IF_FALSE and POP are done too.
+      i += 2;
+    }
+  }
+
+  for (const Patch& patch : patches) {
+    auto offset = static_cast<ptrdiff_t>(label_offset[patch.target]) -
+                  static_cast<ptrdiff_t>(patch.end);
+    if (offset < INT16_MIN || offset > INT16_MAX) {
+      return nullptr;
+    }
+    auto [high, low] = split_jump_offset(static_cast<int16_t>(offset));
+    result->code[patch.operand] = high;
+    result->code[patch.operand + 1] = low;
+  }
+  result->code.shrink_to_fit();
+  result->source_offsets.shrink_to_fit();
+  result->entries.shrink_to_fit();
+  return std::move(result);
+}
+
+void RegisterTranslator::decode() {
+  std::vector<size_t> first_at(chunk.size() + 1, NONE);
+  std::vector<std::pair<size_t, size_t>> jumps;
+  size_t offset = 0;
+  while (offset < chunk.size()) {
+    auto op = static_cast<OpCode>(chunk.at(offset));
+    size_t end = optimise::next_instruction(chunk, offset);
+    first_at[offset] = instructions.size();
+    if (op == OpCode::WIDE) {
+      instructions.push_back(Instruction{static_cast<OpCode>(chunk.at(offset + 1)),
+                                         offset, end, offset + 2, true, false,
+                                         true});
+    } else if (const Superinstruction* super = find_superinstruction(op)) {
+      size_t operands = offset + 1;
+      for (size_t i = 0; i < super->n_components; i++) {
+        OpCode component = super->components[i];
+        if (optimise::is_jump(component)) {
+          jumps.emplace_back(instructions.size(),
+                             static_cast<size_t>(
+                                 optimise::jump_target(chunk, offset)));
+        }
+        instructions.push_back(
+            Instruction{component, offset, end, operands, i == 0, true, false});
+        operands += instruction_length(component) - 1;
+      }
+    } else {
+      if (optimise::is_jump(op)) {
+        jumps.emplace_back(
+            instructions.size(),
+            static_cast<size_t>(optimise::jump_target(chunk, offset)));
+      }
+      instructions.push_back(Instruction{generic_opcode(op), offset, end,
+                                         offset + 1, true, false, false});
+    }
+    offset = end;
+  }
+  for (auto [index, target] : jumps) {
+    instructions[index].target = first_at[target];
+  }
+}
+
+void RegisterTranslator::compute_depths() {
+  // Same as optimise::max_stack_depth, but for each instruction.
+  depth_at.assign(instructions.size(), -1);
+  std::vector<std::pair<size_t, ptrdiff_t>> worklist;
+  worklist.emplace_back(0, static_cast<ptrdiff_t>(function.arity + 1));
+  while (!worklist.empty()) {
+    auto [i, depth] = worklist.back();
+    worklist.pop_back();
+    while (i < instructions.size() && depth_at[i] < 0) {
+      depth_at[i] = depth;
+      const Instruction& ins = instructions[i];
+      ptrdiff_t effect =
+          ins.wide ? optimise::stack_effect(chunk, ins.start)
+                   : optimise::simple_stack_effect(ins.op, chunk, ins.operands);
+      depth += effect;
+      if (ins.target != NONE) {
+        worklist.emplace_back(ins.target, depth);
+      }
+      if (!optimise::falls_through(ins.op)) {
+        break;
+      }
+      i++;
+    }
+  }
+}
+
+void RegisterTranslator::find_labels() {
+  size_t n = instructions.size();
+  is_label.assign(n, false);
+  label_offset.assign(n, NONE);
+  fused.assign(n, false);
+  for (const Instruction& ins : instructions) {
+    if (ins.target != NONE) {
+      is_label[ins.target] = true;
+    }
+  }
+  // A comparison that only decides a jump, as in `if (a < b)`, can jump
+  // straight past the POP that the bytecode does at the jump target. That's
+  // only possible when nothing else jumps into the middle of it.
+  for (size_t i = 0; i + 2 < n; i++) {
+    OpCode op = instructions[i].op;
+    if ((op != OpCode::LESS && op != OpCode::GREATER && op != OpCode::EQUAL) ||
+        instructions[i].wide || depth_at[i] < 0 ||
+        instructions[i + 1].op != OpCode::JUMP_IF_FALSE ||
+        instructions[i + 2].op != OpCode::POP || is_label[i + 1] ||
+        is_label[i + 2]) {
+      continue;
+    }
+    size_t target = instructions[i + 1].target;
+    if (instructions[target].op != OpCode::POP || target + 1 >= n) {
+      continue;
+    }
+    fused[i] = true;
+    is_label[target + 1] = true;
+  }
+}
+
+void RegisterTranslator::flush_slot(size_t slot) {
+  Slot& s = slots[slot];
+  if (s.kind == Slot::Kind::COPY) {
+    emit(RegisterOp::MOVE);
+  } else if (s.kind == Slot::Kind::CONSTANT) {
+    emit(RegisterOp::LOAD_CONSTANT);
+  } else {
+    return;
+  }
+  emit_dst(slot);
+  emit_byte(s.index);
+  s = Slot{};
+}
+
+void RegisterTranslator::set_local(size_t local) {
+  if (local == top()) {
+    flush_slot(local);
+    return;
+  }
+  Slot value = slots[top()];
+  if (value.kind == Slot::Kind::COPY && value.index == local) {
+    return;
+  }
+  // Anything that still refers to the old value needs its own copy.
+  bool copied = false;
+  for (size_t slot = local + 1; slot < top(); slot++) {
+    if (slots[slot].kind == Slot::Kind::COPY && slots[slot].index == local) {
+      flush_slot(slot);
+      copied = true;
+    }
+  }
+  if (!copied && value.kind == Slot::Kind::MATERIALIZED && last_dst != NONE &&
+      last_dst_slot == top()) {
+    // The value was only just computed, so compute it straight into the
+    // local instead.
+    result->code[last_dst] = static_cast<uint8_t>(local);
+    slots[top()] = Slot{Slot::Kind::COPY, static_cast<uint8_t>(local)};
+  } else if (value.kind == Slot::Kind::CONSTANT) {
+    emit(RegisterOp::LOAD_CONSTANT);
+    emit_byte(local);
+    emit_byte(value.index);
+  } else {
+    emit(RegisterOp::MOVE);
+    emit_byte(local);
+    emit_byte(reg(top()));
+  }
+  slots[local] = Slot{};
+  last_dst = NONE;
+}
+
+void RegisterTranslator::binary(size_t index) {
+  const Instruction& ins = instructions[index];
+  OpCode op = ins.op;
+  size_t a = top() - 1;
+  size_t b = top();
+  if (is_constant(a)) {
+    if (is_constant(b)) {
+      flush_slot(b);
+    }
+    // Swap the operands if that doesn't change the result. (ADD can't be
+    // swapped, since it concatenates strings.)
+    if (op == OpCode::MULTIPLY || op == OpCode::EQUAL || op == OpCode::LESS ||
+        op == OpCode::GREATER) {
+      std::swap(a, b);
+      if (op == OpCode::LESS) {
+        op = OpCode::GREATER;
+      } else if (op == OpCode::GREATER) {
+        op = OpCode::LESS;
+      }
+    } else {
+      flush_slot(a);
+    }
+  }
+  bool constant = is_constant(b);
+
+  if (fused[index]) {
+    // Jump if the comparison is false.
+    flush_below(2);
+    RegisterOp jump_op;
+    if (op == OpCode::LESS) {
+      jump_op = constant ? RegisterOp::JUMP_IF_NOT_LESS_CONSTANT
+                         : RegisterOp::JUMP_IF_NOT_LESS;
+    } else if (op == OpCode::GREATER) {
+      jump_op = constant ? RegisterOp::JUMP_IF_NOT_GREATER_CONSTANT
+                         : RegisterOp::JUMP_IF_NOT_GREATER;
+    } else {
+      jump_op = constant ? RegisterOp::JUMP_IF_NOT_EQUAL_CONSTANT
+                         : RegisterOp::JUMP_IF_NOT_EQUAL;
+    }
+    emit(jump_op);
+    emit_byte(reg(a));
+    emit_byte(constant ? slots[b].index : reg(b));
+    emit_jump(instructions[index + 1].target + 1);
+    slots.resize(depth() - 2);
+    return;
+  }
+
+  RegisterOp register_op;
+  switch (op) {
+  case OpCode::ADD:
+    // Concatenating strings allocates, so everything below the operands has
+    // to be on the stack for the GC to see.
+    flush_below(2);
+    register_op = constant ? RegisterOp::ADD_CONSTANT : RegisterOp::ADD;
+    break;
+  case OpCode::SUBTRACT:
+    register_op =
+        constant ? RegisterOp::SUBTRACT_CONSTANT : RegisterOp::SUBTRACT;
+    break;
+  case OpCode::MULTIPLY:
+    register_op =
+        constant ? RegisterOp::MULTIPLY_CONSTANT : RegisterOp::MULTIPLY;
+    break;
+  case OpCode::DIVIDE:
+    register_op = constant ? RegisterOp::DIVIDE_CONSTANT : RegisterOp::DIVIDE;
+    break;
+  case OpCode::LESS:
+    register_op = constant ? RegisterOp::LESS_CONSTANT : RegisterOp::LESS;
+    break;
+  case OpCode::GREATER:
+    register_op = constant ? RegisterOp::GREATER_CONSTANT : RegisterOp::GREATER;
+    break;
+  default:
+    register_op = constant ? RegisterOp::EQUAL_CONSTANT : RegisterOp::EQUAL;
+    break;
+  }
+  size_t operand_depth = depth();
+  uint8_t a_reg = reg(a);
+  uint8_t b_operand = constant ? slots[b].index : reg(b);
+  slots.pop_back();
+  slots.back() = Slot{};
+  emit(register_op);
+  emit_dst(top());
+  emit_byte(a_reg);
+  emit_byte(b_operand);
+  if (op == OpCode::ADD) {
+    emit_byte(operand_depth);
+  }
+}
+
+bool RegisterTranslator::embed(size_t index) {
+  const Instruction& ins = instructions[index];
+  flush_all();
+  std::vector<uint8_t> bytes;
+  if (ins.component) {
+    bytes.push_back(static_cast<uint8_t>(ins.op));
+    for (size_t i = 0; i + 1 < instruction_length(ins.op); i++) {
+      bytes.push_back(operand(ins, i));
+    }
+  } else {
+    for (size_t offset = ins.start; offset < ins.end; offset++) {
+      bytes.push_back(chunk.at(offset));
+    }
+  }
+  if (bytes.size() > UINT8_MAX) {
+    return false;
+  }
+  emit(RegisterOp::STACK);
+  emit_byte(depth());
+  emit_byte(bytes.size());
+  result->code.insert(result->code.end(), bytes.begin(), bytes.end());
+  apply_stack_effect(ins);
+  return true;
+}
+
+void RegisterTranslator::apply_stack_effect(const Instruction& ins) {
+  ptrdiff_t effect =
+      ins.wide ? optimise::stack_effect(chunk, ins.start)
+               : optimise::simple_stack_effect(ins.op, chunk, ins.operands);
+  slots.resize(static_cast<size_t>(static_cast<ptrdiff_t>(depth()) + effect));
+}
+
+bool RegisterTranslator::translate_instruction(size_t index) {
+  const Instruction& ins = instructions[index];
+  if (ins.wide) {
+    // Wide operands don't fit in the register instructions.
+    return embed(index);
+  }
+  switch (ins.op) {
+  case OpCode::CONSTANT:
+    slots.push_back(Slot{Slot::Kind::CONSTANT, operand(ins, 0)});
+    return true;
+  case OpCode::GET_LOCAL: {
+    uint8_t local = operand(ins, 0);
+    if (local >= depth()) {
+      return false;
+    }
+    Slot copy = slots[local];
+    if (copy.kind == Slot::Kind::MATERIALIZED) {
+      copy = Slot{Slot::Kind::COPY, local};
+    }
+    slots.push_back(copy);
+    return true;
+  }
+  case OpCode::SET_LOCAL: {
+    uint8_t local = operand(ins, 0);
+    if (local >= depth()) {
+      return false;
+    }
+    set_local(local);
+    return true;
+  }
+  case OpCode::POP:
+    slots.pop_back();
+    return true;
+
+  case OpCode::GET_GLOBAL_SLOT:
+  case OpCode::GET_UPVALUE:
+    slots.push_back(Slot{});
+    emit(ins.op == OpCode::GET_GLOBAL_SLOT ? RegisterOp::GET_GLOBAL
+                                           : RegisterOp::GET_UPVALUE);
+    emit_dst(top());
+    emit_byte(operand(ins, 0));
+    return true;
+  case OpCode::SET_GLOBAL_SLOT:
+  case OpCode::SET_UPVALUE:
+    if (is_constant(top())) {
+      flush_slot(top());
+    }
+    emit(ins.op == OpCode::SET_GLOBAL_SLOT ? RegisterOp::SET_GLOBAL
+                                           : RegisterOp::SET_UPVALUE);
+    emit_byte(operand(ins, 0));
+    emit_byte(reg(top()));
+    return true;
+
+  case OpCode::ADD:
+  case OpCode::SUBTRACT:
+  case OpCode::MULTIPLY:
+  case OpCode::DIVIDE:
+  case OpCode::LESS:
+  case OpCode::GREATER:
+  case OpCode::EQUAL:
+    binary(index);
+    return true;
+  case OpCode::NEGATE:
+  case OpCode::NOT: {
+    if (is_constant(top())) {
+      flush_slot(top());
+    }
+    uint8_t source = reg(top());
+    slots.back() = Slot{};
+    emit(ins.op == OpCode::NEGATE ? RegisterOp::NEGATE : RegisterOp::NOT);
+    emit_dst(top());
+    emit_byte(source);
+    return true;
+  }
+
+  case OpCode::JUMP:
+  case OpCode::JUMP_LONG:
+    flush_all();
+    emit(RegisterOp::JUMP);
+    emit_jump(ins.target);
+    return true;
+  case OpCode::JUMP_IF_FALSE:
+  case OpCode::JUMP_IF_FALSE_LONG:
+    flush_all();
+    emit(RegisterOp::JUMP_IF_FALSE);
+    emit_byte(top());
+    emit_jump(ins.target);
+    return true;
+
+  // These are run by the bytecode interpreter, but the register instruction
+  // saves a dispatch over doing that with STACK.
+  case OpCode::CALL:
+  case OpCode::RETURN:
+  case OpCode::INVOKE:
+  case OpCode::GET_PROPERTY:
+  case OpCode::SET_PROPERTY:
+  case OpCode::GET_INDEX:
+  case OpCode::SET_INDEX: {
+    flush_all();
+    RegisterOp op;
+    size_t n_operands = 0;
+    switch (ins.op) {
+    case OpCode::CALL:
+      op = RegisterOp::CALL;
+      n_operands = 1;
+      break;
+    case OpCode::RETURN:
+      op = RegisterOp::RETURN;
+      break;
+    case OpCode::INVOKE:
+      op = RegisterOp::INVOKE;
+      n_operands = 3;
+      break;
+    case OpCode::GET_PROPERTY:
+      op = RegisterOp::GET_PROPERTY;
+      n_operands = 2;
+      break;
+    case OpCode::SET_PROPERTY:
+      op = RegisterOp::SET_PROPERTY;
+      n_operands = 2;
+      break;
+    case OpCode::GET_INDEX:
+      op = RegisterOp::GET_INDEX;
+      break;
+    default:
+      op = RegisterOp::SET_INDEX;
+      break;
+    }
+    emit(op);
+    emit_byte(depth());
+    for (size_t i = 0; i < n_operands; i++) {
+      emit_byte(operand(ins, i));
+    }
+    apply_stack_effect(ins);
+    return true;
+  }
+
+  default:
+    return embed(index);
+  }
+}
+
+std::unique_ptr<RegisterCode> compile_register_code(ObjFunction& function) {
+  return RegisterTranslator(function).translate();
+}
+
+} // namespace lox
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "chunk.hpp"
+#include "register_op_def.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace lox {
+
+class ObjFunction;
+
+enum class RegisterOp {
+#define REGISTER_OP_ENUM(name, operands) name,
+  REGISTER_OP_LIST(REGISTER_OP_ENUM)
+#undef REGISTER_OP_ENUM
+};
+#define REGISTER_OP_COUNT(name, operands) +1
+constexpr size_t N_REGISTER_OPS = 0 REGISTER_OP_LIST(REGISTER_OP_COUNT);
+#undef REGISTER_OP_COUNT
+// Register instructions are numbered after all of the bytecode opcodes, so
+// that VM::run can dispatch both through the same table (and the register
+// tier can hand single bytecode instructions to the interpreter without
+// leaving it).
+static_assert(N_OPCODES + N_REGISTER_OPS <= 256);
+constexpr uint8_t register_opcode(RegisterOp op) {
+  return static_cast<uint8_t>(N_OPCODES + static_cast<size_t>(op));
+}
+std::string_view register_op_name(RegisterOp op);
+
+// The second tier of execution: a translation of a function's bytecode into
+// register instructions (see register_op_def.hpp), which VM::run switches to
+// once the function has been called, or has gone round a loop, often enough
+// (see VM::tier_up).
+//
+// Most of the pushing and popping that the bytecode does is only there to
+// move values between local variables and temporaries, so the translation
+// keeps track of what each stack slot would hold instead of moving it, and
+// only writes the slot when something actually needs it there. Everything
+// that the register instructions don't cover runs as ordinary bytecode
+// (through STACK and friends), so nearly every function can be translated.
+//
+// The stack layout is exactly the same as the bytecode's at every jump
+// target, which is what lets a frame that is already running switch over
+// in the middle of a loop.
+class RegisterCode {
+public:
+  uint8_t* entry() { return code.data(); }
+  bool contains(const uint8_t* ip) const {
+    // NOTE: std::less, since comparing pointers into different arrays with <
+    // is unspecified.
+    return !std::less<const uint8_t*>()(ip, code.data()) &&
+           std::less<const uint8_t*>()(ip, code.data() + code.size());
+  }
+  // For error messages and profiling: `ip` is where the register code would
+  // carry on from, and this is where the bytecode would, i.e. the end of the
+  // bytecode instruction that the last register instruction came from (or 0
+  // at the start of the function).
+  size_t bytecode_offset(const uint8_t* ip) const;
+  // Where to carry on in the register code from the start of the bytecode
+  // instruction at `bytecode_offset`, if that's a jump target (which is where
+  // the two tiers' stacks are the same). nullptr if it isn't one.
+  uint8_t* loop_entry(size_t bytecode_offset);
+  size_t heap_size() const {
+    return code.capacity() +
+           source_offsets.capacity() * sizeof(source_offsets[0]) +
+           entries.capacity() * sizeof(entries[0]);
+  }
+  // Disassemble the register instruction at `offset`, and return the offset
+  // of the next one. `chunk` is the function's chunk (for the constants).
+  size_t disassemble(std::ostream& os, size_t offset, const Chunk& chunk,
+                     std::string_view fn_name) const;
+
+private:
+  std::vector<uint8_t> code;
+  // (register code offset, bytecode offset) pairs, one for each register
+  // instruction, in order. The bytecode offset is the end of the bytecode
+  // instruction that it came from.
+  std::vector<std::pair<size_t, size_t>> source_offsets;
+  // (bytecode offset, register code offset) pairs for the jump targets that
+  // are the start of a bytecode instruction, in order.
+  std::vector<std::pair<size_t, size_t>> entries;
+
+  friend class RegisterTranslator;
+};
+
+// Translate `function`'s bytecode into register code. Returns nullptr if it
+// can't be translated: i.e. if its frame is too big for one-byte register
+// operands, or a jump is too far for the register code's two-byte offsets.
+std::unique_ptr<RegisterCode> compile_register_code(ObjFunction& function);
+
+} // namespace lox
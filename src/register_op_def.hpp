@@ -0,0 +1,75 @@
+#pragma once
+
+// The instructions of the register tier (see register_code.hpp). Instead of
+// pushing and popping, these name the stack slots that they read and write
+// directly, so e.g. `a = b + c` (with a, b and c all local variables) is one
+// ADD instead of GET_LOCAL, GET_LOCAL, ADD, SET_LOCAL, POP.
+//
+// Each entry is R(NAME, OPERANDS), where OPERANDS says what the operands are,
+// one character per operand. Every operand is one byte except for jump
+// offsets, which are two (most significant byte first, relative to the end of
+// the instruction, like JUMP):
+//   r  a stack slot in the current frame (a "register")
+//   k  an index into the chunk's constant table
+//   g  a global variable slot
+//   u  an upvalue index
+//   d  the stack depth, i.e. how many slots of the frame are in use
+//   n  an argument count
+//   c  an inline cache index
+//   l  the length of the bytecode instruction that follows (see STACK)
+//   j  a jump offset
+// The first operand of an instruction that produces a value is where it goes.
+//
+// Arithmetic and comparisons have a _CONSTANT form whose second operand is a
+// constant instead of a register. ADD also takes the stack depth, because
+// concatenating strings allocates, and the operands have to be on the stack
+// while it does.
+//
+// The JUMP_IF_NOT_* instructions are a comparison and a JUMP_IF_FALSE in one,
+// for conditions whose value is popped straight afterwards (as in `if` and
+// `while`).
+//
+// The ones from STACK onwards hand over to the bytecode interpreter. They set
+// the stack pointer to the given depth (which the register tier otherwise
+// doesn't keep track of), and then run an ordinary bytecode instruction:
+// STACK runs the one whose bytes follow it, and the rest run the bytecode
+// instruction of the same name, whose operands are the ones after the depth.
+#define REGISTER_OP_LIST(R)                                                    \
+  R(MOVE, "rr")                                                                \
+  R(LOAD_CONSTANT, "rk")                                                       \
+  R(GET_GLOBAL, "rg")                                                          \
+  R(SET_GLOBAL, "gr")                                                          \
+  R(GET_UPVALUE, "ru")                                                         \
+  R(SET_UPVALUE, "ur")                                                         \
+  R(ADD, "rrrd")                                                               \
+  R(ADD_CONSTANT, "rrkd")                                                      \
+  R(SUBTRACT, "rrr")                                                           \
+  R(SUBTRACT_CONSTANT, "rrk")                                                  \
+  R(MULTIPLY, "rrr")                                                           \
+  R(MULTIPLY_CONSTANT, "rrk")                                                  \
+  R(DIVIDE, "rrr")                                                             \
+  R(DIVIDE_CONSTANT, "rrk")                                                    \
+  R(LESS, "rrr")                                                               \
+  R(LESS_CONSTANT, "rrk")                                                      \
+  R(GREATER, "rrr")                                                            \
+  R(GREATER_CONSTANT, "rrk")                                                   \
+  R(EQUAL, "rrr")                                                              \
+  R(EQUAL_CONSTANT, "rrk")                                                     \
+  R(NEGATE, "rr")                                                              \
+  R(NOT, "rr")                                                                 \
+  R(JUMP, "j")                                                                 \
+  R(JUMP_IF_FALSE, "rj")                                                       \
+  R(JUMP_IF_NOT_LESS, "rrj")                                                   \
+  R(JUMP_IF_NOT_LESS_CONSTANT, "rkj")                                          \
+  R(JUMP_IF_NOT_GREATER, "rrj")                                                \
+  R(JUMP_IF_NOT_GREATER_CONSTANT, "rkj")                                       \
+  R(JUMP_IF_NOT_EQUAL, "rrj")                                                  \
+  R(JUMP_IF_NOT_EQUAL_CONSTANT, "rkj")                                         \
+  R(STACK, "dl")                                                               \
+  R(CALL, "dn")                                                                \
+  R(RETURN, "d")                                                               \
+  R(INVOKE, "dnkc")                                                            \
+  R(GET_PROPERTY, "dkc")                                                       \
+  R(SET_PROPERTY, "dkc")                                                       \
+  R(GET_INDEX, "d")                                                            \
+  R(SET_INDEX, "d")
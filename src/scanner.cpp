@@ -1,5 +1,8 @@
 #include "scanner.hpp"
-#include <cctype>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <format>
 #include <ostream>
 #include <sstream>
@@ -8,8 +11,203 @@
 // This is temporary, remove this when we don't need to debug print stuff
 #include <iostream>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 namespace lox::scanner {
 
+namespace {
+
+// Character classes, looked up in a table instead of calling std::isdigit
+// and friends (which are also undefined for negative chars).
+enum CharClass : uint8_t {
+  DIGIT = 1 << 0,
+  // Letters and underscores, i.e. what an identifier can start with.
+  ALPHA = 1 << 1,
+  // Whitespace other than newlines (which have to be counted).
+  BLANK = 1 << 2,
+};
+
+constexpr std::array<uint8_t, 256> CHAR_CLASSES = [] {
+  std::array<uint8_t, 256> classes{};
+  for (size_t c = '0'; c <= '9'; c++) {
+    classes[c] = DIGIT;
+  }
+  for (size_t c = 'a'; c <= 'z'; c++) {
+    classes[c] = ALPHA;
+    classes[c - 'a' + 'A'] = ALPHA;
+  }
+  classes['_'] = ALPHA;
+  classes[' '] = BLANK;
+  classes['\t'] = BLANK;
+  classes['\r'] = BLANK;
+  return classes;
+}();
+
+bool has_class(char c, uint8_t mask) {
+  return (CHAR_CLASSES[static_cast<unsigned char>(c)] & mask) != 0;
+}
+
+// The SIMD helpers below look at 16 bytes at a time. Each returns a bitmask
+// with bit i set if byte i is NOT in the class being skipped, so the number
+// of bytes to skip is the number of trailing zeros.
+#if defined(__SSE2__)
+constexpr bool HAVE_SIMD = true;
+
+uint32_t non_identifier_mask(const char* p) {
+  __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  // NOTE: These are signed comparisons, so bytes >= 0x80 (which are negative)
+  // are never in range.
+  __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+  __m128i is_alpha =
+      _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                    _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+  __m128i is_digit =
+      _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+                    _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+  __m128i is_underscore = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_'));
+  __m128i matches =
+      _mm_or_si128(_mm_or_si128(is_alpha, is_digit), is_underscore);
+  return ~static_cast<uint32_t>(_mm_movemask_epi8(matches)) & 0xffff;
+}
+
+uint32_t non_blank_mask(const char* p) {
+  __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  __m128i matches =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                                _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+                   _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')));
+  return ~static_cast<uint32_t>(_mm_movemask_epi8(matches)) & 0xffff;
+}
+
+int count_trailing_zeros(uint32_t mask) { return __builtin_ctz(mask); }
+#elif defined(__ARM_NEON)
+constexpr bool HAVE_SIMD = true;
+
+// NEON doesn't have movemask. Instead, narrow each byte of the comparison
+// result to 4 bits, which gives a 64-bit mask with 4 bits per byte.
+uint64_t neon_mask(uint8x16_t matches) {
+  uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+  return ~vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+
+uint64_t non_identifier_mask(const char* p) {
+  uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+  uint8x16_t lower = vorrq_u8(chunk, vdupq_n_u8(0x20));
+  uint8x16_t is_alpha =
+      vcleq_u8(vsubq_u8(lower, vdupq_n_u8('a')), vdupq_n_u8('z' - 'a'));
+  uint8x16_t is_digit =
+      vcleq_u8(vsubq_u8(chunk, vdupq_n_u8('0')), vdupq_n_u8('9' - '0'));
+  uint8x16_t is_underscore = vceqq_u8(chunk, vdupq_n_u8('_'));
+  return neon_mask(vorrq_u8(vorrq_u8(is_alpha, is_digit), is_underscore));
+}
+
+uint64_t non_blank_mask(const char* p) {
+  uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+  uint8x16_t matches = vorrq_u8(vorrq_u8(vceqq_u8(chunk, vdupq_n_u8(' ')),
+                                         vceqq_u8(chunk, vdupq_n_u8('\t'))),
+                                vceqq_u8(chunk, vdupq_n_u8('\r')));
+  return neon_mask(matches);
+}
+
+int count_trailing_zeros(uint64_t mask) { return __builtin_ctzll(mask) / 4; }
+#else
+constexpr bool HAVE_SIMD = false;
+uint32_t non_identifier_mask(const char*) { return 1; }
+uint32_t non_blank_mask(const char*) { return 1; }
+[[maybe_unused]] int count_trailing_zeros(uint32_t) { return 0; }
+#endif
+
+// Skip characters in `classes`, returning a pointer to the first one that
+// isn't (or `end`). `simd_mask` is one of the functions above, and must
+// match the same characters.
+template <typename SimdMask>
+const char* skip_class(const char* p, const char* end, uint8_t classes,
+                       SimdMask simd_mask) {
+  // Most runs are short (a typical identifier, or the indentation at the
+  // start of a line), and for those the table is faster. Only switch to SIMD
+  // once it looks like the run is long.
+  for (const char* scalar_end = std::min(p + 16, end); p != scalar_end; p++) {
+    if (!has_class(*p, classes)) {
+      return p;
+    }
+  }
+  if constexpr (HAVE_SIMD) {
+    while (end - p >= 16) {
+      auto mask = simd_mask(p);
+      if (mask != 0) {
+        return p + count_trailing_zeros(mask);
+      }
+      p += 16;
+    }
+  }
+  while (p != end && has_class(*p, classes)) {
+    p++;
+  }
+  return p;
+}
+
+// Keywords are recognised with a small trie (written out as switches), like
+// the book does: look at the first one or two characters to find the only
+// keyword it could be, then compare the rest.
+TokenType keyword_type(std::string_view text) {
+  auto check = [text](size_t offset, std::string_view rest, TokenType type) {
+    return text.substr(offset) == rest ? type : TokenType::IDENTIFIER;
+  };
+  switch (text[0]) {
+  case 'a':
+    return check(1, "nd", TokenType::AND);
+  case 'c':
+    return check(1, "lass", TokenType::CLASS);
+  case 'e':
+    return check(1, "lse", TokenType::ELSE);
+  case 'f':
+    if (text.size() > 1) {
+      switch (text[1]) {
+      case 'a':
+        return check(2, "lse", TokenType::FALSE);
+      case 'o':
+        return check(2, "r", TokenType::FOR);
+      case 'u':
+        return check(2, "n", TokenType::FUN);
+      }
+    }
+    break;
+  case 'i':
+    return check(1, "f", TokenType::IF);
+  case 'n':
+    return check(1, "il", TokenType::NIL);
+  case 'o':
+    return check(1, "r", TokenType::OR);
+  case 'p':
+    return check(1, "rint", TokenType::PRINT);
+  case 'r':
+    return check(1, "eturn", TokenType::RETURN);
+  case 's':
+    return check(1, "uper", TokenType::SUPER);
+  case 't':
+    if (text.size() > 1) {
+      switch (text[1]) {
+      case 'h':
+        return check(2, "is", TokenType::THIS);
+      case 'r':
+        return check(2, "ue", TokenType::TRUE);
+      }
+    }
+    break;
+  case 'v':
+    return check(1, "ar", TokenType::VAR);
+  case 'w':
+    return check(1, "hile", TokenType::WHILE);
+  }
+  return TokenType::IDENTIFIER;
+}
+
+} // namespace
+
 std::string to_string(const TokenType type) {
   switch (type) {
   case TokenType::LEFT_PAREN:
@@ -20,6 +218,10 @@ std::string to_string(const TokenType type) {
     return "LEFT_BRACE";
   case TokenType::RIGHT_BRACE:
     return "RIGHT_BRACE";
+  case TokenType::LEFT_BRACKET:
+    return "LEFT_BRACKET";
+  case TokenType::RIGHT_BRACKET:
+    return "RIGHT_BRACKET";
   case TokenType::COMMA:
     return "COMMA";
   case TokenType::DOT:
@@ -107,7 +309,8 @@ std::ostream& operator<<(std::ostream& os, const Token& token) {
 }
 
 Scanner::Scanner(std::string_view source)
-    : source(source), line(1), start(source.begin()), current(source.begin()) {}
+    : source(source), line(1), start(source.data()), current(source.data()),
+      end(source.data() + source.size()) {}
 
 void Scanner::scan_and_print() {
   // Mainly for debugging.
@@ -144,7 +347,39 @@ Token Scanner::make_error_token(std::string_view message) {
   return Token(TokenType::ERROR, message, line);
 }
 
+void Scanner::skip_whitespace() {
+  while (!is_at_end()) {
+    switch (peek()) {
+    case ' ':
+    case '\r':
+    case '\t':
+      current = skip_class(current, end, BLANK, non_blank_mask);
+      break;
+    case '\n':
+      line++;
+      current++;
+      break;
+    case '/':
+      if (end - current < 2 || current[1] != '/') {
+        return;
+      }
+      // A comment goes until the end of the line. memchr is vectorised in
+      // every libc worth using.
+      if (const void* newline =
+              std::memchr(current, '\n', static_cast<size_t>(end - current))) {
+        current = static_cast<const char*>(newline);
+      } else {
+        current = end;
+      }
+      break;
+    default:
+      return;
+    }
+  }
+}
+
 Token Scanner::scan_token() {
+  skip_whitespace();
   start = current;
   if (is_at_end()) {
     return make_token(TokenType::_EOF);
@@ -160,6 +395,10 @@ Token Scanner::scan_token() {
     return make_token(TokenType::LEFT_BRACE);
   case '}':
     return make_token(TokenType::RIGHT_BRACE);
+  case '[':
+    return make_token(TokenType::LEFT_BRACKET);
+  case ']':
+    return make_token(TokenType::RIGHT_BRACKET);
   case ';':
     return make_token(TokenType::SEMICOLON);
   case ',':
@@ -171,14 +410,8 @@ Token Scanner::scan_token() {
   case '+':
     return make_token(TokenType::PLUS);
   case '/':
-    if (consume_next_if('/')) {
-      consume_while([](char ch) { return ch != '\n'; });
-      // We can't just do `break`, because that would fall through to the
-      // default case.
-      return scan_token();
-    } else {
-      return make_token(TokenType::SLASH);
-    }
+    // Comments were already skipped by skip_whitespace().
+    return make_token(TokenType::SLASH);
   case '*':
     return make_token(TokenType::STAR);
   case '!':
@@ -193,83 +426,53 @@ Token Scanner::scan_token() {
   case '>':
     return make_token(consume_next_if('=') ? TokenType::GREATER_EQUAL
                                            : TokenType::GREATER);
-  // Whitespace
-  case ' ':
-  case '\r':
-  case '\t':
-    // Ignore whitespace and scan the next token.
-    return scan_token();
-  case '\n':
-    line++;
-    return scan_token();
-
-  // Strings.
   case '"':
-    consume_while([](char ch) { return ch != '"'; });
-    consume(); // Closing quote
-    if (is_at_end()) {
-      return make_error_token("unterminated string literal");
-    } else {
-      return make_token(TokenType::STRING, 1, 1);
-    }
+    return scan_string();
   }
 
-  // Numbers
-  if (std::isdigit(c)) {
-    consume_while([](char ch) { return std::isdigit(ch); });
-    // Look for a fractional part.
-    if (consume_next_if('.')) {
-      if (std::isdigit(peek())) {
-        consume_while([](char ch) { return std::isdigit(ch); });
-      } else {
-        // rewind the dot
-        rewind();
-      }
-    }
-    return make_token(TokenType::NUMBER);
+  if (has_class(c, DIGIT)) {
+    return scan_number();
+  }
+  if (has_class(c, ALPHA)) {
+    return scan_identifier();
+  }
+  return make_error_token("unrecognized character");
+}
+
+Token Scanner::scan_string() {
+  const void* quote =
+      std::memchr(current, '"', static_cast<size_t>(end - current));
+  const char* closing = quote == nullptr ? end : static_cast<const char*>(quote);
+  // Strings can span multiple lines.
+  line += static_cast<size_t>(std::count(current, closing, '\n'));
+  current = closing;
+  if (is_at_end()) {
+    return make_error_token("unterminated string literal");
   }
+  consume(); // Closing quote
+  return make_token(TokenType::STRING, 1, 1);
+}
 
-  // Identifiers. Honestly, I'm lazy to use the trie structure the book uses.
-  // Sorry. Better things to spend my time on.
-  if (std::isalpha(c) || c == '_') {
-    consume_while([](char ch) { return std::isalnum(ch) || ch == '_'; });
-    std::string_view text(start, static_cast<size_t>(current - start));
-    if (text == "and")
-      return make_token(TokenType::AND);
-    if (text == "class")
-      return make_token(TokenType::CLASS);
-    if (text == "else")
-      return make_token(TokenType::ELSE);
-    if (text == "false")
-      return make_token(TokenType::FALSE);
-    if (text == "for")
-      return make_token(TokenType::FOR);
-    if (text == "fun")
-      return make_token(TokenType::FUN);
-    if (text == "if")
-      return make_token(TokenType::IF);
-    if (text == "nil")
-      return make_token(TokenType::NIL);
-    if (text == "or")
-      return make_token(TokenType::OR);
-    if (text == "print")
-      return make_token(TokenType::PRINT);
-    if (text == "return")
-      return make_token(TokenType::RETURN);
-    if (text == "super")
-      return make_token(TokenType::SUPER);
-    if (text == "this")
-      return make_token(TokenType::THIS);
-    if (text == "true")
-      return make_token(TokenType::TRUE);
-    if (text == "var")
-      return make_token(TokenType::VAR);
-    if (text == "while")
-      return make_token(TokenType::WHILE);
-    return make_token(TokenType::IDENTIFIER);
+Token Scanner::scan_number() {
+  // Numbers are short, so SIMD wouldn't help much here.
+  while (!is_at_end() && has_class(peek(), DIGIT)) {
+    current++;
   }
+  // Look for a fractional part.
+  if (end - current >= 2 && peek() == '.' && has_class(current[1], DIGIT)) {
+    current++;
+    while (!is_at_end() && has_class(peek(), DIGIT)) {
+      current++;
+    }
+  }
+  return make_token(TokenType::NUMBER);
+}
 
-  return make_error_token("unrecognized character");
+Token Scanner::scan_identifier() {
+  current = skip_class(current, end, ALPHA | DIGIT, non_identifier_mask);
+  TokenType type = keyword_type(
+      std::string_view(start, static_cast<size_t>(current - start)));
+  return make_token(type);
 }
 
 } // namespace lox::scanner
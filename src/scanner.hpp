@@ -2,7 +2,6 @@
 #include <cstddef>
 #include <string_view>
 #include <string>
-#include <functional>
 
 namespace lox::scanner {
 
@@ -12,6 +11,8 @@ enum class TokenType {
   RIGHT_PAREN,
   LEFT_BRACE,
   RIGHT_BRACE,
+  LEFT_BRACKET,
+  RIGHT_BRACKET,
   COMMA,
   DOT,
   MINUS,
@@ -71,20 +72,18 @@ public:
   explicit Scanner(std::string_view source);
   void scan_and_print();
   Token scan_token();
-  bool is_at_end() const { return current == source.end(); }
+  bool is_at_end() const { return current == end; }
 
 private:
   std::string_view source;
   std::size_t line;
 
-  // NOTE: const_iterator is an iterator that points to a const value (not a
-  // pointer that is itself const). That makes sense because string_view is not
-  // mutable (or cannot mutate the underlying string).
-
   // Start of current lexeme
-  std::string_view::const_iterator start;
+  const char* start;
   // Current character being examined
-  std::string_view::const_iterator current;
+  const char* current;
+  // One past the last character of the source
+  const char* end;
 
   Token make_token(TokenType type);
   Token make_token(TokenType type, size_t skip_begin, size_t skip_end);
@@ -102,14 +101,13 @@ private:
     current++;
     return true;
   }
-  void consume_while(std::function<bool(char)> predicate) {
-    while (!is_at_end() && predicate(*current)) {
-      if (*current == '\n') {
-        line++;
-      }
-      current++;
-    }
-  }
+  // Skip whitespace and comments, counting newlines.
+  void skip_whitespace();
+  // These are called after the first character of the token has been
+  // consumed.
+  Token scan_string();
+  Token scan_number();
+  Token scan_identifier();
 };
 
 } // namespace lox::scanner
@@ -1,45 +1,159 @@
 #pragma once
-#include <string>
-#include <unordered_map>
+#include "value.hpp"
+#include <cstddef>
+#include <functional>
+#include <string_view>
+#include <vector>
 
 namespace lox {
 
-class ObjString;
-
-// https://www.cppstories.com/2021/heterogeneous-access-cpp20/
-struct string_hash {
-  // NOTE: `using` defines a type inside the struct. The value of the type
-  // doesn't matter; it just matters that it's defined. The presence of this
-  // type is what allows the unordered_map to use heterogeneous lookup (instead
-  // of converting any lookup key to the key type, std::string, which can cause
-  // allocations).
-  using is_transparent = void;
-  size_t operator()(std::string_view txt) const {
-    return std::hash<std::string_view>{}(txt);
+// The hash function used for all strings. ObjString caches the result of this
+// when it's created, so each string only ever gets hashed once.
+inline size_t hash_string(std::string_view str) {
+  return std::hash<std::string_view>{}(str);
+}
+
+// Hash table keyed by (interned) ObjString pointers, using open addressing
+// with linear probing.
+//
+// Because all strings are interned, two ObjString* keys refer to the same
+// string if and only if they are the same pointer. So lookups by ObjString*
+// never need to compare string contents, and can use the hash that was cached
+// in the ObjString when it was created. The only time we need to compare
+// contents is when we are looking up a string that hasn't been interned yet
+// (see `find_key`), which is what GC::get_string_ptr does.
+//
+// Keys are not owned by the map (nor are they marked by the GC): whoever owns
+// the map is responsible for making sure that the keys stay alive, or for
+// removing them (with `erase_if`) before they are collected.
+template <typename Val> class StringMap {
+public:
+  StringMap() = default;
+
+  size_t size() const { return count; }
+
+  // Returns a pointer to the value for `key`, or nullptr if it's not there.
+  Val* find(const ObjString* key) {
+    if (count == 0) {
+      return nullptr;
+    }
+    size_t mask = entries.size() - 1;
+    for (size_t i = key->hash & mask;; i = (i + 1) & mask) {
+      Entry& entry = entries[i];
+      if (entry.key == key) {
+        return &entry.value;
+      } else if (entry.key == nullptr) {
+        return nullptr;
+      }
+    }
   }
-  size_t operator()(const std::string& txt) const {
-    return std::hash<std::string>{}(txt);
+
+  // Look up a key by its contents (and precomputed hash). Returns nullptr if
+  // no such key exists.
+  ObjString* find_key(std::string_view str, size_t hash) const {
+    if (count == 0) {
+      return nullptr;
+    }
+    size_t mask = entries.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      const Entry& entry = entries[i];
+      if (entry.key == nullptr) {
+        return nullptr;
+      } else if (entry.key->hash == hash && entry.key->value == str) {
+        return entry.key;
+      }
+    }
+  }
+
+  // Insert `key` with `value`, overwriting the old value if it already
+  // exists.
+  void set(ObjString* key, Val value) {
+    // Keep the load factor at or below 3/4.
+    if (4 * (count + 1) > 3 * entries.size()) {
+      grow();
+    }
+    size_t mask = entries.size() - 1;
+    size_t i = key->hash & mask;
+    while (entries[i].key != nullptr && entries[i].key != key) {
+      i = (i + 1) & mask;
+    }
+    if (entries[i].key == nullptr) {
+      count++;
+    }
+    entries[i] = Entry{key, value};
   }
-  size_t operator()(ObjString* obj) const;
-};
 
-struct string_eq {
-  using is_transparent = void;
+  // Remove all entries for which `pred(key, value)` returns true.
+  template <typename Pred> void erase_if(Pred pred) {
+    size_t i = 0;
+    while (i < entries.size()) {
+      Entry& entry = entries[i];
+      if (entry.key != nullptr && pred(entry.key, entry.value)) {
+        // erase_at may move a later entry into slot i, so we have to look at
+        // slot i again.
+        erase_at(i);
+      } else {
+        i++;
+      }
+    }
+  }
 
-  static std::string_view to_view(const std::string& s) { return s; }
-  static std::string_view to_view(std::string_view s) { return s; }
-  static std::string_view to_view(ObjString* obj);
+  template <typename F> void for_each(F f) const {
+    for (const Entry& entry : entries) {
+      if (entry.key != nullptr) {
+        f(entry.key, entry.value);
+      }
+    }
+  }
 
-  template <typename T, typename U>
-  bool operator()(const T& t, const U& u) const {
-    return to_view(t) == to_view(u);
+private:
+  struct Entry {
+    // nullptr means that the slot is empty.
+    ObjString* key = nullptr;
+    Val value{};
+  };
+  // The size of this is always zero or a power of two, so that we can use a
+  // mask instead of the modulo operator.
+  std::vector<Entry> entries;
+  size_t count = 0;
+
+  void grow() {
+    std::vector<Entry> old_entries = std::move(entries);
+    entries = std::vector<Entry>(old_entries.empty() ? 16 : old_entries.size() * 2);
+    size_t mask = entries.size() - 1;
+    for (const Entry& entry : old_entries) {
+      if (entry.key != nullptr) {
+        size_t i = entry.key->hash & mask;
+        while (entries[i].key != nullptr) {
+          i = (i + 1) & mask;
+        }
+        entries[i] = entry;
+      }
+    }
   }
-};
 
-template <typename Val> class StringMap {
-public:
-  StringMap() = default;
-  std::unordered_map<std::string, Val, string_hash, string_eq> map;
+  // Deletion with linear probing can't just empty the slot, because that would
+  // break the probe sequence for any entries after it. Instead of leaving a
+  // tombstone, we shift later entries in the same probe sequence backwards
+  // into the hole.
+  void erase_at(size_t hole) {
+    size_t mask = entries.size() - 1;
+    for (size_t j = (hole + 1) & mask; entries[j].key != nullptr;
+         j = (j + 1) & mask) {
+      size_t ideal = entries[j].key->hash & mask;
+      // The entry at j can be moved into the hole only if its ideal slot is
+      // not (cyclically) between the hole and j. Otherwise moving it would
+      // put it before the start of its own probe sequence.
+      bool ideal_in_between = (hole <= j) ? (hole < ideal && ideal <= j)
+                                          : (hole < ideal || ideal <= j);
+      if (!ideal_in_between) {
+        entries[hole] = entries[j];
+        hole = j;
+      }
+    }
+    entries[hole] = Entry{};
+    count--;
+  }
 };
 
 } // namespace lox
@@ -0,0 +1,50 @@
+#pragma once
+
+// Superinstructions are single opcodes that do the work of a whole sequence
+// of ordinary instructions, so that the VM only has to dispatch once for the
+// whole sequence. Everything about them is generated from this table: the
+// opcodes themselves, the peephole rule that fuses each sequence (see
+// optimise.cpp), and the VM handler.
+//
+// Each entry is S(NAME, (PREFIX...), LAST). The VM handler for NAME runs the
+// instructions in PREFIX one after another without dispatching in between,
+// and then jumps straight into the existing handler for LAST. The operands of
+// a superinstruction are just the (one-byte) operands of all of its component
+// instructions, in order, so e.g. LOCAL_CONST_LESS is three bytes long:
+//   LOCAL_CONST_LESS <local index> <constant index>
+//
+// Restrictions:
+//  - PREFIX can have up to four instructions, each of which must be one of the
+//    simple instructions that can_be_superinstruction_prefix() allows.
+//  - JUMP_IF_FALSE can only be in PREFIX if there are no operands after it,
+//    since the jump offset is relative to the end of the superinstruction.
+//  - LAST can be any instruction with a fixed length, including jumps and
+//    RETURN (but not CLOSURE, WIDE, or the long jumps).
+//
+// To find out which sequences are worth adding here, build with
+// `make BUILD=profile` and run a representative workload: it prints the most
+// common pairs and triples of instructions, in this format.
+#define SUPERINSTRUCTION_LIST(S)                                               \
+  S(LOCAL_CONST_LESS_JUMP_IF_FALSE_POP, (GET_LOCAL, CONSTANT, LESS,            \
+                                         JUMP_IF_FALSE), POP)                  \
+  S(LOCAL_CONST_LESS_JUMP_IF_FALSE, (GET_LOCAL, CONSTANT, LESS),               \
+    JUMP_IF_FALSE)                                                             \
+  S(LOCAL_CONST_LESS, (GET_LOCAL, CONSTANT), LESS)                             \
+  S(ADD_LOCAL_CONST, (GET_LOCAL, CONSTANT, ADD, SET_LOCAL), POP)               \
+  S(GET_LOCAL_GET_LOCAL_ADD, (GET_LOCAL, GET_LOCAL), ADD)                      \
+  S(JUMP_IF_FALSE_POP, (JUMP_IF_FALSE), POP)                                   \
+  S(CONSTANT_RETURN, (CONSTANT), RETURN)
+
+// NOTE: The preprocessor can't loop, so to do something for each instruction
+// in a PREFIX we need one macro for each possible length.
+#define LOX_FOR_EACH_1(M, a) M(a)
+#define LOX_FOR_EACH_2(M, a, ...) M(a) LOX_FOR_EACH_1(M, __VA_ARGS__)
+#define LOX_FOR_EACH_3(M, a, ...) M(a) LOX_FOR_EACH_2(M, __VA_ARGS__)
+#define LOX_FOR_EACH_4(M, a, ...) M(a) LOX_FOR_EACH_3(M, __VA_ARGS__)
+#define LOX_FOR_EACH_PICK(_1, _2, _3, _4, NAME, ...) NAME
+#define LOX_FOR_EACH(M, ...)                                                   \
+  LOX_FOR_EACH_PICK(__VA_ARGS__, LOX_FOR_EACH_4, LOX_FOR_EACH_3,               \
+                    LOX_FOR_EACH_2, LOX_FOR_EACH_1)(M, __VA_ARGS__)
+// Apply M to each instruction in a parenthesised PREFIX.
+#define LOX_FOR_EACH_PREFIX(M, prefix) LOX_FOR_EACH(M, LOX_UNPAREN prefix)
+#define LOX_UNPAREN(...) __VA_ARGS__
@@ -1,7 +1,10 @@
 #include "value.hpp"
 #include "gc.hpp"
 #include "value_def.hpp"
+#include <algorithm>
 #include <ostream>
+#include <sstream>
+#include <vector>
 
 namespace lox {
 
@@ -24,12 +27,100 @@ std::ostream& operator<<(std::ostream& os, const Value& value) {
   return os;
 }
 
-Value ObjNativeFunction::call(uint8_t arg_count, const Value* args) {
-  if (arg_count != arity) {
-    throw std::runtime_error("expected " + std::to_string(arity) +
-                             " arguments but got " + std::to_string(arg_count));
+ObjShape* ObjClass::get_root_shape(GC& gc) {
+  if (root_shape == nullptr) {
+    root_shape = gc.alloc<ObjShape>();
+    gc.write_barrier(this);
   }
-  return function(arg_count, args);
+  return root_shape;
+}
+
+ObjShape* ObjShape::add_field(ObjString* field, GC& gc) {
+  auto it = transitions.find(field);
+  if (it != transitions.end()) {
+    return it->second;
+  }
+  ObjShape* child = gc.alloc<ObjShape>(this, field);
+  transitions.emplace(field, child);
+  gc.write_barrier(this);
+  return child;
+}
+
+void ObjInstance::set_field(ObjString* name, Value value, GC& gc) {
+  if (const size_t* slot = shape->find(name)) {
+    fields[*slot] = value;
+  } else {
+    shape = shape->add_field(name, gc);
+    fields.push_back(value);
+  }
+  gc.write_barrier(this);
+}
+
+std::string_view ObjRope::flatten() const {
+  if (left == nullptr) {
+    return flat;
+  }
+  flat.reserve(length);
+  // Ropes built up in a loop (`s = s + piece`) are as deep as they are long,
+  // so walk them with an explicit stack rather than recursing.
+  std::vector<const Obj*> pending{right, left};
+  while (!pending.empty()) {
+    const Obj* obj = pending.back();
+    pending.pop_back();
+    if (obj->type == ObjType::STRING) {
+      flat += static_cast<const ObjString*>(obj)->value;
+      continue;
+    }
+    auto rope = static_cast<const ObjRope*>(obj);
+    if (rope->left == nullptr) {
+      flat += rope->flat;
+    } else {
+      pending.push_back(rope->right);
+      pending.push_back(rope->left);
+    }
+  }
+  left = nullptr;
+  right = nullptr;
+  return flat;
+}
+
+std::string_view string_contents(const Obj* obj) {
+  if (obj->type == ObjType::STRING) {
+    return static_cast<const ObjString*>(obj)->value;
+  }
+  return static_cast<const ObjRope*>(obj)->flatten();
+}
+
+namespace {
+
+size_t string_length(const Obj* obj) {
+  if (obj->type == ObjType::STRING) {
+    return static_cast<const ObjString*>(obj)->value.size();
+  }
+  return static_cast<const ObjRope*>(obj)->get_length();
+}
+
+} // namespace
+
+std::string ObjList::to_repr() const {
+  // The lists that are currently being printed, so that a list that contains
+  // itself is printed as `[[...]]` rather than forever.
+  thread_local std::vector<const ObjList*> printing;
+  if (std::find(printing.begin(), printing.end(), this) != printing.end()) {
+    return "[...]";
+  }
+  printing.push_back(this);
+  std::string repr = "[";
+  for (size_t i = 0; i < elements.size(); i++) {
+    if (i > 0) {
+      repr += ", ";
+    }
+    std::ostringstream element;
+    element << elements[i];
+    repr += element.str();
+  }
+  printing.pop_back();
+  return repr + "]";
 }
 
 bool is_truthy(const Value& value) {
@@ -56,32 +147,59 @@ bool is_equal(const Value& a, const Value& b) {
   } else if (is_double(a)) {
     return is_double(b) && (as_double(a) == as_double(b));
   } else if (is_obj(a)) {
-    // Because all strings are interned, pointer equality is sufficient
-    return is_obj(b) && (as_obj(a) == as_obj(b));
+    if (!is_obj(b)) {
+      return false;
+    }
+    const Obj* aptr = as_obj(a);
+    const Obj* bptr = as_obj(b);
+    if (aptr == bptr) {
+      return true;
+    }
+    // Because all ObjStrings are interned, pointer equality is sufficient for
+    // them, but ropes have to be compared by their contents.
+    if ((aptr->type == ObjType::ROPE || bptr->type == ObjType::ROPE) &&
+        is_string_obj(aptr) && is_string_obj(bptr)) {
+      return string_length(aptr) == string_length(bptr) &&
+             string_contents(aptr) == string_contents(bptr);
+    }
+    return false;
   } else {
     throw std::runtime_error("unreachable in is_equal: unknown value type");
   }
 }
 
+ObjString* concatenate(const ObjString* a, const ObjString* b, GC& gc) {
+  // SUBTLE NOT-BUG: gc.get_string_ptr has to allocate, which means that it
+  // might trigger GC, which in turn might clean up the old strings. But
+  // that's fine, because this line will extract the data from the old strings
+  // and concatenate them,
+  std::string new_str;
+  new_str.reserve(a->value.size() + b->value.size());
+  new_str.append(a->value).append(b->value);
+  // so even if GC triggers here, we won't run into segfaults. If the result
+  // wasn't already interned, its buffer is moved into the new ObjString.
+  return gc.get_string_ptr(std::move(new_str));
+}
+
 Value add(const Value& a, const Value& b, GC& gc) {
   if (is_double(a) && is_double(b)) {
     return from_double(as_double(a) + as_double(b));
   } else if (is_obj(a) && is_obj(b)) {
     auto aptr = as_obj(a);
     auto bptr = as_obj(b);
-    if (aptr->type != ObjType::STRING || bptr->type != ObjType::STRING) {
+    if (!is_string_obj(aptr) || !is_string_obj(bptr)) {
       throw std::runtime_error(
           "operands to `+` must be two numbers or two strings");
     }
-    auto str1 = static_cast<ObjString*>(aptr);
-    auto str2 = static_cast<ObjString*>(bptr);
-    // SUBTLE NOT-BUG: gc.get_string_ptr has to allocate, which means that it
-    // might trigger GC, which in turn might clean up the old strings. But
-    // that's fine, because this line will extract the data from the old strings
-    // and concatenate them,
-    std::string new_str = str1->value + str2->value;
-    // so even if GC triggers here, we won't run into segfaults.
-    return from_obj(gc.get_string_ptr(new_str));
+    size_t length = string_length(aptr) + string_length(bptr);
+    if (length < ObjRope::MIN_LENGTH && aptr->type == ObjType::STRING &&
+        bptr->type == ObjType::STRING) {
+      return from_obj(concatenate(static_cast<ObjString*>(aptr),
+                                  static_cast<ObjString*>(bptr), gc));
+    }
+    // NOTE: The caller has to keep `a` and `b` reachable (e.g. on the VM
+    // stack), since this allocation might trigger GC.
+    return from_obj(gc.alloc<ObjRope>(aptr, bptr, length));
   } else {
     throw std::runtime_error(
         "operands to `+` must be two numbers or two strings");
@@ -2,7 +2,7 @@
 
 #include "chunk.hpp"
 #include "optimise.hpp"
-#include "stringmap.hpp"
+#include "register_code.hpp"
 #include "value_def.hpp"
 #include <boost/unordered/unordered_flat_map.hpp>
 #include <functional>
@@ -11,6 +11,8 @@
 #include <stdint.h>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace lox {
@@ -25,8 +27,15 @@ enum class ObjType {
   NATIVE_FUNCTION,
   CLASS,
   INSTANCE,
-  BOUND_METHOD
+  BOUND_METHOD,
+  SHAPE,
+  ROPE,
+  LIST,
+  FIBER
 };
+// Number of different ObjTypes. This must be kept in sync with the enum above
+// (the GC uses it to size its table of per-type allocation pools).
+constexpr size_t NUM_OBJ_TYPES = static_cast<size_t>(ObjType::FIBER) + 1;
 
 // Forward declarations
 class GC;
@@ -49,6 +58,10 @@ public:
   // not by the Obj itself.
   Obj* next = nullptr;
   bool is_marked = false;
+  // Only used by the generational GC: whether this object has survived a
+  // collection, and whether it's currently in the remembered set.
+  bool is_old = false;
+  bool is_remembered = false;
   size_t size = 0;
 
   // NOTE: Marking a member function as `virtual` means that C++ will force
@@ -68,6 +81,10 @@ public:
   // NOTE: the (= 0) makes this a 'pure virtual' function, meaning that derived
   // classes must implement this function.
   virtual std::string to_repr() const = 0;
+  // Number of bytes of heap memory owned by this object *outside* of its own
+  // allocation, e.g. the buffer of a std::string or std::vector member. The GC
+  // adds this to the object's block size when accounting for memory usage.
+  virtual size_t heap_size() const { return 0; }
 
   // NOTE: `protected` means this constructor can only be called by derived
   // classes
@@ -78,28 +95,147 @@ protected:
 class ObjString : public Obj {
 public:
   std::string value;
-  ObjString(std::string_view str) : Obj(static_type), value(str) {}
+  // Cached result of hash_string(value). Strings are immutable, so we only
+  // need to compute this once, when the string is created (which only ever
+  // happens inside GC::get_string_ptr).
+  size_t hash;
+  ObjString(std::string_view str, size_t hash)
+      : Obj(static_type), value(str), hash(hash) {}
+  ObjString(std::string&& str, size_t hash)
+      : Obj(static_type), value(std::move(str)), hash(hash) {}
   std::string to_repr() const override { return "\"" + value + "\""; }
+  size_t heap_size() const override {
+    // Short strings are stored inside the std::string object itself (the
+    // 'small string optimisation'), in which case there's no extra memory.
+    const char* data = value.data();
+    auto self = reinterpret_cast<const char*>(&value);
+    bool is_inline = data >= self && data < self + sizeof(value);
+    return is_inline ? 0 : value.capacity() + 1;
+  }
 
   static constexpr ObjType static_type = ObjType::STRING;
   static constexpr std::string_view static_type_name = "ObjString";
 };
 
+// The result of concatenating two long strings (see lox::add). Rather than
+// copying both of them into a new string, which makes building up a string
+// piece by piece quadratic, and then hashing and interning the result, a rope
+// just points to its two halves (each of which is an ObjString or another
+// ObjRope). The characters are only copied into one buffer when something
+// needs them all in one place, i.e. when the rope is compared or printed.
+//
+// Ropes aren't interned, so unlike ObjStrings, two different ropes (or a rope
+// and an ObjString) can have the same contents; is_equal compares them by
+// contents instead.
+class ObjRope : public Obj {
+public:
+  // Concatenations shorter than this produce an ordinary, interned ObjString:
+  // short strings are cheap to copy, and are the ones that are most likely to
+  // be compared.
+  static constexpr size_t MIN_LENGTH = 64;
+
+  ObjRope(Obj* left, Obj* right, size_t length)
+      : Obj(static_type), left(left), right(right), length(length) {}
+
+  size_t get_length() const { return length; }
+  // The halves, or nullptr once the rope has been flattened.
+  Obj* get_left() const { return left; }
+  Obj* get_right() const { return right; }
+  // The contents. The first call copies them into `flat` and lets go of the
+  // halves (so the GC can free them, if nothing else uses them).
+  std::string_view flatten() const;
+
+  std::string to_repr() const override {
+    std::string repr = "\"";
+    repr += flatten();
+    repr += '"';
+    return repr;
+  }
+  size_t heap_size() const override { return flat.capacity(); }
+
+  static constexpr ObjType static_type = ObjType::ROPE;
+  static constexpr std::string_view static_type_name = "ObjRope";
+
+private:
+  // NOTE: These are `mutable` because flattening doesn't change what the rope
+  // represents, so it's allowed on a const rope (e.g. inside is_equal).
+  mutable Obj* left;
+  mutable Obj* right;
+  size_t length;
+  mutable std::string flat;
+};
+
+// Whether `obj` is an ObjString or an ObjRope.
+inline bool is_string_obj(const Obj* obj) {
+  return obj->type == ObjType::STRING || obj->type == ObjType::ROPE;
+}
+// The contents of an ObjString or ObjRope (flattening the latter).
+std::string_view string_contents(const Obj* obj);
+
+// Approximate number of bytes of heap memory used by one of the hash maps
+// below. Flat maps store their elements inline in a single bucket array, plus
+// (roughly) one byte of metadata per bucket.
+template <typename Map> size_t map_heap_size(const Map& map) {
+  return map.bucket_count() * (sizeof(typename Map::value_type) + 1);
+}
+
+// Hash for maps keyed by ObjString*. Because all strings are interned, the
+// default pointer equality is the same as string equality, and we can reuse
+// the cached hash of the string instead of hashing the pointer.
+struct ObjStringPtrHash {
+  // Tells boost that the hash is already well-distributed, so that it doesn't
+  // need to apply its own mixing on top.
+  using is_avalanching = std::true_type;
+  size_t operator()(const ObjString* str) const { return str->hash; }
+};
+
 class ObjFunction : public Obj {
 public:
-  ObjString* name;
+  // NOTE: The fields that VM::call reads come first, so that they share a
+  // cache line with the object header.
   size_t arity;
-  std::vector<Upvalue> upvalues;
+  // The maximum number of stack slots that a call to this function can use
+  // (including the slot for the callee itself and its arguments). This is
+  // computed once the chunk is finalised, and lets VM::call check for stack
+  // overflow once per call rather than on every push.
+  size_t max_stack_depth = 0;
+  // Whether any closure created inside this function captures one of its
+  // local variables. If not, then returning from it doesn't have to close any
+  // upvalues.
+  bool has_captured_locals = false;
+  // How many times the function has been called, and how many times a loop
+  // in it has gone round, so far. Once either of these reaches the VM's
+  // tier-up threshold, the VM translates the function into register code
+  // (see VM::tier_up).
+  uint32_t calls = 0;
+  uint32_t backedges = 0;
+  bool tier_up_attempted = false;
+  // nullptr until then, or if the function couldn't be translated.
+  std::unique_ptr<RegisterCode> register_code;
   Chunk chunk;
+  std::vector<Upvalue> upvalues;
+  // Only needed for error messages, printing, and profiling.
+  ObjString* name;
   ObjFunction(ObjString* name, size_t arity)
-      : Obj(static_type), name(name), arity(arity), chunk() {}
+      : Obj(static_type), arity(arity), chunk(), name(name) {}
+
+  // Where a new call starts executing.
+  uint8_t* entry_point() {
+    return register_code ? register_code->entry() : chunk.begin_location();
+  }
 
   std::string to_repr() const override { return "<fn " + name->value + ">"; }
+  size_t heap_size() const override {
+    return upvalues.capacity() * sizeof(Upvalue) + chunk.heap_size() +
+           (register_code ? register_code->heap_size() : 0);
+  }
 
   static constexpr ObjType static_type = ObjType::FUNCTION;
   static constexpr std::string_view static_type_name = "ObjFunction";
 
-  void optimise_chunk() { chunk = lox::optimise::peephole_optimise(chunk); }
+  void optimise_chunk(GC& gc) {
+    chunk = lox::optimise::peephole_optimise(chunk, gc);
+  }
 };
 
 class ObjUpvalue : public Obj {
@@ -124,56 +260,177 @@ public:
   std::string to_repr() const override {
     return "<clos " + function->name->value + ">";
   }
+  size_t heap_size() const override {
+    return upvalues.capacity() * sizeof(ObjUpvalue*);
+  }
 
   static constexpr ObjType static_type = ObjType::CLOSURE;
   static constexpr std::string_view static_type_name = "ObjClosure";
 };
 
+// What a native function gets, besides its arguments.
+struct NativeContext {
+  // Whatever was passed to VM::define_native along with the function.
+  void* userdata;
+  // Natives report errors by setting this, instead of throwing. The message
+  // must outlive the call (in practice it's always a string literal).
+  const char* error = nullptr;
+
+  Value fail(const char* message) {
+    error = message;
+    return nil_val();
+  }
+};
+
+// The raw native function ABI. By the time this is called, the VM has
+// already checked that `args` holds exactly `arity` arguments.
+using NativeFn = Value (*)(NativeContext& context, const Value* args);
+
 class ObjNativeFunction : public Obj {
 public:
-  ObjNativeFunction(
-      std::string_view name, size_t arity,
-      std::function<Value(size_t arg_count, const Value* args)> function)
+  std::string name;
+  // The number of arguments it SHOULD take.
+  size_t arity;
+  // The actual C++ function that implements the native function.
+  NativeFn function;
+  void* userdata;
+
+  ObjNativeFunction(std::string_view name, size_t arity, NativeFn function,
+                    void* userdata)
       : Obj(static_type), name(std::string(name)), arity(arity),
-        function(function) {}
+        function(function), userdata(userdata) {}
 
-  Value call(uint8_t arg_count, const Value* args);
   std::string to_repr() const override { return "<native fn " + name + ">"; }
 
   static constexpr ObjType static_type = ObjType::NATIVE_FUNCTION;
   static constexpr std::string_view static_type_name = "ObjNativeFunction";
+};
 
-private:
-  std::string name;
-  // The number of arguments it SHOULD take.
-  size_t arity;
-  // The actual C++ function that implements the native function.
-  std::function<Value(size_t arg_count, const Value* args)> function;
+// Natives can also be written as `Value f(NativeContext&, Value, ...)`, with
+// one parameter per argument. native_fn<f> is then a NativeFn that unpacks
+// the arguments and calls f directly, and native_arity<f> is its arity.
+namespace native_detail {
+template <auto F> struct Traits;
+template <typename... Args, Value (*F)(NativeContext&, Args...)>
+struct Traits<F> {
+  static_assert((std::is_same_v<Args, Value> && ...),
+                "native function arguments must all be Values");
+  static constexpr size_t arity = sizeof...(Args);
+
+  template <size_t... I>
+  static Value call(NativeContext& context, const Value* args,
+                    std::index_sequence<I...>) {
+    return F(context, args[I]...);
+  }
+  static Value trampoline(NativeContext& context, const Value* args) {
+    return call(context, args, std::index_sequence_for<Args...>{});
+  }
 };
+} // namespace native_detail
+
+template <auto F>
+inline constexpr size_t native_arity = native_detail::Traits<F>::arity;
+template <auto F>
+inline constexpr NativeFn native_fn = &native_detail::Traits<F>::trampoline;
+
+class ObjShape;
 
 class ObjClass : public Obj {
 public:
   ObjString* name;
-  boost::unordered_flat_map<ObjString*, ObjClosure*> methods;
+  boost::unordered_flat_map<ObjString*, ObjClosure*, ObjStringPtrHash> methods;
+  // The shape of a freshly created instance of this class (i.e. one with no
+  // fields). This is created the first time the class is instantiated; use
+  // get_root_shape() to access it.
+  ObjShape* root_shape = nullptr;
 
   ObjClass(ObjString* name) : Obj(static_type), name(name) {}
 
+  // May allocate, so the class must be reachable by the GC when calling this.
+  ObjShape* get_root_shape(GC& gc);
+
   std::string to_repr() const override { return "<class " + name->value + ">"; }
+  size_t heap_size() const override { return map_heap_size(methods); }
 
   static constexpr ObjType static_type = ObjType::CLASS;
   static constexpr std::string_view static_type_name = "ObjClass";
 };
 
+// A shape (or 'hidden class') describes which fields an instance has, and
+// where in the instance's `fields` array each of them is stored. Instances
+// with the same fields, added in the same order, share the same shape. So
+// once we have looked up a field on one instance, we can remember the result
+// for any other instance with the same shape (see InlineCache in chunk.hpp).
+//
+// Shapes form a tree: each class has a root shape with no fields, and adding
+// a field to an instance moves it to a child shape. Shapes are never modified
+// once created, apart from adding new transitions. Because each class has its
+// own tree, a shape also determines the class of the instance.
+class ObjShape : public Obj {
+public:
+  // The shape that this one was created from, and the field that was added.
+  // (Both are nullptr for a root shape.)
+  ObjShape* parent;
+  ObjString* key;
+  // All fields in this shape, and their slot indices.
+  boost::unordered_flat_map<ObjString*, size_t, ObjStringPtrHash> slots;
+  // Shapes that are obtained by adding a field to this one.
+  boost::unordered_flat_map<ObjString*, ObjShape*, ObjStringPtrHash>
+      transitions;
+
+  ObjShape() : Obj(static_type), parent(nullptr), key(nullptr) {}
+  ObjShape(ObjShape* parent, ObjString* key)
+      : Obj(static_type), parent(parent), key(key), slots(parent->slots) {
+    slots.emplace(key, parent->slots.size());
+  }
+
+  // Returns the slot of `field`, or nullptr if this shape doesn't have it.
+  const size_t* find(ObjString* field) const {
+    auto it = slots.find(field);
+    return it == slots.end() ? nullptr : &it->second;
+  }
+  size_t num_fields() const { return slots.size(); }
+  // The shape obtained by adding `field` to this one. May allocate, so this
+  // shape and `field` must be reachable by the GC when calling this.
+  ObjShape* add_field(ObjString* field, GC& gc);
+
+  std::string to_repr() const override { return "<shape>"; }
+  size_t heap_size() const override {
+    return map_heap_size(slots) + map_heap_size(transitions);
+  }
+
+  static constexpr ObjType static_type = ObjType::SHAPE;
+  static constexpr std::string_view static_type_name = "ObjShape";
+};
+
 class ObjInstance : public Obj {
 public:
   ObjClass* klass;
-  boost::unordered_flat_map<ObjString*, Value> fields;
-
-  ObjInstance(ObjClass* klass) : Obj(static_type), klass(klass) {}
+  ObjShape* shape;
+  // Field values, indexed by the slots in `shape`.
+  std::vector<Value> fields;
+
+  // `shape` should be klass->get_root_shape().
+  ObjInstance(ObjClass* klass, ObjShape* shape)
+      : Obj(static_type), klass(klass), shape(shape) {}
+
+  // Returns a pointer to the value of the field, or nullptr if there's no
+  // such field.
+  Value* find_field(ObjString* name) {
+    const size_t* slot = shape->find(name);
+    return slot == nullptr ? nullptr : &fields[*slot];
+  }
+  // Sets the value of a field, adding it if it doesn't exist. This may
+  // allocate a new shape, so the instance, `name`, and `value` must all be
+  // reachable by the GC when calling this.
+  void set_field(ObjString* name, Value value, GC& gc);
 
   std::string to_repr() const override {
     return "<instance of " + klass->to_repr() + ">";
   }
+  size_t heap_size() const override {
+    return fields.capacity() * sizeof(Value);
+  }
 
   static constexpr ObjType static_type = ObjType::INSTANCE;
   static constexpr std::string_view static_type_name = "ObjInstance";
@@ -196,6 +453,26 @@ public:
   static constexpr std::string_view static_type_name = "ObjBoundMethod";
 };
 
+// A list, e.g. `[1, 2, 3]`. The elements are stored contiguously, so the bulk
+// natives (see list_kernels.hpp) can work on runs of numbers directly.
+class ObjList : public Obj {
+public:
+  // NOTE: After storing an object in here, call GC::write_barrier on the
+  // list.
+  std::vector<Value> elements;
+
+  explicit ObjList(std::vector<Value> elements)
+      : Obj(static_type), elements(std::move(elements)) {}
+
+  std::string to_repr() const override;
+  size_t heap_size() const override {
+    return elements.capacity() * sizeof(Value);
+  }
+
+  static constexpr ObjType static_type = ObjType::LIST;
+  static constexpr std::string_view static_type_name = "ObjList";
+};
+
 // Convert a `Value` to a specific ObjFoo* type
 template <typename T> T* as_objptr(Value value, const std::string& error_msg) {
   if (!is_obj(value)) {
@@ -215,7 +492,12 @@ template <typename T> T* as_objptr_unsafe(Value value) {
 
 bool is_truthy(const Value& value);
 bool is_equal(const Value& a, const Value& b);
+// Implements `+`: adds two numbers, or concatenates two strings (which may
+// produce an ObjRope).
 Value add(const Value& a, const Value& b, GC& gc);
+// Concatenates two strings into an interned ObjString, never a rope. This is
+// for constant folding, since constants have to be ObjStrings.
+ObjString* concatenate(const ObjString* a, const ObjString* b, GC& gc);
 
 // NOTE: Operators like these should (best) be declared in the same namespace
 // as the type they operate on. The compiler will be able to find them via
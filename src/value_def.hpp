@@ -40,6 +40,14 @@ constexpr Value from_bool(const bool& b) {
 constexpr bool is_nil(const Value& value) { return value.data == NIL; }
 constexpr Value nil_val() { return Value{NIL}; }
 
+// Sentinel for global variable slots that have been assigned by the compiler
+// but not yet defined at runtime. Lox code can never produce this value.
+constexpr uint64_t UNDEFINED = QNAN | 4;
+constexpr bool is_undefined(const Value& value) {
+  return value.data == UNDEFINED;
+}
+constexpr Value undefined_val() { return Value{UNDEFINED}; }
+
 constexpr uint64_t OBJ_MASK = 0xFFFF000000000000;
 constexpr uint64_t OBJ_VAL_MASK = 0x0000FFFFFFFFFFFF;
 
@@ -73,6 +81,13 @@ constexpr bool is_nil(const Value& value) {
   return std::holds_alternative<std::monostate>(value);
 }
 constexpr Value nil_val() { return std::monostate{}; }
+// Sentinel for global variable slots that have been assigned by the compiler
+// but not yet defined at runtime. We use a null Obj* since no real object can
+// live there.
+constexpr bool is_undefined(const Value& value) {
+  return std::holds_alternative<Obj*>(value) && std::get<Obj*>(value) == nullptr;
+}
+constexpr Value undefined_val() { return static_cast<Obj*>(nullptr); }
 
 constexpr Value from_bool(bool b) { return b; }
 constexpr Value from_double(double d) { return d; }
@@ -1,33 +1,243 @@
 #include "vm.hpp"
+#include "bytecode.hpp"
 #include "chunk.hpp"
 #include "gc.hpp"
+#include "list_kernels.hpp"
+#include "optimise.hpp"
+#include "register_code.hpp"
 #include "value_def.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <fstream>
 #include <iostream>
 #include <stdexcept>
-#include <thread>
 
 namespace {
-lox::Value clock_native(size_t, const lox::Value*) {
+lox::Value clock_native(lox::NativeContext&) {
   return lox::from_double(static_cast<double>(std::clock()) / CLOCKS_PER_SEC);
 }
-lox::Value sleep_native(size_t, const lox::Value* args) {
-  if (!lox::is_double(args[0])) {
-    throw std::runtime_error("sleep expects one numeric argument");
+lox::Value sleep_native(lox::NativeContext& context, lox::Value duration) {
+  if (!lox::is_double(duration)) {
+    return context.fail("sleep expects one numeric argument");
   }
-  double seconds = lox::as_double(args[0]);
-  if (seconds < 0) {
-    throw std::runtime_error("sleep duration must be non-negative");
+  double seconds = lox::as_double(duration);
+  if (!(seconds >= 0)) {
+    return context.fail("sleep duration must be non-negative");
   }
-  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
-  return lox::Value{}; // return nil
+  // Only the current fiber sleeps; the others carry on in the meantime. (The
+  // cap is so that converting it to the clock's units can't overflow.)
+  static_cast<lox::VM*>(context.userdata)
+      ->sleep(std::chrono::duration<double>(std::min(seconds, 1e9)));
+  return lox::nil_val();
+}
+lox::Value spawn_native(lox::NativeContext& context, lox::Value function) {
+  lox::ObjFiber* fiber = nullptr;
+  if (lox::is_obj(function) &&
+      lox::as_obj(function)->type == lox::ObjType::CLOSURE) {
+    fiber = static_cast<lox::VM*>(context.userdata)
+                ->spawn(static_cast<lox::ObjClosure*>(lox::as_obj(function)));
+  }
+  if (fiber == nullptr) {
+    return context.fail("spawn expects a function that takes no arguments");
+  }
+  return lox::from_obj(fiber);
+}
+lox::Value yield_native(lox::NativeContext& context) {
+  static_cast<lox::VM*>(context.userdata)->yield();
+  return lox::nil_val();
+}
+lox::Value join_native(lox::NativeContext& context, lox::Value fiber_value) {
+  if (!lox::is_obj(fiber_value) ||
+      lox::as_obj(fiber_value)->type != lox::ObjType::FIBER) {
+    return context.fail("join expects a fiber");
+  }
+  auto vm = static_cast<lox::VM*>(context.userdata);
+  auto fiber = static_cast<lox::ObjFiber*>(lox::as_obj(fiber_value));
+  if (fiber->state == lox::ObjFiber::State::DONE) {
+    return fiber->result;
+  }
+  if (fiber == vm->running_fiber()) {
+    return context.fail("a fiber can't join itself");
+  }
+  // When `fiber` finishes, it resumes this one with its result.
+  fiber->joiners.push_back(vm->suspend());
+  vm->gc().write_barrier(fiber);
+  return lox::nil_val();
+}
+lox::Value gc_stats_native(lox::NativeContext& context) {
+  return static_cast<lox::VM*>(context.userdata)->gc_stats_instance();
+}
+
+// Check that `index` can be used to index into `list` (i.e. that it's an
+// integer in range), and convert it.
+size_t list_index(const lox::ObjList* list, lox::Value index) {
+  if (!lox::is_double(index)) {
+    throw std::runtime_error("list index must be a number");
+  }
+  double i = lox::as_double(index);
+  if (i != std::trunc(i)) {
+    throw std::runtime_error("list index must be an integer");
+  }
+  if (i < 0 || i >= static_cast<double>(list->elements.size())) {
+    throw std::runtime_error("list index out of range");
+  }
+  return static_cast<size_t>(i);
+}
+// nullptr if `value` isn't a list.
+lox::ObjList* as_list(lox::Value value) {
+  if (!lox::is_obj(value) || lox::as_obj(value)->type != lox::ObjType::LIST) {
+    return nullptr;
+  }
+  return static_cast<lox::ObjList*>(lox::as_obj(value));
+}
+lox::Value list_native(lox::NativeContext& context, lox::Value length,
+                       lox::Value value) {
+  double n = lox::is_double(length) ? lox::as_double(length) : -1;
+  if (!(n >= 0 && n <= UINT32_MAX) || n != std::trunc(n)) {
+    return context.fail("list expects a non-negative integer length");
+  }
+  // `value` is still on the stack, so it can't be freed by this allocation.
+  auto list = static_cast<lox::VM*>(context.userdata)
+                  ->gc()
+                  .alloc<lox::ObjList>(
+                      std::vector<lox::Value>(static_cast<size_t>(n), value));
+  return lox::from_obj(list);
+}
+lox::Value len_native(lox::NativeContext& context, lox::Value xs) {
+  lox::ObjList* list = as_list(xs);
+  if (list == nullptr) {
+    return context.fail("len expects a list");
+  }
+  return lox::from_double(static_cast<double>(list->elements.size()));
+}
+lox::Value append_native(lox::NativeContext& context, lox::Value xs,
+                         lox::Value value) {
+  lox::ObjList* list = as_list(xs);
+  if (list == nullptr) {
+    return context.fail("append expects a list");
+  }
+  list->elements.push_back(value);
+  static_cast<lox::VM*>(context.userdata)->gc().write_barrier(list);
+  return lox::nil_val();
+}
+lox::Value fill_native(lox::NativeContext& context, lox::Value xs,
+                       lox::Value value) {
+  lox::ObjList* list = as_list(xs);
+  if (list == nullptr) {
+    return context.fail("fill expects a list");
+  }
+  lox::list_kernels::fill(list->elements, value);
+  static_cast<lox::VM*>(context.userdata)->gc().write_barrier(list);
+  return lox::nil_val();
+}
+lox::Value sum_native(lox::NativeContext& context, lox::Value xs) {
+  lox::ObjList* list = as_list(xs);
+  if (list == nullptr || !lox::list_kernels::all_numbers(list->elements)) {
+    return context.fail("sum expects a list of numbers");
+  }
+  return lox::from_double(lox::list_kernels::sum(list->elements));
+}
+lox::Value scale_native(lox::NativeContext& context, lox::Value xs,
+                        lox::Value factor) {
+  lox::ObjList* list = as_list(xs);
+  if (list == nullptr || !lox::list_kernels::all_numbers(list->elements) ||
+      !lox::is_double(factor)) {
+    return context.fail("scale expects a list of numbers and a number");
+  }
+  // Numbers aren't objects, so this doesn't need a write barrier.
+  lox::list_kernels::scale(list->elements, lox::as_double(factor));
+  return lox::nil_val();
+}
+lox::Value dot_native(lox::NativeContext& context, lox::Value xs,
+                      lox::Value ys) {
+  lox::ObjList* a = as_list(xs);
+  lox::ObjList* b = as_list(ys);
+  if (a == nullptr || b == nullptr ||
+      !lox::list_kernels::all_numbers(a->elements) ||
+      !lox::list_kernels::all_numbers(b->elements)) {
+    return context.fail("dot expects two lists of numbers");
+  }
+  if (a->elements.size() != b->elements.size()) {
+    return context.fail("dot expects lists of the same length");
+  }
+  return lox::from_double(lox::list_kernels::dot(a->elements, b->elements));
+}
+
+void define_builtin_natives(lox::VM& vm) {
+  vm.define_native<clock_native>("clock");
+  vm.define_native<sleep_native>("sleep", &vm);
+  vm.define_native<spawn_native>("spawn", &vm);
+  vm.define_native<yield_native>("yield", &vm);
+  vm.define_native<join_native>("join", &vm);
+  vm.define_native<gc_stats_native>("gcStats", &vm);
+  vm.define_native<list_native>("list", &vm);
+  vm.define_native<len_native>("len");
+  vm.define_native<append_native>("append", &vm);
+  vm.define_native<fill_native>("fill", &vm);
+  vm.define_native<sum_native>("sum");
+  vm.define_native<scale_native>("scale");
+  vm.define_native<dot_native>("dot");
+}
+
+lox::GC make_gc(const lox::InterpretOptions& options) {
+  lox::GC gc(options.gc_mode);
+  gc.set_pause_budget(options.gc_pause_budget);
+  return gc;
+}
+
+// Everything that happens after the top-level function has been compiled (or
+// loaded from bytecode): define the native functions, then invoke it.
+lox::InterpretResult run_toplevel(lox::VM& vm,
+                                  const lox::InterpretOptions& options,
+                                  bool streaming = false) {
+#ifdef LOX_TIME
+  auto start_time = std::chrono::steady_clock::now();
+#endif
+  define_builtin_natives(vm);
+  if (options.profile || !options.profile_folded_path.empty()) {
+    vm.enable_profiling();
+  }
+  if (options.line_buffered) {
+    vm.output().set_mode(lox::OutputBuffer::Mode::LINE);
+  }
+  vm.set_tier_up_threshold(options.tier_up_threshold);
+  lox::InterpretResult retval =
+      streaming ? vm.compile_and_run_streaming() : vm.invoke_toplevel();
+  vm.output().flush();
+#ifdef LOX_TIME
+  auto run_done_time = std::chrono::steady_clock::now();
+  auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      run_done_time - start_time);
+  std::cerr << "Execution: " << elapsed_us.count() << " us\n";
+  vm.get_tier_timings().report(std::cerr, elapsed_us);
+#endif
+#ifdef LOX_PROFILE_OPCODES
+  vm.report_opcode_profile(std::cerr);
+#endif
+  if (options.gc_stats) {
+    vm.gc_stats().write_json(std::cerr);
+  }
+  if (const lox::Profiler* profiler = vm.get_profiler()) {
+    profiler->report(std::cerr);
+    if (!options.profile_folded_path.empty()) {
+      std::ofstream out(options.profile_folded_path);
+      profiler->write_folded_stacks(out);
+      if (!out) {
+        std::cerr << "Could not write file \"" << options.profile_folded_path
+                  << "\"\n";
+      }
+    }
+  }
+  return retval;
 }
 } // namespace
 
 namespace lox {
 
-lox::InterpretResult interpret(std::string_view source) {
+lox::InterpretResult interpret(std::string_view source,
+                               const InterpretOptions& options) {
 #ifdef LOX_TIME
   auto start_time = std::chrono::steady_clock::now();
 #endif
@@ -35,12 +245,16 @@ lox::InterpretResult interpret(std::string_view source) {
   // perform any scanning. Scanning will happen on demand!
   std::unique_ptr<scanner::Scanner> scanner =
       std::make_unique<scanner::Scanner>(source);
-  Chunk chunk;
-  GC gc;
   // Create a top-level ObjFunction
-  VM vm(std::move(scanner), std::move(gc));
+  VM vm(std::move(scanner), make_gc(options), options.max_call_depth);
+  if (options.streaming) {
+    return run_toplevel(vm, options, true);
+  }
   InterpretResult compile_result = vm.compile();
   if (compile_result != InterpretResult::OK) {
+    if (options.gc_stats) {
+      vm.gc_stats().write_json(std::cerr);
+    }
     return compile_result;
   }
 #ifdef LOX_TIME
@@ -48,32 +262,75 @@ lox::InterpretResult interpret(std::string_view source) {
   auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
       compile_done_time - start_time);
   std::cerr << "Compilation: " << elapsed_us.count() << " us\n";
+  lox::optimise::report_pass_timings(std::cerr);
 #endif
-  // Then invoke it
-  vm.define_native("clock", 0, clock_native);
-  vm.define_native("sleep", 1, sleep_native);
-  InterpretResult retval = vm.invoke_toplevel();
+  return run_toplevel(vm, options);
+}
+
+lox::InterpretResult compile_to_bytecode(std::string_view source,
+                                         std::ostream& out) {
+  VM vm(std::make_unique<scanner::Scanner>(source), GC());
+  InterpretResult compile_result = vm.compile();
+  if (compile_result != InterpretResult::OK) {
+    return compile_result;
+  }
+  try {
+    vm.write_bytecode(out, bytecode::hash_source(source));
+  } catch (const std::runtime_error& e) {
+    std::cerr << "Could not write bytecode: " << e.what() << "\n";
+    return InterpretResult::COMPILE_ERROR;
+  }
+  return InterpretResult::OK;
+}
+
+lox::InterpretResult interpret_bytecode(std::span<const uint8_t> bytes,
+                                        const InterpretOptions& options) {
 #ifdef LOX_TIME
-  auto run_done_time = std::chrono::steady_clock::now();
-  elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
-      run_done_time - compile_done_time);
-  std::cerr << "Execution: " << elapsed_us.count() << " us\n";
+  auto start_time = std::chrono::steady_clock::now();
 #endif
-  return retval;
+  // The VM still needs a scanner, but it never gets used.
+  VM vm(std::make_unique<scanner::Scanner>(""), make_gc(options),
+        options.max_call_depth);
+  InterpretResult load_result = vm.load_bytecode(bytes);
+  if (load_result != InterpretResult::OK) {
+    if (options.gc_stats) {
+      vm.gc_stats().write_json(std::cerr);
+    }
+    return load_result;
+  }
+#ifdef LOX_TIME
+  auto load_done_time = std::chrono::steady_clock::now();
+  auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      load_done_time - start_time);
+  std::cerr << "Loading bytecode: " << elapsed_us.count() << " us\n";
+#endif
+  return run_toplevel(vm, options);
 }
 
-VM::VM(std::unique_ptr<scanner::Scanner> scanner, GC gc)
-    : _gc(std::move(gc)), parser() {
-  call_frames.reserve(MAX_CALL_FRAMES);
-  // NOTE: By reserving memory here we avoid having to reallocate when we call
-  // push_back. That means that we don't need to do what the book does by having
-  // stack_pop decrement a pointer: we can just make stack_pop call pop_back()
-  // on the stack. That allows us to keep track of the stack size using
-  // stack.size() rather than a separate variable, which can get out of sync.
-  stack.reserve(MAX_STACK_SIZE);
+Session::Session(const InterpretOptions& options)
+    : vm(std::make_unique<scanner::Scanner>(""), make_gc(options),
+         options.max_call_depth) {
+  define_builtin_natives(vm);
+  if (options.line_buffered) {
+    vm.output().set_mode(OutputBuffer::Mode::LINE);
+  }
+  vm.set_tier_up_threshold(options.tier_up_threshold);
+}
+
+VM::VM(std::unique_ptr<scanner::Scanner> scanner, GC gc,
+       size_t max_call_depth)
+    : call_frames(std::make_unique<CallFrame[]>(max_call_depth)),
+      max_call_depth(max_call_depth),
+      stack(std::make_unique<lox::Value[]>(max_call_depth *
+                                           STACK_SLOTS_PER_FRAME)),
+      stack_top(stack.get()),
+      max_stack_size(max_call_depth * STACK_SLOTS_PER_FRAME),
+      _gc(std::move(gc)), parser(),
+      fiber_call_depth(std::min(max_call_depth, FIBER_MAX_CALL_DEPTH)) {
   ObjString* top_level_str = _gc.get_string_ptr("#toplevel#");
   auto top_level_fn = _gc.alloc<ObjFunction>(top_level_str, size_t(0));
-  parser = std::make_unique<Parser>(std::move(scanner), top_level_fn, _gc);
+  parser = std::make_unique<Parser>(std::move(scanner), top_level_fn, _gc,
+                                    globals);
   initString = _gc.get_string_ptr("init");
   // Aggressive GC: run it every time we allocate
   _gc.set_alloc_callback([this]() { this->maybe_gc(); });
@@ -91,6 +348,24 @@ lox::InterpretResult VM::compile() {
   return InterpretResult::OK;
 }
 
+lox::InterpretResult VM::load_bytecode(std::span<const uint8_t> bytes) {
+  bytecode::Reader reader(bytes, _gc, globals);
+  bytecode_reader = &reader;
+  try {
+    top_level_fn = reader.read();
+  } catch (const std::runtime_error& e) {
+    bytecode_reader = nullptr;
+    std::cerr << "Could not load bytecode: " << e.what() << "\n";
+    return InterpretResult::COMPILE_ERROR;
+  }
+  bytecode_reader = nullptr;
+  return InterpretResult::OK;
+}
+
+void VM::write_bytecode(std::ostream& out, uint64_t source_hash) const {
+  bytecode::write(out, top_level_fn, globals, source_hash);
+}
+
 lox::InterpretResult VM::invoke_toplevel() {
   // Earlier we reserved stack slot zero for the VM. We have to mirror that
   // here. We push top_level_fn to the stack first so that it doesn't get
@@ -107,85 +382,134 @@ lox::InterpretResult VM::invoke_toplevel() {
   return result;
 }
 
+lox::InterpretResult VM::compile_and_run_streaming() {
+  // Note that each declaration can only be compiled after the previous ones
+  // have run, so a compile error is only reported once everything before it
+  // has been executed.
+  while (!parser->at_end()) {
+    ObjString* name = _gc.get_string_ptr("#toplevel#");
+    stack_push(from_obj(name));
+    // This replaces the previous declaration's function, which isn't
+    // referenced by anything else now that it's finished running, so the GC
+    // can free it (and its chunk).
+    top_level_fn = _gc.alloc<ObjFunction>(name, size_t(0));
+    stack_pop();
+    top_level_fn = parser->next_declaration(top_level_fn);
+    if (top_level_fn == nullptr) {
+      return InterpretResult::COMPILE_ERROR;
+    }
+    more_declarations = !parser->at_end();
+    InterpretResult result = invoke_toplevel();
+    if (result != InterpretResult::OK) {
+      more_declarations = false;
+      return result;
+    }
+  }
+  return InterpretResult::OK;
+}
+
+lox::InterpretResult VM::eval(std::string_view source) {
+  ObjString* name = _gc.get_string_ptr("#toplevel#");
+  stack_push(from_obj(name));
+  // As in compile_and_run_streaming, this replaces the previous top-level
+  // function, which can now be freed.
+  top_level_fn = _gc.alloc<ObjFunction>(name, size_t(0));
+  stack_pop();
+  parser->reset(std::make_unique<scanner::Scanner>(source), top_level_fn);
+  InterpretResult result = compile();
+  if (result == InterpretResult::OK) {
+    result = invoke_toplevel();
+  }
+  if (result == InterpretResult::RUNTIME_ERROR) {
+    unwind_after_error();
+  }
+  _output.flush();
+  return result;
+}
+
 VM& VM::stack_reset() {
-  stack.clear();
+  stack_top = stack.get();
   return *this;
 }
 
-lox::Value* VM::stack_top_address() {
-  if (stack.empty()) {
-    error("stack_top_address: stack underflow");
-  }
-  return &stack.back();
+void VM::unwind_after_error() {
+  // Closures that escaped (e.g. by being assigned to a global) may still have
+  // upvalues pointing into the stack, so those have to be closed first.
+  close_upvalues_after(stack.get());
+  stack_reset();
+  frame_count = 0;
 }
 
+// NOTE: These are only used outside the main VM loop (VM::run has its own
+// unchecked versions, see PUSH/POP/PEEK below), so it doesn't hurt to check
+// the bounds here.
 void VM::stack_push(const lox::Value& value) {
-  if (stack.size() >= MAX_STACK_SIZE) {
+  if (stack_size() >= max_stack_size) {
     error("stack overflow");
   }
-  stack.push_back(value);
+  *stack_top++ = value;
 }
 
 lox::Value VM::stack_pop() {
-  if (stack.empty()) {
+  if (stack_top == stack.get()) {
     error("stack_pop: stack underflow");
   }
-  Value value = std::move(stack.back());
-  stack.pop_back();
-  return value;
+  return *--stack_top;
 }
 
 lox::Value VM::stack_peek() {
-  if (stack.empty()) {
+  if (stack_top == stack.get()) {
     error("stack_peek: stack underflow");
   }
-  return stack.back();
+  return stack_top[-1];
 }
 
 void VM::close_upvalues_after(Value* addr) {
-  for (auto it = open_upvalues.begin(); it != open_upvalues.end();) {
-    // `it` iterates over a vector of ObjUpvalue*, so we have to dereference
-    // it to get the ObjUpvalue* itself.
-    auto upvalue_ptr = *it;
-    if (upvalue_ptr->location >= addr) {
+  // Because open_upvalues is sorted, the ones we need to close are all at the
+  // back, and we can stop as soon as we reach one below `addr`.
+  while (!open_upvalues.empty() && open_upvalues.back()->location >= addr) {
+    ObjUpvalue* upvalue_ptr = open_upvalues.back();
 #ifdef LOX_DEBUG
-      std::cerr << "closing upvalue at location " << upvalue_ptr->location
-                << " with value " << *(upvalue_ptr->location) << "\n";
+    std::cerr << "closing upvalue at location " << upvalue_ptr->location
+              << " with value " << *(upvalue_ptr->location) << "\n";
 #endif
-      upvalue_ptr->closed = *(upvalue_ptr->location);
-      upvalue_ptr->location = &(upvalue_ptr->closed);
-      it = open_upvalues.erase(it);
-    } else {
-      ++it;
-    }
+    upvalue_ptr->closed = *(upvalue_ptr->location);
+    upvalue_ptr->location = &(upvalue_ptr->closed);
+    _gc.write_barrier(upvalue_ptr);
+    open_upvalues.pop_back();
   }
 }
 
-lox::Value
-VM::stack_modify_top(const std::function<lox::Value(const lox::Value&)>& op) {
-  if (stack.empty()) {
-    error("stack_modify_top: stack underflow");
+ObjUpvalue* VM::capture_upvalue(Value* local) {
+  // Search from the back: locals being captured are usually in the current
+  // call frame, i.e. near the top of the stack, so this is a short scan.
+  // NOTE: `rbegin()` and `rend()` give reverse iterators, which go backwards
+  // through the vector when incremented.
+  auto it = open_upvalues.rbegin();
+  while (it != open_upvalues.rend() && (*it)->location > local) {
+    ++it;
   }
-  Value& value = stack.back();
-  value = op(value);
-  return value;
-}
-
-void VM::stack_replace_top(const lox::Value& new_value) {
-  if (stack.empty()) {
-    error("stack_replace_top: stack underflow");
+  if (it != open_upvalues.rend() && (*it)->location == local) {
+    return *it;
   }
-  stack.back() = new_value;
+  // Not found so we can create a new upvalue. Allocating doesn't change
+  // open_upvalues, so `it` is still valid afterwards.
+  ObjUpvalue* upvalue = _gc.alloc<ObjUpvalue>(local);
+  // NOTE: `it.base()` is the (forward) iterator pointing one element after
+  // `*it`, which is exactly where the new upvalue needs to go to keep the
+  // vector sorted. Most of the time that's the end, so this is a push_back.
+  open_upvalues.insert(it.base(), upvalue);
+  return upvalue;
 }
 
 std::ostream& VM::stack_dump(std::ostream& out) const {
-  if (stack.empty()) {
+  if (stack_top == stack.get()) {
     out << "          <empty stack>\n";
     return out;
   }
   out << "          ";
-  for (const auto& v : stack) {
-    out << "[" << v << "]";
+  for (const Value* v = stack.get(); v != stack_top; ++v) {
+    out << "[" << *v << "]";
   }
   out << "\n";
   return out;
@@ -197,468 +521,983 @@ void VM::error(const std::string& message) {
   throw std::runtime_error("line " + std::to_string(line) + ": " + message);
 }
 
+void VM::arity_error(size_t arity, size_t arg_count) {
+  throw std::runtime_error("expected " + std::to_string(arity) +
+                           " arguments but got " + std::to_string(arg_count));
+}
+
+void VM::call_depth_error() {
+  throw std::runtime_error("stack overflow: too many nested function calls");
+}
+
 // Create a new call frame and update the VM's internal state so that we are
 // in that new frame. This function doesn't actually RUN the code in the
 // function; that's left to the VM loop!
-void VM::call(ObjClosure* callee, size_t arg_count, uint8_t* local_ip) {
-  if (call_frames.size() >= MAX_CALL_FRAMES) {
-    throw std::runtime_error("stack overflow: too many nested function calls");
+CallFrame* VM::call(ObjClosure* callee, size_t arg_count, uint8_t* local_ip) {
+  ObjFunction* function = callee->function;
+  if (function->arity != arg_count) [[unlikely]] {
+    arity_error(function->arity, arg_count);
+  }
+  if (++function->calls == tier_up_threshold) [[unlikely]] {
+    tier_up(function);
   }
-  // Check arity
-  if (callee->function->arity != arg_count) {
-    throw std::runtime_error("expected " +
-                             std::to_string(callee->function->arity) +
-                             " arguments but got " + std::to_string(arg_count));
+  if (frame_count == max_call_depth) [[unlikely]] {
+    call_depth_error();
+  }
+  // This is the only place where we check for stack overflow. We know the
+  // maximum number of slots that the callee can use, so if that fits, none of
+  // the pushes inside VM::run need to be checked.
+  size_t stack_start = stack_size() - arg_count - 1;
+  if (stack_start + function->max_stack_depth > max_stack_size) [[unlikely]] {
+    throw std::runtime_error("stack overflow");
   }
 
-  // Store the current ip in the call frame before we change it. local_ip can be
-  // nullptr for the very top-level function: at that point, current_frame
-  // hasn't even been set, so we can't do any of this.
+  // Store the current ip in the call frame before we change it. local_ip is
+  // nullptr for the very top-level function, since there's no caller then.
   if (local_ip != nullptr) {
-    Chunk* current_chunk = get_chunk_ptr();
-    uint8_t* chunk_begin = current_chunk->begin_location();
-    uint8_t* chunk_end = current_chunk->end_location();
-    if (local_ip < chunk_begin || local_ip >= chunk_end) {
+#ifdef LOX_DEBUG
+    Chunk* current_chunk = current_frame().chunk;
+    const RegisterCode* register_code =
+        current_frame().closure->function->register_code.get();
+    if ((local_ip < current_chunk->begin_location() ||
+         local_ip >= current_chunk->end_location()) &&
+        (register_code == nullptr || !register_code->contains(local_ip))) {
       throw std::runtime_error("internal error: call: local_ip out of bounds");
     }
-    // static_cast is now safe since we checked it
-    current_frame().ip = static_cast<size_t>(local_ip - chunk_begin);
+#endif
+    current_frame().ip = local_ip;
   }
 
   // Begin the next call frame.
-  size_t stack_start = stack.size() - arg_count - 1;
-  CallFrame new_frame(callee, 0, stack_start);
-  call_frames.push_back(new_frame);
+  CallFrame* frame = &call_frames[frame_count++];
+  frame->closure = callee;
+  frame->chunk = &function->chunk;
+  frame->constants = function->chunk.get_constants().data();
+  frame->ip = function->entry_point();
+  frame->slots = stack.get() + stack_start;
+  return frame;
+}
+
+void VM::tier_up(ObjFunction* function) {
+#ifdef LOX_PROFILE_OPCODES
+  // OpcodeProfile only knows about bytecode.
+  bool profiling = true;
+#else
+  bool profiling = profiler != nullptr;
+#endif
+  if (function->tier_up_attempted || tier_up_threshold == 0 || profiling) {
+    return;
+  }
+  function->tier_up_attempted = true;
+#ifdef LOX_TIME
+  tier_timings.charge();
+  auto start_time = std::chrono::steady_clock::now();
+#endif
+  function->register_code = compile_register_code(*function);
+#ifdef LOX_TIME
+  tier_timings.compile_time += std::chrono::steady_clock::now() - start_time;
+  (function->register_code ? tier_timings.compiled
+                           : tier_timings.unsupported)++;
+  tier_timings.skip();
+#endif
+}
+
+#ifdef LOX_TIME
+void TierTimings::report(std::ostream& os,
+                         std::chrono::microseconds execution) const {
+  auto compile_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(compile_time);
+  // Everything else is split between the tiers in proportion to their ticks.
+  double running_us =
+      static_cast<double>(std::max(execution - compile_us,
+                                   std::chrono::microseconds(0))
+                              .count());
+  uint64_t total_ticks = ticks[0] + ticks[1];
+  double register_fraction =
+      total_ticks == 0 ? 0
+                       : static_cast<double>(ticks[1]) /
+                             static_cast<double>(total_ticks);
+  auto register_us =
+      static_cast<long long>(running_us * register_fraction + 0.5);
+  os << "  Interpreter: "
+     << static_cast<long long>(running_us + 0.5) - register_us << " us\n";
+  os << "  Register tier: " << register_us << " us\n";
+  os << "  Register tier compilation: " << compile_us.count() << " us ("
+     << compiled << " functions compiled, " << unsupported
+     << " unsupported)\n";
+  // Every tick in VM::run should have gone to exactly one of the tiers or
+  // been skipped; if not, the split above is meaningless.
+  uint64_t accounted_ticks = total_ticks + skipped_ticks;
+  uint64_t discrepancy = accounted_ticks > run_ticks
+                             ? accounted_ticks - run_ticks
+                             : run_ticks - accounted_ticks;
+  if (discrepancy > run_ticks / 100) {
+    os << "  Warning: the tiers account for " << accounted_ticks
+       << " ticks, but " << run_ticks << " were spent running\n";
+  }
+}
+#endif
+
+bool VM::call_native(ObjNativeFunction* native, size_t arg_count,
+                     uint8_t* local_ip) {
+  if (native->arity != arg_count) [[unlikely]] {
+    arity_error(native->arity, arg_count);
+  }
+  NativeContext context{native->userdata};
+  Value retval = native->function(context, stack_top - arg_count);
+  if (context.error != nullptr) [[unlikely]] {
+    throw std::runtime_error(context.error);
+  }
+  // Pop the function and its arguments off the stack, and replace them with
+  // the return value.
+  stack_top -= arg_count;
+  stack_top[-1] = retval;
+  if (switch_pending) [[unlikely]] {
+    switch_pending = false;
+    current_frame().ip = local_ip;
+    // This can't be nullptr, since the fiber that was just running is either
+    // ready or waiting.
+    switch_to(scheduler.next());
+    return true;
+  }
+  return false;
+}
+
+ObjFiber* VM::running_fiber() {
+  if (current_fiber == nullptr) {
+    main_fiber = _gc.alloc<ObjFiber>();
+    main_fiber->state = ObjFiber::State::RUNNING;
+    current_fiber = main_fiber;
+  }
+  return current_fiber;
+}
+
+ObjFiber* VM::spawn(ObjClosure* entry) {
+  size_t slots = fiber_call_depth * STACK_SLOTS_PER_FRAME;
+  if (entry->function->arity != 0 || entry->function->max_stack_depth > slots) {
+    return nullptr;
+  }
+  // The main fiber needs somewhere to save its state before anything else
+  // can run.
+  running_fiber();
+  auto fiber = _gc.alloc<ObjFiber>(entry, fiber_call_depth, slots);
+  scheduler.spawn(fiber);
+  return fiber;
+}
+
+void VM::yield() {
+  if (scheduler.has_work()) {
+    scheduler.make_ready(running_fiber());
+    switch_pending = true;
+  }
+}
+
+void VM::sleep(std::chrono::duration<double> duration) {
+  scheduler.suspend_until(
+      running_fiber(),
+      Scheduler::Clock::now() +
+          std::chrono::duration_cast<Scheduler::Clock::duration>(duration));
+  switch_pending = true;
+}
+
+ObjFiber* VM::suspend() {
+  ObjFiber* fiber = running_fiber();
+  scheduler.suspend(fiber);
+  switch_pending = true;
+  return fiber;
+}
+
+void VM::resume(ObjFiber* fiber, lox::Value value) {
+  if (fiber->state != ObjFiber::State::SUSPENDED) {
+    return;
+  }
+  fiber->resume_value = value;
+  _gc.write_barrier(fiber);
+  scheduler.make_ready(fiber);
+}
+
+void VM::switch_to(ObjFiber* next) {
+  ObjFiber* prev = current_fiber;
+  if (next != prev) {
+    prev->call_frames = std::move(call_frames);
+    prev->frame_count = frame_count;
+    prev->max_call_depth = max_call_depth;
+    prev->stack = std::move(stack);
+    prev->stack_top = stack_top;
+    prev->max_stack_size = max_stack_size;
+    prev->open_upvalues = std::move(open_upvalues);
+    if (prev->state == ObjFiber::State::DONE && prev != main_fiber) {
+      prev->release();
+    }
+    // The saved stack can refer to anything.
+    _gc.write_barrier(prev);
+
+    call_frames = std::move(next->call_frames);
+    frame_count = next->frame_count;
+    max_call_depth = next->max_call_depth;
+    stack = std::move(next->stack);
+    stack_top = next->stack_top;
+    max_stack_size = next->max_stack_size;
+    open_upvalues = std::move(next->open_upvalues);
+    next->frame_count = 0;
+    next->stack_top = nullptr;
+    next->open_upvalues.clear();
+    current_fiber = next;
+  }
+  next->state = ObjFiber::State::RUNNING;
+  if (next->resume_value.has_value()) {
+    // This is the slot where the native function that suspended the fiber
+    // left its return value.
+    stack_top[-1] = *next->resume_value;
+    next->resume_value.reset();
+  }
+}
+
+bool VM::finish_fiber(lox::Value retval) {
+  if (current_fiber == nullptr) {
+    // No fibers have ever been used.
+    return false;
+  }
+  if (current_fiber == main_fiber && more_declarations) {
+    // The other fibers carry on once the next declaration has been compiled.
+    return false;
+  }
+  if (current_fiber != main_fiber) {
+    current_fiber->result = retval;
+    for (ObjFiber* joiner : current_fiber->joiners) {
+      resume(joiner, retval);
+    }
+    current_fiber->joiners.clear();
+    scheduler.finish(current_fiber);
+    _gc.write_barrier(current_fiber);
+  }
+  ObjFiber* next = scheduler.next();
+  if (next == nullptr) {
+    // Every fiber has finished, including the main one (otherwise it would
+    // still be ready or waiting).
+    switch_to(main_fiber);
+    return false;
+  }
+  switch_to(next);
+  return true;
+}
+
+void VM::abandon_fibers() {
+  switch_pending = false;
+  if (current_fiber == nullptr) {
+    return;
+  }
+  main_fiber->resume_value.reset();
+  switch_to(main_fiber);
+  // Like close_upvalues_after(), for the fibers that aren't running.
+  for (ObjFiber* fiber : scheduler.get_live()) {
+    for (ObjUpvalue* upvalue : fiber->open_upvalues) {
+      upvalue->closed = *(upvalue->location);
+      upvalue->location = &(upvalue->closed);
+      _gc.write_barrier(upvalue);
+    }
+  }
+  scheduler.clear();
 }
 
-VM& VM::define_native(
-    const std::string& name, size_t arity,
-    std::function<lox::Value(size_t, const lox::Value*)> function) {
-  auto native_fn = _gc.alloc<ObjNativeFunction>(name, arity, function);
-  globals.map[name] = from_obj(native_fn);
+VM& VM::define_native(std::string_view name, size_t arity, NativeFn function,
+                      void* userdata) {
+  auto native_fn =
+      _gc.alloc<ObjNativeFunction>(name, arity, function, userdata);
+  // Make sure that the native function isn't GC'd when we allocate the name.
+  stack_push(from_obj(native_fn));
+  globals.define(_gc.get_string_ptr(name), from_obj(native_fn));
+  stack_pop();
   return *this;
 }
 
+InlineCache::Entry VM::resolve_property(ObjInstance* instance, ObjString* name,
+                                        bool methods_first) {
+  InlineCache::Entry entry;
+  entry.shape = instance->shape;
+  const size_t* slot = instance->shape->find(name);
+  const auto& classmethods = instance->klass->methods;
+  auto method_itr = classmethods.find(name);
+  bool has_method = method_itr != classmethods.end();
+  if (slot != nullptr && !(methods_first && has_method)) {
+    entry.slot = *slot;
+  } else if (has_method) {
+    entry.method = method_itr->second;
+  } else {
+    throw std::runtime_error("undefined property '" + name->value + "'");
+  }
+  return entry;
+}
+
+InlineCache::Entry VM::lookup_property(Chunk* chunk, uint32_t cache_index,
+                                       ObjInstance* instance, ObjString* name,
+                                       bool methods_first) {
+  if (cache_index == NO_INLINE_CACHE) {
+    return resolve_property(instance, name, methods_first);
+  }
+  InlineCache& cache = chunk->inline_cache_at(cache_index);
+  if (const InlineCache::Entry* hit = cache.find(instance->shape)) {
+    return *hit;
+  }
+  InlineCache::Entry entry = resolve_property(instance, name, methods_first);
+  cache.insert(entry);
+  // The cache belongs to the function, which might already have been traced.
+  _gc.write_barrier(current_frame().closure->function);
+  return entry;
+}
+
+lox::Value VM::gc_stats_instance() {
+  // Take the snapshot first, so that it isn't affected by the allocations
+  // below.
+  GCStats stats = _gc.get_stats();
+  GCStats::TypeStats total = stats.total();
+
+  // Everything we allocate here has to stay on the stack until it's been
+  // attached to the instance, so that it isn't GC'd in the meantime.
+  ObjString* class_name = _gc.get_string_ptr("GCStats");
+  stack_push(from_obj(class_name));
+  auto klass = _gc.alloc<ObjClass>(class_name);
+  stack_push(from_obj(klass));
+  auto instance = _gc.alloc<ObjInstance>(klass, klass->get_root_shape(_gc));
+  stack_push(from_obj(instance));
+
+  auto set_field = [this, instance](const char* name, double value) {
+    ObjString* key = _gc.get_string_ptr(name);
+    stack_push(from_obj(key));
+    instance->set_field(key, from_double(value), _gc);
+    stack_pop();
+  };
+  auto us = [](std::chrono::nanoseconds ns) {
+    return std::chrono::duration<double, std::micro>(ns).count();
+  };
+  set_field("collections", static_cast<double>(stats.collections));
+  set_field("minorCollections", static_cast<double>(stats.minor_collections));
+  set_field("majorCollections", static_cast<double>(stats.major_collections));
+  set_field("incrementalSteps", static_cast<double>(stats.incremental_steps));
+  set_field("objectsAllocated", static_cast<double>(total.objects_allocated));
+  set_field("objectsFreed", static_cast<double>(total.objects_freed));
+  set_field("bytesAllocated", static_cast<double>(stats.bytes_allocated));
+  set_field("peakBytes", static_cast<double>(stats.peak_bytes));
+  set_field("bytesReserved", static_cast<double>(stats.bytes_reserved));
+  set_field("internedStrings", static_cast<double>(stats.interned_strings));
+  set_field("totalPauseUs", us(stats.total_pause));
+  set_field("maxPauseUs", us(stats.max_pause));
+
+  stack_pop();
+  stack_pop();
+  stack_pop();
+  return from_obj(instance);
+}
+
 // Note, we can't use a function for this since goto won't work from inside a
 // function
 #ifdef LOX_DEBUG
+// (The register tier doesn't keep `sp` up to date, so there's no stack to
+// dump while it's running.)
 #define DISPATCH()                                                             \
   do {                                                                         \
-    stack_dump(std::cerr);                                                     \
-    current_frame().ip =                                                       \
-        static_cast<size_t>(local_ip - chunkptr->begin_location());            \
-    current_frame().disassemble(std::cerr);                                    \
-    goto* dispatch_table[*local_ip++];                                         \
+    stack_top = sp;                                                            \
+    frame->ip = local_ip;                                                      \
+    if (!frame->in_register_code()) {                                          \
+      stack_dump(std::cerr);                                                   \
+    }                                                                          \
+    frame->disassemble(std::cerr);                                             \
+    goto* dispatch[*local_ip++];                                               \
+  } while (false)
+#elif defined(LOX_PROFILE_OPCODES)
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    opcode_profile.record(local_ip);                                           \
+    goto* dispatch[*local_ip++];                                               \
   } while (false)
 #else
-#define DISPATCH() goto* dispatch_table[*local_ip++]
+#define DISPATCH() goto* dispatch[*local_ip++]
 #endif
 
+// Stack manipulation inside VM::run. These operate on the local `sp` and so
+// don't do any bounds checking: VM::call already checked that the current
+// function's maximum stack depth fits.
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - static_cast<ptrdiff_t>(distance)])
+#define DROP(n) (sp -= (n))
+// Write the local stack pointer back to the VM. This has to be done before
+// anything that looks at the stack from outside VM::run, i.e. anything that
+// might allocate (and hence trigger GC), or call a function.
+#define SYNC_SP() (stack_top = sp)
+
+// Read an operand that follows a WIDE prefix.
+#define READ_WIDE_OPERAND()                                                    \
+  (local_ip += 3, lox::read_wide_operand(local_ip - 3))
+// Read a one-byte or wide operand.
+#define READ_OPERAND(width) ((width) == 1 ? *local_ip++ : READ_WIDE_OPERAND())
+
+#define BINARY_OP(op, conv_func)                                               \
+  do {                                                                         \
+    lox::Value b = POP();                                                      \
+    lox::Value a = PEEK(0);                                                    \
+    if (is_double(a) && is_double(b)) {                                        \
+      PEEK(0) = conv_func(as_double(a) op as_double(b));                       \
+    } else {                                                                   \
+      error("operands must be numbers");                                       \
+    }                                                                          \
+  } while (false)
+
+// The bodies of the instructions that can be in the PREFIX of a
+// superinstruction (see superinstruction_def.hpp), i.e. everything except the
+// final DISPATCH(). These only handle one-byte operands. The handlers for the
+// instructions themselves use them too, where they can.
+#define BODY_CONSTANT()                                                        \
+  do {                                                                         \
+    PUSH(constants[*local_ip++]);                                              \
+  } while (false)
+#define BODY_GET_LOCAL()                                                       \
+  do {                                                                         \
+    PUSH(frame_base[*local_ip++]);                                             \
+  } while (false)
+#define BODY_SET_LOCAL()                                                       \
+  do {                                                                         \
+    frame_base[*local_ip++] = PEEK(0);                                         \
+  } while (false)
+#define BODY_GET_UPVALUE()                                                     \
+  do {                                                                         \
+    PUSH(*frame->closure->upvalues.at(*local_ip++)->location);                 \
+  } while (false)
+#define BODY_GET_GLOBAL_SLOT()                                                 \
+  do {                                                                         \
+    uint8_t slot = *local_ip++;                                                \
+    lox::Value value = globals[slot];                                          \
+    if (is_undefined(value)) {                                                 \
+      error("undefined variable '" + globals.name_at(slot)->value + "'");      \
+    }                                                                          \
+    PUSH(value);                                                               \
+  } while (false)
+#define BODY_POP() DROP(1)
+#define BODY_NEGATE()                                                          \
+  do {                                                                         \
+    lox::Value value = PEEK(0);                                                \
+    if (is_double(value)) {                                                    \
+      PEEK(0) = from_double(-as_double(value));                                \
+    } else {                                                                   \
+      error("operand must be a number");                                       \
+    }                                                                          \
+  } while (false)
+#define BODY_NOT()                                                             \
+  do {                                                                         \
+    PEEK(0) = from_bool(!(lox::is_truthy(PEEK(0))));                           \
+  } while (false)
+#define BODY_ADD()                                                             \
+  do {                                                                         \
+    lox::Value b = PEEK(0);                                                    \
+    lox::Value a = PEEK(1);                                                    \
+    if (is_double(a) && is_double(b)) {                                        \
+      DROP(1);                                                                 \
+      PEEK(0) = from_double(as_double(a) + as_double(b));                      \
+    } else {                                                                   \
+      /* it's a string. Leave both operands on the stack while we              \
+         concatenate them, since that allocates. */                            \
+      SYNC_SP();                                                               \
+      lox::Value result = lox::add(a, b, _gc);                                 \
+      DROP(1);                                                                 \
+      PEEK(0) = result;                                                        \
+    }                                                                          \
+  } while (false)
+#define BODY_SUBTRACT() BINARY_OP(-, lox::from_double)
+#define BODY_MULTIPLY() BINARY_OP(*, lox::from_double)
+#define BODY_DIVIDE() BINARY_OP(/, lox::from_double)
+#define BODY_GREATER() BINARY_OP(>, lox::from_bool)
+#define BODY_LESS() BINARY_OP(<, lox::from_bool)
+#define BODY_EQUAL()                                                           \
+  do {                                                                         \
+    lox::Value b = POP();                                                      \
+    lox::Value a = PEEK(0);                                                    \
+    PEEK(0) = from_bool(lox::is_equal(a, b));                                  \
+  } while (false)
+// Inside a superinstruction, JUMP_IF_FALSE can only be followed by
+// instructions without operands, so local_ip is already at the end of the
+// superinstruction once we've read the offset.
+#define BODY_JUMP_IF_FALSE()                                                   \
+  do {                                                                         \
+    ptrdiff_t jump_offset = lox::get_jump_offset(local_ip[0], local_ip[1]);    \
+    local_ip += 2;                                                             \
+    if (!lox::is_truthy(PEEK(0))) {                                            \
+      local_ip += jump_offset;                                                 \
+      DISPATCH();                                                              \
+    }                                                                          \
+  } while (false)
+
 InterpretResult VM::run() {
+#ifdef LOX_TIME
+  // Only the time spent in here counts towards either tier.
+  struct TierTimer {
+    TierTimings& timings;
+    ~TierTimer() { timings.stop(); }
+  };
+  tier_timings.start();
+  TierTimer tier_timer{tier_timings};
+#endif
   try {
-    // Retain a pointer to the raw data, so that we don't have to keep going
-    // through current_frame().closure->function->chunk, which is very
-    // inefficient.
-    Chunk* chunkptr = get_chunk_ptr();
-    uint8_t* local_ip = chunkptr->location_at(current_frame().ip);
-    uint8_t* chunk_end = chunkptr->end_location();
-    // These variables have to be updated whenever we change the call frame
-    // (and dispatch_call() will let us know whether that happened).
+    // Keep copies of the current frame's fields in local variables, so that
+    // the compiler can keep them in registers.
+    CallFrame* frame = &current_frame();
+    Chunk* chunkptr = frame->chunk;
+    const lox::Value* constants = frame->constants;
+    uint8_t* local_ip = frame->ip;
+    // Likewise for the top of the stack, and the start of the current frame's
+    // slots on the stack (which is where its local variables live).
+    lox::Value* sp = stack_top;
+    lox::Value* frame_base = frame->slots;
+    // These variables have to be updated whenever we change the call frame.
+    // Every frame caches what we need, so this is just a few loads.
+    auto enter_frame = [&](CallFrame* new_frame) {
+      frame = new_frame;
+      chunkptr = frame->chunk;
+      constants = frame->constants;
+      local_ip = frame->ip;
+      frame_base = frame->slots;
+#ifdef LOX_TIME
+      tier_timings.enter(frame->in_register_code());
+#endif
+    };
+    // For when something other than VM::run changed the call frame (and
+    // dispatch_call() will let us know whether that happened). Note that this
+    // reloads `sp` too, so SYNC_SP() must have been called beforehand.
     auto update_chunk_and_ip = [&]() {
-      chunkptr = get_chunk_ptr();
-      local_ip = chunkptr->location_at(current_frame().ip);
-      chunk_end = chunkptr->end_location();
+      enter_frame(&current_frame());
+      sp = stack_top;
     };
+#ifdef LOX_TIME
+    tier_timings.enter(frame->in_register_code());
+#endif
 
+    // NOTE: Generic instructions that have quickened forms (see
+    // quickening_def.hpp) are dispatched to QUICKEN_<name>, which rewrites
+    // the instruction and then runs DO_<name>. That can't be done in DO_<name>
+    // itself, because superinstructions jump straight there, and then
+    // local_ip[-1] isn't the opcode.
     static void* dispatch_table[] = {
-#define DO_LABEL(name) &&DO_##name,
+#define DO_LABEL(name)                                                         \
+  OpCode::name == OpCode::ADD     ? &&QUICKEN_ADD                              \
+  : OpCode::name == OpCode::EQUAL ? &&QUICKEN_EQUAL                            \
+                                  : &&DO_##name,
         OPCODE_LIST(DO_LABEL)
+#define SUPERINSTRUCTION_LABEL(name, prefix, last) &&DO_##name,
+        SUPERINSTRUCTION_LIST(SUPERINSTRUCTION_LABEL)
+#define QUICKENED_LABEL(name, generic) &&DO_##name,
+        QUICKENED_LIST(QUICKENED_LABEL)
+#define REGISTER_LABEL(name, operands) &&REG_##name,
+        REGISTER_OP_LIST(REGISTER_LABEL)
+#undef REGISTER_LABEL
+#undef QUICKENED_LABEL
+#undef SUPERINSTRUCTION_LABEL
 #undef DO_LABEL
     };
+    // When profiling, every instruction is dispatched to PROFILE first, which
+    // then jumps to its real handler through dispatch_table.
+    static void* profiling_table[] = {
+#define PROFILE_LABEL(name) &&PROFILE,
+        OPCODE_LIST(PROFILE_LABEL)
+#define SUPERINSTRUCTION_PROFILE_LABEL(name, prefix, last) PROFILE_LABEL(name)
+        SUPERINSTRUCTION_LIST(SUPERINSTRUCTION_PROFILE_LABEL)
+#define QUICKENED_PROFILE_LABEL(name, generic) PROFILE_LABEL(name)
+        QUICKENED_LIST(QUICKENED_PROFILE_LABEL)
+        // (Never used, since there's no register tier while profiling.)
+#define REGISTER_PROFILE_LABEL(name, operands) PROFILE_LABEL(name)
+        REGISTER_OP_LIST(REGISTER_PROFILE_LABEL)
+#undef REGISTER_PROFILE_LABEL
+#undef QUICKENED_PROFILE_LABEL
+#undef SUPERINSTRUCTION_PROFILE_LABEL
+#undef PROFILE_LABEL
+    };
+    static_assert(std::size(profiling_table) == std::size(dispatch_table));
+    // DISPATCH() goes through this. Choosing the table once here (rather than
+    // checking whether we're profiling on every instruction) means that the
+    // normal path doesn't pay anything for the profiler.
+    void* const* const dispatch = profiler ? profiling_table : dispatch_table;
+
+    // Instructions store their operands here after reading them from the
+    // bytecode (see DO_WIDE for why).
+    uint32_t operand1 = 0;
+    uint32_t operand2 = 0;
+    uint32_t operand3 = 0;
+    // Extra state for CLOSURE and INVOKE, which are a bit different.
+    size_t closure_operand_width = 1;
+    bool methods_first = true;
 
     DISPATCH();
 
-  DO_CONSTANT: {
-    uint8_t constant_index = *local_ip++;
-    lox::Value c = chunkptr->constant_at(constant_index);
-    stack_push(c);
+  PROFILE:
+    // DISPATCH() has already moved local_ip past the opcode.
+    frame->ip = local_ip;
+    profiler->record(static_cast<OpCode>(local_ip[-1]), call_frames.get(),
+                     frame_count);
+    goto* dispatch_table[local_ip[-1]];
+
+  DO_CONSTANT:
+    operand1 = *local_ip++;
+  EXEC_CONSTANT: {
+    uint32_t constant_index = operand1;
+    lox::Value c = constants[constant_index];
+    PUSH(c);
     DISPATCH();
   }
-  DO_CLOSURE: {
-    uint8_t constant_index = *local_ip++;
-    lox::Value c = chunkptr->constant_at(constant_index);
+  DO_CLOSURE:
+    operand1 = *local_ip++;
+    closure_operand_width = 1;
+  EXEC_CLOSURE: {
+    uint32_t constant_index = operand1;
+    lox::Value c = constants[constant_index];
     // We know that `c` has to be a ObjFunction* here, so we can directly
     // use static_cast instead of checking the ObjType inside (even if it's
     // a bit dangerous)
     auto c_fn = as_objptr_unsafe<ObjFunction>(c);
     // avoid GCing the function while the closure is being created
-    stack_push(from_obj(c_fn));
+    PUSH(from_obj(c_fn));
+    SYNC_SP();
     auto c_clos = _gc.alloc<ObjClosure>(c_fn);
-    stack_pop();
-    // we'll push the closure to the stack first even though it's not
+    // we'll put the closure on the stack first even though it's not
     // complete, to avoid it being GC'd while we're making the upvalues.
-    stack_push(from_obj(c_clos));
+    PEEK(0) = from_obj(c_clos);
     for (size_t i = 0; i < c_fn->upvalues.size(); ++i) {
-      uint8_t is_local = *local_ip++;
-      uint8_t index = *local_ip++;
+      uint32_t is_local = READ_OPERAND(closure_operand_width);
+      uint32_t index = READ_OPERAND(closure_operand_width);
       if (is_local) {
         // The upvalue references a local variable in its parent function
         // (which is the current function! since we have just finished
         // compiling the inner function and have now exited back to the
         // parent).
-        Value* local_value = get_local_variable_address(index);
-        // local_value is somewhere on the stack. Let's check if the VM
-        // already has an open upvalue pointing to that stack slot. If so,
-        // we can reuse it.
-        // NOTE: lambda captures are kind of weird in C++! You can't use
-        // local_value inside the lambda unless you capture it by
-        // including it inside the square brackets (which is a capture
-        // list). Then there are also lots of different ways to capture
-        // things. You can capture by reference ([&something]) or by
-        // value ([something]), and you can also capture *everything* by
-        // reference ([&]) or by value ([=]).
-        // TODO: this is a bit suboptimal because our open_upvalues
-        // vector is not sorted. That means that every search is O(n). We
-        // could optimise this by keeping open_upvalues sorted and then
-        // stopping once we have passed the relevant stack slot. The book
-        // does this, but I didn't want to bother with the manual pointer
-        // stuff.
-        auto it = std::find_if(open_upvalues.begin(), open_upvalues.end(),
-                               [local_value](ObjUpvalue* upv) {
-                                 return upv->location == local_value;
-                               });
-        if (it != open_upvalues.end()) {
-          c_clos->upvalues.push_back(*it);
-        } else {
-          // Not found so we can create a new upvalue
-          ObjUpvalue* upvalue = _gc.alloc<ObjUpvalue>(local_value);
-          open_upvalues.push_back(upvalue);
-          c_clos->upvalues.push_back(upvalue);
-        }
+        // local_value is somewhere on the stack. If the VM already has an
+        // open upvalue pointing to that stack slot, it gets reused.
+        Value* local_value = frame_base + index;
+        c_clos->upvalues.push_back(capture_upvalue(local_value));
       } else {
         // The upvalue references an upvalue in the parent function, so we
         // can just copy the pointer to that upvalue.
-        c_clos->upvalues.push_back(current_frame().closure->upvalues.at(index));
+        c_clos->upvalues.push_back(frame->closure->upvalues.at(index));
       }
+      // Allocating an upvalue can trigger a GC, so the closure might not be
+      // young any more.
+      _gc.write_barrier(c_clos);
     }
     DISPATCH();
   }
-  DO_GET_UPVALUE: {
-    uint8_t upvalue_index = *local_ip++;
-    lox::ObjUpvalue* upvalue =
-        current_frame().closure->upvalues.at(upvalue_index);
+  DO_GET_UPVALUE:
+    operand1 = *local_ip++;
+  EXEC_GET_UPVALUE: {
+    uint32_t upvalue_index = operand1;
+    lox::ObjUpvalue* upvalue = frame->closure->upvalues.at(upvalue_index);
     lox::Value actual_value = *(upvalue->location);
-    stack_push(actual_value);
+    PUSH(actual_value);
     DISPATCH();
   }
-  DO_SET_UPVALUE: {
-    uint8_t upvalue_index = *local_ip++;
-    lox::ObjUpvalue* upvalue =
-        current_frame().closure->upvalues.at(upvalue_index);
-    lox::Value target_value = stack_peek();
+  DO_SET_UPVALUE:
+    operand1 = *local_ip++;
+  EXEC_SET_UPVALUE: {
+    uint32_t upvalue_index = operand1;
+    lox::ObjUpvalue* upvalue = frame->closure->upvalues.at(upvalue_index);
+    lox::Value target_value = PEEK(0);
     *(upvalue->location) = target_value;
+    // Only matters if the upvalue is closed (if it's open, `location` points
+    // into the stack), but checking that would cost as much as the barrier.
+    _gc.write_barrier(upvalue);
     DISPATCH();
   }
   DO_CLOSE_UPVALUE: {
     // This effectively only closes the upvalue that's at the top of the
     // stack.
-    close_upvalues_after(stack_top_address());
-    stack_pop();
+    close_upvalues_after(sp - 1);
+    DROP(1);
     DISPATCH();
   }
   DO_NEGATE: {
-    lox::Value value = stack_pop();
-    if (is_double(value)) {
-      stack_push(from_double(-as_double(value)));
-    } else {
-      error("operand must be a number");
-    }
+    BODY_NEGATE();
     DISPATCH();
   }
   DO_NOT: {
-    stack_modify_top([](const lox::Value& value) {
-      return from_bool(!(lox::is_truthy(value)));
-    });
+    BODY_NOT();
     DISPATCH();
   }
-  DO_ADD: {
-    lox::Value b = stack_pop();
-    lox::Value a = stack_peek();
-    if (is_double(a) && is_double(b)) {
-      // Attempts at perf optimisations using Instruments.app... don't think
-      // it made much of a difference though.
-      stack_replace_top(from_double(as_double(a) + as_double(b)));
-    } else {
-      // it's a string
-      stack_pop(); // pop a
-      stack_push(lox::add(a, b, _gc));
+  QUICKEN_ADD:
+    if (is_double(PEEK(0)) && is_double(PEEK(1))) {
+      local_ip[-1] = static_cast<uint8_t>(OpCode::ADD_NUM);
     }
+  DO_ADD: {
+    BODY_ADD();
     DISPATCH();
   }
+  DO_ADD_NUM: {
+    lox::Value b = PEEK(0);
+    lox::Value a = PEEK(1);
+    if (is_double(a) && is_double(b)) [[likely]] {
+      DROP(1);
+      PEEK(0) = from_double(as_double(a) + as_double(b));
+      DISPATCH();
+    }
+    local_ip[-1] = static_cast<uint8_t>(OpCode::ADD);
+    goto DO_ADD;
+  }
   DO_SUBTRACT: {
-    handle_binary_op([](double a, double b) { return a - b; },
-                     lox::from_double);
+    BODY_SUBTRACT();
     DISPATCH();
   }
   DO_MULTIPLY: {
-    handle_binary_op([](double a, double b) { return a * b; },
-                     lox::from_double);
+    BODY_MULTIPLY();
     DISPATCH();
   }
   DO_DIVIDE: {
-    handle_binary_op([](double a, double b) { return a / b; },
-                     lox::from_double);
+    BODY_DIVIDE();
     DISPATCH();
   }
+  QUICKEN_EQUAL:
+    if (is_double(PEEK(0)) && is_double(PEEK(1))) {
+      local_ip[-1] = static_cast<uint8_t>(OpCode::EQUAL_NUM);
+    }
   DO_EQUAL: {
-    lox::Value b = stack_pop();
-    lox::Value a = stack_pop();
-    stack_push(from_bool(lox::is_equal(a, b)));
+    BODY_EQUAL();
     DISPATCH();
   }
+  DO_EQUAL_NUM: {
+    // Unlike lox::is_equal, this doesn't need a function call.
+    lox::Value b = PEEK(0);
+    lox::Value a = PEEK(1);
+    if (is_double(a) && is_double(b)) [[likely]] {
+      DROP(1);
+      PEEK(0) = from_bool(as_double(a) == as_double(b));
+      DISPATCH();
+    }
+    local_ip[-1] = static_cast<uint8_t>(OpCode::EQUAL);
+    goto DO_EQUAL;
+  }
   DO_GREATER: {
-    handle_binary_op([](double a, double b) { return a > b; }, lox::from_bool);
+    BODY_GREATER();
     DISPATCH();
   }
   DO_LESS: {
-    handle_binary_op([](double a, double b) { return a < b; }, lox::from_bool);
+    BODY_LESS();
     DISPATCH();
   }
   DO_PRINT: {
-    lox::Value value = stack_pop();
-    // operator<< on Value is already defined to print the correct
-    // representation
-    std::cout << value << "\n";
+    _output.print_line(POP());
     DISPATCH();
   }
   DO_POP: {
-    stack_pop();
+    BODY_POP();
     DISPATCH();
   }
-  DO_DEFINE_GLOBAL: {
-    // The parser will have pushed the variable name (as a string) onto
-    // the chunk's constant table. Separately, in the bytecode, it will
-    // have a DEFINE_GLOBAL instruction followed by the constant index.
-    // When we get here we have already seen the DEFINE_GLOBAL
-    // instruction, so we need to read the variable name.
-    uint8_t constant_index = *local_ip++;
-    lox::Value c = chunkptr->constant_at(constant_index);
-    ObjString* var_name = as_objptr_unsafe<ObjString>(c);
-    // After this, the parser will have emitted bytecode that pushes the
+  DO_DEFINE_GLOBAL_SLOT:
+    // The parser will have assigned the variable a slot in the global table,
+    // and emitted the slot index after the DEFINE_GLOBAL_SLOT instruction.
+    operand1 = *local_ip++;
+  EXEC_DEFINE_GLOBAL_SLOT: {
+    uint32_t slot = operand1;
+    // Before this, the parser will have emitted bytecode that pushes the
     // value of the variable onto the stack. So we need to pop that value.
-    // (Or, following the book, just peek it now and pop it later, after
-    // we've stored it.)
-    lox::Value var_value = stack_peek();
-    // Then we can define the global variable by adding it to our map.
-    // NOTE: operator[] will create a new entry if the key doesn't exist
-    // yet. It returns a reference to the value, which can then be
-    // assigned to. So this doesn't desugar to something like setindex! in
-    // Julia, it is just a composition of operator[] and assignment.
-    //
-    // We have to access the actual underlying string value here because we
-    // are creating a new key in the map (which takes std::string as
-    // keys)
-    globals.map[var_name->value] = var_value;
-    stack_pop(); // now pop the value
-    DISPATCH();
-  }
-  DO_CLASS: {
-    uint8_t constant_index = *local_ip++;
-    lox::Value c = chunkptr->constant_at(constant_index);
+    globals[slot] = POP();
+    DISPATCH();
+  }
+  DO_CLASS:
+    operand1 = *local_ip++;
+  EXEC_CLASS: {
+    uint32_t constant_index = operand1;
+    lox::Value c = constants[constant_index];
     ObjString* class_name = as_objptr_unsafe<ObjString>(c);
+    SYNC_SP();
     auto new_class = _gc.alloc<ObjClass>(class_name);
-    stack_push(from_obj(new_class));
+    PUSH(from_obj(new_class));
     DISPATCH();
   }
   DO_DEFINE_METHOD: {
     // pop ObjClosure from stack
-    lox::Value val = stack_pop();
+    lox::Value val = POP();
     auto closure_ptr = as_objptr<ObjClosure>(
         val, "internal error: expected ObjClosure on stack for DEFINE_METHOD");
     ObjString* method_name_str = closure_ptr->function->name;
     // The class should now be at the top of the stack
-    lox::Value class_val = stack_peek();
+    lox::Value class_val = PEEK(0);
     auto class_ptr = as_objptr<ObjClass>(
         class_val,
         "internal error: expected ObjClass on stack for DEFINE_METHOD");
     class_ptr->methods[method_name_str] = closure_ptr;
+    _gc.write_barrier(class_ptr);
     DISPATCH();
   }
-  DO_GET_GLOBAL: {
-    uint8_t constant_index = *local_ip++;
-    lox::Value c = chunkptr->constant_at(constant_index);
-    ObjString* var_name = as_objptr_unsafe<ObjString>(c);
-    // Now that we have the name of the variable, we can look it up in our
-    // map
-    auto it = globals.map.find(var_name);
-    if (it == globals.map.end()) {
-      error("undefined variable '" + var_name->value + "'");
+  DO_GET_GLOBAL_SLOT:
+    operand1 = *local_ip++;
+  EXEC_GET_GLOBAL_SLOT: {
+    uint32_t slot = operand1;
+    lox::Value value = globals[slot];
+    // The slot exists as soon as the name has been seen by the compiler, but
+    // that doesn't mean that the variable has actually been defined yet.
+    if (is_undefined(value)) {
+      error("undefined variable '" + globals.name_at(slot)->value + "'");
     }
-    stack_push(it->second);
+    PUSH(value);
     DISPATCH();
   }
-  DO_SET_GLOBAL: {
-    uint8_t constant_index = *local_ip++;
-    lox::Value c = chunkptr->constant_at(constant_index);
-    ObjString* var_name = as_objptr_unsafe<ObjString>(c);
-    auto it = globals.map.find(var_name);
-    if (it == globals.map.end()) {
-      error("undefined variable '" + var_name->value + "'");
-    } else {
-      // Update the value in the globals table.
-      // Peek not pop because assignment expressions return the assigned
-      // value and it might be used again later!
-      lox::Value var_value = stack_peek();
-      it->second = var_value;
+  DO_SET_GLOBAL_SLOT:
+    operand1 = *local_ip++;
+  EXEC_SET_GLOBAL_SLOT: {
+    uint32_t slot = operand1;
+    lox::Value& global = globals[slot];
+    if (is_undefined(global)) {
+      error("undefined variable '" + globals.name_at(slot)->value + "'");
     }
+    // Peek not pop because assignment expressions return the assigned
+    // value and it might be used again later! (The globals table is always
+    // treated as a GC root, so this doesn't need a write barrier.)
+    global = PEEK(0);
     DISPATCH();
   }
-  DO_GET_PROPERTY: {
+  DO_GET_PROPERTY:
+    operand1 = *local_ip++;
+    operand2 = *local_ip++;
+  EXEC_GET_PROPERTY: {
     // the instance is at the top of the stack
-    lox::Value instance_value = stack_peek();
+    lox::Value instance_value = PEEK(0);
     auto instanceptr = as_objptr<ObjInstance>(
         instance_value, "cannot access property of non-instance");
-    uint8_t constant_index = *local_ip++;
-    lox::Value c = chunkptr->constant_at(constant_index);
+    uint32_t constant_index = operand1;
+    uint32_t cache_index = operand2;
+    lox::Value c = constants[constant_index];
     ObjString* property_name = as_objptr_unsafe<ObjString>(c);
-    // Check first if it's a field on the instance
-    auto it = instanceptr->fields.find(property_name);
-    if (it != instanceptr->fields.end()) {
+    // Fields take precedence over methods
+    InlineCache::Entry entry = lookup_property(chunkptr, cache_index,
+                                               instanceptr, property_name,
+                                               /*methods_first=*/false);
+    if (entry.method == nullptr) {
       // It was a field
-      stack_replace_top(it->second);
+      PEEK(0) = instanceptr->fields[entry.slot];
     } else {
-      // Maybe it's a method
-      const auto& classmethods = instanceptr->klass->methods;
-      auto method_itr = classmethods.find(property_name);
-      if (method_itr != classmethods.end()) {
-        ObjClosure* method_closure = method_itr->second;
-        ObjBoundMethod* bound_method =
-            _gc.alloc<ObjBoundMethod>(instanceptr, method_closure);
-        stack_replace_top(from_obj(bound_method));
-      } else {
-        // OK, it really wasn't found
-        throw std::runtime_error("undefined property '" + property_name->value +
-                                 "'");
-      }
+      // It was a method, so we need to bind it to the instance
+      SYNC_SP();
+      ObjBoundMethod* bound_method =
+          _gc.alloc<ObjBoundMethod>(instanceptr, entry.method);
+      PEEK(0) = from_obj(bound_method);
     }
     DISPATCH();
   }
-  DO_SET_PROPERTY: {
+  DO_SET_PROPERTY:
+    operand1 = *local_ip++;
+    operand2 = *local_ip++;
+  EXEC_SET_PROPERTY: {
     // the value to set is at the top of the stack
-    lox::Value value_to_set = stack_peek();
+    lox::Value value_to_set = PEEK(0);
     // the instance is just below it
-    lox::Value instance_value = stack[stack.size() - 2];
+    lox::Value instance_value = PEEK(1);
     auto instanceptr = as_objptr<ObjInstance>(
         instance_value, "cannot access property of non-instance");
-    uint8_t constant_index = *local_ip++;
-    lox::Value c = chunkptr->constant_at(constant_index);
-    ObjString* property_name = as_objptr_unsafe<ObjString>(c);
-    // NOTE: operator[] does not allow for heterogeneous lookup, so we need
-    // to actually access the underlying std::string
-    instanceptr->fields[property_name] = value_to_set;
+    uint32_t constant_index = operand1;
+    uint32_t cache_index = operand2;
+    InlineCache* cache = cache_index == NO_INLINE_CACHE
+                             ? nullptr
+                             : &chunkptr->inline_cache_at(cache_index);
+    const InlineCache::Entry* hit =
+        cache == nullptr ? nullptr : cache->find(instanceptr->shape);
+    if (hit != nullptr) {
+      if (hit->new_shape != nullptr) {
+        // Adding a new field, and we already know which shape the instance
+        // will end up with.
+        instanceptr->shape = hit->new_shape;
+        instanceptr->fields.push_back(value_to_set);
+      } else {
+        instanceptr->fields[hit->slot] = value_to_set;
+      }
+      _gc.write_barrier(instanceptr);
+    } else {
+      lox::Value c = constants[constant_index];
+      ObjString* property_name = as_objptr_unsafe<ObjString>(c);
+      ObjShape* old_shape = instanceptr->shape;
+      // Adding a field may allocate a new shape
+      SYNC_SP();
+      instanceptr->set_field(property_name, value_to_set, _gc);
+      if (cache != nullptr) {
+        InlineCache::Entry entry;
+        entry.shape = old_shape;
+        entry.slot = *instanceptr->shape->find(property_name);
+        if (instanceptr->shape != old_shape) {
+          entry.new_shape = instanceptr->shape;
+        }
+        cache->insert(entry);
+        _gc.write_barrier(frame->closure->function);
+      }
+    }
     // Pop the instance and value, but leave the value on the stack since
     // (a.x = b) evaluates to b
-    stack_pop();
-    stack_replace_top(value_to_set);
+    DROP(1);
+    PEEK(0) = value_to_set;
     DISPATCH();
   }
-  DO_INVOKE: {
+  // CALL_PROPERTY is `(a.b)(...)`. It's the same as INVOKE, except that it
+  // looks up the property in the same order as GET_PROPERTY does.
+  DO_CALL_PROPERTY:
+  DO_INVOKE:
+    methods_first = local_ip[-1] == static_cast<uint8_t>(lox::OpCode::INVOKE);
+    operand1 = *local_ip++;
+    operand2 = *local_ip++;
+    operand3 = *local_ip++;
+  EXEC_INVOKE: {
     // top of the stack are the arguments, then the instance
-    uint8_t nargs = *local_ip++;
-    lox::Value instance_value = stack[stack.size() - 1 - nargs];
+    uint32_t nargs = operand1;
+    lox::Value instance_value = PEEK(nargs);
     auto instanceptr = as_objptr<ObjInstance>(
         instance_value, "cannot invoke method on non-instance");
-    uint8_t constant_index = *local_ip++;
-    lox::Value c = chunkptr->constant_at(constant_index);
+    uint32_t constant_index = operand2;
+    uint32_t cache_index = operand3;
+    lox::Value c = constants[constant_index];
     ObjString* method_name = as_objptr_unsafe<ObjString>(c);
-    // Now we need to check if it is indeed a method
-    const auto& classmethods = instanceptr->klass->methods;
-    auto method_itr = classmethods.find(method_name);
-    if (method_itr != classmethods.end()) {
+    InlineCache::Entry entry = lookup_property(
+        chunkptr, cache_index, instanceptr, method_name, methods_first);
+    if (entry.method != nullptr) {
       // Invoke the method on this instance. This is really easy because
       // everything is already in the right place!
-      call(method_itr->second, nargs, local_ip);
-      update_chunk_and_ip();
+      SYNC_SP();
+      enter_frame(call(entry.method, nargs, local_ip));
     } else {
       // If not, fall back to retrieving a field and then calling it
-      auto it = instanceptr->fields.find(method_name);
-      if (it != instanceptr->fields.end()) {
-        // Replace the instance with whatever the property was
-        stack[stack.size() - 1 - nargs] = it->second;
-        if (dispatch_call(it->second, nargs, local_ip)) {
-          update_chunk_and_ip();
-        }
+      lox::Value field = instanceptr->fields[entry.slot];
+      // Replace the instance with whatever the property was
+      PEEK(nargs) = field;
+      SYNC_SP();
+      if (dispatch_call(field, nargs, local_ip)) {
+        update_chunk_and_ip();
       } else {
-        throw std::runtime_error("undefined property '" + method_name->value +
-                                 "'");
+        sp = stack_top;
       }
     }
     DISPATCH();
   }
-  DO_SET_LOCAL: {
-    uint8_t local_index = *local_ip++;
+  DO_SET_LOCAL:
+    operand1 = *local_ip++;
+  EXEC_SET_LOCAL: {
+    uint32_t local_index = operand1;
 #ifdef LOX_DEBUG
-    if (static_cast<size_t>(local_index) > stack.size()) {
-      std::cerr << "stack_size=" << stack.size()
+    if (frame_base + local_index >= sp) {
+      std::cerr << "stack_size=" << (sp - stack.get())
                 << ", local_index=" << +local_index << "\n";
       error("SET_LOCAL: invalid local variable index");
     }
 #endif
-    set_local_variable(local_index, stack_peek());
+    frame_base[local_index] = PEEK(0);
     DISPATCH();
   }
-  DO_GET_LOCAL: {
-    uint8_t local_index = *local_ip++;
+  DO_GET_LOCAL:
+    operand1 = *local_ip++;
+  EXEC_GET_LOCAL: {
+    uint32_t local_index = operand1;
 #ifdef LOX_DEBUG
-    if (static_cast<size_t>(local_index) > stack.size()) {
-      std::cerr << "stack_size=" << stack.size()
+    if (frame_base + local_index >= sp) {
+      std::cerr << "stack_size=" << (sp - stack.get())
                 << ", local_index=" << +local_index << "\n";
       error("GET_LOCAL: invalid local variable index");
     }
 #endif
-    lox::Value local_value = get_local_variable(local_index);
-    stack_push(local_value);
-    DISPATCH();
-  }
-  DO_ADD_LOCAL_CONST: {
-    uint8_t local_index = *local_ip++;
-#ifdef LOX_DEBUG
-    if (static_cast<size_t>(local_index) > stack.size()) {
-      std::cerr << "stack_size=" << stack.size()
-                << ", local_index=" << +local_index << "\n";
-      error("ADD_LOCAL_CONST: invalid local variable index");
-    }
-#endif
-    lox::Value local_value = get_local_variable(local_index);
-    uint8_t constant_index = *local_ip++;
-    lox::Value cnst = chunkptr->constant_at(constant_index);
-    lox::Value result = lox::add(local_value, cnst, _gc);
-    set_local_variable(local_index, result);
-    DISPATCH();
-  }
-  DO_LOCAL_CONST_LESS: {
-    uint8_t local_index = *local_ip++;
-#ifdef LOX_DEBUG
-    if (static_cast<size_t>(local_index) > stack.size()) {
-      std::cerr << "stack_size=" << stack.size()
-                << ", local_index=" << +local_index << "\n";
-      error("ADD_LOCAL_CONST: invalid local variable index");
-    }
-#endif
-    lox::Value local_value = get_local_variable(local_index);
-    uint8_t constant_index = *local_ip++;
-    lox::Value cnst = chunkptr->constant_at(constant_index);
-    if (lox::is_double(local_value) && lox::is_double(cnst)) {
-      lox::Value result =
-          lox::from_bool(lox::as_double(local_value) < lox::as_double(cnst));
-      stack_push(result);
-    }
+    PUSH(frame_base[local_index]);
     DISPATCH();
   }
   DO_JUMP_IF_FALSE: {
     // Don't pop the condition yet, because we might need to use it for
     // logical shortcircuiting later.
-    lox::Value condition = stack_peek();
+    lox::Value condition = PEEK(0);
     if (!lox::is_truthy(condition)) {
       uint8_t high_byte = *local_ip++;
       uint8_t low_byte = *local_ip++;
@@ -674,61 +1513,192 @@ InterpretResult VM::run() {
     uint8_t low_byte = *local_ip++;
     ptrdiff_t jump_offset = lox::get_jump_offset(high_byte, low_byte);
     local_ip += jump_offset;
+    // Jumping backwards means going round a loop. A function that's hot
+    // because of its loops switches to the register tier here, without
+    // waiting for the next call.
+    if (jump_offset < 0) {
+      ObjFunction* function = frame->closure->function;
+      if (++function->backedges == tier_up_threshold) [[unlikely]] {
+        tier_up(function);
+        uint8_t* entry =
+            function->register_code
+                ? function->register_code->loop_entry(
+                      static_cast<size_t>(local_ip - chunkptr->begin_location()))
+                : nullptr;
+        if (entry != nullptr) {
+          local_ip = entry;
+#ifdef LOX_TIME
+          tier_timings.enter(true);
+#endif
+        }
+      }
+    }
     DISPATCH();
   }
+  DO_JUMP_IF_FALSE_LONG: {
+    lox::Value condition = PEEK(0);
+    if (!lox::is_truthy(condition)) {
+      ptrdiff_t jump_offset = lox::get_long_jump_offset(local_ip);
+      local_ip += 4 + jump_offset;
+    } else {
+      local_ip += 4;
+    }
+    DISPATCH();
+  }
+  DO_JUMP_LONG: {
+    ptrdiff_t jump_offset = lox::get_long_jump_offset(local_ip);
+    local_ip += 4 + jump_offset;
+    DISPATCH();
+  }
+  DO_WIDE: {
+    // The operands of the next instruction are three bytes each instead of
+    // one. We read them here, and then jump to the part of the instruction's
+    // usual implementation that comes after reading its operands. That way
+    // only big programs pay for the wide operands.
+    auto wide_opcode = static_cast<lox::OpCode>(*local_ip++);
+    switch (wide_opcode) {
+    case lox::OpCode::CONSTANT:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_CONSTANT;
+    case lox::OpCode::CLOSURE:
+      operand1 = READ_WIDE_OPERAND();
+      closure_operand_width = 3;
+      goto EXEC_CLOSURE;
+    case lox::OpCode::GET_UPVALUE:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_GET_UPVALUE;
+    case lox::OpCode::SET_UPVALUE:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_SET_UPVALUE;
+    case lox::OpCode::CLASS:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_CLASS;
+    case lox::OpCode::GET_GLOBAL_SLOT:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_GET_GLOBAL_SLOT;
+    case lox::OpCode::SET_GLOBAL_SLOT:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_SET_GLOBAL_SLOT;
+    case lox::OpCode::DEFINE_GLOBAL_SLOT:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_DEFINE_GLOBAL_SLOT;
+    case lox::OpCode::SET_LOCAL:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_SET_LOCAL;
+    case lox::OpCode::GET_LOCAL:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_GET_LOCAL;
+    case lox::OpCode::GET_SUPER:
+      operand1 = READ_WIDE_OPERAND();
+      goto EXEC_GET_SUPER;
+    case lox::OpCode::GET_PROPERTY:
+      operand1 = READ_WIDE_OPERAND();
+      operand2 = READ_WIDE_OPERAND();
+      goto EXEC_GET_PROPERTY;
+    case lox::OpCode::SET_PROPERTY:
+      operand1 = READ_WIDE_OPERAND();
+      operand2 = READ_WIDE_OPERAND();
+      goto EXEC_SET_PROPERTY;
+    case lox::OpCode::SUPER_INVOKE:
+      operand1 = READ_WIDE_OPERAND();
+      operand2 = READ_WIDE_OPERAND();
+      goto EXEC_SUPER_INVOKE;
+    case lox::OpCode::INVOKE:
+    case lox::OpCode::CALL_PROPERTY:
+      methods_first = wide_opcode == lox::OpCode::INVOKE;
+      operand1 = READ_WIDE_OPERAND();
+      operand2 = READ_WIDE_OPERAND();
+      operand3 = READ_WIDE_OPERAND();
+      goto EXEC_INVOKE;
+    default:
+      throw std::runtime_error("invalid instruction after WIDE");
+    }
+  }
   DO_CALL: {
     // This is the number of arguments pushed to the stack.
     uint8_t nargs = *local_ip++;
     // The function pointer should have been pushed to the stack before
     // the arguments.
-    auto maybe_objptr = stack[stack.size() - 1 - nargs];
-    if (dispatch_call(maybe_objptr, nargs, local_ip)) {
+    auto maybe_objptr = PEEK(nargs);
+    SYNC_SP();
+    // Closures and native functions are by far the most common callees, so
+    // we handle them here without going through dispatch_call.
+    Obj* callee = is_obj(maybe_objptr) ? as_obj(maybe_objptr) : nullptr;
+    if (callee != nullptr && callee->type == ObjType::CLOSURE) {
+      enter_frame(call(static_cast<ObjClosure*>(callee), nargs, local_ip));
+    } else if (callee != nullptr &&
+               callee->type == ObjType::NATIVE_FUNCTION) {
+      if (call_native(static_cast<ObjNativeFunction*>(callee), nargs,
+                      local_ip)) {
+        update_chunk_and_ip();
+      } else {
+        sp = stack_top;
+      }
+    } else if (dispatch_call(maybe_objptr, nargs, local_ip)) {
       update_chunk_and_ip();
+    } else {
+      // Even if we didn't change frames, the callee (e.g. a class with no
+      // initialiser) will have replaced itself and its arguments with the
+      // return value.
+      sp = stack_top;
     }
     DISPATCH();
   }
   DO_RETURN: {
-    lox::Value retval = stack_pop();
-    close_upvalues_after(&stack[current_frame().stack_start]);
-
-    if (call_frames.size() == 1) {
-      // We are about to return from the top level, so we're done executing
-      // the entire programme. Pop the top level function off the stack
-      // and finish.
-      stack_pop();
+    lox::Value retval = POP();
+    // Only functions that had locals captured can have open upvalues pointing
+    // into their stack frame.
+    if (frame->closure->function->has_captured_locals) {
+      close_upvalues_after(frame_base);
+    }
+
+    if (frame_count == 1) {
+      // We are about to return from the top level (of the programme, or of a
+      // fiber). Pop the function off the stack, and if there are other
+      // fibers that still have work to do, carry on with them.
+      DROP(1);
+      SYNC_SP();
+      frame_count = 0;
+      if (finish_fiber(retval)) {
+        update_chunk_and_ip();
+        DISPATCH();
+      }
       return InterpretResult::OK;
     } else {
       // Reset the VM's state to where it was before it entered the current
       // call.
-      stack.resize(current_frame().stack_start);
-      stack_push(retval);
-      call_frames.pop_back();
-      update_chunk_and_ip();
+      sp = frame_base;
+      PUSH(retval);
+      frame_count--;
+      enter_frame(frame - 1);
     }
     DISPATCH();
   }
   DO_INHERIT: {
     // The top of the stack should be the subclass, and then the superclass is
     // just below it
-    lox::Value subclass_value = stack_pop();
+    lox::Value subclass_value = POP();
     auto subclass_ptr =
         as_objptr<ObjClass>(subclass_value, "cannot have non-class inherit");
-    lox::Value superclass_value = stack_pop();
+    lox::Value superclass_value = POP();
     auto superclass_ptr =
         as_objptr<ObjClass>(superclass_value, "cannot inherit from non-class");
     // Copy methods from superclass to subclass. At this point, the subclass
     // has no methods so it's fine to just copy the entire map.
     subclass_ptr->methods = superclass_ptr->methods;
+    _gc.write_barrier(subclass_ptr);
     DISPATCH();
   }
-  DO_GET_SUPER: {
-    uint8_t constant_index = *local_ip++;
-    lox::Value method_name_val = chunkptr->constant_at(constant_index);
+  DO_GET_SUPER:
+    operand1 = *local_ip++;
+  EXEC_GET_SUPER: {
+    uint32_t constant_index = operand1;
+    lox::Value method_name_val = constants[constant_index];
     ObjString* method_name = as_objptr_unsafe<ObjString>(method_name_val);
     // We need to create an ObjBoundMethod, but specifically, it's the
     // ObjClosure from the superclass, coupled with the *current* instance we're
     // using. The superclass is at the top of the stack right now.
-    lox::Value superclass_value = stack_pop();
+    lox::Value superclass_value = POP();
     // TODO: We don't need to check this; by construction this should always be
     // the superclass.
     auto superclass_ptr = as_objptr<ObjClass>(
@@ -741,24 +1711,28 @@ InterpretResult VM::run() {
     }
     ObjClosure* method_closure = method_itr->second;
     // The instance is now at the top of the stack.
-    lox::Value instance_value = stack_peek();
+    lox::Value instance_value = PEEK(0);
     // TODO: We don't need to check this; by construction this should always be
     // the instance.
     auto instance_ptr = as_objptr<ObjInstance>(
         instance_value, "cannot get superclass method for non-instance");
+    SYNC_SP();
     ObjBoundMethod* bound_method =
         _gc.alloc<ObjBoundMethod>(instance_ptr, method_closure);
-    stack_replace_top(from_obj(bound_method));
+    PEEK(0) = from_obj(bound_method);
     DISPATCH();
   }
-  DO_SUPER_INVOKE: {
+  DO_SUPER_INVOKE:
     // read the arity + method name
-    uint8_t nargs = *local_ip++;
-    uint8_t constant_index = *local_ip++;
-    lox::Value method_name_val = chunkptr->constant_at(constant_index);
+    operand1 = *local_ip++;
+    operand2 = *local_ip++;
+  EXEC_SUPER_INVOKE: {
+    uint32_t nargs = operand1;
+    uint32_t constant_index = operand2;
+    lox::Value method_name_val = constants[constant_index];
     ObjString* method_name = as_objptr_unsafe<ObjString>(method_name_val);
     // top of the stack is the superclass, which we use to get the method.
-    lox::Value superclass_value = stack_pop();
+    lox::Value superclass_value = POP();
     // TODO: We don't need to check this; by construction this should always be
     // the superclass.
     auto superclass_ptr = as_objptr<ObjClass>(
@@ -774,27 +1748,280 @@ InterpretResult VM::run() {
     // superclass) with the instance + arguments (which were arranged nicely
     // for us already). We don't need to use dispatch_call because we know
     // that it's definitely an ObjClosure.
-    call(method_closure, nargs, local_ip);
-    update_chunk_and_ip();
+    SYNC_SP();
+    enter_frame(call(method_closure, nargs, local_ip));
+    DISPATCH();
+  }
+  DO_BUILD_LIST: {
+    uint8_t n_elements = *local_ip++;
+    // The elements stay on the stack (and hence reachable) until the list has
+    // been allocated.
+    SYNC_SP();
+    auto list = _gc.alloc<ObjList>(std::vector<Value>(sp - n_elements, sp));
+    DROP(n_elements);
+    PUSH(from_obj(list));
+    DISPATCH();
+  }
+  DO_GET_INDEX: {
+    lox::Value index_value = POP();
+    auto list = as_objptr<ObjList>(PEEK(0), "can only index into lists");
+    PEEK(0) = list->elements[list_index(list, index_value)];
+    DISPATCH();
+  }
+  DO_SET_INDEX: {
+    // As with SET_PROPERTY, the value is left on the stack as the result of
+    // the assignment.
+    lox::Value value = POP();
+    lox::Value index_value = POP();
+    auto list = as_objptr<ObjList>(PEEK(0), "can only index into lists");
+    list->elements[list_index(list, index_value)] = value;
+    _gc.write_barrier(list);
+    PEEK(0) = value;
+    DISPATCH();
+  }
+
+    // Superinstructions: run each instruction in the prefix, then go straight
+    // to the handler for the last one (which reads its own operands and
+    // dispatches as usual).
+#define SUPERINSTRUCTION_PREFIX_BODY(op) BODY_##op();
+#define SUPERINSTRUCTION_HANDLER(name, prefix, last)                           \
+  DO_##name:                                                                   \
+    LOX_FOR_EACH_PREFIX(SUPERINSTRUCTION_PREFIX_BODY, prefix)                  \
+    goto DO_##last;
+    SUPERINSTRUCTION_LIST(SUPERINSTRUCTION_HANDLER)
+#undef SUPERINSTRUCTION_HANDLER
+#undef SUPERINSTRUCTION_PREFIX_BODY
+
+    // The register tier (see register_code.hpp). These leave local_ip at the
+    // next instruction, and `sp` wherever it was: it's only set where the
+    // bytecode interpreter takes over.
+#define REG(n) frame_base[local_ip[n]]
+#define REG_CONSTANT(n) constants[local_ip[n]]
+  REG_MOVE:
+    REG(0) = REG(1);
+    local_ip += 2;
+    DISPATCH();
+  REG_LOAD_CONSTANT:
+    REG(0) = REG_CONSTANT(1);
+    local_ip += 2;
+    DISPATCH();
+  REG_GET_GLOBAL: {
+    uint8_t slot = local_ip[1];
+    lox::Value value = globals[slot];
+    if (is_undefined(value)) {
+      error("undefined variable '" + globals.name_at(slot)->value + "'");
+    }
+    REG(0) = value;
+    local_ip += 2;
+    DISPATCH();
+  }
+  REG_SET_GLOBAL: {
+    uint8_t slot = local_ip[0];
+    lox::Value& global = globals[slot];
+    if (is_undefined(global)) {
+      error("undefined variable '" + globals.name_at(slot)->value + "'");
+    }
+    global = REG(1);
+    local_ip += 2;
+    DISPATCH();
+  }
+  REG_GET_UPVALUE:
+    REG(0) = *frame->closure->upvalues.at(local_ip[1])->location;
+    local_ip += 2;
+    DISPATCH();
+  REG_SET_UPVALUE: {
+    lox::ObjUpvalue* upvalue = frame->closure->upvalues.at(local_ip[0]);
+    *(upvalue->location) = REG(1);
+    _gc.write_barrier(upvalue);
+    local_ip += 2;
     DISPATCH();
   }
+#define REG_ADD_HANDLER(label, b_operand)                                      \
+  label: {                                                                     \
+    lox::Value a = REG(1);                                                     \
+    lox::Value b = b_operand;                                                  \
+    if (is_double(a) && is_double(b)) [[likely]] {                             \
+      REG(0) = from_double(as_double(a) + as_double(b));                       \
+    } else {                                                                   \
+      /* Put the operands where the bytecode would have had them, so that      \
+         they're reachable while the strings are concatenated. */              \
+      sp = frame_base + local_ip[3];                                           \
+      PEEK(1) = a;                                                             \
+      PEEK(0) = b;                                                             \
+      BODY_ADD();                                                              \
+      REG(0) = PEEK(0);                                                        \
+    }                                                                          \
+    local_ip += 4;                                                             \
+    DISPATCH();                                                                \
+  }
+    REG_ADD_HANDLER(REG_ADD, REG(2))
+    REG_ADD_HANDLER(REG_ADD_CONSTANT, REG_CONSTANT(2))
+#undef REG_ADD_HANDLER
+#define REG_BINARY_HANDLER(label, b_operand, op, conv_func)                    \
+  label: {                                                                     \
+    lox::Value a = REG(1);                                                     \
+    lox::Value b = b_operand;                                                  \
+    if (!is_double(a) || !is_double(b)) [[unlikely]] {                         \
+      error("operands must be numbers");                                       \
+    }                                                                          \
+    REG(0) = conv_func(as_double(a) op as_double(b));                          \
+    local_ip += 3;                                                             \
+    DISPATCH();                                                                \
+  }
+#define REG_BINARY_OP(name, op, conv_func)                                     \
+  REG_BINARY_HANDLER(REG_##name, REG(2), op, conv_func)                        \
+  REG_BINARY_HANDLER(REG_##name##_CONSTANT, REG_CONSTANT(2), op, conv_func)
+    REG_BINARY_OP(SUBTRACT, -, lox::from_double)
+    REG_BINARY_OP(MULTIPLY, *, lox::from_double)
+    REG_BINARY_OP(DIVIDE, /, lox::from_double)
+    REG_BINARY_OP(LESS, <, lox::from_bool)
+    REG_BINARY_OP(GREATER, >, lox::from_bool)
+#undef REG_BINARY_OP
+#undef REG_BINARY_HANDLER
+#define REG_EQUAL_HANDLER(label, b_operand)                                    \
+  label: {                                                                     \
+    lox::Value a = REG(1);                                                     \
+    lox::Value b = b_operand;                                                  \
+    REG(0) = from_bool(is_double(a) && is_double(b)                            \
+                           ? as_double(a) == as_double(b)                      \
+                           : lox::is_equal(a, b));                             \
+    local_ip += 3;                                                             \
+    DISPATCH();                                                                \
+  }
+    REG_EQUAL_HANDLER(REG_EQUAL, REG(2))
+    REG_EQUAL_HANDLER(REG_EQUAL_CONSTANT, REG_CONSTANT(2))
+#undef REG_EQUAL_HANDLER
+  REG_NEGATE: {
+    lox::Value value = REG(1);
+    if (!is_double(value)) [[unlikely]] {
+      error("operand must be a number");
+    }
+    REG(0) = from_double(-as_double(value));
+    local_ip += 2;
+    DISPATCH();
+  }
+  REG_NOT:
+    REG(0) = from_bool(!lox::is_truthy(REG(1)));
+    local_ip += 2;
+    DISPATCH();
+  REG_JUMP: {
+    ptrdiff_t jump_offset = lox::get_jump_offset(local_ip[0], local_ip[1]);
+    local_ip += 2 + jump_offset;
+    DISPATCH();
+  }
+  REG_JUMP_IF_FALSE: {
+    ptrdiff_t jump_offset = lox::get_jump_offset(local_ip[1], local_ip[2]);
+    bool jump = !lox::is_truthy(REG(0));
+    local_ip += 3;
+    if (jump) {
+      local_ip += jump_offset;
+    }
+    DISPATCH();
+  }
+  // The condition of these doesn't go in a register, so the first operand is
+  // the left-hand side of the comparison.
+#define REG_COMPARE_JUMP_HANDLER(label, b_operand, op)                         \
+  label: {                                                                     \
+    lox::Value a = REG(0);                                                     \
+    lox::Value b = b_operand;                                                  \
+    if (!is_double(a) || !is_double(b)) [[unlikely]] {                         \
+      error("operands must be numbers");                                       \
+    }                                                                          \
+    ptrdiff_t jump_offset = lox::get_jump_offset(local_ip[2], local_ip[3]);    \
+    local_ip += 4;                                                             \
+    if (!(as_double(a) op as_double(b))) {                                     \
+      local_ip += jump_offset;                                                 \
+    }                                                                          \
+    DISPATCH();                                                                \
+  }
+    REG_COMPARE_JUMP_HANDLER(REG_JUMP_IF_NOT_LESS, REG(1), <)
+    REG_COMPARE_JUMP_HANDLER(REG_JUMP_IF_NOT_LESS_CONSTANT, REG_CONSTANT(1), <)
+    REG_COMPARE_JUMP_HANDLER(REG_JUMP_IF_NOT_GREATER, REG(1), >)
+    REG_COMPARE_JUMP_HANDLER(REG_JUMP_IF_NOT_GREATER_CONSTANT, REG_CONSTANT(1),
+                             >)
+#undef REG_COMPARE_JUMP_HANDLER
+#define REG_EQUAL_JUMP_HANDLER(label, b_operand)                               \
+  label: {                                                                     \
+    lox::Value a = REG(0);                                                     \
+    lox::Value b = b_operand;                                                  \
+    bool equal = is_double(a) && is_double(b) ? as_double(a) == as_double(b)   \
+                                              : lox::is_equal(a, b);           \
+    ptrdiff_t jump_offset = lox::get_jump_offset(local_ip[2], local_ip[3]);    \
+    local_ip += 4;                                                             \
+    if (!equal) {                                                              \
+      local_ip += jump_offset;                                                 \
+    }                                                                          \
+    DISPATCH();                                                                \
+  }
+    REG_EQUAL_JUMP_HANDLER(REG_JUMP_IF_NOT_EQUAL, REG(1))
+    REG_EQUAL_JUMP_HANDLER(REG_JUMP_IF_NOT_EQUAL_CONSTANT, REG_CONSTANT(1))
+#undef REG_EQUAL_JUMP_HANDLER
+  // The rest hand over to the bytecode handlers, which read the rest of the
+  // operands themselves.
+  REG_STACK:
+    sp = frame_base + local_ip[0];
+    local_ip += 2;
+    DISPATCH();
+  REG_CALL:
+    sp = frame_base + *local_ip++;
+    goto DO_CALL;
+  REG_RETURN:
+    sp = frame_base + *local_ip++;
+    goto DO_RETURN;
+  REG_INVOKE:
+    sp = frame_base + *local_ip++;
+    methods_first = true;
+    operand1 = *local_ip++;
+    operand2 = *local_ip++;
+    operand3 = *local_ip++;
+    goto EXEC_INVOKE;
+  REG_GET_PROPERTY:
+    sp = frame_base + *local_ip++;
+    goto DO_GET_PROPERTY;
+  REG_SET_PROPERTY:
+    sp = frame_base + *local_ip++;
+    goto DO_SET_PROPERTY;
+  REG_GET_INDEX:
+    sp = frame_base + *local_ip++;
+    goto DO_GET_INDEX;
+  REG_SET_INDEX:
+    sp = frame_base + *local_ip++;
+    goto DO_SET_INDEX;
+#undef REG_CONSTANT
+#undef REG
 
-    if (local_ip == chunk_end) {
+    if (local_ip == chunkptr->end_location()) {
       // Successfully read all bytes.
       return InterpretResult::OK;
     } else {
       throw std::runtime_error("unexpected end of bytecode");
     }
   } catch (const std::runtime_error& e) {
-    std::cerr << "lox runtime error at line "
-              << current_frame().get_current_debuginfo_line() << ": "
-              << e.what() << "\n";
-    // Print call stack
-    for (auto cf = call_frames.rbegin(); cf != call_frames.rend(); ++cf) {
+    // Make sure that everything printed before the error comes out first.
+    _output.flush();
+    std::cerr << "lox runtime error";
+    // There are no frames if a fiber had just finished (e.g. if there was a
+    // deadlock after that).
+    if (frame_count > 0) {
+      std::cerr << " at line " << current_frame().get_current_debuginfo_line();
+    }
+    std::cerr << ": " << e.what() << "\n";
+    // Print call stack. After a stack overflow that's thousands of frames,
+    // so only the innermost and outermost ones are printed.
+    constexpr size_t TRACE_ENDS = 10;
+    for (size_t i = frame_count; i-- > 0;) {
+      if (frame_count > 2 * TRACE_ENDS && i == frame_count - TRACE_ENDS - 1) {
+        std::cerr << " ... " << frame_count - 2 * TRACE_ENDS
+                  << " more calls ...\n";
+        i = TRACE_ENDS;
+        continue;
+      }
+      const CallFrame* cf = &call_frames[i];
       const std::string& fname = cf->closure->function->name->value;
       std::size_t line = cf->get_current_debuginfo_line();
       std::cerr << " in line " << line << ", function " << fname << "\n";
     }
+    abandon_fibers();
     return InterpretResult::RUNTIME_ERROR;
   }
 }
@@ -812,22 +2039,18 @@ bool VM::dispatch_call(lox::Value maybe_objptr, size_t nargs,
     return true;
   }
   case ObjType::NATIVE_FUNCTION: {
-    auto native_fnptr = static_cast<ObjNativeFunction*>(objptr);
-    Value retval = native_fnptr->call(nargs, &stack[stack.size() - nargs]);
-    // Pop the function and its arguments off the stack.
-    stack.resize(stack.size() - nargs - 1);
-    // Push the return value onto the stack.
-    stack_push(retval);
-    return false;
+    return call_native(static_cast<ObjNativeFunction*>(objptr), nargs,
+                       local_ip);
   }
   case ObjType::CLASS: {
     auto classptr = static_cast<ObjClass*>(objptr);
-    ObjInstance* inst = _gc.alloc<ObjInstance>(classptr);
+    ObjInstance* inst =
+        _gc.alloc<ObjInstance>(classptr, classptr->get_root_shape(_gc));
     // Replace the class pointer on the stack with the instance pointer
     // (so that it doesn't get GC'd). Recall that at this point the class
     // will have been pushed to the stack, followed by any function
     // arguments.
-    stack[stack.size() - 1 - nargs] = from_obj(inst);
+    stack_top[-1 - static_cast<ptrdiff_t>(nargs)] = from_obj(inst);
     // Check for an initialiser.
     auto init_method_itr = classptr->methods.find(initString);
     if (init_method_itr != classptr->methods.end()) {
@@ -860,7 +2083,8 @@ bool VM::dispatch_call(lox::Value maybe_objptr, size_t nargs,
   case ObjType::BOUND_METHOD: {
     auto bound_method_ptr = static_cast<ObjBoundMethod*>(objptr);
     // Stick `this` just before the arguments.
-    stack[stack.size() - 1 - nargs] = from_obj(bound_method_ptr->receiver);
+    stack_top[-1 - static_cast<ptrdiff_t>(nargs)] =
+        from_obj(bound_method_ptr->receiver);
     call(bound_method_ptr->method, nargs, local_ip);
     return true;
   }
@@ -870,25 +2094,34 @@ bool VM::dispatch_call(lox::Value maybe_objptr, size_t nargs,
   }
 }
 
+void VM::mark_roots() {
+  _gc.mark_as_grey(initString);
+
+  for (const Value* v = stack.get(); v != stack_top; ++v) {
+    _gc.mark_as_grey(*v);
+  }
+  globals.mark_as_grey(_gc);
+  for (size_t i = 0; i < frame_count; i++) {
+    _gc.mark_as_grey(call_frames[i].closure);
+  }
+  for (const auto& upvalue : open_upvalues) {
+    _gc.mark_as_grey(upvalue);
+  }
+  _gc.mark_as_grey(main_fiber);
+  _gc.mark_as_grey(current_fiber);
+  scheduler.mark_as_grey(_gc);
+  parser->mark_function_as_grey();
+  if (bytecode_reader != nullptr) {
+    bytecode_reader->mark_as_grey(_gc);
+  }
+  _gc.mark_as_grey(top_level_fn);
+}
+
 void VM::maybe_gc() {
   if (_gc.should_gc()) {
-    // Mark roots as grey.
-    _gc.mark_as_grey(initString);
-
-    for (const auto& v : stack) {
-      _gc.mark_as_grey(v);
-    }
-    for (const auto& [_, global_value] : globals.map) {
-      _gc.mark_as_grey(global_value);
-    }
-    for (const auto& frame : call_frames) {
-      _gc.mark_as_grey(frame.closure);
+    if (_gc.begin_collection()) {
+      mark_roots();
     }
-    for (const auto& upvalue : open_upvalues) {
-      _gc.mark_as_grey(upvalue);
-    }
-    parser->mark_function_as_grey();
-
     _gc.gc();
   }
 }
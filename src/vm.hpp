@@ -1,118 +1,317 @@
 #pragma once
 
 #include "compiler.hpp"
+#include "fiber.hpp"
 #include "gc.hpp"
-#include "stringmap.hpp"
+#include "globals.hpp"
+#include "opcode_profile.hpp"
+#include "output.hpp"
+#include "profiler.hpp"
 #include "value.hpp"
 #include "value_def.hpp"
+#include <chrono>
 #include <cstddef>
-#include <functional>
+#include <cstdint>
+#include <iostream>
 #include <memory>
 #include <ostream>
+#include <span>
 #include <stdexcept>
+#include <string>
 #include <string_view>
 #include <vector>
 
 namespace lox {
 
-InterpretResult interpret(std::string_view source);
+inline constexpr size_t DEFAULT_MAX_CALL_DEPTH = 4096;
+// The most that loxc allows --max-call-depth to be. The frames and the value
+// stack are allocated up front, and at this depth they already take up
+// well over 100 MB.
+inline constexpr size_t MAX_CALL_DEPTH_LIMIT = 1 << 18;
+// Fibers other than the main one get smaller stacks, so that there can be lots
+// of them.
+inline constexpr size_t FIBER_MAX_CALL_DEPTH = 256;
+// How many calls (or loop iterations) it takes for a function to be
+// translated into register code (see VM::tier_up).
+inline constexpr uint32_t DEFAULT_TIER_UP_THRESHOLD = 1000;
 
-class CallFrame {
+// Settings that are chosen when the interpreter starts up.
+struct InterpretOptions {
+  GCMode gc_mode = GCMode::MARK_SWEEP;
+  // Only used by the incremental GC.
+  std::chrono::microseconds gc_pause_budget{500};
+  // Print the GC statistics (as JSON, to stderr) when the program finishes.
+  bool gc_stats = false;
+  // How many nested function calls are allowed before we report a stack
+  // overflow. The value stack is sized in proportion to this.
+  size_t max_call_depth = DEFAULT_MAX_CALL_DEPTH;
+  // Compile and run the top-level code one declaration at a time, instead of
+  // compiling all of it first (see VM::compile_and_run_streaming). Only
+  // applies when running source code.
+  bool streaming = false;
+  // Run with a Profiler, and print its report to stderr when the program
+  // finishes.
+  bool profile = false;
+  // If not empty (which implies `profile`), also write the sampled call
+  // stacks to this file, in the folded format that flame graph tools read.
+  std::string profile_folded_path;
+  // Flush the output after every line that `print` writes, instead of in
+  // large chunks. This is for interactive use: main() turns it on for the
+  // REPL, and when stdout is a terminal.
+  bool line_buffered = false;
+  // See VM::set_tier_up_threshold.
+  uint32_t tier_up_threshold = DEFAULT_TIER_UP_THRESHOLD;
+};
+
+InterpretResult interpret(std::string_view source,
+                          const InterpretOptions& options = {});
+// Compile `source` and write it to `out` as bytecode (see bytecode.hpp),
+// without running it.
+InterpretResult compile_to_bytecode(std::string_view source, std::ostream& out);
+// Run a program from bytecode that compile_to_bytecode wrote earlier.
+InterpretResult interpret_bytecode(std::span<const uint8_t> bytes,
+                                   const InterpretOptions& options = {});
+
+namespace bytecode {
+class Reader;
+}
+
+#ifdef LOX_TIME
+// How the time spent in VM::run splits between the bytecode interpreter and
+// the register tier, and how long translating functions into register code
+// took. Switching between the tiers is counted in cycle counter ticks, which
+// are then scaled to the total execution time when reporting.
+class TierTimings {
 public:
-  ObjClosure* closure;
-  size_t ip;
-  size_t stack_start;
-
-  CallFrame(ObjClosure* clos, size_t ip, size_t stack_start)
-      : closure(std::move(clos)), ip(ip), stack_start(stack_start) {}
-  uint8_t read_byte() { return closure->function->chunk.at(ip++); }
-  void shift_ip(ptrdiff_t offset) {
-    ptrdiff_t ip_signed = static_cast<ptrdiff_t>(ip);
-    ip_signed += offset;
-    if (ip_signed < 0) {
-      throw std::runtime_error("shift_ip: negative offset out of bounds");
-    }
-    ip = static_cast<size_t>(ip_signed);
-    if (ip > closure->function->chunk.size()) {
-      throw std::runtime_error("shift_ip: positive offset out of bounds");
+  // VM::run calls these on the way in and out: only the ticks in between
+  // count towards either tier.
+  void start() {
+    last_ticks = run_start_ticks = read_ticks();
+    running = true;
+  }
+  void stop() {
+    charge();
+    run_ticks += last_ticks - run_start_ticks;
+    running = false;
+  }
+  // Charge the ticks since the last switch to the tier that was running, and
+  // switch to `register_tier`.
+  void enter(bool register_tier) {
+    if (running) {
+      uint64_t now = read_ticks();
+      ticks[in_register_tier] += now - last_ticks;
+      last_ticks = now;
     }
+    in_register_tier = register_tier;
   }
-  size_t get_current_debuginfo_line() {
-    return closure->function->chunk.debuginfo_at(ip - 1);
+  // Charge the ticks since the last switch, without switching.
+  void charge() { enter(in_register_tier); }
+  // Don't charge the time since the last switch to either tier.
+  void skip() {
+    if (running) {
+      uint64_t now = read_ticks();
+      skipped_ticks += now - last_ticks;
+      last_ticks = now;
+    }
   }
-  bool is_at_end() const { return ip >= closure->function->chunk.size(); }
-  bool exactly_at_end() const { return ip == closure->function->chunk.size(); }
 
-  void disassemble(std::ostream& out) const {
-    closure->function->chunk.disassemble(out, ip,
-                                         closure->function->name->value);
-  }
+  std::chrono::nanoseconds compile_time{0};
+  size_t compiled = 0;
+  size_t unsupported = 0;
+  // `execution` is the total execution time, which includes compile_time.
+  void report(std::ostream& os, std::chrono::microseconds execution) const;
+
+private:
+  uint64_t ticks[2] = {0, 0};
+  uint64_t last_ticks = 0;
+  bool in_register_tier = false;
+  bool running = false;
+  // For checking that the tiers' ticks (and the skipped ones) add up to the
+  // time spent in VM::run.
+  uint64_t run_start_ticks = 0;
+  uint64_t run_ticks = 0;
+  uint64_t skipped_ticks = 0;
 };
+#endif
 
 class VM {
 public:
-  VM(std::unique_ptr<scanner::Scanner> scanner, GC gc);
+  VM(std::unique_ptr<scanner::Scanner> scanner, GC gc,
+     size_t max_call_depth = DEFAULT_MAX_CALL_DEPTH);
   InterpretResult run();
   std::ostream& stack_dump(std::ostream& out) const;
   InterpretResult compile();
+  // Alternative to compile(): read the top-level function from bytecode.
+  InterpretResult load_bytecode(std::span<const uint8_t> bytes);
+  // Write the compiled top-level function out as bytecode.
+  void write_bytecode(std::ostream& out, uint64_t source_hash) const;
   InterpretResult invoke_toplevel();
-  VM& define_native(
-      const std::string& name, size_t arity,
-      std::function<lox::Value(size_t, const lox::Value*)> function);
+  // Alternative to compile() followed by invoke_toplevel(): compile and run
+  // the top-level code one declaration at a time.
+  InterpretResult compile_and_run_streaming();
+  // Compile and run another piece of source code in this VM, on top of
+  // whatever earlier code left behind (globals, interned strings, and the rest
+  // of the heap). `source` doesn't have to outlive the call. After a runtime
+  // error the stack is cleared, so the VM can carry on being used.
+  InterpretResult eval(std::string_view source);
+  // Make a native function available as a global variable. `userdata` is
+  // passed back to it in the NativeContext on every call.
+  VM& define_native(std::string_view name, size_t arity, NativeFn function,
+                    void* userdata = nullptr);
+  // Same, for a native written as `Value f(NativeContext&, Value, ...)`; the
+  // arity is worked out from its signature.
+  template <auto F>
+  VM& define_native(std::string_view name, void* userdata = nullptr) {
+    return define_native(name, native_arity<F>, native_fn<F>, userdata);
+  }
+  // Where `print` writes to (stdout, via std::cout).
+  OutputBuffer& output() { return _output; }
+  // Garbage collector statistics.
+  GCStats gc_stats() const { return _gc.get_stats(); }
+  // For natives that allocate objects, or that store values into existing
+  // ones (which needs a write barrier).
+  GC& gc() { return _gc; }
+
+  // Fibers (see fiber.hpp). The functions that suspend the running fiber are
+  // only for native functions to call: the switch to another fiber happens
+  // once the native function has returned.
+  //
+  // The fiber that is running now.
+  ObjFiber* running_fiber();
+  // Create a fiber that will call `entry`, and queue it up to run. Returns
+  // nullptr if `entry` takes any arguments, or needs more stack than a fiber
+  // has.
+  ObjFiber* spawn(ObjClosure* entry);
+  // Let the other fibers that are ready run first.
+  void yield();
+  // Suspend the running fiber for `duration`.
+  void sleep(std::chrono::duration<double> duration);
+  // Suspend the running fiber until something calls resume() on it, and
+  // return it.
+  ObjFiber* suspend();
+  // Make a suspended fiber ready to run again. `value` is what the native
+  // function that suspended it returns. This does nothing if `fiber` isn't
+  // suspended.
+  // NOTE: After a runtime error, every fiber apart from the main one is
+  // thrown away (and may then be freed), so a host must forget about the
+  // fibers it was going to resume.
+  void resume(ObjFiber* fiber, lox::Value value);
+  // Wait for I/O inside `loop` when no fiber can run (see EventLoop). `loop`
+  // must outlive the VM, or be replaced with nullptr first.
+  void set_event_loop(EventLoop* loop) { scheduler.set_event_loop(loop); }
+  // The same statistics, as a Lox object (this implements the gcStats()
+  // native function).
+  lox::Value gc_stats_instance();
+  // From now on, run every instruction through a Profiler (see
+  // profiler.hpp).
+  void enable_profiling(
+      uint64_t sample_interval = Profiler::DEFAULT_SAMPLE_INTERVAL) {
+    profiler = std::make_unique<Profiler>(sample_interval);
+  }
+  // nullptr unless profiling is enabled.
+  const Profiler* get_profiler() const { return profiler.get(); }
+  // Translate functions into register code once they have been called, or
+  // have gone round a loop, this many times. 0 turns the register tier off.
+  // It's also off while profiling, since the profiler counts bytecode
+  // instructions.
+  void set_tier_up_threshold(uint32_t threshold) {
+    tier_up_threshold = threshold;
+  }
+#ifdef LOX_TIME
+  const TierTimings& get_tier_timings() const { return tier_timings; }
+#endif
+#ifdef LOX_PROFILE_OPCODES
+  void report_opcode_profile(std::ostream& out) const {
+    opcode_profile.report(out, 40);
+  }
+#endif
 
 private:
-  std::vector<CallFrame> call_frames;
-  // NOTE: We use std::vector here instead of std::stack because the latter does
-  // not provide random access (you can only access the top element).
-  std::vector<lox::Value> stack;
+  // NOTE: Like the value stack below, this is a fixed-size buffer, so pointers
+  // to frames stay valid while the VM is running. Only the first
+  // `frame_count` entries are in use.
+  std::unique_ptr<CallFrame[]> call_frames;
+  size_t frame_count = 0;
+  size_t max_call_depth;
+  // NOTE: The value stack is a fixed-size buffer rather than a std::vector.
+  // Its address never changes, so VM::run can cache a raw pointer to the top
+  // of the stack in a local variable (which the compiler can keep in a
+  // register) instead of going through push_back/pop_back. `stack_top` points
+  // one past the last live slot. While VM::run is executing, it is only
+  // guaranteed to be up to date when run() calls out to something that needs
+  // to look at the stack (e.g. the GC, or `call`).
+  std::unique_ptr<lox::Value[]> stack;
+  lox::Value* stack_top;
+  size_t max_stack_size;
   GC _gc;
-  // maps from the name of a global variable to its value
-  StringMap<Value> globals;
+  // Global variables, indexed by the slots that the parser assigned.
+  Globals globals;
   std::unique_ptr<Parser> parser;
-  // sorted upvalues that haven't been closed yet. They sort in decreasing order
-  // of the stack slot that they point to
+  // Upvalues that haven't been closed yet, sorted in increasing order of the
+  // stack slot that they point to. That means the ones nearest the top of the
+  // stack (which are the ones that get captured and closed most often) are at
+  // the back of the vector.
   std::vector<ObjUpvalue*> open_upvalues;
   // Interned string for "init", which we use when we need to look up the
   // initialiser method of a class.
   ObjString* initString;
   // Top-level function, which is populated after compilation and then called
-  // in invoke_toplevel.
-  ObjFunction* top_level_fn;
+  // in invoke_toplevel. Once compilation has finished, nothing else refers to
+  // it until it's on the stack, so it has to be treated as a GC root.
+  ObjFunction* top_level_fn = nullptr;
+  // Only set while load_bytecode is running, since the functions it has
+  // allocated aren't reachable from anything else yet.
+  bytecode::Reader* bytecode_reader = nullptr;
+#ifdef LOX_PROFILE_OPCODES
+  OpcodeProfile opcode_profile;
+#endif
+  // call_frames, frame_count, max_call_depth, stack, stack_top,
+  // max_stack_size, and open_upvalues all belong to the running fiber, and
+  // switch_to() moves them in and out of ObjFibers.
+  Scheduler scheduler;
+  // Both of these are nullptr until a fiber native is first used.
+  ObjFiber* main_fiber = nullptr;
+  ObjFiber* current_fiber = nullptr;
+  // How deep the call stack of every fiber except the main one can go.
+  size_t fiber_call_depth;
+  // Set by the functions that suspend the running fiber, so that
+  // call_native() knows to switch fibers afterwards.
+  bool switch_pending = false;
+  // Set by compile_and_run_streaming while there are declarations left to
+  // run, so that the main fiber returning from one doesn't mean the
+  // programme has finished (and the other fibers don't all run to completion
+  // in between declarations).
+  bool more_declarations = false;
+  std::unique_ptr<Profiler> profiler;
+  OutputBuffer _output{std::cout};
+  uint32_t tier_up_threshold = DEFAULT_TIER_UP_THRESHOLD;
+#ifdef LOX_TIME
+  TierTimings tier_timings;
+#endif
 
-  CallFrame& current_frame() { return call_frames.back(); }
-  Chunk* get_chunk_ptr() { return &current_frame().closure->function->chunk; }
+  CallFrame& current_frame() { return call_frames[frame_count - 1]; }
 
+  // Close all open upvalues pointing to `addr` or above.
   void close_upvalues_after(Value* addr);
+  // Return an upvalue pointing to the stack slot `local`, reusing an open one
+  // if there is one.
+  ObjUpvalue* capture_upvalue(Value* local);
+
+  // Look up a property on an instance, and return where it was found (the
+  // shape of the entry is the instance's current shape). Throws if it doesn't
+  // exist. If `methods_first` is true, methods take precedence over fields
+  // with the same name.
+  InlineCache::Entry resolve_property(ObjInstance* instance, ObjString* name,
+                                      bool methods_first);
+  // Same, but first tries the inline cache with the given index in `chunk`,
+  // and fills it in if the lookup missed.
+  InlineCache::Entry lookup_property(Chunk* chunk, uint32_t cache_index,
+                                     ObjInstance* instance, ObjString* name,
+                                     bool methods_first);
 
   // Run garbage collection
   void maybe_gc();
-
-  lox::Value get_local_variable(size_t local_index) {
-    // Because local_index is an index into the current function's locals,
-    // which may not start at zero (but instead start at
-    // current_frame().stack_start), we need to offset it by stack_start.
-    size_t stack_index = current_frame().stack_start + local_index;
-    if (stack_index >= stack.size()) {
-      error("get_local_variable: invalid local variable index");
-    }
-    return stack[stack_index];
-  }
-
-  lox::Value* get_local_variable_address(size_t local_index) {
-    size_t stack_index = current_frame().stack_start + local_index;
-    if (stack_index >= stack.size()) {
-      error("get_local_variable: invalid local variable index");
-    }
-    return &stack[current_frame().stack_start + local_index];
-  }
-
-  void set_local_variable(size_t local_index, const lox::Value& value) {
-    size_t stack_index = current_frame().stack_start + local_index;
-    if (stack_index >= stack.size()) {
-      error("set_local_variable: invalid local variable index");
-    }
-    stack[stack_index] = value;
-  }
+  void mark_roots();
 
   void error(const std::string& message);
 
@@ -125,42 +324,73 @@ private:
   // The reason why we need to know whether the call frame was changed is that
   // if it was, then we need to update the local variables like local_ip inside
   // the VM loop. If not, then we don't need to.
+  // VM::run calls closures directly, and only goes through this for
+  // everything else.
   [[nodiscard]] bool dispatch_call(lox::Value callee, size_t arg_count,
                                    uint8_t* local_ip);
-  void call(ObjClosure* callee, size_t arg_count, uint8_t* local_ip);
+  // Push a new call frame for `callee` (whose arguments are already on the
+  // stack), and return it. `local_ip` is where to resume the caller.
+  CallFrame* call(ObjClosure* callee, size_t arg_count, uint8_t* local_ip);
+  // The error paths of call(), which are kept out of line so that the checks
+  // in call() are as cheap as possible.
+  [[noreturn]] static void arity_error(size_t arity, size_t arg_count);
+  [[noreturn]] static void call_depth_error();
+  // `function` is hot: translate it into register code (see
+  // register_code.hpp), unless that has already been tried. Frames that are
+  // already running it carry on in the bytecode until they jump back to the
+  // start of a loop.
+  void tier_up(ObjFunction* function);
+  // Call a native function whose arguments are on top of the stack, and
+  // replace them (and the function) with its return value. Returns true if
+  // the native function suspended the running fiber, in which case the VM
+  // will have switched to another one (`local_ip` is where to resume the
+  // suspended one).
+  [[nodiscard]] bool call_native(ObjNativeFunction* native, size_t arg_count,
+                                 uint8_t* local_ip);
+  // Save the running fiber's state, and load `next`'s.
+  void switch_to(ObjFiber* next);
+  // The running fiber has just returned from its bottom-most frame with
+  // `retval`. Returns true if the VM has switched to another fiber, or false
+  // if there's nothing left to run (and we're back on the main fiber).
+  [[nodiscard]] bool finish_fiber(lox::Value retval);
+  // After a runtime error, go back to the main fiber, and throw away the
+  // other ones.
+  void abandon_fibers();
 
   // Move the stack pointer back to the base
   VM& stack_reset();
+  // Throw away the call frames and stack that a runtime error left behind.
+  void unwind_after_error();
 
-  static constexpr size_t MAX_CALL_FRAMES = 64;
-  static constexpr size_t MAX_STACK_SIZE = 64 * UINT8_MAX;
+  // The value stack has this many slots for each allowed call frame. That's
+  // plenty for typical functions, but a function can use up to UINT8_MAX
+  // locals, so very deep recursion through a function with lots of locals
+  // can still run out of stack before it runs out of frames.
+  static constexpr size_t STACK_SLOTS_PER_FRAME = 64;
 
+  size_t stack_size() const {
+    return static_cast<size_t>(stack_top - stack.get());
+  }
   lox::Value stack_peek();
-  lox::Value* stack_top_address();
   lox::Value stack_pop();
-
   void stack_push(const lox::Value&);
+};
 
-  // Apply `op` to the top value on the stack, replacing it with the result
-  lox::Value
-  stack_modify_top(const std::function<lox::Value(const lox::Value&)>& op);
-
-  void stack_replace_top(const lox::Value&);
-
-  // This used to be
-  // VM& handle_binary_op(const std::function<lox::Value(double, double)>& op);
-  // but we now make it a template to avoid type erasure
-  template <typename BinaryOp, typename ConvFunc> VM& handle_binary_op(BinaryOp op, ConvFunc conv_func) {
-    lox::Value b = stack_pop();
-    lox::Value a = stack_peek();
-    if (is_double(a) && is_double(b)) {
-      lox::Value result = conv_func(op(as_double(a), as_double(b)));
-      stack_replace_top(result);
-    } else {
-      error("operands must be numbers");
-    }
-    return *this;
-  }
+// A long-lived interpreter. Unlike interpret(), which sets up a fresh VM for
+// every programme, each call to eval() runs in the same VM, so globals defined
+// by one call are visible to the next, and the natives and heap only have to
+// be set up once. This is what the REPL uses.
+class Session {
+public:
+  explicit Session(const InterpretOptions& options = {});
+  InterpretResult eval(std::string_view source) { return vm.eval(source); }
+  GCStats gc_stats() const { return vm.gc_stats(); }
+  // For hosts that add their own native functions, or wait for fibers in
+  // their own event loop.
+  VM& get_vm() { return vm; }
+
+private:
+  VM vm;
 };
 
 } // namespace lox
@@ -1,6 +1,7 @@
 #!/usr/bin/env bash
 
-# This script runs end-to-end tests for the project.
+# This script runs end-to-end tests for the project. Any arguments are passed
+# on to the interpreter.
 DIR=$(dirname "$0")
 printf "\e[1;34mRunning end-to-end tests...\e[0m\n"
 
@@ -15,7 +16,7 @@ for output_file in ${FILES[@]}; do
     # Get the lox file.
     loxfile="${output_file%.out}.lox"
     # Run the lox interpreter with the lox file and capture the output
-    actual_output=$("$DIR/../loxc" "$loxfile")
+    actual_output=$("$DIR/../loxc" "$@" "$loxfile")
     # Check exit code.
     if [ $? -ne 0 ]; then
         printf "\e[31m ($i/$nfiles) Test failed (interpreter error):\e[0m %s\n" "$loxfile"
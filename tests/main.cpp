@@ -1,4 +1,25 @@
+#include "bytecode.hpp"
 #include "chunk.hpp"
+#include "gc.hpp"
+#include "isolate.hpp"
+#include "line_table.hpp"
+#include "list_kernels.hpp"
+#include "output.hpp"
+#include "pool.hpp"
+#include "scanner.hpp"
+#include "stringmap.hpp"
+#include "vm.hpp"
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <vector>
 #include <catch2/catch_test_macros.hpp>
 
 TEST_CASE("Chunk") {
@@ -19,4 +40,853 @@ TEST_CASE("Chunk") {
   chunk.push_constant(lox::from_double(3.14));
   REQUIRE(chunk.constants_size() == 1);
   REQUIRE(chunk.size() == 3);
+
+  // Truncating drops the line info for the removed bytes too.
+  chunk.truncate(1);
+  REQUIRE(chunk.size() == 1);
+  REQUIRE(chunk.debuginfo_size() == 1);
+  chunk.write(lox::OpCode::POP, line);
+  REQUIRE(chunk.debuginfo_size() == 1);
+  REQUIRE(chunk.debuginfo_at(1) == line);
+  REQUIRE_THROWS(chunk.truncate(3));
+}
+
+TEST_CASE("Line table") {
+  lox::LineTable table;
+  REQUIRE(table.empty());
+  REQUIRE_THROWS(table.line_at(0));
+  table.add(0, 10);
+  table.add(1, 10); // same line, so no new entry
+  table.add(3, 9);  // lines can go backwards
+  table.add(200, 100000);
+  table.add(70000, 2);
+  REQUIRE(table.size() == 4);
+  REQUIRE(table.heap_size() < table.size() * sizeof(lox::DebugInfo));
+
+  // In any order, since lookups try to carry on from the previous one.
+  REQUIRE(table.line_at(70001) == 2);
+  REQUIRE(table.line_at(0) == 10);
+  REQUIRE(table.line_at(2) == 10);
+  REQUIRE(table.line_at(3) == 9);
+  REQUIRE(table.line_at(199) == 9);
+  REQUIRE(table.line_at(200) == 100000);
+  REQUIRE(table.line_at(69999) == 100000);
+  REQUIRE(table.line_at(1) == 10);
+
+  std::vector<lox::DebugInfo> entries = table.entries();
+  REQUIRE(entries.size() == 4);
+  REQUIRE(entries[2].bytecode_offset == 200);
+  REQUIRE(entries[2].line == 100000);
+
+  table.truncate(200);
+  REQUIRE(table.size() == 2);
+  REQUIRE(table.line_at(70000) == 9);
+  // Adding after truncating carries on from the last remaining entry.
+  table.add(250, 11);
+  REQUIRE(table.line_at(250) == 11);
+  REQUIRE(table.line_at(249) == 9);
+  table.truncate(0);
+  REQUIRE(table.empty());
+  table.add(5, 7);
+  REQUIRE_THROWS(table.line_at(4));
+  REQUIRE(table.line_at(5) == 7);
+}
+
+TEST_CASE("Scanner") {
+  using lox::scanner::TokenType;
+  // Long enough that the identifier and the indentation span more than one
+  // 16-byte block.
+  std::string long_name(40, 'x');
+  long_name += "_9";
+  std::string source = "fun fo fals falsey this thi true _ a1\n" +
+                       std::string(37, ' ') + long_name +
+                       " // comment\n\"two\nlines\" 12.5 3. \"oops";
+  lox::scanner::Scanner scanner(source);
+  auto expect = [&scanner](TokenType type, std::string_view lexeme,
+                           size_t line) {
+    lox::scanner::Token token = scanner.scan_token();
+    REQUIRE(token.type == type);
+    REQUIRE(token.lexeme == lexeme);
+    REQUIRE(token.line == line);
+  };
+  expect(TokenType::FUN, "fun", 1);
+  expect(TokenType::IDENTIFIER, "fo", 1);
+  expect(TokenType::IDENTIFIER, "fals", 1);
+  expect(TokenType::IDENTIFIER, "falsey", 1);
+  expect(TokenType::THIS, "this", 1);
+  expect(TokenType::IDENTIFIER, "thi", 1);
+  expect(TokenType::TRUE, "true", 1);
+  expect(TokenType::IDENTIFIER, "_", 1);
+  expect(TokenType::IDENTIFIER, "a1", 1);
+  expect(TokenType::IDENTIFIER, long_name, 2);
+  expect(TokenType::STRING, "two\nlines", 4);
+  expect(TokenType::NUMBER, "12.5", 4);
+  expect(TokenType::NUMBER, "3", 4);
+  expect(TokenType::DOT, ".", 4);
+  expect(TokenType::ERROR, "unterminated string literal", 4);
+  expect(TokenType::_EOF, "", 4);
+}
+
+TEST_CASE("StringMap") {
+  // Plenty of keys, so that the table has to grow and probe sequences collide.
+  std::vector<std::unique_ptr<lox::ObjString>> keys;
+  for (int i = 0; i < 1000; i++) {
+    std::string s = "key" + std::to_string(i);
+    keys.push_back(std::make_unique<lox::ObjString>(s, lox::hash_string(s)));
+  }
+
+  lox::StringMap<int> map;
+  REQUIRE(map.find(keys[0].get()) == nullptr);
+  for (int i = 0; i < 1000; i++) {
+    map.set(keys[static_cast<size_t>(i)].get(), i);
+  }
+  REQUIRE(map.size() == 1000);
+  map.set(keys[7].get(), -7);
+  REQUIRE(map.size() == 1000);
+  REQUIRE(*map.find(keys[7].get()) == -7);
+  REQUIRE(map.find_key("key123", lox::hash_string("key123")) == keys[123].get());
+  REQUIRE(map.find_key("nope", lox::hash_string("nope")) == nullptr);
+
+  // Erase every other key; the rest must still be reachable.
+  map.erase_if([](lox::ObjString*, int value) { return value % 2 == 0; });
+  REQUIRE(map.size() == 500);
+  for (int i = 0; i < 1000; i++) {
+    int* value = map.find(keys[static_cast<size_t>(i)].get());
+    if (i % 2 == 0) {
+      REQUIRE(value == nullptr);
+    } else {
+      REQUIRE(value != nullptr);
+      REQUIRE(*value == (i == 7 ? -7 : i));
+    }
+  }
+}
+
+TEST_CASE("Pool") {
+  lox::Pool pool(40);
+  REQUIRE(pool.block_size() >= 40);
+  REQUIRE(pool.block_size() % alignof(std::max_align_t) == 0);
+
+  // Enough blocks to need several pages.
+  std::vector<void*> blocks;
+  for (size_t i = 0; i < 10000; i++) {
+    blocks.push_back(pool.allocate());
+  }
+  size_t reserved = pool.reserved_bytes();
+  REQUIRE(reserved >= 10000 * pool.block_size());
+  // Freed blocks are reused rather than allocating new pages.
+  pool.deallocate(blocks.back());
+  blocks.pop_back();
+  blocks.push_back(pool.allocate());
+  REQUIRE(pool.reserved_bytes() == reserved);
+  // Nothing can be released while every page has live blocks.
+  REQUIRE(pool.release_empty_pages(0) == 0);
+
+  for (void* block : blocks) {
+    pool.deallocate(block);
+  }
+  REQUIRE(pool.release_empty_pages(1) == reserved - lox::Pool::PAGE_SIZE);
+  REQUIRE(pool.reserved_bytes() == lox::Pool::PAGE_SIZE);
+  // The remaining page is still usable.
+  void* block = pool.allocate();
+  REQUIRE(pool.reserved_bytes() == lox::Pool::PAGE_SIZE);
+  pool.deallocate(block);
+  REQUIRE(pool.release_empty_pages(0) == lox::Pool::PAGE_SIZE);
+  REQUIRE(pool.reserved_bytes() == 0);
+}
+
+TEST_CASE("Output buffer") {
+  using lox::OutputBuffer;
+  SECTION("formats values like operator<<") {
+    lox::GC gc;
+    lox::ObjString* str = gc.get_string_ptr("hello");
+    std::vector<lox::Value> values = {
+        lox::nil_val(),         lox::from_bool(true),
+        lox::from_double(3),    lox::from_double(-0.5),
+        lox::from_double(1e21), lox::from_double(123456789),
+        lox::from_double(0.1),  lox::from_obj(str)};
+    std::ostringstream expected;
+    std::ostringstream actual;
+    {
+      OutputBuffer output(actual);
+      for (lox::Value value : values) {
+        lox::operator<<(expected, value) << "\n";
+        output.print_line(value);
+      }
+    }
+    REQUIRE(actual.str() == expected.str());
+  }
+
+  SECTION("only flushes when asked to, or when it fills up") {
+    std::ostringstream out;
+    OutputBuffer output(out);
+    output.print_line(lox::from_double(1));
+    REQUIRE(out.str().empty());
+    output.flush();
+    REQUIRE(out.str() == "1\n");
+    while (out.str().size() < OutputBuffer::FLUSH_THRESHOLD) {
+      output.print_line(lox::from_double(1));
+    }
+    // It only ever flushes whole lines.
+    REQUIRE(out.str().ends_with("\n"));
+  }
+
+  SECTION("line mode flushes every line") {
+    std::ostringstream out;
+    OutputBuffer output(out, OutputBuffer::Mode::LINE);
+    output.print_line(lox::from_bool(false));
+    REQUIRE(out.str() == "false\n");
+  }
+}
+
+TEST_CASE("Generational GC") {
+  lox::GC gc(lox::GCMode::GENERATIONAL);
+  auto collect = [&gc](lox::Obj* root) {
+    // Generational collections always start by marking the roots.
+    REQUIRE(gc.begin_collection());
+    gc.mark_as_grey(root);
+    gc.gc();
+  };
+
+  auto klass = gc.alloc<lox::ObjClass>(gc.get_string_ptr("Box"));
+  auto instance = gc.alloc<lox::ObjInstance>(klass, klass->get_root_shape(gc));
+  collect(instance);
+  REQUIRE(instance->is_old);
+  REQUIRE(klass->is_old);
+
+  // A young object that is only reachable from an old one has to be kept
+  // alive by the write barrier, even though minor collections don't trace
+  // through old objects.
+  lox::ObjString* field = gc.get_string_ptr("field");
+  instance->set_field(field, lox::from_obj(gc.get_string_ptr("young")), gc);
+  REQUIRE(instance->is_remembered);
+  size_t live_bytes = gc.get_bytes_allocated();
+  gc.get_string_ptr("garbage");
+  collect(instance);
+  REQUIRE(gc.get_bytes_allocated() == live_bytes);
+  REQUIRE(field->is_old);
+  REQUIRE(!instance->is_remembered);
+}
+
+TEST_CASE("Incremental GC") {
+  lox::GC gc(lox::GCMode::INCREMENTAL);
+  // With no time budget, each step only does a little bit of work.
+  gc.set_pause_budget(std::chrono::microseconds(0));
+  auto klass = gc.alloc<lox::ObjClass>(gc.get_string_ptr("Box"));
+  lox::ObjShape* root_shape = klass->get_root_shape(gc);
+  auto root = gc.alloc<lox::ObjInstance>(klass, root_shape);
+  for (int i = 0; i < 200; i++) {
+    root->set_field(gc.get_string_ptr("f" + std::to_string(i)),
+                    lox::from_obj(gc.alloc<lox::ObjInstance>(klass, root_shape)),
+                    gc);
+  }
+  lox::ObjString* white = gc.get_string_ptr("white");
+  auto step = [&gc, root]() {
+    if (gc.begin_collection()) {
+      gc.mark_as_grey(root);
+    }
+    gc.gc();
+  };
+
+  step();
+  REQUIRE(gc.collection_in_progress());
+  REQUIRE(root->is_marked);
+  // Store an unmarked object into one that has already been traced. Without
+  // the write barrier, it would never get marked.
+  root->set_field(gc.get_string_ptr("later"), lox::from_obj(white), gc);
+  while (gc.collection_in_progress()) {
+    step();
+  }
+  // If `white` had been freed, this would have to allocate a new string.
+  size_t bytes = gc.get_bytes_allocated();
+  REQUIRE(gc.get_string_ptr("white") == white);
+  REQUIRE(gc.get_bytes_allocated() == bytes);
+}
+
+namespace {
+// Run a Lox programme, and return what it printed.
+std::string run_lox(const std::string& source,
+                    const lox::InterpretOptions& options = {}) {
+  std::ostringstream out;
+  std::streambuf* old_buf = std::cout.rdbuf(out.rdbuf());
+  lox::InterpretResult result = lox::interpret(source, options);
+  std::cout.rdbuf(old_buf);
+  REQUIRE(result == lox::InterpretResult::OK);
+  return out.str();
+}
+
+std::span<const uint8_t> as_bytes(const std::string& str) {
+  return {reinterpret_cast<const uint8_t*>(str.data()), str.size()};
+}
+
+// Same, but go via bytecode.
+std::string run_lox_bytecode(const std::string& source) {
+  std::ostringstream bytecode;
+  REQUIRE(lox::compile_to_bytecode(source, bytecode) ==
+          lox::InterpretResult::OK);
+  std::string bytes = bytecode.str();
+  REQUIRE(lox::bytecode::is_up_to_date(as_bytes(bytes), source));
+  std::ostringstream out;
+  std::streambuf* old_buf = std::cout.rdbuf(out.rdbuf());
+  lox::InterpretResult result = lox::interpret_bytecode(as_bytes(bytes));
+  std::cout.rdbuf(old_buf);
+  REQUIRE(result == lox::InterpretResult::OK);
+  return out.str();
+}
+} // namespace
+
+TEST_CASE("Wide operands") {
+  SECTION("globals") {
+    std::string source;
+    for (int i = 0; i < 300; i++) {
+      source += "var g" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+    }
+    source += "g299 = g299 + g1;\nprint g0 + g299;\n";
+    REQUIRE(run_lox(source) == "300\n");
+  }
+
+  SECTION("constants") {
+    // Each number literal gets its own constant, so everything after this
+    // needs wide constant indices.
+    std::string source = "var x = 0";
+    for (int i = 0; i < 300; i++) {
+      source += " + " + std::to_string(i);
+    }
+    source += ";\nprint x;\n";
+    source += "print 1 + 2;\n"; // folded by the optimiser
+    source += "print \"a\" + \"b\";\n";
+    source += "class P { m(y) { return this.f + y; } }\n";
+    source += "class Q < P { m(y) { return super.m(y) + (super.m)(y); } }\n";
+    source += "var p = Q();\np.f = 10;\nprint p.f;\nprint p.m(1);\n";
+    source += "print (p.m)(2);\n";
+    REQUIRE(run_lox(source) == "44850\n3\n\"ab\"\n10\n22\n24\n");
+  }
+
+  SECTION("locals and upvalues") {
+    std::string source = "fun f() {\n";
+    for (int i = 0; i < 300; i++) {
+      source += "  var l" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+    }
+    source += "  l299 = l299 + 1;\n";
+    source += "  fun inner() { l298 = l298 + 2; return l299 + l298; }\n";
+    source += "  return inner() + l0 + l298;\n}\nprint f();\n";
+    REQUIRE(run_lox(source) == "900\n");
+  }
+
+  SECTION("long jumps") {
+    // Each of these statements is 8 bytes of bytecode, so this is too much
+    // code to jump over with a two-byte offset.
+    std::string body;
+    for (int i = 0; i < 5000; i++) {
+      body += "  x = x + 1;\n";
+    }
+    std::string source = "var x = 0;\nvar i = 0;\n";
+    source += "if (x > 0) {\n" + body + "} else {\n  print \"else\";\n}\n";
+    source += "if (x == 0) {\n" + body + "}\nprint x;\n";
+    source += "while (i < 3) {\n  i = i + 1;\n" + body + "}\nprint x;\n";
+    source += "print (x == 0) or (x > 0 and x < 100000);\n";
+    REQUIRE(run_lox(source) == "\"else\"\n5000\n20000\ntrue\n");
+  }
+}
+
+TEST_CASE("Quickening") {
+  STATIC_REQUIRE(lox::generic_opcode(lox::OpCode::ADD_NUM) == lox::OpCode::ADD);
+  STATIC_REQUIRE(lox::generic_opcode(lox::OpCode::ADD) == lox::OpCode::ADD);
+  STATIC_REQUIRE(lox::is_quickened(lox::OpCode::EQUAL_NUM));
+  STATIC_REQUIRE(!lox::is_superinstruction(lox::OpCode::EQUAL_NUM));
+  STATIC_REQUIRE(lox::instruction_length(lox::OpCode::ADD_NUM) == 1);
+
+  SECTION("disassembly") {
+    lox::Chunk chunk;
+    chunk.write(lox::OpCode::ADD_NUM, 1);
+    std::ostringstream out;
+    REQUIRE(chunk.disassemble(out, 0, "f") == 1);
+    REQUIRE(out.str().find("ADD_NUM") != std::string::npos);
+  }
+
+  SECTION("call sites that see different types") {
+    // The ADD in `add` and the EQUAL in `eq` are quickened by the first
+    // call, and have to be de-quickened by the second.
+    std::string source = "fun add(a, b) { return a + b; }\n"
+                         "fun eq(a, b) { return a == b; }\n"
+                         "print add(1, 2);\n"
+                         "print add(\"a\", \"b\");\n"
+                         "print add(3, 4);\n"
+                         "print eq(1, 1);\n"
+                         "print eq(\"x\", \"x\");\n"
+                         "print eq(nil, 2);\n"
+                         "print eq(2, 3);\n";
+    REQUIRE(run_lox(source) == "3\n\"ab\"\n7\ntrue\ntrue\nfalse\nfalse\n");
+  }
+}
+
+TEST_CASE("Register tier") {
+  // Translate every function into register code on its first call, and
+  // compare with never doing so.
+  auto compare = [](const std::string& source) {
+    lox::InterpretOptions eager, never;
+    eager.tier_up_threshold = 1;
+    never.tier_up_threshold = 0;
+    REQUIRE(run_lox(source, eager) == run_lox(source, never));
+  };
+
+  SECTION("arithmetic, strings and locals") {
+    compare("fun f(a, b) { var c = a + b; var d = c; c = c * 2;"
+            "  print 1 < a; print a > 1; return d + c; }\n"
+            "fun g(a, b) { var c = a; c = a + b; return c + \"!\"; }\n"
+            "print f(1, 2); print f(-1.5, 0.25);\n"
+            "print g(\"a\", \"b\"); print g(\"\", \"x\");\n"
+            "fun h(x) { return -x / 2 - 3 * x; } print h(4); print !h(0);");
+  }
+
+  SECTION("conditions") {
+    compare("fun f(x) { var n = 0;"
+            "  if (x < 3) n = n + 1; if (3 < x) n = n + 10;"
+            "  if (x == 3) n = n + 100; if (3 == x) n = n + 1000;"
+            "  if (x > 2 and !(x > 4)) n = n + 10000;"
+            "  while (n > 0 and n < 20000) n = n * 2;"
+            "  return n; }\n"
+            "for (var i = 0; i < 6; i = i + 1) print f(i);\n"
+            "fun g(x) { if (x == nil or x == \"s\") return 1; return 2; }\n"
+            "print g(nil); print g(\"s\"); print g(true); print g(0);");
+  }
+
+  SECTION("closures and globals") {
+    compare("var g = 0;\n"
+            "fun counter() { var n = 0; fun inc() { n = n + 1; g = g + n;"
+            "  return n; } return inc; }\n"
+            "var c = counter(); c(); c(); print c(); print g;");
+  }
+
+  SECTION("recursion, classes and lists") {
+    compare("fun fib(n) { if (n < 2) return n;"
+            "  return fib(n - 1) + fib(n - 2); }\n"
+            "print fib(15);\n"
+            "class P { init(x) { this.x = x; } get() { return this.x; } }\n"
+            "class Q < P { get() { return super.get() * 2; } }\n"
+            "fun f(n) { var xs = list(n, 0);"
+            "  for (var i = 0; i < n; i = i + 1) xs[i] = Q(i).get() + xs[i];"
+            "  return xs[n - 1] + sum(xs); }\n"
+            "print f(10);");
+  }
+
+  SECTION("loops in code that's already running") {
+    // The top-level code is only ever called once, so it can only switch
+    // over in the middle of its loop.
+    std::string source = "var x = 0;\n"
+                         "for (var i = 0; i < 5000; i = i + 1) {"
+                         "  var y = i * 2; if (y > 100) x = x + y; }\n"
+                         "print x;\n";
+    lox::InterpretOptions never;
+    never.tier_up_threshold = 0;
+    REQUIRE(run_lox(source) == run_lox(source, never));
+    compare(source);
+  }
+
+  SECTION("functions that can't be translated") {
+    // Too many locals to fit in a one-byte register, and a jump too long for
+    // a two-byte offset: these stay in the interpreter.
+    std::string source = "fun f() {\n";
+    for (int i = 0; i < 300; i++) {
+      source += "  var l" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+    }
+    source += "  return l0 + l299;\n}\nprint f(); print f();\n";
+    source += "fun g(x) {\n  if (x > 0) {\n";
+    for (int i = 0; i < 5000; i++) {
+      source += "    x = x + 1;\n";
+    }
+    source += "  }\n  return x;\n}\nprint g(1); print g(0);\n";
+    compare(source);
+  }
+
+  SECTION("runtime errors") {
+    // Errors in register code are reported at the same place.
+    auto run_error = [](uint32_t tier_up_threshold) {
+      lox::InterpretOptions options;
+      options.tier_up_threshold = tier_up_threshold;
+      std::ostringstream err;
+      std::streambuf* old_buf = std::cerr.rdbuf(err.rdbuf());
+      lox::InterpretResult result =
+          lox::interpret("fun f(x) {\n  var y = x * 2;\n  return y + 1;\n}\n"
+                         "f(1);\nf(\"a\");\n",
+                         options);
+      std::cerr.rdbuf(old_buf);
+      REQUIRE(result == lox::InterpretResult::RUNTIME_ERROR);
+      return err.str();
+    };
+    std::string error = run_error(1);
+    REQUIRE(error.find("function f") != std::string::npos);
+    REQUIRE(error == run_error(0));
+  }
+}
+
+TEST_CASE("List kernels") {
+  // 13 elements, so that the kernels' leftover (non-vectorised) elements get
+  // tested too.
+  std::vector<lox::Value> xs;
+  for (int i = 1; i <= 13; i++) {
+    xs.push_back(lox::from_double(i));
+  }
+  REQUIRE(lox::list_kernels::all_numbers(xs));
+  REQUIRE(lox::list_kernels::sum(xs) == 91);
+  REQUIRE(lox::list_kernels::dot(xs, xs) == 819);
+  lox::list_kernels::scale(xs, 0.5);
+  REQUIRE(lox::as_double(xs[12]) == 6.5);
+  REQUIRE(lox::list_kernels::sum(std::span<const lox::Value>()) == 0);
+
+  xs[7] = lox::nil_val();
+  REQUIRE(!lox::list_kernels::all_numbers(xs));
+  lox::list_kernels::fill(xs, lox::from_bool(true));
+  REQUIRE(lox::as_bool(xs[7]));
+  REQUIRE(lox::is_bool(xs[0]));
+}
+
+TEST_CASE("Streaming") {
+  std::string source = R"(
+    var total = 0;
+    fun add(n) { total = total + n; }
+    class Counter {
+      init() { this.count = 0; }
+      bump() { this.count = this.count + 1; return this; }
+    }
+    var c = Counter();
+    for (var i = 0; i < 100; i = i + 1) { add(i); c.bump(); }
+    print total;
+    print c.count;
+    { var local = "block"; print local; }
+  )";
+  for (lox::GCMode mode : {lox::GCMode::MARK_SWEEP, lox::GCMode::GENERATIONAL,
+                           lox::GCMode::INCREMENTAL}) {
+    lox::InterpretOptions options{.gc_mode = mode, .streaming = true};
+    REQUIRE(run_lox(source, options) == run_lox(source));
+  }
+}
+
+TEST_CASE("Session") {
+  for (lox::GCMode mode : {lox::GCMode::MARK_SWEEP, lox::GCMode::GENERATIONAL,
+                           lox::GCMode::INCREMENTAL}) {
+    lox::Session session({.gc_mode = mode});
+    auto eval = [&session](const std::string& source) {
+      std::ostringstream out;
+      std::streambuf* old_buf = std::cout.rdbuf(out.rdbuf());
+      lox::InterpretResult result = session.eval(source);
+      std::cout.rdbuf(old_buf);
+      return std::make_pair(result, out.str());
+    };
+    using lox::InterpretResult;
+
+    SECTION("globals persist between calls") {
+      REQUIRE(eval("var a = 1;").first == InterpretResult::OK);
+      REQUIRE(eval("fun f(x) { return x + a; }").first == InterpretResult::OK);
+      REQUIRE(eval("class C { init() { this.v = 3; } }").first ==
+              InterpretResult::OK);
+      REQUIRE(eval("a = a + 1; print f(C().v);").second == "5\n");
+    }
+
+    SECTION("errors don't end the session") {
+      REQUIRE(eval("var a = 1;").first == InterpretResult::OK);
+      REQUIRE(eval("print (;").first == InterpretResult::COMPILE_ERROR);
+      // A closure that escapes from a call that then fails keeps its upvalue.
+      REQUIRE(eval("var g; fun f() { var x = \"kept\"; fun h() { return x; } "
+                   "g = h; nil(); } f();")
+                  .first == InterpretResult::RUNTIME_ERROR);
+      REQUIRE(eval("print a; print g();").second == "1\n\"kept\"\n");
+    }
+  }
+}
+
+namespace {
+// A stand-in for a host's event loop. `fetch(x)` suspends the fiber that
+// calls it, and the "I/O" finishes (giving 10 * x) the next time the VM waits.
+struct FakeIO : lox::EventLoop {
+  lox::VM* vm = nullptr;
+  std::vector<std::pair<lox::ObjFiber*, double>> pending;
+  int waits = 0;
+  void wait(std::optional<Clock::time_point>) override {
+    waits++;
+    for (auto [fiber, x] : pending) {
+      vm->resume(fiber, lox::from_double(10 * x));
+    }
+    pending.clear();
+  }
+};
+lox::Value fetch_native(lox::NativeContext& context, lox::Value x) {
+  auto io = static_cast<FakeIO*>(context.userdata);
+  io->pending.emplace_back(io->vm->suspend(), lox::as_double(x));
+  return lox::nil_val();
+}
+} // namespace
+
+TEST_CASE("Fibers") {
+  lox::Session session;
+  FakeIO io;
+  io.vm = &session.get_vm();
+  io.vm->define_native<fetch_native>("fetch", &io);
+  io.vm->set_event_loop(&io);
+  auto eval = [&session](const std::string& source) {
+    std::ostringstream out;
+    std::streambuf* old_buf = std::cout.rdbuf(out.rdbuf());
+    lox::InterpretResult result = session.eval(source);
+    std::cout.rdbuf(old_buf);
+    return std::make_pair(result, out.str());
+  };
+  REQUIRE(eval("fun get(x) { fun run() { return fetch(x); } return run; }")
+              .first == lox::InterpretResult::OK);
+
+  SECTION("waits overlap") {
+    // All three fetches are waited for at once.
+    auto [result, out] = eval("var a = spawn(get(1)); var b = spawn(get(2));"
+                              "print fetch(3) + join(a) + join(b);");
+    REQUIRE(result == lox::InterpretResult::OK);
+    REQUIRE(out == "60\n");
+    REQUIRE(io.waits == 1);
+  }
+
+  SECTION("errors in fibers don't end the session") {
+    REQUIRE(eval("fun f() { nil(); } spawn(get(5)); join(spawn(f));").first ==
+            lox::InterpretResult::RUNTIME_ERROR);
+    // Every fiber is thrown away after an error, including the one that was
+    // waiting for I/O.
+    REQUIRE(io.pending.size() == 1);
+    io.pending.clear();
+    REQUIRE(eval("print join(spawn(get(4)));").second == "40\n");
+  }
+}
+
+TEST_CASE("Isolates") {
+  REQUIRE_FALSE(lox::Program::compile("var;").has_value());
+
+  // Every isolate gets its own globals, so each run sees `count` start at 0.
+  // (No printing, since the runs happen on several threads at once.)
+  std::optional<lox::Program> program = lox::Program::compile(R"(
+    var count = 0;
+    class Box { init(v) { this.v = v; } }
+    fun work(n) { var b = Box(0); for (var i = 0; i < n; i = i + 1) b.v = b.v + i; return b.v; }
+    count = count + work(1000);
+    if (count != 499500) nil();
+  )");
+  REQUIRE(program.has_value());
+  std::vector<lox::InterpretResult> results =
+      lox::run_isolates(*program, 16, 4, {.gc_mode = lox::GCMode::INCREMENTAL});
+  REQUIRE(results == std::vector<lox::InterpretResult>(
+                         16, lox::InterpretResult::OK));
+
+  std::optional<lox::Program> failing = lox::Program::compile("nil();");
+  REQUIRE(failing.has_value());
+  REQUIRE(lox::run_isolates(*failing, 3, 2) ==
+          std::vector<lox::InterpretResult>(
+              3, lox::InterpretResult::RUNTIME_ERROR));
+}
+
+TEST_CASE("Profiler") {
+  std::string path =
+      (std::filesystem::temp_directory_path() / "lox_profile_test.folded")
+          .string();
+  std::string source = R"(
+    fun spin(n) { var total = 0; for (var i = 0; i < n; i = i + 1) total = total + i; return total; }
+    fun outer() { return spin(20000); }
+    print outer() > 0;
+  )";
+  lox::InterpretOptions options{.profile_folded_path = path};
+  REQUIRE(run_lox(source, options) == "true\n");
+  std::ifstream in(path);
+  std::string line;
+  uint64_t samples = 0;
+  while (std::getline(in, line)) {
+    // e.g. "#toplevel#;outer;spin 123"
+    size_t space = line.rfind(' ');
+    REQUIRE(line.starts_with("#toplevel#"));
+    samples += std::stoull(line.substr(space + 1));
+    if (line.substr(0, space) == "#toplevel#;outer;spin") {
+      REQUIRE(std::stoull(line.substr(space + 1)) > 100);
+    }
+  }
+  // spin() runs about ten instructions per iteration.
+  REQUIRE(samples > 150);
+  std::filesystem::remove(path);
+}
+
+namespace {
+// The bytecode for `source`, and where the top-level function is in it, so
+// that tests can corrupt it.
+struct BytecodeFile {
+  std::string bytes;
+  // The top-level function, starting from its arity (i.e. after its name).
+  size_t function = 0;
+  size_t code = 0;
+  size_t code_size = 0;
+
+  explicit BytecodeFile(const std::string& source) {
+    std::ostringstream bytecode;
+    REQUIRE(lox::compile_to_bytecode(source, bytecode) ==
+            lox::InterpretResult::OK);
+    bytes = bytecode.str();
+    // Skip the header, the global names and the function's name.
+    size_t pos = 24;
+    uint32_t n_globals = u32_at(pos);
+    pos += 4;
+    for (uint32_t i = 0; i < n_globals + 1; i++) {
+      pos += 4 + u32_at(pos);
+    }
+    function = pos;
+    // ...and its arity, max_stack_depth, has_captured_locals and upvalues.
+    pos += 4 + 4 + 1;
+    pos += 4 + 5 * u32_at(pos);
+    code_size = u32_at(pos);
+    code = pos + 4;
+  }
+
+  uint32_t u32_at(size_t pos) const {
+    uint32_t value = 0;
+    for (size_t i = 0; i < 4; i++) {
+      value |= static_cast<uint32_t>(static_cast<uint8_t>(bytes[pos + i]))
+               << (8 * i);
+    }
+    return value;
+  }
+
+  // The operands of the first instruction with opcode `op`. (There are no
+  // WIDEs or CLOSUREs with upvalues in the tests, so every instruction's
+  // length is fixed.)
+  size_t operands_of(lox::OpCode op) const {
+    size_t i = 0;
+    while (i < code_size && static_cast<lox::OpCode>(bytes[code + i]) != op) {
+      auto other = static_cast<lox::OpCode>(bytes[code + i]);
+      size_t length =
+          other == lox::OpCode::CLOSURE ? 2 : lox::instruction_length(other);
+      REQUIRE(length != 0);
+      i += length;
+    }
+    REQUIRE(i < code_size);
+    return code + i + 1;
+  }
+
+  // Run the file with the byte at `pos` replaced by `byte`.
+  lox::InterpretResult corrupt(size_t pos, uint8_t byte) const {
+    std::string corrupted = bytes;
+    corrupted[pos] = static_cast<char>(byte);
+    std::ostringstream out;
+    std::streambuf* old_buf = std::cout.rdbuf(out.rdbuf());
+    lox::InterpretResult result = lox::interpret_bytecode(as_bytes(corrupted));
+    std::cout.rdbuf(old_buf);
+    return result;
+  }
+};
+} // namespace
+
+TEST_CASE("Bytecode files") {
+  SECTION("round trip") {
+    std::string source = R"(
+var greeting = "hello";
+fun make_counter() {
+  var count = 0;
+  fun counter() { count = count + 1; return count; }
+  return counter;
+}
+var c = make_counter();
+c();
+print c();
+class A { init(x) { this.x = x; } get() { return this.x; } }
+class B < A { get() { return super.get() * 2; } }
+print B(21).get();
+print greeting + " world";
+print nil == false;
+fun call_later() { return later(); }
+fun later() { return 1.5; }
+print call_later();
+)";
+    // Enough globals and constants to need wide operands, too.
+    for (int i = 0; i < 300; i++) {
+      source += "var g" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+    }
+    source += "if (g299 > 0) { print g299; } else { print g0; }\n";
+    std::string expected = run_lox(source);
+    REQUIRE(run_lox_bytecode(source) == expected);
+  }
+
+  SECTION("invalidation") {
+    std::string source = "print 1;";
+    std::ostringstream bytecode;
+    REQUIRE(lox::compile_to_bytecode(source, bytecode) ==
+            lox::InterpretResult::OK);
+    std::string bytes = bytecode.str();
+    REQUIRE(lox::bytecode::is_up_to_date(as_bytes(bytes), source));
+    REQUIRE(!lox::bytecode::is_up_to_date(as_bytes(bytes), "print 2;"));
+
+    // A different interpreter version
+    std::string other_version = bytes;
+    other_version[8] = static_cast<char>(other_version[8] ^ 1);
+    REQUIRE(!lox::bytecode::is_up_to_date(as_bytes(other_version), source));
+    REQUIRE(lox::interpret_bytecode(as_bytes(other_version)) ==
+            lox::InterpretResult::COMPILE_ERROR);
+
+    // Truncated, or not bytecode at all
+    std::string truncated = bytes.substr(0, bytes.size() - 1);
+    REQUIRE(lox::interpret_bytecode(as_bytes(truncated)) ==
+            lox::InterpretResult::COMPILE_ERROR);
+    REQUIRE(lox::interpret_bytecode(as_bytes(source)) ==
+            lox::InterpretResult::COMPILE_ERROR);
+  }
+
+  SECTION("operands out of range") {
+    BytecodeFile file("var g = 1.5;\nif (g > 1) { print g; } else { g = 2; }");
+    REQUIRE(file.corrupt(file.operands_of(lox::OpCode::CONSTANT), 200) ==
+            lox::InterpretResult::COMPILE_ERROR);
+    REQUIRE(file.corrupt(file.operands_of(lox::OpCode::GET_GLOBAL_SLOT), 1) ==
+            lox::InterpretResult::COMPILE_ERROR);
+    // The jump over the else branch: past the end of the code, before the
+    // start, and into the middle of the CONSTANT after the else branch's POP.
+    size_t jump = file.operands_of(lox::OpCode::JUMP);
+    REQUIRE(file.corrupt(jump, 0x7f) == lox::InterpretResult::COMPILE_ERROR);
+    REQUIRE(file.corrupt(jump, 0xff) == lox::InterpretResult::COMPILE_ERROR);
+    REQUIRE(file.corrupt(jump + 1, 2) == lox::InterpretResult::COMPILE_ERROR);
+    // Onto the POP of the condition at the start of the else branch, which
+    // the jump over the then branch reaches with the condition still on the
+    // stack.
+    REQUIRE(file.corrupt(jump + 1, 0) == lox::InterpretResult::COMPILE_ERROR);
+  }
+
+  SECTION("stack depth") {
+    BytecodeFile file("fun f(a) { return a; }\n{ var x = 1; print f(x); }");
+    REQUIRE(file.corrupt(file.operands_of(lox::OpCode::GET_LOCAL), 3) ==
+            lox::InterpretResult::COMPILE_ERROR);
+    // More arguments than there are values on the stack.
+    REQUIRE(file.corrupt(file.operands_of(lox::OpCode::CALL), 3) ==
+            lox::InterpretResult::COMPILE_ERROR);
+    // The top-level function is called without arguments.
+    REQUIRE(file.corrupt(file.function, 1) ==
+            lox::InterpretResult::COMPILE_ERROR);
+    // A huge number of upvalues, which would take far more space than there
+    // is in the file.
+    REQUIRE(file.corrupt(file.function + 4 + 4 + 1 + 3, 0x7f) ==
+            lox::InterpretResult::COMPILE_ERROR);
+    // max_stack_depth is worked out again when the file is loaded.
+    REQUIRE(file.corrupt(file.function + 4, 0) == lox::InterpretResult::OK);
+  }
+}
+
+namespace {
+lox::Value native_add(lox::NativeContext& context, lox::Value a,
+                      lox::Value b) {
+  if (!lox::is_double(a) || !lox::is_double(b)) {
+    return context.fail("add expects two numbers");
+  }
+  *static_cast<int*>(context.userdata) += 1;
+  return lox::from_double(lox::as_double(a) + lox::as_double(b));
+}
+} // namespace
+
+TEST_CASE("Native functions") {
+  STATIC_REQUIRE(lox::native_arity<native_add> == 2);
+  int calls = 0;
+  lox::NativeContext context{&calls};
+  lox::Value args[] = {lox::from_double(1), lox::from_double(2)};
+  lox::Value result = lox::native_fn<native_add>(context, args);
+  REQUIRE(context.error == nullptr);
+  REQUIRE(lox::as_double(result) == 3);
+  REQUIRE(calls == 1);
+
+  args[1] = lox::nil_val();
+  lox::native_fn<native_add>(context, args);
+  REQUIRE(std::string(context.error) == "add expects two numbers");
+  REQUIRE(calls == 1);
 }